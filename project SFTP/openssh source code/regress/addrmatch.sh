@@ -50,5 +50,75 @@ run_trial user 2001::1 somehost ::2 1234 nomatch "IP6 network"
 run_trial user ::5 somehost ::1 1234 match3 "IP6 localaddress"
 run_trial user ::5 somehost ::2 5678 match4 "IP6 localport"
 
+cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
+cat >>$OBJ/sshd_proxy <<EOD
+ForceCommand nomatch
+Match Address 172.16.0.0/12,!172.17.0.0/16,172.17.5.0/24
+	ForceCommand match1
+Match Address fe80::%1/64
+	ForceCommand match2
+EOD
+
+run_trial user 172.18.0.1 somehost 1.2.3.4 1234 match1 "outer network"
+run_trial user 172.17.1.1 somehost 1.2.3.4 1234 nomatch "negated inner network"
+run_trial user 172.17.5.1 somehost 1.2.3.4 1234 nomatch "network inside negated one"
+run_trial user fe80::1%1 somehost ::2 1234 match2 "scoped IP6 network"
+run_trial user fe80::1 somehost ::2 1234 nomatch "unscoped IP6 in scoped network"
+
+cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
+cat >>$OBJ/sshd_proxy <<EOD
+ForceCommand nomatch
+Match Address !203.0.113.0/24,0.0.0.0/0
+	ForceCommand match1
+Match Address ::/0
+	ForceCommand match2
+EOD
+
+run_trial user 198.18.0.1 somehost 1.2.3.4 1234 match1 "IP4 /0"
+run_trial user 203.0.113.1 somehost 1.2.3.4 1234 nomatch "negated network before /0"
+run_trial user 2001:db8::1 somehost ::2 1234 match2 "IP6 /0"
+
+# An inconsistent mask makes the list invalid and sshd exit, printing
+# nothing, unless a negated entry before it has already matched.
+cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
+cat >>$OBJ/sshd_proxy <<EOD
+ForceCommand nomatch
+Match Address !192.0.2.0/24,198.51.100.0/24,198.51.0.0/8
+	ForceCommand match1
+EOD
+
+run_trial user 192.0.2.1 somehost 1.2.3.4 1234 nomatch "negated entry before invalid one"
+run_trial user 198.51.100.1 somehost 1.2.3.4 1234 "" "valid entry before invalid one"
+
 cp $OBJ/sshd_proxy_bak $OBJ/sshd_proxy
 rm $OBJ/sshd_proxy_bak
+
+# CIDR lists are checked when signing a certificate with a source-address
+rm -f $OBJ/addrmatch_ca* $OBJ/addrmatch_key*
+${SSHKEYGEN} -q -N '' -t rsa -f $OBJ/addrmatch_ca ||\
+	fatal "ssh-keygen of addrmatch_ca failed"
+${SSHKEYGEN} -q -N '' -t rsa -f $OBJ/addrmatch_key ||\
+	fatal "ssh-keygen of addrmatch_key failed"
+
+cidr_trial()
+{
+	list="$1"; expected="$2"; descr="$3"
+
+	verbose "test $descr for source-address $list"
+	rm -f $OBJ/addrmatch_key-cert.pub
+	${SSHKEYGEN} -q -s $OBJ/addrmatch_ca -I addrmatch \
+	    -O source-address="$list" $OBJ/addrmatch_key.pub >/dev/null 2>&1
+	result=$?
+	test $result -ne 0 && result=1
+	if [ "$result" != "$expected" ]; then
+		fail "failed '$descr' expected $expected got $result"
+	fi
+}
+
+cidr_trial "10.0.0.0/8,::1" 0 "valid cidr list"
+cidr_trial "0.0.0.0/0,::/0" 0 "cidr /0"
+cidr_trial "10.0.0.0/8,10.1.0.0/8" 1 "valid entry before invalid cidr"
+cidr_trial "10.0.0.0/8,fe80::1%lo" 1 "scoped IP6 in cidr list"
+cidr_trial "fe80::1%lo,10.0.0.0/8" 1 "scoped IP6 first in cidr list"
+
+rm -f $OBJ/addrmatch_ca* $OBJ/addrmatch_key*
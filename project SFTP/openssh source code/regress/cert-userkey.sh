@@ -306,6 +306,98 @@ test_one "principals key option principals" success "-n mekmitasdigoat" \
 test_one "principals key option no principals" failure "" \
     authorized_keys ',principals="mekmitasdigoat"'
 
+# Compiled revocation lists (ssh-keygen -k)
+compiled_one() {
+	ident=$1
+	result=$2
+	key=$3
+
+	(
+		cat $OBJ/sshd_proxy_bak
+		echo "TrustedUserCAKeys $OBJ/user_ca_key.pub"
+		echo "RevokedKeys $OBJ/revoked_compiled"
+	) > $OBJ/sshd_proxy
+	verbose "$tid: compiled revocation list $ident expect $result"
+	${SSH} -2i $key -F $OBJ/ssh_proxy somehost true >/dev/null 2>&1
+	rc=$?
+	if [ "x$result" = "xsuccess" ] ; then
+		if [ $rc -ne 0 ]; then
+			fail "compiled revocation list $ident failed unexpectedly"
+		fi
+	else
+		if [ $rc -eq 0 ]; then
+			fail "compiled revocation list $ident succeeded unexpectedly"
+		fi
+	fi
+}
+
+compile_revoked() {
+	${SSHKEYGEN} -q -k -f $OBJ/revoked_compiled \
+	    -s $OBJ/user_ca_key.pub $OBJ/revoked_src ||
+		fail "ssh-keygen -k failed"
+}
+
+sign_serial() {
+	${SSHKEYGEN} -q -s $OBJ/user_ca_key -I "regress user key for $USER" \
+	    -n $USER -z $1 $OBJ/cert_user_key_rsa ||
+		fail "couldn't sign cert_user_key_rsa with serial $1"
+}
+
+${SSHKEYGEN} -q -N '' -t rsa -f $OBJ/cert_user_key_plain ||
+	fail "ssh-keygen of cert_user_key_plain failed"
+
+# Plain key
+cp $OBJ/cert_user_key_plain.pub $OBJ/authorized_keys_$USER
+echo "serial: 1000" > $OBJ/revoked_src
+compile_revoked
+compiled_one "plain key not listed" success $OBJ/cert_user_key_plain
+cat $OBJ/cert_user_key_plain.pub > $OBJ/revoked_src
+compile_revoked
+compiled_one "plain key" failure $OBJ/cert_user_key_plain
+
+# CA key
+echo > $OBJ/authorized_keys_$USER
+sign_serial 1
+echo "serial: 1000" > $OBJ/revoked_src
+compile_revoked
+compiled_one "CA key not listed" success $OBJ/cert_user_key_rsa
+cat $OBJ/user_ca_key.pub > $OBJ/revoked_src
+compile_revoked
+compiled_one "CA key" failure $OBJ/cert_user_key_rsa
+
+# Serial ranges, out of order, touching and overlapping, and both extremes
+(
+	echo "# revoked serials"
+	echo "serial: 25-40"
+	echo "serial: 0"
+	echo "serial: 10-19"
+	echo "serial: 20-24"
+	echo "serial: 30"
+	echo "serial: 18446744073709551615"
+) > $OBJ/revoked_src
+compile_revoked
+for s in 0 10 19 20 24 25 33 40 18446744073709551615 ; do
+	sign_serial $s
+	compiled_one "serial $s" failure $OBJ/cert_user_key_rsa
+done
+for s in 1 9 41 1000 18446744073709551614 ; do
+	sign_serial $s
+	compiled_one "serial $s" success $OBJ/cert_user_key_rsa
+done
+
+# A damaged list refuses all keys
+cp $OBJ/cert_user_key_plain.pub $OBJ/authorized_keys_$USER
+echo "serial: 1000" > $OBJ/revoked_src
+compile_revoked
+cp $OBJ/revoked_compiled $OBJ/revoked_good
+dd if=$OBJ/revoked_good of=$OBJ/revoked_compiled bs=1 count=40 \
+    >/dev/null 2>&1
+compiled_one "truncated" failure $OBJ/cert_user_key_plain
+(cat $OBJ/revoked_good ; echo) > $OBJ/revoked_compiled
+compiled_one "trailing garbage" failure $OBJ/cert_user_key_plain
+rm -f $OBJ/revoked_src $OBJ/revoked_compiled $OBJ/revoked_good
+rm -f $OBJ/authorized_keys_$USER
+
 # Wrong certificate
 cat $OBJ/sshd_proxy_bak > $OBJ/sshd_proxy
 for ktype in rsa dsa ecdsa rsa_v00 dsa_v00 ; do 
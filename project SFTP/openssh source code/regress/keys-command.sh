@@ -8,30 +8,122 @@ if [ -z "$SUDO" ]; then
 fi
 
 # Establish a AuthorizedKeysCommand in /var/run where it will have
-# acceptable directory permissions.
+# acceptable directory permissions.  It counts its runs in $RUNS, fails
+# if $FAIL exists and pads its output to more than a megabyte if $BIG
+# exists.
 KEY_COMMAND="/var/run/keycommand_${LOGNAME}"
+RUNS=$OBJ/keycommand_runs
+FAIL=$OBJ/keycommand_fail
+BIG=$OBJ/keycommand_big
 cat << _EOF | $SUDO sh -c "cat > '$KEY_COMMAND'"
 #!/bin/sh
 test "x\$1" != "x${LOGNAME}" && exit 1
-exec cat "$OBJ/authorized_keys_${LOGNAME}"
+echo run >> "$RUNS"
+test -f "$FAIL" && exit 1
+cat "$OBJ/authorized_keys_${LOGNAME}"
+test -f "$BIG" && awk 'BEGIN { for (i = 0; i < 20000; i++) printf "# %077d\n", i }'
+exit 0
 _EOF
 $SUDO chmod 0755 "$KEY_COMMAND"
 
-cp $OBJ/sshd_proxy $OBJ/sshd_proxy.bak
-(
-	grep -vi AuthorizedKeysFile $OBJ/sshd_proxy.bak
-	echo AuthorizedKeysFile none
-	echo AuthorizedKeysCommand $KEY_COMMAND
-	echo AuthorizedKeysCommandUser ${LOGNAME}
-) > $OBJ/sshd_proxy
-
-if [ -x $KEY_COMMAND ]; then
-	${SSH} -F $OBJ/ssh_proxy somehost true
-	if [ $? -ne 0 ]; then
-		fail "connect failed"
-	fi
-else
+if [ ! -x $KEY_COMMAND ]; then
 	echo "SKIPPED: $KEY_COMMAND not executable (/var/run mounted noexec?)"
+	$SUDO rm -f $KEY_COMMAND
+	exit 0
+fi
+
+# keys_command_config file cachetime: use the command instead of files
+keys_command_config ()
+{
+	cp $OBJ/$1 $OBJ/$1.bak
+	(
+		grep -vi AuthorizedKeysFile $OBJ/$1.bak
+		echo AuthorizedKeysFile none
+		echo AuthorizedKeysCommand $KEY_COMMAND
+		echo AuthorizedKeysCommandUser ${LOGNAME}
+		echo AuthorizedKeysCommandCacheTime $2
+	) > $OBJ/$1
+}
+
+restore_config ()
+{
+	mv $OBJ/$1.bak $OBJ/$1
+}
+
+# expect_runs n what: the command ran n times since $RUNS was removed
+expect_runs ()
+{
+	n=0
+	test -f $RUNS && n=`wc -l < $RUNS | sed 's/ //g'`
+	if [ "$n" -ne $1 ]; then
+		fail "$2: command ran $n times, expected $1"
+	fi
+}
+
+login ()
+{
+	${SSH} -2 -F $OBJ/ssh_config somehost true
+}
+
+rm -f $RUNS $FAIL $BIG
+
+verbose "$tid: connect"
+keys_command_config sshd_proxy 0
+${SSH} -2 -F $OBJ/ssh_proxy somehost true
+if [ $? -ne 0 ]; then
+	fail "connect failed"
+fi
+
+verbose "$tid: oversized output"
+rm -f $RUNS
+touch $BIG
+${SSH} -2 -F $OBJ/ssh_proxy somehost true
+if [ $? -eq 0 ]; then
+	fail "connect succeeded with oversized command output"
 fi
+rm -f $BIG
+restore_config sshd_proxy
+
+# Each connection to the daemon is served by a new sshd, re-executed
+# unless -r is given, so the cache must be shared between them.
+for rexec in "" "-r"; do
+	verbose "$tid: cached output ${rexec:-re-exec}"
+	keys_command_config sshd_config 1h
+	rm -f $RUNS
+	start_sshd $rexec
+	login || fail "first cached login failed ${rexec}"
+	expect_runs 1 "first cached login ${rexec}"
+	login || fail "second cached login failed ${rexec}"
+	expect_runs 1 "second cached login ${rexec}"
+	cleanup
+	restore_config sshd_config
+
+	verbose "$tid: cached failure ${rexec:-re-exec}"
+	keys_command_config sshd_config "1h 1h"
+	rm -f $RUNS
+	touch $FAIL
+	start_sshd $rexec
+	login && fail "login with failing command succeeded ${rexec}"
+	expect_runs 1 "failed login ${rexec}"
+	# the failure is remembered, so the now working command is not run
+	rm -f $FAIL
+	login && fail "login with cached failure succeeded ${rexec}"
+	expect_runs 1 "login with cached failure ${rexec}"
+	cleanup
+	restore_config sshd_config
+done
+
+verbose "$tid: cache expiry"
+keys_command_config sshd_config 2s
+rm -f $RUNS
+start_sshd
+login || fail "first login failed"
+expect_runs 1 "first login"
+sleep 3
+login || fail "login after expiry failed"
+expect_runs 2 "login after expiry"
+cleanup
+restore_config sshd_config
 
+rm -f $RUNS $FAIL $BIG
 $SUDO rm -f $KEY_COMMAND
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 
+#include "xmalloc.h"
 #include "match.h"
 #include "log.h"
 
@@ -358,37 +359,191 @@ addr_netmatch(const struct xaddr *host, const struct xaddr *net, u_int masklen)
 }
 
 /*
- * Match "addr" against list pattern list "_list", which may contain a
- * mix of CIDR addresses and old-school wildcards.
- *
- * If addr is NULL, then no matching is performed, but _list is parsed
- * and checked for well-formedness.
+ * Address lists are compiled into a set on first use and the sets of
+ * recently used lists are kept, keyed by the list string, so that long
+ * lists are neither parsed again nor scanned linearly for every address.
  *
- * Returns 1 on match found (never returned when addr == NULL).
- * Returns 0 on if no match found, or no errors found when addr == NULL.
- * Returns -1 on negated match found (never returned when addr == NULL).
- * Returns -2 on invalid list entry.
+ * The networks of a list go into a binary trie per address family, whose
+ * nodes are flagged with ADDR_SET_POS or ADDR_SET_NEG where a (negated)
+ * prefix ends; looking an address up collects the flags along its path.
+ * Wildcard patterns and IPv6 networks with a scope id, which must match
+ * exactly, are kept in a list and tried one by one.
  */
-int
-addr_match_list(const char *addr, const char *_list)
+#define ADDR_SET_CACHE	16	/* compiled lists kept */
+
+#define ADDR_SET_POS	1
+#define ADDR_SET_NEG	2
+
+#define ADDR_BIT(a, i)	(((a)->addr8[(i) / 8] >> (7 - (i) % 8)) & 1)
+
+struct addr_trie_node {
+	u_int	child[2];	/* 0 if none; the root is never a child */
+	int	flags;
+};
+
+struct addr_trie {
+	struct addr_trie_node *nodes;
+	u_int	nnodes;
+	u_int	alloc;
+};
+
+struct addr_set_entry {
+	int	flag;
+	char	*pattern;	/* wildcard, or NULL for a network */
+	struct xaddr net;
+	u_int	masklen;
+};
+
+struct addr_set {
+	char	*list;
+	u_int32_t hash;
+	int	cidr_only;	/* compiled for addr_match_cidr_list() */
+	u_int	used;		/* LRU clock */
+	int	bad;		/* result for an invalid list, or 0 */
+	struct addr_trie trie4, trie6;
+	struct addr_set_entry *entries;
+	u_int	nentries;
+};
+
+static struct addr_set *addr_set_cache[ADDR_SET_CACHE];
+static u_int addr_set_clock;
+
+static u_int
+addr_trie_node(struct addr_trie *t)
+{
+	if (t->nnodes == t->alloc) {
+		t->alloc = t->alloc == 0 ? 64 : t->alloc * 2;
+		t->nodes = xrealloc(t->nodes, t->alloc, sizeof(*t->nodes));
+	}
+	memset(&t->nodes[t->nnodes], 0, sizeof(*t->nodes));
+	return t->nnodes++;
+}
+
+static void
+addr_trie_insert(struct addr_trie *t, const struct xaddr *a, u_int masklen,
+    int flag)
 {
-	char *list, *cp, *o;
-	struct xaddr try_addr, match_addr;
-	u_int masklen, neg;
-	int ret = 0, r;
+	u_int i, n, next;
+
+	if (t->nnodes == 0)
+		addr_trie_node(t);	/* root */
+	for (i = 0, n = 0; i < masklen; i++, n = next) {
+		if ((next = t->nodes[n].child[ADDR_BIT(a, i)]) == 0) {
+			/* may move t->nodes */
+			next = addr_trie_node(t);
+			t->nodes[n].child[ADDR_BIT(a, i)] = next;
+		}
+	}
+	t->nodes[n].flags |= flag;
+}
 
-	if (addr != NULL && addr_pton(addr, &try_addr) != 0) {
-		debug2("%s: couldn't parse address %.100s", __func__, addr);
+/* Returns the ADDR_SET_* flags of the prefixes of 'a' in 't' */
+static int
+addr_trie_lookup(const struct addr_trie *t, const struct xaddr *a, u_int bits)
+{
+	u_int i, n = 0;
+	int flags = 0;
+
+	if (t->nnodes == 0)
 		return 0;
+	for (i = 0; ; i++) {
+		flags |= t->nodes[n].flags;
+		if (i == bits || (flags & ADDR_SET_NEG) != 0)
+			break;
+		if ((n = t->nodes[n].child[ADDR_BIT(a, i)]) == 0)
+			break;
 	}
-	if ((o = list = strdup(_list)) == NULL)
-		return -1;
+	return flags;
+}
+
+static void
+addr_set_add(struct addr_set *set, const char *pattern,
+    const struct xaddr *net, u_int masklen, int flag)
+{
+	struct addr_set_entry *e;
+
+	if (pattern == NULL && net->af == AF_INET) {
+		addr_trie_insert(&set->trie4, net, masklen, flag);
+		return;
+	}
+	if (pattern == NULL && net->scope_id == 0) {
+		addr_trie_insert(&set->trie6, net, masklen, flag);
+		return;
+	}
+	set->entries = xrealloc(set->entries, set->nentries + 1,
+	    sizeof(*set->entries));
+	e = &set->entries[set->nentries++];
+	memset(e, 0, sizeof(*e));
+	e->flag = flag;
+	if (pattern != NULL)
+		e->pattern = xstrdup(pattern);
+	else {
+		memcpy(&e->net, net, sizeof(e->net));
+		e->masklen = masklen;
+	}
+}
+
+/*
+ * Returns the ADDR_SET_* flags of the entries of 'set' that match 'addr',
+ * which parses to 'a'.
+ */
+static int
+addr_set_match(const struct addr_set *set, const char *addr,
+    const struct xaddr *a)
+{
+	const struct addr_set_entry *e;
+	u_int i;
+	int flags;
+
+	if (a->af == AF_INET)
+		flags = addr_trie_lookup(&set->trie4, a, 32);
+	else if (a->scope_id == 0)
+		flags = addr_trie_lookup(&set->trie6, a, 128);
+	else
+		flags = 0;
+	for (i = 0; i < set->nentries && (flags & ADDR_SET_NEG) == 0; i++) {
+		e = &set->entries[i];
+		if (e->pattern != NULL ? match_pattern(addr, e->pattern) == 1 :
+		    addr_netmatch(a, &e->net, e->masklen) == 0)
+			flags |= e->flag;
+	}
+	return flags;
+}
+
+static void
+addr_set_free(struct addr_set *set)
+{
+	u_int i;
+
+	if (set == NULL)
+		return;
+	for (i = 0; i < set->nentries; i++)
+		free(set->entries[i].pattern);
+	free(set->entries);
+	free(set->trie4.nodes);
+	free(set->trie6.nodes);
+	free(set->list);
+	free(set);
+}
+
+/*
+ * Compile the entries of a list for addr_match_list().  Entries after an
+ * invalid one are ignored, as they would never be looked at.
+ */
+static void
+addr_set_compile_list(struct addr_set *set, char *list)
+{
+	struct xaddr match_addr;
+	u_int masklen;
+	char *cp;
+	int r, neg;
+
 	while ((cp = strsep(&list, ",")) != NULL) {
 		neg = *cp == '!';
 		if (neg)
 			cp++;
 		if (*cp == '\0') {
-			ret = -2;
+			set->bad = -2;
 			break;
 		}
 		/* Prefer CIDR address matching */
@@ -396,58 +551,29 @@ addr_match_list(const char *addr, const char *_list)
 		if (r == -2) {
 			error("Inconsistent mask length for "
 			    "network \"%.100s\"", cp);
-			ret = -2;
+			set->bad = -2;
 			break;
-		} else if (r == 0) {
-			if (addr != NULL && addr_netmatch(&try_addr,
-                           &match_addr, masklen) == 0) {
- foundit:
-				if (neg) {
-					ret = -1;
-					break;
-				}
-				ret = 1;
-			}
-			continue;
-		} else {
-			/* If CIDR parse failed, try wildcard string match */
-			if (addr != NULL && match_pattern(addr, cp) == 1)
-				goto foundit;
 		}
+		/* If CIDR parse failed, try wildcard string match */
+		addr_set_add(set, r == 0 ? NULL : cp, &match_addr, masklen,
+		    neg ? ADDR_SET_NEG : ADDR_SET_POS);
 	}
-	free(o);
-
-	return ret;
 }
 
-/*
- * Match "addr" against list CIDR list "_list". Lexical wildcards and
- * negation are not supported. If "addr" == NULL, will verify structure
- * of "_list".
- *
- * Returns 1 on match found (never returned when addr == NULL).
- * Returns 0 on if no match found, or no errors found when addr == NULL.
- * Returns -1 on error
- */
-int
-addr_match_cidr_list(const char *addr, const char *_list)
+/* Compile the entries of a list for addr_match_cidr_list() */
+static void
+addr_set_compile_cidr_list(struct addr_set *set, char *list)
 {
-	char *list, *cp, *o;
-	struct xaddr try_addr, match_addr;
+	struct xaddr match_addr;
 	u_int masklen;
-	int ret = 0, r;
+	char *cp;
+	int r;
 
-	if (addr != NULL && addr_pton(addr, &try_addr) != 0) {
-		debug2("%s: couldn't parse address %.100s", __func__, addr);
-		return 0;
-	}
-	if ((o = list = strdup(_list)) == NULL)
-		return -1;
 	while ((cp = strsep(&list, ",")) != NULL) {
 		if (*cp == '\0') {
 			error("%s: empty entry in list \"%.100s\"",
-			    __func__, o);
-			ret = -1;
+			    __func__, set->list);
+			set->bad = -1;
 			break;
 		}
 
@@ -461,35 +587,135 @@ addr_match_cidr_list(const char *addr, const char *_list)
 		if (strlen(cp) > INET6_ADDRSTRLEN + 3) {
 			error("%s: list entry \"%.100s\" too long",
 			    __func__, cp);
-			ret = -1;
+			set->bad = -1;
 			break;
 		}
 #define VALID_CIDR_CHARS "0123456789abcdefABCDEF.:/"
 		if (strspn(cp, VALID_CIDR_CHARS) != strlen(cp)) {
 			error("%s: list entry \"%.100s\" contains invalid "
 			    "characters", __func__, cp);
-			ret = -1;
+			set->bad = -1;
+			break;
 		}
 
-		/* Prefer CIDR address matching */
 		r = addr_pton_cidr(cp, &match_addr, &masklen);
 		if (r == -1) {
 			error("Invalid network entry \"%.100s\"", cp);
-			ret = -1;
+			set->bad = -1;
 			break;
 		} else if (r == -2) {
 			error("Inconsistent mask length for "
 			    "network \"%.100s\"", cp);
-			ret = -1;
+			set->bad = -1;
 			break;
-		} else if (r == 0 && addr != NULL) {
-			if (addr_netmatch(&try_addr, &match_addr,
-			    masklen) == 0)
-				ret = 1;
-			continue;
 		}
+		addr_set_add(set, NULL, &match_addr, masklen, ADDR_SET_POS);
 	}
-	free(o);
+}
 
-	return ret;
+/* Returns the compiled set for '_list', from the cache if possible */
+static struct addr_set *
+addr_set_get(const char *_list, int cidr_only)
+{
+	struct addr_set *set;
+	const u_char *p;
+	u_int32_t hash = 2166136261U;	/* FNV-1a */
+	char *list;
+	u_int i, victim = 0;
+
+	for (p = (const u_char *)_list; *p != '\0'; p++)
+		hash = (hash ^ *p) * 16777619U;
+	for (i = 0; i < ADDR_SET_CACHE; i++) {
+		set = addr_set_cache[i];
+		if (set == NULL) {
+			victim = i;
+			break;
+		}
+		if (set->hash == hash && set->cidr_only == cidr_only &&
+		    strcmp(set->list, _list) == 0) {
+			set->used = ++addr_set_clock;
+			return set;
+		}
+		if (set->used < addr_set_cache[victim]->used)
+			victim = i;
+	}
+
+	set = xcalloc(1, sizeof(*set));
+	set->list = xstrdup(_list);
+	set->hash = hash;
+	set->cidr_only = cidr_only;
+	list = xstrdup(_list);
+	if (cidr_only)
+		addr_set_compile_cidr_list(set, list);
+	else
+		addr_set_compile_list(set, list);
+	free(list);
+	debug3("%s: \"%.100s\": %u+%u trie nodes, %u other entries", __func__,
+	    _list, set->trie4.nnodes, set->trie6.nnodes, set->nentries);
+
+	addr_set_free(addr_set_cache[victim]);
+	addr_set_cache[victim] = set;
+	set->used = ++addr_set_clock;
+	return set;
+}
+
+/*
+ * Match "addr" against list pattern list "_list", which may contain a
+ * mix of CIDR addresses and old-school wildcards.
+ *
+ * If addr is NULL, then no matching is performed, but _list is parsed
+ * and checked for well-formedness.
+ *
+ * Returns 1 on match found (never returned when addr == NULL).
+ * Returns 0 on if no match found, or no errors found when addr == NULL.
+ * Returns -1 on negated match found (never returned when addr == NULL).
+ * Returns -2 on invalid list entry.
+ */
+int
+addr_match_list(const char *addr, const char *_list)
+{
+	struct addr_set *set;
+	struct xaddr try_addr;
+	int flags = 0;
+
+	if (addr != NULL && addr_pton(addr, &try_addr) != 0) {
+		debug2("%s: couldn't parse address %.100s", __func__, addr);
+		return 0;
+	}
+	set = addr_set_get(_list, 0);
+	if (addr != NULL)
+		flags = addr_set_match(set, addr, &try_addr);
+	/* a negated match before an invalid entry wins */
+	if (flags & ADDR_SET_NEG)
+		return -1;
+	if (set->bad != 0)
+		return set->bad;
+	return (flags & ADDR_SET_POS) ? 1 : 0;
+}
+
+/*
+ * Match "addr" against list CIDR list "_list". Lexical wildcards and
+ * negation are not supported. If "addr" == NULL, will verify structure
+ * of "_list".
+ *
+ * Returns 1 on match found (never returned when addr == NULL).
+ * Returns 0 on if no match found, or no errors found when addr == NULL.
+ * Returns -1 on error
+ */
+int
+addr_match_cidr_list(const char *addr, const char *_list)
+{
+	struct addr_set *set;
+	struct xaddr try_addr;
+
+	if (addr != NULL && addr_pton(addr, &try_addr) != 0) {
+		debug2("%s: couldn't parse address %.100s", __func__, addr);
+		return 0;
+	}
+	set = addr_set_get(_list, 1);
+	if (set->bad != 0)
+		return set->bad;
+	if (addr != NULL && addr_set_match(set, addr, &try_addr) != 0)
+		return 1;
+	return 0;
 }
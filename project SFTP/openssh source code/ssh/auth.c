@@ -57,6 +57,7 @@
 #endif
 #include "authfile.h"
 #include "monitor_wrap.h"
+#include "revoke.h"
 #include "err.h"
 
 /* import */
@@ -515,12 +516,15 @@ int
 auth_key_is_revoked(struct sshkey *key)
 {
 	char *key_fp;
-	int r;
+	int r, compiled;
 
 	if (options.revoked_keys_file == NULL)
 		return 0;
 
-	switch ((r = sshkey_in_file(key, options.revoked_keys_file, 0))) {
+	r = revoke_check(options.revoked_keys_file, key, &compiled);
+	if (r == SSH_ERR_KEY_NOT_FOUND && !compiled)
+		r = sshkey_in_file(key, options.revoked_keys_file, 0);
+	switch (r) {
 	case SSH_ERR_KEY_NOT_FOUND:
 		/* key not revoked */
 		return 0;
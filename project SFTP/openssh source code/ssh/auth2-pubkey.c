@@ -62,6 +62,7 @@
 #include "authfile.h"
 #include "match.h"
 #include "err.h"
+#include "cmdcache.h"
 
 /* import */
 extern ServerOptions options;
@@ -286,18 +287,127 @@ match_principals_file(char *file, struct passwd *pw, struct sshkey_cert *cert)
 }
 
 /*
- * Checks whether key is allowed in authorized_keys-format file,
+ * Checks whether 'found', read from line 'linenum' of 'file' together
+ * with 'key_options', allows 'key'.  Returns 1 if so, 0 otherwise.
+ */
+static int
+check_authkey_line(struct sshkey *found, char *key_options, char *file,
+    u_long linenum, struct sshkey *key, struct passwd *pw)
+{
+	const char *reason;
+	char *fp;
+
+	if (sshkey_is_cert(key)) {
+		if (!sshkey_equal(found, key->cert->signature_key))
+			return 0;
+		if (auth_parse_options(pw, key_options, file,
+		    linenum) != 1)
+			return 0;
+		if (!key_is_cert_authority)
+			return 0;
+		fp = sshkey_fingerprint(found, SSH_FP_MD5,
+		    SSH_FP_HEX);
+		debug("matching CA found: file %s, line %lu, %s %s",
+		    file, linenum, sshkey_type(found), fp);
+		/*
+		 * If the user has specified a list of principals as
+		 * a key option, then prefer that list to matching
+		 * their username in the certificate principals list.
+		 */
+		if (authorized_principals != NULL &&
+		    !match_principals_option(authorized_principals,
+		    key->cert)) {
+			reason = "Certificate does not contain an "
+			    "authorized principal";
+ fail_reason:
+			xfree(fp);
+			error("%s", reason);
+			auth_debug_add("%s", reason);
+			return 0;
+		}
+		if (sshkey_cert_check_authority(key, 0, 0,
+		    authorized_principals == NULL ? pw->pw_name : NULL,
+		    &reason) != 0)
+			goto fail_reason;
+		if (auth_cert_options(key, pw) != 0) {
+			xfree(fp);
+			return 0;
+		}
+		verbose("Accepted certificate ID \"%s\" "
+		    "signed by %s CA %s via %s", key->cert->key_id,
+		    sshkey_type(found), fp, file);
+		xfree(fp);
+		return 1;
+	} else if (sshkey_equal(found, key)) {
+		if (auth_parse_options(pw, key_options, file,
+		    linenum) != 1)
+			return 0;
+		if (key_is_cert_authority)
+			return 0;
+		debug("matching key found: file %s, line %lu",
+		    file, linenum);
+		fp = sshkey_fingerprint(found, SSH_FP_MD5, SSH_FP_HEX);
+		verbose("Found matching %s key: %s",
+		    sshkey_type(found), fp);
+		xfree(fp);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Parses authorized_keys line 'line' into 'found' and checks whether it
+ * allows 'key'.  Returns 1 if so, 0 otherwise.
+ */
+static int
+check_authkeys_text(struct sshkey *found, char *line, char *file,
+    u_long linenum, struct sshkey *key, struct passwd *pw)
+{
+	char *cp, *key_options = NULL;
+
+	auth_clear_options();
+
+	/* Skip leading whitespace, empty and comment lines. */
+	for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
+		;
+	if (!*cp || *cp == '\n' || *cp == '#')
+		return 0;
+
+	if (sshkey_read(found, &cp) != 0) {
+		/* no key?  check if there are options for this key */
+		int quoted = 0;
+		debug2("user_key_allowed: check options: '%s'", cp);
+		key_options = cp;
+		for (; *cp && (quoted || (*cp != ' ' && *cp != '\t')); cp++) {
+			if (*cp == '\\' && cp[1] == '"')
+				cp++;	/* Skip both */
+			else if (*cp == '"')
+				quoted = !quoted;
+		}
+		/* Skip remaining whitespace. */
+		for (; *cp == ' ' || *cp == '\t'; cp++)
+			;
+		if (sshkey_read(found, &cp) != 0) {
+			debug2("user_key_allowed: advance: '%s'", cp);
+			/* still no key?  advance to next line*/
+			return 0;
+		}
+	}
+	return check_authkey_line(found, key_options, file, linenum, key, pw);
+}
+
+/*
+ * Checks whether key is allowed in authorized_keys-format stream,
  * returns 1 if the key is allowed or 0 otherwise.
  */
 static int
-check_authkeys_file(FILE *f, char *file, struct sshkey *key, struct passwd *pw)
+check_authkeys_stream(FILE *f, char *file, struct sshkey *key,
+    struct passwd *pw)
 {
 	char line[SSH_MAX_PUBKEY_BYTES];
-	const char *reason;
 	int found_key = 0;
 	u_long linenum = 0;
 	struct sshkey *found = NULL;
-	char *fp;
 
 	found_key = 0;
 	found = sshkey_new(sshkey_is_cert(key) ? KEY_UNSPEC : key->type);
@@ -305,20 +415,217 @@ check_authkeys_file(FILE *f, char *file, struct sshkey *key, struct passwd *pw)
 		goto done;
 
 	while (read_keyfile_line(f, file, line, sizeof(line), &linenum) != -1) {
-		char *cp, *key_options = NULL;
+		if (check_authkeys_text(found, line, file, linenum, key, pw)) {
+			found_key = 1;
+			break;
+		}
+	}
+ done:
+	if (found != NULL)
+		sshkey_free(found);
+	if (!found_key)
+		debug2("key not found");
+	return found_key;
+}
 
-		auth_clear_options();
+/*
+ * As check_authkeys_stream(), for authorized_keys text held in 'buf',
+ * e.g. the output of AuthorizedKeysCommand.
+ */
+static int
+check_authkeys_buf(const struct sshbuf *buf, char *file, struct sshkey *key,
+    struct passwd *pw)
+{
+	char line[SSH_MAX_PUBKEY_BYTES];
+	const u_char *p = sshbuf_ptr(buf), *nl;
+	size_t off, len, total = sshbuf_len(buf);
+	int found_key = 0;
+	u_long linenum = 0;
+	struct sshkey *found = NULL;
+
+	found = sshkey_new(sshkey_is_cert(key) ? KEY_UNSPEC : key->type);
+	if (found == NULL)
+		goto done;
+
+	for (off = 0; off < total; off += len + 1) {
+		if ((nl = memchr(p + off, '\n', total - off)) == NULL)
+			len = total - off;
+		else
+			len = nl - (p + off);
+		linenum++;
+		if (len >= sizeof(line)) {
+			error("%s:%lu: line too long", file, linenum);
+			continue;
+		}
+		memcpy(line, p + off, len);
+		line[len] = '\0';
+		if (check_authkeys_text(found, line, file, linenum, key, pw)) {
+			found_key = 1;
+			break;
+		}
+	}
+ done:
+	if (found != NULL)
+		sshkey_free(found);
+	if (!found_key)
+		debug2("key not found");
+	return found_key;
+}
+
+/*
+ * Index of an authorized_keys file, so that the monitor does not parse
+ * the whole file for every key that is offered and again when the key is
+ * used.  Lines are hashed by their key blob, which only needs a base64
+ * decode; the key itself and the options are parsed only for lines whose
+ * blob hash matches the offered key.  An index is valid for as long as
+ * the file has the same device, inode, mtime and size.
+ */
+#define AUTHKEYS_CACHE_MAX	4
+
+struct authkeys_entry {
+	u_int32_t	hash;
+	u_long		linenum;
+	int		next;		/* in the same bucket, in file order */
+	char		*options;	/* NULL if the line has none */
+	char		*keytext;	/* "type base64" as sshkey_read() wants */
+};
+
+struct authkeys_index {
+	char		*file;
+	dev_t		dev;
+	ino_t		ino;
+	time_t		mtime;
+	off_t		size;
+	struct authkeys_entry *entries;
+	u_int		nentries;
+	int		*buckets;
+	u_int		nbuckets;	/* power of two */
+};
+
+static struct authkeys_index *authkeys_cache[AUTHKEYS_CACHE_MAX];
+static u_int authkeys_cache_next;
+
+/* FNV-1a */
+static u_int32_t
+authkeys_hash(const u_char *p, size_t len)
+{
+	u_int32_t h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void
+authkeys_index_free(struct authkeys_index *idx)
+{
+	u_int i;
+
+	if (idx == NULL)
+		return;
+	for (i = 0; i < idx->nentries; i++) {
+		free(idx->entries[i].options);
+		free(idx->entries[i].keytext);
+	}
+	free(idx->entries);
+	free(idx->buckets);
+	free(idx->file);
+	free(idx);
+}
+
+/*
+ * If 'cp' starts with a key as accepted by sshkey_read(), decode its blob
+ * into 'blob' and return the length of the "type base64" text, otherwise
+ * return 0.
+ */
+static size_t
+authkeys_key_text(char *cp, struct sshbuf *blob)
+{
+	char *space, *ep;
+	int r, type;
+
+	if ((space = strchr(cp, ' ')) == NULL)
+		return 0;
+	*space = '\0';
+	type = sshkey_type_from_name(cp);
+	*space = ' ';
+	if (type == KEY_UNSPEC || space[1] == '\0')
+		return 0;
+	if ((ep = strchr(space + 1, ' ')) != NULL)
+		*ep = '\0';
+	sshbuf_reset(blob);
+	r = sshbuf_b64tod(blob, space + 1);
+	if (ep != NULL)
+		*ep = ' ';
+	else
+		ep = space + 1 + strlen(space + 1);
+	if (r != 0 || sshbuf_len(blob) == 0)
+		return 0;
+	return ep - cp;
+}
+
+static char *
+authkeys_strndup(const char *s, size_t len)
+{
+	char *r;
+
+	r = xmalloc(len + 1);
+	memcpy(r, s, len);
+	r[len] = '\0';
+	return r;
+}
+
+static void
+authkeys_index_add(struct authkeys_index *idx, const struct sshbuf *blob,
+    u_long linenum, const char *opts, size_t optlen, const char *keytext,
+    size_t keylen)
+{
+	struct authkeys_entry *e;
+
+	if ((idx->nentries & (idx->nentries - 1)) == 0)
+		idx->entries = xrealloc(idx->entries,
+		    idx->nentries == 0 ? 16 : idx->nentries * 2,
+		    sizeof(*idx->entries));
+	e = &idx->entries[idx->nentries++];
+	e->hash = authkeys_hash(sshbuf_ptr(blob), sshbuf_len(blob));
+	e->linenum = linenum;
+	e->next = -1;
+	e->options = opts == NULL ? NULL : authkeys_strndup(opts, optlen);
+	e->keytext = authkeys_strndup(keytext, keylen);
+}
+
+static struct authkeys_index *
+authkeys_index_build(FILE *f, char *file, const struct stat *st)
+{
+	char line[SSH_MAX_PUBKEY_BYTES];
+	struct authkeys_index *idx;
+	struct sshbuf *blob;
+	u_long linenum = 0;
+	size_t keylen;
+	u_int n;
+	int i;
+
+	if ((blob = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	idx = xcalloc(1, sizeof(*idx));
+	idx->file = xstrdup(file);
+	idx->dev = st->st_dev;
+	idx->ino = st->st_ino;
+	idx->mtime = st->st_mtime;
+	idx->size = st->st_size;
+
+	/* Same tokenisation as check_authkeys_stream(). */
+	while (read_keyfile_line(f, file, line, sizeof(line), &linenum) != -1) {
+		char *cp, *key_options = NULL;
+		int quoted = 0;
 
-		/* Skip leading whitespace, empty and comment lines. */
 		for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
 			;
 		if (!*cp || *cp == '\n' || *cp == '#')
 			continue;
-
-		if (sshkey_read(found, &cp) != 0) {
-			/* no key?  check if there are options for this key */
-			int quoted = 0;
-			debug2("user_key_allowed: check options: '%s'", cp);
+		if ((keylen = authkeys_key_text(cp, blob)) == 0) {
 			key_options = cp;
 			for (; *cp && (quoted || (*cp != ' ' && *cp != '\t')); cp++) {
 				if (*cp == '\\' && cp[1] == '"')
@@ -326,76 +633,110 @@ check_authkeys_file(FILE *f, char *file, struct sshkey *key, struct passwd *pw)
 				else if (*cp == '"')
 					quoted = !quoted;
 			}
-			/* Skip remaining whitespace. */
 			for (; *cp == ' ' || *cp == '\t'; cp++)
 				;
-			if (sshkey_read(found, &cp) != 0) {
-				debug2("user_key_allowed: advance: '%s'", cp);
-				/* still no key?  advance to next line*/
+			if ((keylen = authkeys_key_text(cp, blob)) == 0)
 				continue;
-			}
 		}
-		if (sshkey_is_cert(key)) {
-			if (!sshkey_equal(found, key->cert->signature_key))
-				continue;
-			if (auth_parse_options(pw, key_options, file,
-			    linenum) != 1)
-				continue;
-			if (!key_is_cert_authority)
-				continue;
-			fp = sshkey_fingerprint(found, SSH_FP_MD5,
-			    SSH_FP_HEX);
-			debug("matching CA found: file %s, line %lu, %s %s",
-			    file, linenum, sshkey_type(found), fp);
-			/*
-			 * If the user has specified a list of principals as
-			 * a key option, then prefer that list to matching
-			 * their username in the certificate principals list.
-			 */
-			if (authorized_principals != NULL &&
-			    !match_principals_option(authorized_principals,
-			    key->cert)) {
-				reason = "Certificate does not contain an "
-				    "authorized principal";
- fail_reason:
-				xfree(fp);
-				error("%s", reason);
-				auth_debug_add("%s", reason);
-				continue;
-			}
-			if (sshkey_cert_check_authority(key, 0, 0,
-			    authorized_principals == NULL ? pw->pw_name : NULL,
-			    &reason) != 0)
-				goto fail_reason;
-			if (auth_cert_options(key, pw) != 0) {
-				xfree(fp);
-				continue;
-			}
-			verbose("Accepted certificate ID \"%s\" "
-			    "signed by %s CA %s via %s", key->cert->key_id,
-			    sshkey_type(found), fp, file);
-			xfree(fp);
-			found_key = 1;
+		authkeys_index_add(idx, blob, linenum, key_options,
+		    key_options == NULL ? 0 : (size_t)(cp - key_options),
+		    cp, keylen);
+	}
+	sshbuf_free(blob);
+
+	for (n = 16; n < idx->nentries * 2; n <<= 1)
+		;
+	idx->nbuckets = n;
+	idx->buckets = xcalloc(n, sizeof(*idx->buckets));
+	memset(idx->buckets, 0xff, n * sizeof(*idx->buckets));
+	/* insert backwards so that each bucket lists its lines in order */
+	for (i = (int)idx->nentries - 1; i >= 0; i--) {
+		n = idx->entries[i].hash & (idx->nbuckets - 1);
+		idx->entries[i].next = idx->buckets[n];
+		idx->buckets[n] = i;
+	}
+	debug2("%s: %s: %u keys", __func__, file, idx->nentries);
+	return idx;
+}
+
+/* Returns the index for the open file 'f', building it if necessary. */
+static struct authkeys_index *
+authkeys_index_get(FILE *f, char *file, const struct stat *st)
+{
+	struct authkeys_index *idx;
+	u_int i;
+
+	for (i = 0; i < AUTHKEYS_CACHE_MAX; i++) {
+		if ((idx = authkeys_cache[i]) == NULL ||
+		    strcmp(idx->file, file) != 0)
+			continue;
+		if (idx->dev == st->st_dev && idx->ino == st->st_ino &&
+		    idx->mtime == st->st_mtime && idx->size == st->st_size) {
+			debug3("%s: using cached index of %s", __func__, file);
+			return idx;
+		}
+		authkeys_index_free(idx);
+		authkeys_cache[i] = NULL;
+		break;
+	}
+	if (i == AUTHKEYS_CACHE_MAX) {
+		i = authkeys_cache_next++ % AUTHKEYS_CACHE_MAX;
+		authkeys_index_free(authkeys_cache[i]);
+	}
+	return (authkeys_cache[i] = authkeys_index_build(f, file, st));
+}
+
+/*
+ * Checks whether key is allowed in authorized_keys-format file,
+ * returns 1 if the key is allowed or 0 otherwise.
+ */
+static int
+check_authkeys_file(FILE *f, char *file, struct sshkey *key, struct passwd *pw)
+{
+	struct authkeys_index *idx;
+	struct authkeys_entry *e;
+	struct sshkey *found = NULL;
+	struct stat st;
+	u_char *blob;
+	size_t blen;
+	u_int32_t hash;
+	char *keytext, *cp;
+	int r, i, found_key = 0;
+
+	/* command output and other streams are read as they come */
+	if (fstat(fileno(f), &st) == -1 || !S_ISREG(st.st_mode))
+		return check_authkeys_stream(f, file, key, pw);
+
+	idx = authkeys_index_get(f, file, &st);
+	if ((r = sshkey_to_blob(sshkey_is_cert(key) ?
+	    key->cert->signature_key : key, &blob, &blen)) != 0) {
+		error("%s: sshkey_to_blob: %s", __func__, ssh_err(r));
+		return 0;
+	}
+	hash = authkeys_hash(blob, blen);
+	free(blob);
+
+	for (i = idx->buckets[hash & (idx->nbuckets - 1)]; i != -1;
+	    i = e->next) {
+		e = &idx->entries[i];
+		if (e->hash != hash)
+			continue;
+		auth_clear_options();
+		found = sshkey_new(sshkey_is_cert(key) ?
+		    KEY_UNSPEC : key->type);
+		if (found == NULL)
 			break;
-		} else if (sshkey_equal(found, key)) {
-			if (auth_parse_options(pw, key_options, file,
-			    linenum) != 1)
-				continue;
-			if (key_is_cert_authority)
-				continue;
+		/* sshkey_read() modifies the text it parses */
+		cp = keytext = xstrdup(e->keytext);
+		r = sshkey_read(found, &cp);
+		free(keytext);
+		if (r == 0 && check_authkey_line(found, e->options, file,
+		    e->linenum, key, pw))
 			found_key = 1;
-			debug("matching key found: file %s, line %lu",
-			    file, linenum);
-			fp = sshkey_fingerprint(found, SSH_FP_MD5, SSH_FP_HEX);
-			verbose("Found matching %s key: %s",
-			    sshkey_type(found), fp);
-			xfree(fp);
+		sshkey_free(found);
+		if (found_key)
 			break;
-		}
 	}
- done:
-	if (found != NULL)
-		sshkey_free(found);
 	if (!found_key)
 		debug2("key not found");
 	return found_key;
@@ -486,6 +827,9 @@ user_key_allowed2(struct passwd *pw, struct sshkey *key, char *file)
 	return found_key;
 }
 
+/* More output than this makes the AuthorizedKeysCommand fail */
+#define AUTHKEYS_COMMAND_MAX	(64 * CMDCACHE_SLOT_SIZE)
+
 /*
  * Checks whether key is allowed in output of command.
  * returns 1 if the key is allowed or 0 otherwise.
@@ -493,13 +837,14 @@ user_key_allowed2(struct passwd *pw, struct sshkey *key, char *file)
 static int
 user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
 {
-	FILE *f;
-	int ok, found_key = 0;
+	struct sshbuf *output = NULL;
+	int found_key = 0;
 	struct passwd *pw;
 	struct stat st;
-	int status, devnull, p[2], i;
+	int r, status, devnull, p[2], i;
 	pid_t pid;
-	char *username, errmsg[512];
+	ssize_t len;
+	char *username, errmsg[512], buf[4096];
 
 	if (options.authorized_keys_command == NULL ||
 	    options.authorized_keys_command[0] != '/')
@@ -534,6 +879,22 @@ user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
 		goto out;
 	}
 
+	if ((output = sshbuf_new()) == NULL) {
+		error("%s: sshbuf_new failed", __func__);
+		goto out;
+	}
+	switch (cmdcache_lookup(options.authorized_keys_command,
+	    pw->pw_name, user_pw->pw_name, output)) {
+	case CMDCACHE_HIT:
+		found_key = check_authkeys_buf(output,
+		    options.authorized_keys_command, key, pw);
+		goto out;
+	case CMDCACHE_FAILED:
+		debug("AuthorizedKeysCommand %s failed recently for %s",
+		    options.authorized_keys_command, user_pw->pw_name);
+		goto out;
+	}
+
 	if (pipe(p) != 0) {
 		error("%s: pipe: %s", __func__, strerror(errno));
 		goto out;
@@ -553,6 +914,7 @@ user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
 		error("%s: fork: %s", __func__, strerror(errno));
 		close(p[0]);
 		close(p[1]);
+		sshbuf_free(output);
 		return 0;
 	case 0: /* child */
 		for (i = 0; i < NSIG; i++)
@@ -601,17 +963,33 @@ user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
 	temporarily_use_uid(pw);
 
 	close(p[1]);
-	if ((f = fdopen(p[0], "r")) == NULL) {
-		error("%s: fdopen: %s", __func__, strerror(errno));
-		close(p[0]);
+	for (;;) {
+		if ((len = read(p[0], buf, sizeof(buf))) == -1 &&
+		    errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		if (sshbuf_len(output) + len > AUTHKEYS_COMMAND_MAX) {
+			error("AuthorizedKeysCommand %s output for %s "
+			    "exceeds %d bytes", options.authorized_keys_command,
+			    user_pw->pw_name, AUTHKEYS_COMMAND_MAX);
+			break;
+		}
+		if ((r = sshbuf_put(output, buf, len)) != 0) {
+			error("%s: sshbuf_put: %s", __func__, ssh_err(r));
+			break;
+		}
+	}
+	close(p[0]);
+	if (len != 0) {
+		if (len == -1)
+			error("%s: read: %s", __func__, strerror(errno));
 		/* Don't leave zombie child */
 		kill(pid, SIGTERM);
 		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
 			;
 		goto out;
 	}
-	ok = check_authkeys_file(f, options.authorized_keys_command, key, pw);
-	fclose(f);
 
 	while (waitpid(pid, &status, 0) == -1) {
 		if (errno != EINTR) {
@@ -622,15 +1000,23 @@ user_key_command_allowed2(struct passwd *user_pw, struct sshkey *key)
 	if (WIFSIGNALED(status)) {
 		error("AuthorizedKeysCommand %s exited on signal %d",
 		    options.authorized_keys_command, WTERMSIG(status));
+		cmdcache_store(options.authorized_keys_command, pw->pw_name,
+		    user_pw->pw_name, 0, NULL);
 		goto out;
 	} else if (WEXITSTATUS(status) != 0) {
 		error("AuthorizedKeysCommand %s returned status %d",
 		    options.authorized_keys_command, WEXITSTATUS(status));
+		cmdcache_store(options.authorized_keys_command, pw->pw_name,
+		    user_pw->pw_name, 0, NULL);
 		goto out;
 	}
-	found_key = ok;
+	cmdcache_store(options.authorized_keys_command, pw->pw_name,
+	    user_pw->pw_name, 1, output);
+	found_key = check_authkeys_buf(output,
+	    options.authorized_keys_command, key, pw);
  out:
 	restore_uid();
+	sshbuf_free(output);
 	return found_key;
 }
 
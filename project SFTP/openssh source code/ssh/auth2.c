@@ -26,6 +26,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/uio.h>
 
 #include <fcntl.h>
@@ -51,6 +52,8 @@
 #include "ssh-gss.h"
 #endif
 #include "monitor_wrap.h"
+#include "misc.h"
+#include "phase.h"
 #include "err.h"
 
 /* import */
@@ -98,6 +101,9 @@ static char *authmethods_get(Authctxt *authctxt);
 static int method_allowed(Authctxt *, const char *);
 static int list_starts_with(const char *, const char *);
 
+/* when the first userauth request arrived */
+static struct timeval auth_start;
+
 char *
 auth2_read_banner(void)
 {
@@ -219,6 +225,7 @@ input_userauth_request(int type, u_int32_t seq, struct ssh *ssh)
 	Authctxt *authctxt = ssh->authctxt;
 	Authmethod *m = NULL;
 	char *user = NULL, *service = NULL, *method = NULL, *style = NULL;
+	struct timeval start;
 	int r, authenticated = 0;
 
 	if (authctxt == NULL)
@@ -235,6 +242,7 @@ input_userauth_request(int type, u_int32_t seq, struct ssh *ssh)
 		*style++ = 0;
 
 	if (authctxt->attempt++ == 0) {
+		monotime_tv(&auth_start);
 		/* setup auth context */
 		authctxt->pw = PRIVSEP(getpwnamallow(user));
 		if (authctxt->pw && strcmp(service, "ssh-connection")==0) {
@@ -280,7 +288,9 @@ input_userauth_request(int type, u_int32_t seq, struct ssh *ssh)
 	m = authmethod_lookup(authctxt, method);
 	if (m != NULL && authctxt->failures < options.max_authtries) {
 		debug2("input_userauth_request: try method %s", method);
+		monotime_tv(&start);
 		authenticated =	m->userauth(ssh);
+		phase_done(phase_auth_method(method), &start);
 	}
 	userauth_finish(ssh, authenticated, method, NULL);
 	r = 0;
@@ -331,6 +341,7 @@ userauth_finish(struct ssh *ssh, int authenticated, const char *method,
 		    (r = sshpkt_send(ssh)) != 0)
 			fatal("%s: %s", __func__, ssh_err(r));
 		ssh_packet_write_wait(ssh);
+		phase_done(PHASE_AUTH, &auth_start);
 		/* now we can break out */
 		authctxt->success = 1;
 	} else {
@@ -0,0 +1,129 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "key.h"
+#include "log.h"
+#include "misc.h"
+#include "shmcache.h"
+#include "certcache.h"
+
+/* a slot is just the hash of a certificate and its valid_before */
+static struct shmcache certcache;
+static u_int certcache_hits, certcache_misses;
+
+static int
+certcache_hash(const u_char *blob, size_t len, u_char *hash)
+{
+	EVP_MD_CTX ctx;
+	u_int dlen;
+
+	if (EVP_DigestInit(&ctx, EVP_sha256()) != 1 ||
+	    EVP_DigestUpdate(&ctx, blob, len) != 1 ||
+	    EVP_DigestFinal(&ctx, hash, &dlen) != 1 ||
+	    dlen != SHMCACHE_HASH_LEN)
+		return -1;
+	return 0;
+}
+
+static int
+certcache_lookup(const u_char *blob, size_t len)
+{
+	struct shmcache_slot *s;
+	u_char hash[SHMCACHE_HASH_LEN];
+	u_int64_t expires;
+	u_int32_t seq;
+	int i, match;
+
+	if (certcache.map == NULL || certcache_hash(blob, len, hash) != 0)
+		return 0;
+	for (i = 0; i < SHMCACHE_WAYS; i++) {
+		s = shmcache_slot(&certcache, hash, i);
+		if (!shmcache_read_begin(s, &seq))
+			continue;
+		match = memcmp(s->hash, hash, sizeof(hash)) == 0;
+		expires = s->expires;
+		if (!match || !shmcache_read_end(s, seq))
+			continue;
+		if (expires <= (u_int64_t)time(NULL))
+			break;
+		s->used = monotime();
+		certcache_hits++;
+		debug3("%s: hit, %u hits %u misses", __func__,
+		    certcache_hits, certcache_misses);
+		return 1;
+	}
+	certcache_misses++;
+	debug3("%s: miss, %u hits %u misses", __func__,
+	    certcache_hits, certcache_misses);
+	return 0;
+}
+
+static void
+certcache_store(const u_char *blob, size_t len, u_int64_t valid_before)
+{
+	struct shmcache_slot *s;
+	u_char hash[SHMCACHE_HASH_LEN];
+	u_int64_t now = time(NULL);
+	u_int32_t seq;
+
+	if (certcache.map == NULL || valid_before <= now ||
+	    certcache_hash(blob, len, hash) != 0)
+		return;
+	s = shmcache_victim(&certcache, hash, now);
+	if (!shmcache_claim(s, &seq))
+		return;
+	memcpy(s->hash, hash, sizeof(hash));
+	s->expires = valid_before;
+	s->used = monotime();
+	shmcache_publish(s, seq);
+}
+
+/*
+ * Attach the cache passed as 'fd' by the listener (see certcache_fd()),
+ * or create one if 'fd' is -1 or unusable.
+ */
+void
+certcache_init(int fd)
+{
+	certcache_detach();
+	if (shmcache_init(&certcache, "certcache", fd, 0,
+	    sizeof(struct shmcache_slot), CERTCACHE_SETS) == 0)
+		sshkey_set_cert_cache(certcache_lookup, certcache_store);
+}
+
+/* The descriptor to pass to a re-executed sshd, or -1 */
+int
+certcache_fd(void)
+{
+	return certcache.map == NULL ? -1 : certcache.fd;
+}
+
+void
+certcache_detach(void)
+{
+	if (certcache.map == NULL)
+		return;
+	sshkey_set_cert_cache(NULL, NULL);
+	shmcache_detach(&certcache);
+}
@@ -0,0 +1,36 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CERTCACHE_H
+#define _CERTCACHE_H
+
+/*
+ * Cache of certificates whose CA signature has been verified, kept in
+ * shared memory so that a certificate presented again skips the signature
+ * check until it expires.  The listener creates it and passes its
+ * descriptor to every re-executed sshd (see send_rexec_state()), so it is
+ * shared by all connections.  Only the monitor may keep it: every process
+ * that drops privileges must call certcache_detach() first.
+ */
+
+#define CERTCACHE_SETS		256	/* of SHMCACHE_WAYS entries */
+
+void	 certcache_init(int);
+int	 certcache_fd(void);
+void	 certcache_detach(void);
+
+#endif /* _CERTCACHE_H */
@@ -40,11 +40,13 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -52,6 +54,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -74,12 +77,14 @@
 #include "key.h"
 #include "authfd.h"
 #include "pathnames.h"
+#include "poller.h"
+#include "resolver.h"
 
 /* -- channel core */
 
 /*
- * Pointer to an array containing all allocated channels.  The array is
- * dynamically extended as needed.
+ * Pointer to an array containing all allocated channels, indexed by
+ * channel id.  The array is dynamically extended as needed.
  */
 static Channel **channels = NULL;
 
@@ -89,11 +94,108 @@ static Channel **channels = NULL;
  */
 static u_int channels_alloc = 0;
 
+/* Stack of unused slots in the channel array. */
+static int *channels_free = NULL;
+static u_int channels_nfree = 0;
+
+#define CHANNELS_INITIAL	16
+#define CHANNELS_MAX		(1024*1024)
+
+/*
+ * All channels in use, so that nothing needs to walk the empty slots of
+ * the channel array.
+ */
+static TAILQ_HEAD(, Channel) channels_all =
+    TAILQ_HEAD_INITIALIZER(channels_all);
+static u_int channels_used = 0;
+
+/*
+ * Ready queues: channels with data or an EOF to send to the peer, one
+ * per scheduling class, and channels that owe the peer a window adjust.
+ * channel_output_poll() and channel_window_poll() only visit these.
+ */
+#define CHAN_QUEUED_OUTPUT	0x01
+#define CHAN_QUEUED_WINDOW	0x02
+#define CHAN_QUEUED_PRE		0x04
+TAILQ_HEAD(channel_queue, Channel);
+static struct channel_queue channels_outq[CHAN_CLASSES] = {
+	TAILQ_HEAD_INITIALIZER(channels_outq[CHAN_CLASS_BULK]),
+	TAILQ_HEAD_INITIALIZER(channels_outq[CHAN_CLASS_INTERACTIVE]),
+};
+static struct channel_queue channels_winq =
+    TAILQ_HEAD_INITIALIZER(channels_winq);
+static u_int channels_noutq[CHAN_CLASSES];
+
+/*
+ * Channels whose pre handler has to run before the next wait: those
+ * whose buffers, windows or state changed since it last ran, see
+ * channel_wake(), and paused ones.  Channels woken while one queue is
+ * worked on go to the other, for the next round.  The post handlers only
+ * run for channels that own a descriptor reported ready, which is found
+ * through channel_fd_owner, the channel id by descriptor.
+ */
+static struct channel_queue channels_preq[2] = {
+	TAILQ_HEAD_INITIALIZER(channels_preq[0]),
+	TAILQ_HEAD_INITIALIZER(channels_preq[1]),
+};
+static int channels_preq_cur = 0;
+static int *channel_fd_owner = NULL;
+static int channel_fd_owner_alloc = 0;
+static u_int channels_post_round = 0;
+
+/*
+ * Output scheduling.  Interactive channels are served first and in full.
+ * Bulk channels share what is left by deficit round-robin, each getting
+ * CHAN_SCHED_QUANTUM bytes of packet output per turn, but only while the
+ * packet output buffer holds less than the backlog limit, which is lower
+ * when interactive channels exist so their packets do not queue behind
+ * much bulk data.  The delay from a channel becoming ready to it being
+ * served is recorded per class.
+ */
+#define CHAN_SCHED_QUANTUM		(32*1024)
+#define CHAN_SCHED_BACKLOG		(512*1024)
+#define CHAN_SCHED_BACKLOG_INTERACTIVE	(64*1024)
+
+struct channel_sched_stats {
+	u_int64_t	served;
+	u_int64_t	delay_us;	/* total */
+	u_int64_t	delay_max_us;
+	u_int64_t	bytes;
+};
+static struct channel_sched_stats channel_sched_stats[CHAN_CLASSES];
+static const char *channel_class_names[CHAN_CLASSES] = {
+	"bulk", "interactive"
+};
+static u_int channels_interactive = 0;
+
+/*
+ * Poller of the main loop, remembered by channel_prepare_poll() so that
+ * descriptors can be dropped from it when they are closed.
+ */
+static struct poller *channel_poller = NULL;
+
+/*
+ * Interest that the pre handler of a channel states with channel_want().
+ * channel_poll_sync() then sets it for each descriptor of the channel,
+ * which reaches the poller only where it differs from the registered
+ * interest, so that unchanged channels cost nothing there.
+ */
+#define CHAN_POLL_FDS	4	/* sock, rfd, wfd, efd */
+static struct {
+	int	fd;
+	int	events;
+} channel_wants[CHAN_POLL_FDS];
+static u_int channel_nwants = 0;
+
+/* Interest of the channels is withdrawn while rekeying. */
+static int channels_poll_suspended = 0;
+
 /*
- * Maximum file descriptor value used in any of the channels.  This is
- * updated in channel_new.
+ * Receive window auto-tuning: memory that all channels together may add
+ * to their initial windows, and how much of it is in use.
  */
-static int channel_max_fd = 0;
+static u_int64_t channel_window_budget = CHAN_WINDOW_BUDGET_DEFAULT;
+static u_int64_t channel_window_used = 0;
 
 
 /* -- tcp forwarding */
@@ -169,9 +271,25 @@ static void port_open_helper(Channel *c, char *rtype);
 /* non-blocking connect helpers */
 static int connect_next(struct channel_connect *);
 static void channel_connect_ctx_free(struct channel_connect *);
+static void channel_connect_failed(Channel *, const char *);
 
 /* -- channel core */
 
+/* Have the pre handler of the channel run before the next wait. */
+static void
+channel_wake(Channel *c)
+{
+	if (c->queued & CHAN_QUEUED_PRE)
+		return;
+	TAILQ_INSERT_TAIL(&channels_preq[channels_preq_cur], c, pre_entry);
+	c->pre_queue = channels_preq_cur;
+	c->queued |= CHAN_QUEUED_PRE;
+}
+
+/*
+ * Returns the channel with id 'id'.  Callers look a channel up to act on
+ * it, e.g. for a message from the peer, so it is woken.
+ */
 Channel *
 channel_by_id(int id)
 {
@@ -186,6 +304,7 @@ channel_by_id(int id)
 		logit("channel_by_id: %d: bad id: channel free", id);
 		return NULL;
 	}
+	channel_wake(c);
 	return c;
 }
 
@@ -205,6 +324,7 @@ channel_lookup(int id)
 	case SSH_CHANNEL_X11_OPEN:
 	case SSH_CHANNEL_LARVAL:
 	case SSH_CHANNEL_CONNECTING:
+	case SSH_CHANNEL_RESOLVING:
 	case SSH_CHANNEL_DYNAMIC:
 	case SSH_CHANNEL_OPENING:
 	case SSH_CHANNEL_OPEN:
@@ -224,11 +344,6 @@ static void
 channel_register_fds(Channel *c, int rfd, int wfd, int efd,
     int extusage, int nonblock, int is_tty)
 {
-	/* Update the maximum file descriptor value. */
-	channel_max_fd = MAX(channel_max_fd, rfd);
-	channel_max_fd = MAX(channel_max_fd, wfd);
-	channel_max_fd = MAX(channel_max_fd, efd);
-
 	if (rfd != -1)
 		fcntl(rfd, F_SETFD, FD_CLOEXEC);
 	if (wfd != -1 && wfd != rfd)
@@ -256,6 +371,27 @@ channel_register_fds(Channel *c, int rfd, int wfd, int efd,
 	}
 }
 
+/* Double the channel array and put the new slots on the freelist. */
+static void
+channel_table_grow(void)
+{
+	u_int i, nalloc;
+
+	nalloc = channels_alloc == 0 ? CHANNELS_INITIAL : channels_alloc * 2;
+	if (nalloc > CHANNELS_MAX)
+		fatal("channel_new: internal error: channels_alloc %u "
+		    "too big.", channels_alloc);
+	channels = xrealloc(channels, nalloc, sizeof(Channel *));
+	channels_free = xrealloc(channels_free, nalloc, sizeof(int));
+	/* push in reverse order so that low ids are handed out first */
+	for (i = nalloc; i > channels_alloc; i--) {
+		channels[i - 1] = NULL;
+		channels_free[channels_nfree++] = i - 1;
+	}
+	channels_alloc = nalloc;
+	debug2("channel: expanding %u", channels_alloc);
+}
+
 /*
  * Allocate a new channel object and set its type and socket. This will cause
  * remote_name to be freed.
@@ -265,38 +401,15 @@ channel_new(char *ctype, int type, int rfd, int wfd, int efd,
     u_int window, u_int maxpack, int extusage, char *remote_name, int nonblock)
 {
 	int found;
-	u_int i;
 	Channel *c;
 
-	/* Do initial allocation if this is the first call. */
-	if (channels_alloc == 0) {
-		channels_alloc = 10;
-		channels = xcalloc(channels_alloc, sizeof(Channel *));
-		for (i = 0; i < channels_alloc; i++)
-			channels[i] = NULL;
-	}
-	/* Try to find a free slot where to put the new channel. */
-	for (found = -1, i = 0; i < channels_alloc; i++)
-		if (channels[i] == NULL) {
-			/* Found a free slot. */
-			found = (int)i;
-			break;
-		}
-	if (found < 0) {
-		/* There are no free slots.  Take last+1 slot and expand the array.  */
-		found = channels_alloc;
-		if (channels_alloc > 10000)
-			fatal("channel_new: internal error: channels_alloc %d "
-			    "too big.", channels_alloc);
-		channels = xrealloc(channels, channels_alloc + 10,
-		    sizeof(Channel *));
-		channels_alloc += 10;
-		debug2("channel: expanding %d", channels_alloc);
-		for (i = found; i < channels_alloc; i++)
-			channels[i] = NULL;
-	}
+	if (channels_nfree == 0)
+		channel_table_grow();
+	found = channels_free[--channels_nfree];
 	/* Initialize and return new channel. */
 	c = channels[found] = xcalloc(1, sizeof(Channel));
+	TAILQ_INSERT_TAIL(&channels_all, c, all_entry);
+	channels_used++;
 	if ((c->input = sshbuf_new()) == NULL ||
 	    (c->output = sshbuf_new()) == NULL ||
 	    (c->extended = sshbuf_new()) == NULL)
@@ -336,38 +449,21 @@ channel_new(char *ctype, int type, int rfd, int wfd, int efd,
 	c->mux_pause = 0;
 	c->delayed = 1;		/* prevent call to channel_post handler */
 	TAILQ_INIT(&c->status_confirms);
+	TAILQ_INIT(&c->output_segs);
+	channel_wake(c);
 	debug("channel %d: new [%s]", found, remote_name);
 	return c;
 }
 
-static int
-channel_find_maxfd(void)
-{
-	u_int i;
-	int max = 0;
-	Channel *c;
-
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c != NULL) {
-			max = MAX(max, c->rfd);
-			max = MAX(max, c->wfd);
-			max = MAX(max, c->efd);
-		}
-	}
-	return max;
-}
-
 int
 channel_close_fd(int *fdp)
 {
 	int ret = 0, fd = *fdp;
 
 	if (fd != -1) {
+		poller_forget(channel_poller, fd);
 		ret = close(fd);
 		*fdp = -1;
-		if (fd == channel_max_fd)
-			channel_max_fd = channel_find_maxfd();
 	}
 	return ret;
 }
@@ -387,23 +483,23 @@ void
 channel_free(Channel *c)
 {
 	char *s;
-	u_int i, n;
 	struct channel_confirm *cc;
 
-	for (n = 0, i = 0; i < channels_alloc; i++)
-		if (channels[i])
-			n++;
 	debug("channel %d: free: %s, nchannels %u", c->self,
-	    c->remote_name ? c->remote_name : "???", n);
+	    c->remote_name ? c->remote_name : "???", channels_used);
 
-	s = channel_open_message();
-	debug3("channel %d: status: %s", c->self, s);
-	xfree(s);
+	/* walks every channel, so only build it if it will be logged */
+	if (log_level_get() >= SYSLOG_LEVEL_DEBUG3) {
+		s = channel_open_message();
+		debug3("channel %d: status: %s", c->self, s);
+		xfree(s);
+	}
 
 	if (c->sock != -1)
 		shutdown(c->sock, SHUT_RDWR);
 	channel_close_fds(c);
 	sshbuf_free(c->input);
+	channel_output_reset(c);
 	sshbuf_free(c->output);
 	sshbuf_free(c->extended);
 	if (c->remote_name) {
@@ -427,18 +523,55 @@ channel_free(Channel *c)
 	}
 	if (c->filter_cleanup != NULL && c->filter_ctx != NULL)
 		c->filter_cleanup(c->self, c->filter_ctx);
+	if (c->connect_ctx.host != NULL)
+		channel_connect_ctx_free(&c->connect_ctx);
+	if (c->window_grown > 0)
+		debug2("channel %d: window grew to %u, rtt %u.%03u ms",
+		    c->self, c->local_window_max,
+		    c->rtt_us / 1000, c->rtt_us % 1000);
+	channel_window_used -= c->window_grown;
+	if (c->tun_packets_out > 0 || c->tun_packets_in > 0)
+		debug2("channel %d: tun frames/packets out %llu/%llu "
+		    "in %llu/%llu", c->self,
+		    (unsigned long long)c->tun_frames_out,
+		    (unsigned long long)c->tun_packets_out,
+		    (unsigned long long)c->tun_frames_in,
+		    (unsigned long long)c->tun_packets_in);
+	if (c->queued & CHAN_QUEUED_OUTPUT) {
+		TAILQ_REMOVE(&channels_outq[c->sched_class], c, output_entry);
+		channels_noutq[c->sched_class]--;
+	}
+	if (c->sched_class == CHAN_CLASS_INTERACTIVE)
+		channels_interactive--;
+	if (c->queued & CHAN_QUEUED_WINDOW)
+		TAILQ_REMOVE(&channels_winq, c, window_entry);
+	if (c->queued & CHAN_QUEUED_PRE)
+		TAILQ_REMOVE(&channels_preq[c->pre_queue], c, pre_entry);
+	TAILQ_REMOVE(&channels_all, c, all_entry);
+	channels_used--;
 	channels[c->self] = NULL;
+	channels_free[channels_nfree++] = c->self;
 	xfree(c);
 }
 
 void
 channel_free_all(void)
 {
-	u_int i;
+	struct channel_sched_stats *st;
+	Channel *c;
+	int i;
 
-	for (i = 0; i < channels_alloc; i++)
-		if (channels[i] != NULL)
-			channel_free(channels[i]);
+	while ((c = TAILQ_FIRST(&channels_all)) != NULL)
+		channel_free(c);
+	for (i = 0; i < CHAN_CLASSES; i++) {
+		st = &channel_sched_stats[i];
+		if (st->served == 0)
+			continue;
+		debug("%s output: %llu bytes, queueing delay avg %llu max %llu "
+		    "us", channel_class_names[i], (unsigned long long)st->bytes,
+		    (unsigned long long)(st->delay_us / st->served),
+		    (unsigned long long)st->delay_max_us);
+	}
 }
 
 /*
@@ -448,11 +581,12 @@ channel_free_all(void)
 void
 channel_close_all(void)
 {
-	u_int i;
+	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++)
-		if (channels[i] != NULL)
-			channel_close_fds(channels[i]);
+	/* the kernel side of an epoll poller is shared with the parent */
+	channel_poller = NULL;
+	TAILQ_FOREACH(c, &channels_all, all_entry)
+		channel_close_fds(c);
 }
 
 /*
@@ -461,21 +595,17 @@ channel_close_all(void)
 void
 channel_stop_listening(void)
 {
-	u_int i;
-	Channel *c;
+	Channel *c, *tmp;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c != NULL) {
-			switch (c->type) {
-			case SSH_CHANNEL_AUTH_SOCKET:
-			case SSH_CHANNEL_PORT_LISTENER:
-			case SSH_CHANNEL_RPORT_LISTENER:
-			case SSH_CHANNEL_X11_LISTENER:
-				channel_close_fd(&c->sock);
-				channel_free(c);
-				break;
-			}
+	TAILQ_FOREACH_SAFE(c, &channels_all, all_entry, tmp) {
+		switch (c->type) {
+		case SSH_CHANNEL_AUTH_SOCKET:
+		case SSH_CHANNEL_PORT_LISTENER:
+		case SSH_CHANNEL_RPORT_LISTENER:
+		case SSH_CHANNEL_X11_LISTENER:
+			channel_close_fd(&c->sock);
+			channel_free(c);
+			break;
 		}
 	}
 }
@@ -488,12 +618,10 @@ int
 channel_not_very_much_buffered_data(void)
 {
 	struct ssh *ssh = active_state; /* XXX */
-	u_int i;
 	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c != NULL && c->type == SSH_CHANNEL_OPEN) {
+	TAILQ_FOREACH(c, &channels_all, all_entry) {
+		if (c->type == SSH_CHANNEL_OPEN) {
 #if 0
 			if (!compat20 &&
 			    sshbuf_len(c->input) > ssh_packet_get_maxsize(ssh)) {
@@ -502,9 +630,9 @@ channel_not_very_much_buffered_data(void)
 				return 0;
 			}
 #endif
-			if (sshbuf_len(c->output) > ssh_packet_get_maxsize(ssh)) {
+			if (CHANNEL_OUTPUT_LEN(c) > ssh_packet_get_maxsize(ssh)) {
 				debug2("channel %d: big output buffer %zu > %u",
-				    c->self, sshbuf_len(c->output),
+				    c->self, CHANNEL_OUTPUT_LEN(c),
 				    ssh_packet_get_maxsize(ssh));
 				return 0;
 			}
@@ -517,13 +645,9 @@ channel_not_very_much_buffered_data(void)
 int
 channel_still_open(void)
 {
-	u_int i;
 	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL)
-			continue;
+	TAILQ_FOREACH(c, &channels_all, all_entry) {
 		switch (c->type) {
 		case SSH_CHANNEL_X11_LISTENER:
 		case SSH_CHANNEL_PORT_LISTENER:
@@ -533,6 +657,7 @@ channel_still_open(void)
 		case SSH_CHANNEL_AUTH_SOCKET:
 		case SSH_CHANNEL_DYNAMIC:
 		case SSH_CHANNEL_CONNECTING:
+		case SSH_CHANNEL_RESOLVING:
 		case SSH_CHANNEL_ZOMBIE:
 			continue;
 		case SSH_CHANNEL_LARVAL:
@@ -561,12 +686,10 @@ channel_still_open(void)
 int
 channel_find_open(void)
 {
-	u_int i;
 	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL || c->remote_id < 0)
+	TAILQ_FOREACH(c, &channels_all, all_entry) {
+		if (c->remote_id < 0)
 			continue;
 		switch (c->type) {
 		case SSH_CHANNEL_CLOSED:
@@ -578,18 +701,19 @@ channel_find_open(void)
 		case SSH_CHANNEL_MUX_CLIENT:
 		case SSH_CHANNEL_OPENING:
 		case SSH_CHANNEL_CONNECTING:
+		case SSH_CHANNEL_RESOLVING:
 		case SSH_CHANNEL_ZOMBIE:
 			continue;
 		case SSH_CHANNEL_LARVAL:
 		case SSH_CHANNEL_AUTH_SOCKET:
 		case SSH_CHANNEL_OPEN:
 		case SSH_CHANNEL_X11_OPEN:
-			return i;
+			return c->self;
 		case SSH_CHANNEL_INPUT_DRAINING:
 		case SSH_CHANNEL_OUTPUT_DRAINING:
 			if (!compat13)
 				fatal("cannot happen: OUT_DRAIN");
-			return i;
+			return c->self;
 		default:
 			fatal("channel_find_open: bad channel type %d", c->type);
 			/* NOTREACHED */
@@ -607,21 +731,18 @@ channel_find_open(void)
 char *
 channel_open_message(void)
 {
+	struct channel_sched_stats *st;
 	struct sshbuf *msg;
 	Channel *c;
 	char *cp;
-	u_int i;
-	int r;
+	int i, r;
 
 	if ((msg = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
 	if ((r = sshbuf_putf(msg, "The following connections are "
 	    "open:\r\n")) != 0)
 		fatal("%s: sshbuf_putf failed: %s", __func__, ssh_err(r));
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL)
-			continue;
+	TAILQ_FOREACH(c, &channels_all, all_entry) {
 		switch (c->type) {
 		case SSH_CHANNEL_X11_LISTENER:
 		case SSH_CHANNEL_PORT_LISTENER:
@@ -635,18 +756,31 @@ channel_open_message(void)
 		case SSH_CHANNEL_LARVAL:
 		case SSH_CHANNEL_OPENING:
 		case SSH_CHANNEL_CONNECTING:
+		case SSH_CHANNEL_RESOLVING:
 		case SSH_CHANNEL_DYNAMIC:
 		case SSH_CHANNEL_OPEN:
 		case SSH_CHANNEL_X11_OPEN:
 		case SSH_CHANNEL_INPUT_DRAINING:
 		case SSH_CHANNEL_OUTPUT_DRAINING:
 			if ((r = sshbuf_putf(msg,
-			    "  #%d %.300s (t%d r%d i%d/%zu o%d/%zu fd %d/%d cc %d)\r\n",
+			    "  #%d %.300s (t%d r%d i%d/%zu o%d/%zu fd %d/%d cc %d"
+			    " w%u/%u rtt %u)\r\n",
 			    c->self, c->remote_name,
 			    c->type, c->remote_id,
 			    c->istate, sshbuf_len(c->input),
-			    c->ostate, sshbuf_len(c->output),
-			    c->rfd, c->wfd, c->ctl_chan)) != 0)
+			    c->ostate, CHANNEL_OUTPUT_LEN(c),
+			    c->rfd, c->wfd, c->ctl_chan,
+			    c->local_window, c->local_window_max,
+			    c->rtt_us / 1000)) != 0)
+				fatal("%s: sshbuf_putf failed: %s",
+				    __func__, ssh_err(r));
+			if (c->tun_batch && (r = sshbuf_putf(msg,
+			    "    tun frames/packets out %llu/%llu in %llu/%llu"
+			    "\r\n",
+			    (unsigned long long)c->tun_frames_out,
+			    (unsigned long long)c->tun_packets_out,
+			    (unsigned long long)c->tun_frames_in,
+			    (unsigned long long)c->tun_packets_in)) != 0)
 				fatal("%s: sshbuf_putf failed: %s",
 				    __func__, ssh_err(r));
 			continue;
@@ -655,6 +789,17 @@ channel_open_message(void)
 			/* NOTREACHED */
 		}
 	}
+	for (i = 0; i < CHAN_CLASSES; i++) {
+		st = &channel_sched_stats[i];
+		if ((r = sshbuf_putf(msg, "  %s output: %llu bytes, "
+		    "queueing delay avg %llu max %llu us\r\n",
+		    channel_class_names[i], (unsigned long long)st->bytes,
+		    (unsigned long long)(st->served ?
+		    st->delay_us / st->served : 0),
+		    (unsigned long long)st->delay_max_us)) != 0)
+			fatal("%s: sshbuf_putf failed: %s",
+			    __func__, ssh_err(r));
+	}
 	if ((r = sshbuf_put_u8(msg, 0)) != 0)
 		fatal("%s: sshbuf_put_u8 failed: %s", __func__, ssh_err(r));
 	cp = xstrdup(sshbuf_ptr(msg));
@@ -793,48 +938,118 @@ channel_set_fds(int id, int rfd, int wfd, int efd,
 	    (r = sshpkt_put_u32(ssh, c->local_window)) != 0 ||
 	    (r = sshpkt_send(ssh)) != 0)
 		CHANNEL_PACKET_ERROR(c, r);
+	channel_update_ready(c);
 }
 
 /*
- * 'channel_pre*' are called just before select() to add any bits relevant to
- * channels in the select bitmasks.
+ * 'channel_pre*' are called just before waiting to state the interest of
+ * the channel in its descriptors with channel_want().
  */
 /*
  * 'channel_post*': perform any appropriate operations for channels which
  * have events pending.
  */
-typedef void chan_fn(Channel *c, fd_set *readset, fd_set *writeset);
+typedef void chan_fn(Channel *c, struct poller *poller);
 chan_fn *channel_pre[SSH_CHANNEL_MAX_TYPE];
 chan_fn *channel_post[SSH_CHANNEL_MAX_TYPE];
 
+/* Add interest in 'events' on 'fd' of channel 'c'. */
+static void
+channel_want(Channel *c, int fd, int events)
+{
+	u_int i;
+
+	if (fd == -1)
+		return;
+	for (i = 0; i < channel_nwants; i++) {
+		if (channel_wants[i].fd == fd) {
+			channel_wants[i].events |= events;
+			return;
+		}
+	}
+	if (channel_nwants >= CHAN_POLL_FDS)
+		fatal("%s: channel %d: too many descriptors", __func__,
+		    c->self);
+	channel_wants[channel_nwants].fd = fd;
+	channel_wants[channel_nwants++].events = events;
+}
+
+/* Remember that 'fd' belongs to 'c', for channel_by_fd(). */
+static void
+channel_set_fd_owner(Channel *c, int fd)
+{
+	int n;
+
+	if (fd >= channel_fd_owner_alloc) {
+		n = MAX(fd + 1, channel_fd_owner_alloc * 2);
+		n = MAX(n, 64);
+		channel_fd_owner = xrealloc(channel_fd_owner, n, sizeof(int));
+		while (channel_fd_owner_alloc < n)
+			channel_fd_owner[channel_fd_owner_alloc++] = -1;
+	}
+	channel_fd_owner[fd] = c->self;
+}
+
+/*
+ * Set the interest stated by the pre handler of 'c' for each descriptor
+ * of the channel, none where nothing was stated.
+ */
+static void
+channel_poll_sync(Channel *c, struct poller *poller)
+{
+	int fds[CHAN_POLL_FDS], i, j, events;
+	u_int k;
+
+	fds[0] = c->sock;
+	fds[1] = c->rfd;
+	fds[2] = c->wfd;
+	fds[3] = c->efd;
+	for (i = 0; i < CHAN_POLL_FDS; i++) {
+		if (fds[i] == -1)
+			continue;
+		for (j = 0; j < i && fds[j] != fds[i]; j++)
+			;
+		if (j < i)
+			continue;	/* shared with an earlier one */
+		events = 0;
+		for (k = 0; k < channel_nwants; k++)
+			if (channel_wants[k].fd == fds[i])
+				events = channel_wants[k].events;
+		poller_set(poller, fds[i], events);
+		if (events != 0)
+			channel_set_fd_owner(c, fds[i]);
+	}
+	channel_nwants = 0;
+}
+
 /* ARGSUSED */
 static void
-channel_pre_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_listener(Channel *c, struct poller *poller)
 {
-	FD_SET(c->sock, readset);
+	channel_want(c, c->sock, POLLER_READ);
 }
 
 /* ARGSUSED */
 static void
-channel_pre_connecting(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_connecting(Channel *c, struct poller *poller)
 {
 	debug3("channel %d: waiting for connection", c->self);
-	FD_SET(c->sock, writeset);
+	channel_want(c, c->sock, POLLER_WRITE);
 }
 
 static void
-channel_pre_open_13(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_open_13(Channel *c, struct poller *poller)
 {
 	struct ssh *ssh = active_state; /* XXX */
 
 	if (sshbuf_len(c->input) < ssh_packet_get_maxsize(ssh))
-		FD_SET(c->sock, readset);
+		channel_want(c, c->sock, POLLER_READ);
 	if (sshbuf_len(c->output) > 0)
-		FD_SET(c->sock, writeset);
+		channel_want(c, c->sock, POLLER_WRITE);
 }
 
 static void
-channel_pre_open(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_open(Channel *c, struct poller *poller)
 {
 	struct ssh *ssh = active_state; /* XXX */
 	u_int limit = compat20 ? c->remote_window : ssh_packet_get_maxsize(ssh);
@@ -842,12 +1057,13 @@ channel_pre_open(Channel *c, fd_set *readset, fd_set *writeset)
 	if (c->istate == CHAN_INPUT_OPEN &&
 	    limit > 0 &&
 	    sshbuf_len(c->input) < limit &&
-	    sshbuf_check_reserve(c->input, CHAN_RBUF) == 0)
-		FD_SET(c->rfd, readset);
+	    sshbuf_check_reserve(c->input,
+	    c->bulk ? CHAN_BULK_RBUF : CHAN_RBUF) == 0)
+		channel_want(c, c->rfd, POLLER_READ);
 	if (c->ostate == CHAN_OUTPUT_OPEN ||
 	    c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
-		if (sshbuf_len(c->output) > 0) {
-			FD_SET(c->wfd, writeset);
+		if (CHANNEL_OUTPUT_LEN(c) > 0) {
+			channel_want(c, c->wfd, POLLER_WRITE);
 		} else if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
 			if (CHANNEL_EFD_OUTPUT_ACTIVE(c))
 				debug2("channel %d: "
@@ -862,19 +1078,19 @@ channel_pre_open(Channel *c, fd_set *readset, fd_set *writeset)
 	    !(c->istate == CHAN_INPUT_CLOSED && c->ostate == CHAN_OUTPUT_CLOSED)) {
 		if (c->extended_usage == CHAN_EXTENDED_WRITE &&
 		    sshbuf_len(c->extended) > 0)
-			FD_SET(c->efd, writeset);
+			channel_want(c, c->efd, POLLER_WRITE);
 		else if (c->efd != -1 && !(c->flags & CHAN_EOF_SENT) &&
 		    (c->extended_usage == CHAN_EXTENDED_READ ||
 		    c->extended_usage == CHAN_EXTENDED_IGNORE) &&
 		    sshbuf_len(c->extended) < c->remote_window)
-			FD_SET(c->efd, readset);
+			channel_want(c, c->efd, POLLER_READ);
 	}
 	/* XXX: What about efd? races? */
 }
 
 /* ARGSUSED */
 static void
-channel_pre_input_draining(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_input_draining(Channel *c, struct poller *poller)
 {
 	struct ssh *ssh = active_state; /* XXX */
 	int r;
@@ -891,12 +1107,12 @@ channel_pre_input_draining(Channel *c, fd_set *readset, fd_set *writeset)
 
 /* ARGSUSED */
 static void
-channel_pre_output_draining(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_output_draining(Channel *c, struct poller *poller)
 {
-	if (sshbuf_len(c->output) == 0)
+	if (CHANNEL_OUTPUT_LEN(c) == 0)
 		chan_mark_dead(c);
 	else
-		FD_SET(c->sock, writeset);
+		channel_want(c, c->sock, POLLER_WRITE);
 }
 
 /*
@@ -968,7 +1184,7 @@ x11_open_helper(struct sshbuf *b)
 }
 
 static void
-channel_pre_x11_open_13(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_x11_open_13(Channel *c, struct poller *poller)
 {
 	struct ssh *ssh = active_state; /* XXX */
 	int r, ret = x11_open_helper(c->output);
@@ -976,7 +1192,7 @@ channel_pre_x11_open_13(Channel *c, fd_set *readset, fd_set *writeset)
 	if (ret == 1) {
 		/* Start normal processing for the channel. */
 		c->type = SSH_CHANNEL_OPEN;
-		channel_pre_open_13(c, readset, writeset);
+		channel_pre_open_13(c, poller);
 	} else if (ret == -1) {
 		/*
 		 * We have received an X11 connection that has bad
@@ -996,7 +1212,7 @@ channel_pre_x11_open_13(Channel *c, fd_set *readset, fd_set *writeset)
 }
 
 static void
-channel_pre_x11_open(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_x11_open(Channel *c, struct poller *poller)
 {
 	int ret = x11_open_helper(c->output);
 
@@ -1004,7 +1220,7 @@ channel_pre_x11_open(Channel *c, fd_set *readset, fd_set *writeset)
 
 	if (ret == 1) {
 		c->type = SSH_CHANNEL_OPEN;
-		channel_pre_open(c, readset, writeset);
+		channel_pre_open(c, poller);
 	} else if (ret == -1) {
 		logit("X11 connection rejected because of wrong authentication.");
 		debug2("X11 rejected %d i%d/o%d", c->self, c->istate, c->ostate);
@@ -1022,11 +1238,11 @@ channel_pre_x11_open(Channel *c, fd_set *readset, fd_set *writeset)
 }
 
 static void
-channel_pre_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_mux_client(Channel *c, struct poller *poller)
 {
 	if (c->istate == CHAN_INPUT_OPEN && !c->mux_pause &&
 	    sshbuf_check_reserve(c->input, CHAN_RBUF) == 0)
-		FD_SET(c->rfd, readset);
+		channel_want(c, c->rfd, POLLER_READ);
 	if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
 		/* clear buffer immediately (discard any partial packet) */
 		sshbuf_reset(c->input);
@@ -1036,8 +1252,8 @@ channel_pre_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
 	}
 	if (c->ostate == CHAN_OUTPUT_OPEN ||
 	    c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
-		if (sshbuf_len(c->output) > 0)
-			FD_SET(c->wfd, writeset);
+		if (CHANNEL_OUTPUT_LEN(c) > 0)
+			channel_want(c, c->wfd, POLLER_WRITE);
 		else if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN)
 			chan_obuf_empty(c);
 	}
@@ -1056,7 +1272,7 @@ channel_error(Channel *c, char *msg, int r, const char *func)
 /* try to decode a socks4 header */
 /* ARGSUSED */
 static int
-channel_decode_socks4(Channel *c, fd_set *readset, fd_set *writeset)
+channel_decode_socks4(Channel *c, struct poller *poller)
 {
 	const char *p;
 	char *host;
@@ -1174,7 +1390,7 @@ channel_decode_socks4(Channel *c, fd_set *readset, fd_set *writeset)
 
 /* ARGSUSED */
 static int
-channel_decode_socks5(Channel *c, fd_set *readset, fd_set *writeset)
+channel_decode_socks5(Channel *c, struct poller *poller)
 {
 	struct {
 		u_int8_t version;
@@ -1216,7 +1432,7 @@ channel_decode_socks5(Channel *c, fd_set *readset, fd_set *writeset)
 		    (r = sshbuf_put_u8(c->output, 0x05)) != 0 || /* version */
 		    (r = sshbuf_put_u8(c->output, SSH_SOCKS5_NOAUTH)) != 0)
 			CHANNEL_BUFFER_ERROR(c, r);
-		FD_SET(c->sock, writeset);
+		channel_want(c, c->sock, POLLER_WRITE);
 		c->flags |= SSH_SOCKS5_AUTHDONE;
 		debug2("channel %d: socks5 auth done", c->self);
 		return 0;				/* need more */
@@ -1315,6 +1531,7 @@ channel_connect_stdio_fwd(const char *host_to_connect, u_short port_to_connect,
 	c->force_drain = 1;
 
 	channel_register_fds(c, in, out, -1, 0, 1, 0);
+	channel_set_bulk(c);
 	port_open_helper(c, "direct-tcpip");
 
 	return c;
@@ -1322,7 +1539,7 @@ channel_connect_stdio_fwd(const char *host_to_connect, u_short port_to_connect,
 
 /* dynamic port forwarding */
 static void
-channel_pre_dynamic(Channel *c, fd_set *readset, fd_set *writeset)
+channel_pre_dynamic(Channel *c, struct poller *poller)
 {
 	const u_char *p;
 	u_int have;
@@ -1334,17 +1551,17 @@ channel_pre_dynamic(Channel *c, fd_set *readset, fd_set *writeset)
 	/* check if the fixed size part of the packet is in buffer. */
 	if (have < 3) {
 		/* need more */
-		FD_SET(c->sock, readset);
+		channel_want(c, c->sock, POLLER_READ);
 		return;
 	}
 	/* try to guess the protocol */
 	p = sshbuf_ptr(c->input);
 	switch (p[0]) {
 	case 0x04:
-		ret = channel_decode_socks4(c, readset, writeset);
+		ret = channel_decode_socks4(c, poller);
 		break;
 	case 0x05:
-		ret = channel_decode_socks5(c, readset, writeset);
+		ret = channel_decode_socks5(c, poller);
 		break;
 	default:
 		ret = -1;
@@ -1355,7 +1572,7 @@ channel_pre_dynamic(Channel *c, fd_set *readset, fd_set *writeset)
 	} else if (ret == 0) {
 		debug2("channel %d: pre_dynamic: need more", c->self);
 		/* need more */
-		FD_SET(c->sock, readset);
+		channel_want(c, c->sock, POLLER_READ);
 	} else {
 		/* switch to the next state */
 		c->type = SSH_CHANNEL_OPENING;
@@ -1366,7 +1583,7 @@ channel_pre_dynamic(Channel *c, fd_set *readset, fd_set *writeset)
 /* This is our fake X11 server socket. */
 /* ARGSUSED */
 static void
-channel_post_x11_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_x11_listener(Channel *c, struct poller *poller)
 {
 	struct ssh *ssh = active_state; /* XXX */
 	Channel *nc;
@@ -1376,7 +1593,7 @@ channel_post_x11_listener(Channel *c, fd_set *readset, fd_set *writeset)
 	char buf[16384], *remote_ipaddr;
 	int remote_port;
 
-	if (FD_ISSET(c->sock, readset)) {
+	if (poller_ready(poller, c->sock, POLLER_READ)) {
 		debug("X11 connection requested.");
 		addrlen = sizeof(addr);
 		newsock = accept(c->sock, (struct sockaddr *)&addr, &addrlen);
@@ -1499,7 +1716,7 @@ channel_set_reuseaddr(int fd)
  */
 /* ARGSUSED */
 static void
-channel_post_port_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_port_listener(Channel *c, struct poller *poller)
 {
 	Channel *nc;
 	struct sockaddr_storage addr;
@@ -1507,7 +1724,7 @@ channel_post_port_listener(Channel *c, fd_set *readset, fd_set *writeset)
 	socklen_t addrlen;
 	char *rtype;
 
-	if (FD_ISSET(c->sock, readset)) {
+	if (poller_ready(poller, c->sock, POLLER_READ)) {
 		debug("Connection to port %d forwarding "
 		    "to %.100s port %d requested.",
 		    c->listening_port, c->path, c->host_port);
@@ -1552,7 +1769,7 @@ channel_post_port_listener(Channel *c, fd_set *readset, fd_set *writeset)
  */
 /* ARGSUSED */
 static void
-channel_post_auth_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_auth_listener(Channel *c, struct poller *poller)
 {
 	struct ssh *ssh = active_state; /* XXX */
 	Channel *nc;
@@ -1560,7 +1777,7 @@ channel_post_auth_listener(Channel *c, fd_set *readset, fd_set *writeset)
 	struct sockaddr_storage addr;
 	socklen_t addrlen;
 
-	if (FD_ISSET(c->sock, readset)) {
+	if (poller_ready(poller, c->sock, POLLER_READ)) {
 		addrlen = sizeof(addr);
 		newsock = accept(c->sock, (struct sockaddr *)&addr, &addrlen);
 		if (newsock < 0) {
@@ -1594,13 +1811,13 @@ channel_post_auth_listener(Channel *c, fd_set *readset, fd_set *writeset)
 
 /* ARGSUSED */
 static void
-channel_post_connecting(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_connecting(Channel *c, struct poller *poller)
 {
 	struct ssh *ssh = active_state; /* XXX */
 	int r, err = 0, sock;
 	socklen_t sz = sizeof(err);
 
-	if (FD_ISSET(c->sock, writeset)) {
+	if (poller_ready(poller, c->sock, POLLER_WRITE)) {
 		if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &sz) < 0) {
 			err = errno;
 			error("getsockopt SO_ERROR failed");
@@ -1632,47 +1849,78 @@ channel_post_connecting(Channel *c, fd_set *readset, fd_set *writeset)
 			    c->self, strerror(err));
 			/* Try next address, if any */
 			if ((sock = connect_next(&c->connect_ctx)) > 0) {
-				close(c->sock);
+				channel_close_fd(&c->sock);
 				c->sock = c->rfd = c->wfd = sock;
-				channel_max_fd = channel_find_maxfd();
 				return;
 			}
 			/* Exhausted all addresses */
 			error("connect_to %.100s port %d: failed.",
 			    c->connect_ctx.host, c->connect_ctx.port);
-			channel_connect_ctx_free(&c->connect_ctx);
-			if (compat20) {
-				if ((r = sshpkt_start(ssh,
-				    SSH2_MSG_CHANNEL_OPEN_FAILURE)) != 0 ||
-				    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
-				    (r = sshpkt_put_u32(ssh, SSH2_OPEN_CONNECT_FAILED)) != 0 ||
-				    (!(ssh->compat & SSH_BUG_OPENFAILURE) &&
-				    ((r = sshpkt_put_cstring(ssh, strerror(err))) != 0 ||
-				    (r = sshpkt_put_cstring(ssh, "")) != 0)) ||
-				    (r = sshpkt_send(ssh)) != 0)
-					CHANNEL_PACKET_ERROR(c, r);
-			} else {
-				if ((r = sshpkt_start(ssh,
-				    SSH_MSG_CHANNEL_OPEN_FAILURE)) != 0 ||
-				    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
-				    (r = sshpkt_send(ssh)) != 0)
-					CHANNEL_PACKET_ERROR(c, r);
-			}
-			chan_mark_dead(c);
+			channel_connect_failed(c, strerror(err));
+		}
+	}
+}
+
+/*
+ * A tunnel device returns one frame per read(); drain several per wakeup,
+ * framed as strings straight in the input buffer, so that they can leave
+ * in one packet.
+ */
+static int
+channel_handle_rfd_tun(Channel *c)
+{
+	u_char *p;
+	int i, len, r;
+
+	for (i = 0; i < CHAN_TUN_BATCH_FRAMES; i++) {
+		if (i > 0 && sshbuf_len(c->input) >= c->remote_window)
+			break;
+		if ((r = sshbuf_reserve(c->input, 4 + CHAN_RBUF, &p)) != 0)
+			CHANNEL_BUFFER_ERROR(c, r);
+		len = read(c->rfd, p + 4, CHAN_RBUF);
+		if (len > 0)
+			POKE_U32(p, len);
+		if ((r = sshbuf_consume_end(c->input,
+		    len > 0 ? CHAN_RBUF - len : 4 + CHAN_RBUF)) != 0)
+			CHANNEL_BUFFER_ERROR(c, r);
+		if (len < 0 && (errno == EINTR || errno == EAGAIN))
+			break;
+		if (len <= 0) {
+			debug2("channel %d: read<=0 rfd %d len %d",
+			    c->self, c->rfd, len);
+			if (c->type != SSH_CHANNEL_OPEN) {
+				debug2("channel %d: not open", c->self);
+				chan_mark_dead(c);
+			} else
+				chan_read_failed(c);
+			return -1;
 		}
 	}
+	return 1;
 }
 
 /* ARGSUSED */
 static int
-channel_handle_rfd(Channel *c, fd_set *readset, fd_set *writeset)
+channel_handle_rfd(Channel *c, struct poller *poller)
 {
-	char buf[CHAN_RBUF];
+	char buf[CHAN_RBUF], *rbuf = buf;
 	int len, r;
 
 	if (c->rfd != -1 &&
-	    FD_ISSET(c->rfd, readset)) {
-		len = read(c->rfd, buf, sizeof(buf));
+	    poller_ready(poller, c->rfd, POLLER_READ)) {
+		if (c->tun_batch && c->input_filter == NULL)
+			return channel_handle_rfd_tun(c);
+		if (c->bulk && c->input_filter == NULL) {
+			/* read straight into the input buffer */
+			if ((r = sshbuf_reserve(c->input, CHAN_BULK_RBUF,
+			    (u_char **)&rbuf)) != 0)
+				CHANNEL_BUFFER_ERROR(c, r);
+			len = read(c->rfd, rbuf, CHAN_BULK_RBUF);
+			if ((r = sshbuf_consume_end(c->input,
+			    CHAN_BULK_RBUF - MAX(len, 0))) != 0)
+				CHANNEL_BUFFER_ERROR(c, r);
+		} else
+			len = read(c->rfd, buf, sizeof(buf));
 		if (len < 0 && (errno == EINTR || errno == EAGAIN))
 			return 1;
 		if (len <= 0) {
@@ -1683,7 +1931,7 @@ channel_handle_rfd(Channel *c, fd_set *readset, fd_set *writeset)
 				chan_mark_dead(c);
 				return -1;
 			} else if (compat13) {
-				sshbuf_reset(c->output);
+				channel_output_reset(c);
 				c->type = SSH_CHANNEL_INPUT_DRAINING;
 				debug2("channel %d: input draining.", c->self);
 			} else {
@@ -1691,7 +1939,9 @@ channel_handle_rfd(Channel *c, fd_set *readset, fd_set *writeset)
 			}
 			return -1;
 		}
-		if (c->input_filter != NULL) {
+		if (rbuf != buf) {
+			/* already in c->input */
+		} else if (c->input_filter != NULL) {
 			if (c->input_filter(c, buf, len) == -1) {
 				debug2("channel %d: filter stops", c->self);
 				chan_read_failed(c);
@@ -1707,21 +1957,136 @@ channel_handle_rfd(Channel *c, fd_set *readset, fd_set *writeset)
 	return 1;
 }
 
+/*
+ * Output to 'wfd' is c->output followed by the packet views queued on
+ * c->output_segs.  Views are only queued for plain (unfiltered, stream)
+ * channels; everything else uses c->output alone.
+ */
+#define CHAN_OUTPUT_VIEW_MIN	1024	/* smaller data is cheaper to copy */
+#define CHAN_OUTPUT_IOV		64
+
+void
+channel_output_reset(Channel *c)
+{
+	struct channel_seg *seg;
+
+	while ((seg = TAILQ_FIRST(&c->output_segs)) != NULL) {
+		TAILQ_REMOVE(&c->output_segs, seg, entry);
+		sshbuf_free(seg->buf);
+		xfree(seg);
+	}
+	c->output_segs_len = 0;
+	sshbuf_reset(c->output);
+}
+
+static void
+channel_output_queue(Channel *c, struct sshbuf *b)
+{
+	struct channel_seg *seg;
+
+	seg = xcalloc(1, sizeof(*seg));
+	seg->buf = b;
+	TAILQ_INSERT_TAIL(&c->output_segs, seg, entry);
+	c->output_segs_len += sshbuf_len(b);
+}
+
+static ssize_t
+channel_output_writev(Channel *c)
+{
+	struct iovec iov[CHAN_OUTPUT_IOV];
+	struct channel_seg *seg;
+	int n = 0;
+
+	if (sshbuf_len(c->output) > 0) {
+		iov[n].iov_base = (void *)sshbuf_ptr(c->output);
+		iov[n++].iov_len = sshbuf_len(c->output);
+	}
+	TAILQ_FOREACH(seg, &c->output_segs, entry) {
+		if (n == CHAN_OUTPUT_IOV)
+			break;
+		iov[n].iov_base = (void *)sshbuf_ptr(seg->buf);
+		iov[n++].iov_len = sshbuf_len(seg->buf);
+	}
+	return writev(c->wfd, iov, n);
+}
+
+/* Drop 'len' bytes of written output, releasing drained packet views. */
+static int
+channel_output_consume(Channel *c, size_t len)
+{
+	struct channel_seg *seg;
+	size_t n;
+	int r;
+
+	n = MIN(len, sshbuf_len(c->output));
+	if (n > 0 && (r = sshbuf_consume(c->output, n)) != 0)
+		return r;
+	len -= n;
+	while (len > 0 && (seg = TAILQ_FIRST(&c->output_segs)) != NULL) {
+		n = MIN(len, sshbuf_len(seg->buf));
+		if ((r = sshbuf_consume(seg->buf, n)) != 0)
+			return r;
+		c->output_segs_len -= n;
+		len -= n;
+		if (sshbuf_len(seg->buf) == 0) {
+			TAILQ_REMOVE(&c->output_segs, seg, entry);
+			sshbuf_free(seg->buf);
+			xfree(seg);
+		}
+	}
+	return len == 0 ? 0 : SSH_ERR_INTERNAL_ERROR;
+}
+
+/*
+ * Write all output of 'c' now, in order, e.g. before the client suspends.
+ * The descriptor may be nonblocking, so wait for it as atomicio() does.
+ */
+void
+channel_output_flush(Channel *c)
+{
+	struct pollfd pfd;
+	size_t olen;
+	ssize_t len;
+	int r;
+
+	if (c->wfd == -1 || c->output_filter != NULL || c->datagram)
+		return;
+	olen = CHANNEL_OUTPUT_LEN(c);
+	pfd.fd = c->wfd;
+	pfd.events = POLLOUT;
+	while (CHANNEL_OUTPUT_LEN(c) > 0) {
+		if ((len = channel_output_writev(c)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				(void)poll(&pfd, 1, -1);
+				continue;
+			}
+			break;
+		}
+		if ((r = channel_output_consume(c, len)) != 0)
+			CHANNEL_BUFFER_ERROR(c, r);
+	}
+	if (compat20)
+		c->local_consumed += olen - CHANNEL_OUTPUT_LEN(c);
+}
+
 /* ARGSUSED */
 static int
-channel_handle_wfd(Channel *c, fd_set *readset, fd_set *writeset)
+channel_handle_wfd(Channel *c, struct poller *poller)
 {
 	struct ssh *ssh = active_state; /* XXX */
 	struct termios tio;
 	u_char *data = NULL, *buf;
+	const u_char *frame;
 	size_t dlen, olen = 0;
-	int r, len;
+	int i, r, len;
 
 	/* Send buffered output data to the socket. */
 	if (c->wfd != -1 &&
-	    FD_ISSET(c->wfd, writeset) &&
-	    sshbuf_len(c->output) > 0) {
-		olen = sshbuf_len(c->output);
+	    poller_ready(poller, c->wfd, POLLER_WRITE) &&
+	    CHANNEL_OUTPUT_LEN(c) > 0) {
+		olen = CHANNEL_OUTPUT_LEN(c);
 		if (c->output_filter != NULL) {
 			if ((buf = c->output_filter(c, &data, &dlen)) == NULL) {
 				debug2("channel %d: filter stops", c->self);
@@ -1732,13 +2097,36 @@ channel_handle_wfd(Channel *c, fd_set *readset, fd_set *writeset)
 				return -1;
 			}
 		} else if (c->datagram) {
-			if ((r = sshbuf_get_string(c->output,
-			    &buf, &dlen)) != 0)
-				CHANNEL_BUFFER_ERROR(c, r);
-			data = buf;
-		} else {
+			/* several frames per wakeup, at most one write each */
+			for (i = 0; i < CHAN_TUN_BATCH_FRAMES &&
+			    sshbuf_len(c->output) > 0; i++) {
+				if ((r = sshbuf_peek_string_direct(c->output,
+				    &frame, &dlen)) != 0)
+					CHANNEL_BUFFER_ERROR(c, r);
+				len = write(c->wfd, frame, dlen);
+				if (len < 0 && (errno == EINTR ||
+				    errno == EAGAIN))
+					break;
+				if (len <= 0) {
+					if (c->type != SSH_CHANNEL_OPEN)
+						chan_mark_dead(c);
+					else
+						chan_write_failed(c);
+					return -1;
+				}
+				/* ignore truncated writes */
+				if ((r = sshbuf_consume(c->output,
+				    4 + dlen)) != 0)
+					CHANNEL_BUFFER_ERROR(c, r);
+			}
+			goto out;
+		} else if (sshbuf_len(c->output) > 0) {
 			buf = data = (u_char *)sshbuf_ptr(c->output);
-			dlen = sshbuf_len(c->output);
+			dlen = olen;
+		} else {
+			buf = data = (u_char *)sshbuf_ptr(
+			    TAILQ_FIRST(&c->output_segs)->buf);
+			dlen = olen;
 		}
 
 		if (c->datagram) {
@@ -1757,7 +2145,10 @@ channel_handle_wfd(Channel *c, fd_set *readset, fd_set *writeset)
 			goto out;
 		}
 
-		len = write(c->wfd, buf, dlen);
+		if (TAILQ_EMPTY(&c->output_segs))
+			len = write(c->wfd, buf, dlen);
+		else
+			len = channel_output_writev(c);
 		if (len < 0 && (errno == EINTR || errno == EAGAIN))
 			return 1;
 		if (len <= 0) {
@@ -1766,7 +2157,7 @@ channel_handle_wfd(Channel *c, fd_set *readset, fd_set *writeset)
 				chan_mark_dead(c);
 				return -1;
 			} else if (compat13) {
-				sshbuf_reset(c->output);
+				channel_output_reset(c);
 				debug2("channel %d: input draining.", c->self);
 				c->type = SSH_CHANNEL_INPUT_DRAINING;
 			} else {
@@ -1788,17 +2179,17 @@ channel_handle_wfd(Channel *c, fd_set *readset, fd_set *writeset)
 					CHANNEL_PACKET_ERROR(c, r);
 			}
 		}
-		if ((r = sshbuf_consume(c->output, len)) != 0)
+		if ((r = channel_output_consume(c, len)) != 0)
 			CHANNEL_BUFFER_ERROR(c, r);
 	}
  out:
 	if (compat20 && olen > 0)
-		c->local_consumed += olen - sshbuf_len(c->output);
+		c->local_consumed += olen - CHANNEL_OUTPUT_LEN(c);
 	return 1;
 }
 
 static int
-channel_handle_efd(Channel *c, fd_set *readset, fd_set *writeset)
+channel_handle_efd(Channel *c, struct poller *poller)
 {
 	char buf[CHAN_RBUF];
 	int len, r;
@@ -1806,7 +2197,7 @@ channel_handle_efd(Channel *c, fd_set *readset, fd_set *writeset)
 /** XXX handle drain efd, too */
 	if (c->efd != -1) {
 		if (c->extended_usage == CHAN_EXTENDED_WRITE &&
-		    FD_ISSET(c->efd, writeset) &&
+		    poller_ready(poller, c->efd, POLLER_WRITE) &&
 		    sshbuf_len(c->extended) > 0) {
 			len = write(c->efd, sshbuf_ptr(c->extended),
 			    sshbuf_len(c->extended));
@@ -1826,7 +2217,7 @@ channel_handle_efd(Channel *c, fd_set *readset, fd_set *writeset)
 		} else if (c->efd != -1 &&
 		    (c->extended_usage == CHAN_EXTENDED_READ ||
 		    c->extended_usage == CHAN_EXTENDED_IGNORE) &&
-		    FD_ISSET(c->efd, readset)) {
+		    poller_ready(poller, c->efd, POLLER_READ)) {
 			len = read(c->efd, buf, sizeof(buf));
 			debug2("channel %d: read %d from efd %d",
 			    c->self, len, c->efd);
@@ -1851,6 +2242,119 @@ channel_handle_efd(Channel *c, fd_set *readset, fd_set *writeset)
 	return 1;
 }
 
+/* Returns true if the peer should be sent a window adjust for c. */
+static int
+channel_window_due(Channel *c)
+{
+	return compat20 &&
+	    c->type == SSH_CHANNEL_OPEN &&
+	    !(c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD)) &&
+	    ((c->local_window_max - c->local_window >
+	    c->local_maxpacket*3) ||
+	    c->local_window < c->local_window_max/2) &&
+	    c->local_consumed > 0;
+}
+
+/*
+ * Mark a channel as carrying bulk data: it reads and sends in chunks of up
+ * to CHAN_BULK_PACKET_DEFAULT and offers the same maximum packet size to
+ * the peer.  A peer offering a maximum packet size above the default asks
+ * for bulk mode.  Must be called before the open or its confirmation is
+ * sent.
+ */
+void
+channel_set_bulk(Channel *c)
+{
+	if (c->datagram || !compat20)
+		return;
+	debug2("channel %d: bulk mode", c->self);
+	c->bulk = 1;
+	c->local_maxpacket = MAX(c->local_maxpacket, CHAN_BULK_PACKET_DEFAULT);
+}
+
+/*
+ * Sets the memory that receive window auto-tuning may add to the windows
+ * of all channels together; 0 disables auto-tuning.
+ */
+void
+channel_set_window_budget(u_int64_t budget)
+{
+	channel_window_budget = budget;
+}
+
+/*
+ * Measure the round trip time from a window adjust to the first data the
+ * peer could only send after seeing it.  Called for data received.
+ */
+static void
+channel_rtt_sample(Channel *c, u_int len)
+{
+	u_int64_t sample;
+
+	c->rx_bytes += len;
+	if (!timerisset(&c->rtt_start) || c->rx_bytes <= c->rtt_edge)
+		return;
+	sample = monotime_since_us(&c->rtt_start);
+	timerclear(&c->rtt_start);
+	if (sample > UINT_MAX)
+		sample = UINT_MAX;
+	/*
+	 * The sender may not have been waiting for window, so favour minima
+	 * and ignore samples spanning an idle period.
+	 */
+	if (c->rtt_us == 0 || sample < c->rtt_us)
+		c->rtt_us = sample;
+	else if (sample < 4 * (u_int64_t)c->rtt_us)
+		c->rtt_us = (7 * (u_int64_t)c->rtt_us + sample) / 8;
+}
+
+/*
+ * Receive window auto-tuning, called before a window adjust is sent.
+ * Once per round trip, look at how much the local side consumed: if that
+ * is more than half the window, the window rather than the bandwidth or
+ * the local reader limits the channel, so let it grow to twice the data
+ * per round trip (at most doubling) as far as the budget allows.  The
+ * growth is passed on to the peer with the pending adjust.
+ */
+static void
+channel_tune_window(Channel *c)
+{
+	u_int64_t elapsed, per_rtt, want, grow;
+
+	if (channel_window_budget == 0 || c->datagram)
+		return;
+	if (!timerisset(&c->tune_start)) {
+		monotime_tv(&c->tune_start);
+		c->tune_bytes = 0;
+		return;
+	}
+	c->tune_bytes += c->local_consumed;
+	if (c->rtt_us == 0 ||
+	    (elapsed = monotime_since_us(&c->tune_start)) < c->rtt_us)
+		return;
+	per_rtt = c->tune_bytes * c->rtt_us / elapsed;
+	monotime_tv(&c->tune_start);
+	c->tune_bytes = 0;
+	if (per_rtt * 2 <= c->local_window_max)
+		return;
+	want = MIN(per_rtt * 2, (u_int64_t)c->local_window_max * 2);
+	grow = want - c->local_window_max;
+	if (channel_window_used >= channel_window_budget)
+		return;
+	grow = MIN(grow, channel_window_budget - channel_window_used);
+	grow = MIN(grow, UINT_MAX / 2 - c->local_window_max);
+	if (grow == 0)
+		return;
+	debug2("channel %d: window %u -> %llu, rtt %u us, %llu bytes/rtt",
+	    c->self, c->local_window_max,
+	    (unsigned long long)(c->local_window_max + grow), c->rtt_us,
+	    (unsigned long long)per_rtt);
+	c->local_window_max += grow;
+	c->local_consumed += grow;
+	c->window_grown += grow;
+	channel_window_used += grow;
+}
+
 /* ARGSUSED */
 static int
 channel_check_window(Channel *c)
@@ -1858,12 +2362,12 @@ channel_check_window(Channel *c)
 	struct ssh *ssh = active_state; /* XXX */
 	int r;
 
-	if (c->type == SSH_CHANNEL_OPEN &&
-	    !(c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD)) &&
-	    ((c->local_window_max - c->local_window >
-	    c->local_maxpacket*3) ||
-	    c->local_window < c->local_window_max/2) &&
-	    c->local_consumed > 0) {
+	if (channel_window_due(c)) {
+		channel_tune_window(c);
+		if (!timerisset(&c->rtt_start)) {
+			c->rtt_edge = c->rx_bytes + c->local_window;
+			monotime_tv(&c->rtt_start);
+		}
 		if ((r = sshpkt_start(ssh,
 		    SSH2_MSG_CHANNEL_WINDOW_ADJUST)) != 0 ||
 		    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
@@ -1880,14 +2384,13 @@ channel_check_window(Channel *c)
 }
 
 static void
-channel_post_open(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_open(Channel *c, struct poller *poller)
 {
-	channel_handle_rfd(c, readset, writeset);
-	channel_handle_wfd(c, readset, writeset);
+	channel_handle_rfd(c, poller);
+	channel_handle_wfd(c, poller);
 	if (!compat20)
 		return;
-	channel_handle_efd(c, readset, writeset);
-	channel_check_window(c);
+	channel_handle_efd(c, poller);
 }
 
 static u_int
@@ -1914,7 +2417,7 @@ read_mux(Channel *c, u_int need)
 }
 
 static void
-channel_post_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_mux_client(Channel *c, struct poller *poller)
 {
 	u_int need;
 	ssize_t len;
@@ -1923,7 +2426,8 @@ channel_post_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
 	if (!compat20)
 		fatal("%s: entered with !compat20", __func__);
 
-	if (c->rfd != -1 && !c->mux_pause && FD_ISSET(c->rfd, readset) &&
+	if (c->rfd != -1 && !c->mux_pause &&
+	    poller_ready(poller, c->rfd, POLLER_READ) &&
 	    (c->istate == CHAN_INPUT_OPEN ||
 	    c->istate == CHAN_INPUT_WAIT_DRAIN)) {
 		/*
@@ -1949,7 +2453,7 @@ channel_post_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
 		}
 	}
 
-	if (c->wfd != -1 && FD_ISSET(c->wfd, writeset) &&
+	if (c->wfd != -1 && poller_ready(poller, c->wfd, POLLER_WRITE) &&
 	    sshbuf_len(c->output) > 0) {
 		len = write(c->wfd, sshbuf_ptr(c->output),
 		    sshbuf_len(c->output));
@@ -1965,7 +2469,7 @@ channel_post_mux_client(Channel *c, fd_set *readset, fd_set *writeset)
 }
 
 static void
-channel_post_mux_listener(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_mux_listener(Channel *c, struct poller *poller)
 {
 	Channel *nc;
 	struct sockaddr_storage addr;
@@ -1974,7 +2478,7 @@ channel_post_mux_listener(Channel *c, fd_set *readset, fd_set *writeset)
 	uid_t euid;
 	gid_t egid;
 
-	if (!FD_ISSET(c->sock, readset))
+	if (!poller_ready(poller, c->sock, POLLER_READ))
 		return;
 
 	debug("multiplexing control connection");
@@ -2018,12 +2522,13 @@ channel_post_mux_listener(Channel *c, fd_set *readset, fd_set *writeset)
 
 /* ARGSUSED */
 static void
-channel_post_output_drain_13(Channel *c, fd_set *readset, fd_set *writeset)
+channel_post_output_drain_13(Channel *c, struct poller *poller)
 {
 	int len, r;
 
 	/* Send buffered output data to the socket. */
-	if (FD_ISSET(c->sock, writeset) && sshbuf_len(c->output) > 0) {
+	if (poller_ready(poller, c->sock, POLLER_WRITE) &&
+	    sshbuf_len(c->output) > 0) {
 		len = write(c->sock, sshbuf_ptr(c->output),
 			    sshbuf_len(c->output));
 		if (len <= 0)
@@ -2138,12 +2643,132 @@ channel_garbage_collect(Channel *c)
 	channel_free(c);
 }
 
+/* Returns true if channel_output_poll() has anything to send for c. */
+static int
+channel_output_pending(Channel *c)
+{
+	if (compat13) {
+		if (c->type != SSH_CHANNEL_OPEN &&
+		    c->type != SSH_CHANNEL_INPUT_DRAINING)
+			return 0;
+	} else {
+		if (c->type != SSH_CHANNEL_OPEN)
+			return 0;
+	}
+	if (compat20 && (c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD)))
+		return 0;
+	if ((c->istate == CHAN_INPUT_OPEN ||
+	    c->istate == CHAN_INPUT_WAIT_DRAIN) &&
+	    sshbuf_len(c->input) > 0) {
+		/* stream data waits for window, datagrams may be dropped */
+		if (!compat20 || c->datagram || c->remote_window > 0)
+			return 1;
+	} else if (c->istate == CHAN_INPUT_WAIT_DRAIN)
+		return 1;
+	if (compat20 &&
+	    !(c->flags & CHAN_EOF_SENT) &&
+	    c->remote_window > 0 &&
+	    sshbuf_len(c->extended) > 0 &&
+	    c->extended_usage == CHAN_EXTENDED_READ)
+		return 1;
+	return 0;
+}
+
+/*
+ * Move the channel onto or off the output and window queues.  A channel
+ * left queued by mistake is merely looked at once more.
+ */
+static void
+channel_requeue(Channel *c)
+{
+	if (channel_output_pending(c)) {
+		if (!(c->queued & CHAN_QUEUED_OUTPUT)) {
+			TAILQ_INSERT_TAIL(&channels_outq[c->sched_class],
+			    c, output_entry);
+			c->queued |= CHAN_QUEUED_OUTPUT;
+			channels_noutq[c->sched_class]++;
+			if (!timerisset(&c->sched_ready))
+				monotime_tv(&c->sched_ready);
+		}
+	} else if (c->queued & CHAN_QUEUED_OUTPUT) {
+		TAILQ_REMOVE(&channels_outq[c->sched_class], c, output_entry);
+		c->queued &= ~CHAN_QUEUED_OUTPUT;
+		channels_noutq[c->sched_class]--;
+		timerclear(&c->sched_ready);
+	}
+	if (channel_window_due(c)) {
+		if (!(c->queued & CHAN_QUEUED_WINDOW)) {
+			TAILQ_INSERT_TAIL(&channels_winq, c, window_entry);
+			c->queued |= CHAN_QUEUED_WINDOW;
+		}
+	} else if (c->queued & CHAN_QUEUED_WINDOW) {
+		TAILQ_REMOVE(&channels_winq, c, window_entry);
+		c->queued &= ~CHAN_QUEUED_WINDOW;
+	}
+}
+
+/*
+ * Requeue the channel and have its pre handler run before the next wait.
+ * Must be called after anything that may change its buffers, windows or
+ * state.
+ */
+void
+channel_update_ready(Channel *c)
+{
+	channel_requeue(c);
+	channel_wake(c);
+}
+
+/*
+ * Put a channel in the interactive or the bulk scheduling class.  This
+ * follows the interactive/bulk choice made for the IPQoS of the
+ * connection, see ssh_packet_set_interactive().
+ */
+void
+channel_set_interactive(Channel *c, int interactive)
+{
+	int class = interactive ? CHAN_CLASS_INTERACTIVE : CHAN_CLASS_BULK;
+
+	if (c->sched_class == class)
+		return;
+	if (c->queued & CHAN_QUEUED_OUTPUT) {
+		TAILQ_REMOVE(&channels_outq[c->sched_class], c, output_entry);
+		channels_noutq[c->sched_class]--;
+		TAILQ_INSERT_TAIL(&channels_outq[class], c, output_entry);
+		channels_noutq[class]++;
+	}
+	if (class == CHAN_CLASS_INTERACTIVE)
+		channels_interactive++;
+	else
+		channels_interactive--;
+	c->sched_class = class;
+	c->sched_deficit = 0;
+	debug2("channel %d: %s scheduling class", c->self,
+	    interactive ? "interactive" : "bulk");
+}
+
+/* Send the window adjusts that have become due. */
+static void
+channel_window_poll(void)
+{
+	Channel *c;
+
+	while ((c = TAILQ_FIRST(&channels_winq)) != NULL) {
+		TAILQ_REMOVE(&channels_winq, c, window_entry);
+		c->queued &= ~CHAN_QUEUED_WINDOW;
+		channel_check_window(c);
+	}
+}
+
+/*
+ * Run the pre handlers of the woken channels.  Paused channels stay
+ * queued until their pause is over.
+ */
 static void
-channel_handler(chan_fn *ftab[], fd_set *readset, fd_set *writeset,
-    time_t *unpause_secs)
+channel_handler_pre(struct poller *poller, time_t *unpause_secs)
 {
 	static int did_init = 0;
-	u_int i, oalloc;
+	struct channel_queue *q;
 	Channel *c;
 	time_t now;
 
@@ -2154,23 +2779,15 @@ channel_handler(chan_fn *ftab[], fd_set *readset, fd_set *writeset,
 	now = time(NULL);
 	if (unpause_secs != NULL)
 		*unpause_secs = 0;
-	for (i = 0, oalloc = channels_alloc; i < oalloc; i++) {
-		c = channels[i];
-		if (c == NULL)
-			continue;
-		if (c->delayed) {
-			if (ftab == channel_pre)
-				c->delayed = 0;
-			else
-				continue;
-		}
-		if (ftab[c->type] != NULL) {
-			/*
-			 * Run handlers that are not paused.
-			 */
-			if (c->notbefore <= now)
-				(*ftab[c->type])(c, readset, writeset);
-			else if (unpause_secs != NULL) {
+	q = &channels_preq[channels_preq_cur];
+	channels_preq_cur = !channels_preq_cur;
+	while ((c = TAILQ_FIRST(q)) != NULL) {
+		TAILQ_REMOVE(q, c, pre_entry);
+		c->queued &= ~CHAN_QUEUED_PRE;
+		c->delayed = 0;
+		if (c->notbefore > now) {
+			channel_wake(c);
+			if (unpause_secs != NULL) {
 				/*
 				 * Collect the time that the earliest
 				 * channel comes off pause.
@@ -2182,7 +2799,11 @@ channel_handler(chan_fn *ftab[], fd_set *readset, fd_set *writeset,
 				    (c->notbefore - now) < *unpause_secs)
 					*unpause_secs = c->notbefore - now;
 			}
-		}
+		} else if (channel_pre[c->type] != NULL)
+			(*channel_pre[c->type])(c, poller);
+		/* paused and handler-less channels want nothing */
+		channel_poll_sync(c, poller);
+		channel_requeue(c);
 		channel_garbage_collect(c);
 	}
 	if (unpause_secs != NULL && *unpause_secs != 0)
@@ -2190,198 +2811,397 @@ channel_handler(chan_fn *ftab[], fd_set *readset, fd_set *writeset,
 		    __func__, (int)*unpause_secs);
 }
 
+/* Returns the channel that registered interest in 'fd' and still owns it. */
+static Channel *
+channel_by_fd(int fd)
+{
+	Channel *c;
+	int id;
+
+	if (fd >= channel_fd_owner_alloc || (id = channel_fd_owner[fd]) < 0 ||
+	    (u_int)id >= channels_alloc || (c = channels[id]) == NULL)
+		return NULL;
+	if (c->sock != fd && c->rfd != fd && c->wfd != fd && c->efd != fd)
+		return NULL;
+	return c;
+}
+
 /*
- * Allocate/update select bitmasks and add any bits relevant to channels in
- * select bitmasks.
+ * Run the post handlers of the channels that own a descriptor reported
+ * ready, once per channel.  Channels created since the last pre handlers
+ * ran are skipped, as their descriptor may reuse a number reported ready
+ * for a channel freed meanwhile.
  */
-void
-channel_prepare_select(fd_set **readsetp, fd_set **writesetp, int *maxfdp,
-    u_int *nallocp, time_t *minwait_secs, int rekeying)
+static void
+channel_handler_post(struct poller *poller)
 {
-	u_int n, sz, nfdset;
+	Channel *c;
+	time_t now;
+	u_int i = 0;
+	int fd;
 
-	n = MAX(*maxfdp, channel_max_fd);
+	now = time(NULL);
+	channels_post_round++;
+	while ((fd = poller_next_ready(poller, &i)) != -1) {
+		if ((c = channel_by_fd(fd)) == NULL || c->delayed ||
+		    c->post_round == channels_post_round ||
+		    c->notbefore > now)
+			continue;
+		c->post_round = channels_post_round;
+		if (channel_post[c->type] != NULL)
+			(*channel_post[c->type])(c, poller);
+		channel_update_ready(c);
+		channel_garbage_collect(c);
+	}
+}
 
-	nfdset = howmany(n+1, NFDBITS);
-	/* Explicitly test here, because xrealloc isn't always called */
-	if (nfdset && SIZE_T_MAX / nfdset < sizeof(fd_mask))
-		fatal("channel_prepare_select: max_fd (%d) is too large", n);
-	sz = nfdset * sizeof(fd_mask);
+/*
+ * Update the interest in the channel descriptors for the coming wait.
+ * While rekeying, the interest of all channels is withdrawn; the pre
+ * handlers restore it afterwards.
+ */
+void
+channel_prepare_poll(struct poller *poller, time_t *minwait_secs, int rekeying)
+{
+	Channel *c;
 
-	/* perhaps check sz < nalloc/2 and shrink? */
-	if (*readsetp == NULL || sz > *nallocp) {
-		*readsetp = xrealloc(*readsetp, nfdset, sizeof(fd_mask));
-		*writesetp = xrealloc(*writesetp, nfdset, sizeof(fd_mask));
-		*nallocp = sz;
+	channel_poller = poller;
+	/* finished lookups may send packets, so hold them while rekeying */
+	poller_set(poller, resolver_fd(), rekeying ? 0 : POLLER_READ);
+	if (rekeying) {
+		if (!channels_poll_suspended) {
+			TAILQ_FOREACH(c, &channels_all, all_entry) {
+				channel_poll_sync(c, poller);
+				channel_wake(c);
+			}
+			channels_poll_suspended = 1;
+		}
+		return;
 	}
-	*maxfdp = n;
-	memset(*readsetp, 0, sz);
-	memset(*writesetp, 0, sz);
-
-	if (!rekeying)
-		channel_handler(channel_pre, *readsetp, *writesetp,
-		    minwait_secs);
+	channels_poll_suspended = 0;
+	channel_handler_pre(poller, minwait_secs);
 }
 
 /*
- * After select, perform any appropriate operations for channels which have
- * events pending.
+ * After waiting, perform any appropriate operations for channels which
+ * have events pending.
  */
 void
-channel_after_select(fd_set *readset, fd_set *writeset)
+channel_after_poll(struct poller *poller)
 {
-	channel_handler(channel_post, readset, writeset, NULL);
+	if (poller_ready(poller, resolver_fd(), POLLER_READ))
+		resolver_dispatch();
+	channel_handler_post(poller);
+	channel_window_poll();
 }
 
 
-/* If there is data to send to the connection, enqueue some of it now. */
-void
-channel_output_poll(void)
+/*
+ * Send as many whole frames queued on a tunnel channel as the window and
+ * packet size allow in one packet.  The payload is the frames as strings,
+ * as they are kept in the buffers.  Frames are never held back to fill a
+ * packet: a batch is what was read since the last loop iteration.
+ */
+static void
+channel_output_tun(struct ssh *ssh, Channel *c)
 {
-	struct ssh *ssh = active_state; /* XXX */
-	Channel *c;
-	u_int i, len;
+	const u_char *p = sshbuf_ptr(c->input);
+	size_t n = 0, flen, len = sshbuf_len(c->input);
+	u_int frames = 0;
 	int r;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL)
-			continue;
+	while (n + 4 <= len && frames < CHAN_TUN_BATCH_FRAMES) {
+		flen = 4 + PEEK_U32(p + n);
+		if (n + flen + 4 > MIN(c->remote_window, c->remote_maxpacket))
+			break;
+		n += flen;
+		frames++;
+	}
+	if (frames == 0) {
+		/* as for other datagrams, drop what does not fit */
+		debug("channel %d: datagram too big for channel", c->self);
+		if ((r = sshbuf_skip_string(c->input)) != 0)
+			CHANNEL_BUFFER_ERROR(c, r);
+		return;
+	}
+	if ((r = sshpkt_start(ssh, SSH2_MSG_CHANNEL_DATA)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+	    (r = sshpkt_put_string(ssh, p, n)) != 0 ||
+	    (r = sshpkt_send(ssh)) != 0)
+		CHANNEL_PACKET_ERROR(c, r);
+	if ((r = sshbuf_consume(c->input, n)) != 0)
+		CHANNEL_BUFFER_ERROR(c, r);
+	c->remote_window -= n + 4;
+	c->tun_frames_out += frames;
+	c->tun_packets_out++;
+}
 
-		/*
-		 * We are only interested in channels that can have buffered
-		 * incoming data.
-		 */
-		if (compat13) {
-			if (c->type != SSH_CHANNEL_OPEN &&
-			    c->type != SSH_CHANNEL_INPUT_DRAINING)
-				continue;
-		} else {
-			if (c->type != SSH_CHANNEL_OPEN)
-				continue;
-		}
-		if (compat20 &&
-		    (c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD))) {
-			/* XXX is this true? */
-			debug3("channel %d: will not send data after close", c->self);
-			continue;
-		}
+/* Enqueue some of the data buffered for channel c. */
+static void
+channel_output_poll_channel(struct ssh *ssh, Channel *c)
+{
+	u_int len;
+	int r;
+
+	/*
+	 * We are only interested in channels that can have buffered
+	 * incoming data.
+	 */
+	if (compat13) {
+		if (c->type != SSH_CHANNEL_OPEN &&
+		    c->type != SSH_CHANNEL_INPUT_DRAINING)
+			return;
+	} else {
+		if (c->type != SSH_CHANNEL_OPEN)
+			return;
+	}
+	if (compat20 &&
+	    (c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD))) {
+		/* XXX is this true? */
+		debug3("channel %d: will not send data after close", c->self);
+		return;
+	}
 
-		/* Get the amount of buffered data for this channel. */
-		if ((c->istate == CHAN_INPUT_OPEN ||
-		    c->istate == CHAN_INPUT_WAIT_DRAIN) &&
-		    (len = sshbuf_len(c->input)) > 0) {
-			if (c->datagram) {
-				if (len > 0) {
-					u_char *data;
-					size_t dlen;
+	/* Get the amount of buffered data for this channel. */
+	if ((c->istate == CHAN_INPUT_OPEN ||
+	    c->istate == CHAN_INPUT_WAIT_DRAIN) &&
+	    (len = sshbuf_len(c->input)) > 0) {
+		if (c->tun_batch) {
+			channel_output_tun(ssh, c);
+			return;
+		}
+		if (c->datagram) {
+			if (len > 0) {
+				u_char *data;
+				size_t dlen;
 
-					if ((r = sshbuf_get_string(c->input,
-					    &data, &dlen)) != 0)
-						CHANNEL_BUFFER_ERROR(c, r);
-					if (dlen > c->remote_window ||
-					    dlen > c->remote_maxpacket) {
-						debug("channel %d: datagram "
-						    "too big for channel",
-						    c->self);
-						xfree(data);
-						continue;
-					}
-					if ((r = sshpkt_start(ssh,
-					    SSH2_MSG_CHANNEL_DATA)) != 0 ||
-					    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
-					    (r = sshpkt_put_string(ssh, data, dlen)) != 0 ||
-					    (r = sshpkt_send(ssh)) != 0)
-						CHANNEL_PACKET_ERROR(c, r);
-					c->remote_window -= dlen + 4;
+				if ((r = sshbuf_get_string(c->input,
+				    &data, &dlen)) != 0)
+					CHANNEL_BUFFER_ERROR(c, r);
+				if (dlen > c->remote_window ||
+				    dlen > c->remote_maxpacket) {
+					debug("channel %d: datagram "
+					    "too big for channel",
+					    c->self);
 					xfree(data);
+					return;
 				}
-				continue;
-			}
-			/*
-			 * Send some data for the other side over the secure
-			 * connection.
-			 */
-			if (compat20) {
-				if (len > c->remote_window)
-					len = c->remote_window;
-				if (len > c->remote_maxpacket)
-					len = c->remote_maxpacket;
-			} else {
-				if (ssh_packet_is_interactive(ssh)) {
-					if (len > 1024)
-						len = 512;
-				} else {
-					/* Keep the packets at reasonable size. */
-					if (len > ssh_packet_get_maxsize(ssh)/2)
-						len = ssh_packet_get_maxsize(ssh)/2;
-				}
-			}
-			if (len > 0) {
-				if ((r = sshpkt_start(ssh, compat20 ?
-				    SSH2_MSG_CHANNEL_DATA : SSH_MSG_CHANNEL_DATA)) != 0 ||
+				if ((r = sshpkt_start(ssh,
+				    SSH2_MSG_CHANNEL_DATA)) != 0 ||
 				    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
-				    (r = sshpkt_put_string(ssh, sshbuf_ptr(c->input),
-				    len)) != 0 ||
+				    (r = sshpkt_put_string(ssh, data, dlen)) != 0 ||
 				    (r = sshpkt_send(ssh)) != 0)
 					CHANNEL_PACKET_ERROR(c, r);
-				if ((r = sshbuf_consume(c->input, len)) != 0)
-					CHANNEL_BUFFER_ERROR(c, r);
-				c->remote_window -= len;
+				c->remote_window -= dlen + 4;
+				xfree(data);
 			}
-		} else if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
-			if (compat13)
-				fatal("cannot happen: istate == INPUT_WAIT_DRAIN for proto 1.3");
-			/*
-			 * input-buffer is empty and read-socket shutdown:
-			 * tell peer, that we will not send more data: send IEOF.
-			 * hack for extended data: delay EOF if EFD still in use.
-			 */
-			if (CHANNEL_EFD_INPUT_ACTIVE(c))
-				debug2("channel %d: "
-				    "ibuf_empty delayed efd %d/(%zu)",
-				    c->self, c->efd, sshbuf_len(c->extended));
-			else
-				chan_ibuf_empty(c);
-		}
-		/* Send extended data, i.e. stderr */
-		if (compat20 &&
-		    !(c->flags & CHAN_EOF_SENT) &&
-		    c->remote_window > 0 &&
-		    (len = sshbuf_len(c->extended)) > 0 &&
-		    c->extended_usage == CHAN_EXTENDED_READ) {
-			debug2("channel %d: rwin %u elen %zu euse %d",
-			    c->self, c->remote_window, sshbuf_len(c->extended),
-			    c->extended_usage);
+			return;
+		}
+		/*
+		 * Send some data for the other side over the secure
+		 * connection.
+		 */
+		if (compat20) {
 			if (len > c->remote_window)
 				len = c->remote_window;
 			if (len > c->remote_maxpacket)
 				len = c->remote_maxpacket;
-			if ((r = sshpkt_start(ssh,
-			    SSH2_MSG_CHANNEL_EXTENDED_DATA)) != 0 ||
+			/* interactive channels keep small packets */
+			if (!c->bulk && len > CHAN_SES_PACKET_DEFAULT)
+				len = CHAN_SES_PACKET_DEFAULT;
+		} else {
+			if (ssh_packet_is_interactive(ssh)) {
+				if (len > 1024)
+					len = 512;
+			} else {
+				/* Keep the packets at reasonable size. */
+				if (len > ssh_packet_get_maxsize(ssh)/2)
+					len = ssh_packet_get_maxsize(ssh)/2;
+			}
+		}
+		if (len > 0) {
+			if ((r = sshpkt_start(ssh, compat20 ?
+			    SSH2_MSG_CHANNEL_DATA : SSH_MSG_CHANNEL_DATA)) != 0 ||
 			    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
-			    (r = sshpkt_put_u32(ssh, SSH2_EXTENDED_DATA_STDERR)) != 0 ||
-			    (r = sshpkt_put_string(ssh,
-			    sshbuf_ptr(c->extended), len)) != 0 ||
+			    (r = sshpkt_put_string(ssh, sshbuf_ptr(c->input),
+			    len)) != 0 ||
 			    (r = sshpkt_send(ssh)) != 0)
 				CHANNEL_PACKET_ERROR(c, r);
-			if ((r = sshbuf_consume(c->extended, len)) != 0)
+			if ((r = sshbuf_consume(c->input, len)) != 0)
 				CHANNEL_BUFFER_ERROR(c, r);
 			c->remote_window -= len;
-			debug2("channel %d: sent ext data %d", c->self, len);
 		}
+	} else if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
+		if (compat13)
+			fatal("cannot happen: istate == INPUT_WAIT_DRAIN for proto 1.3");
+		/*
+		 * input-buffer is empty and read-socket shutdown:
+		 * tell peer, that we will not send more data: send IEOF.
+		 * hack for extended data: delay EOF if EFD still in use.
+		 */
+		if (CHANNEL_EFD_INPUT_ACTIVE(c))
+			debug2("channel %d: "
+			    "ibuf_empty delayed efd %d/(%zu)",
+			    c->self, c->efd, sshbuf_len(c->extended));
+		else
+			chan_ibuf_empty(c);
+	}
+	/* Send extended data, i.e. stderr */
+	if (compat20 &&
+	    !(c->flags & CHAN_EOF_SENT) &&
+	    c->remote_window > 0 &&
+	    (len = sshbuf_len(c->extended)) > 0 &&
+	    c->extended_usage == CHAN_EXTENDED_READ) {
+		debug2("channel %d: rwin %u elen %zu euse %d",
+		    c->self, c->remote_window, sshbuf_len(c->extended),
+		    c->extended_usage);
+		if (len > c->remote_window)
+			len = c->remote_window;
+		if (len > c->remote_maxpacket)
+			len = c->remote_maxpacket;
+		if ((r = sshpkt_start(ssh,
+		    SSH2_MSG_CHANNEL_EXTENDED_DATA)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, SSH2_EXTENDED_DATA_STDERR)) != 0 ||
+		    (r = sshpkt_put_string(ssh,
+		    sshbuf_ptr(c->extended), len)) != 0 ||
+		    (r = sshpkt_send(ssh)) != 0)
+			CHANNEL_PACKET_ERROR(c, r);
+		if ((r = sshbuf_consume(c->extended, len)) != 0)
+			CHANNEL_BUFFER_ERROR(c, r);
+		c->remote_window -= len;
+		debug2("channel %d: sent ext data %d", c->self, len);
+	}
+}
+
+/* Take the first channel off a ready queue and account its waiting time. */
+static Channel *
+channel_sched_dequeue(int class)
+{
+	struct channel_sched_stats *st = &channel_sched_stats[class];
+	Channel *c;
+	u_int64_t delay;
+
+	if ((c = TAILQ_FIRST(&channels_outq[class])) == NULL)
+		return NULL;
+	TAILQ_REMOVE(&channels_outq[class], c, output_entry);
+	c->queued &= ~CHAN_QUEUED_OUTPUT;
+	channels_noutq[class]--;
+	if (timerisset(&c->sched_ready)) {
+		delay = monotime_since_us(&c->sched_ready);
+		timerclear(&c->sched_ready);
+		st->served++;
+		st->delay_us += delay;
+		st->delay_max_us = MAX(st->delay_max_us, delay);
+	}
+	return c;
+}
+
+/* Enqueue one round of data for c, returns the packet output it took. */
+static size_t
+channel_sched_send(struct ssh *ssh, Channel *c)
+{
+	struct sshbuf *output = ssh_packet_get_output(ssh);
+	size_t before = sshbuf_len(output), sent;
+
+	channel_output_poll_channel(ssh, c);
+	sent = sshbuf_len(output) > before ? sshbuf_len(output) - before : 0;
+	channel_sched_stats[c->sched_class].bytes += sent;
+	return sent;
+}
+
+/* If there is data to send to the connection, enqueue some of it now. */
+void
+channel_output_poll(void)
+{
+	struct ssh *ssh = active_state; /* XXX */
+	struct sshbuf *output = ssh_packet_get_output(ssh);
+	Channel *c;
+	size_t backlog, sent, total;
+	u_int n;
+	int progress, waiting;
+
+	/* interactive channels first, a quantum each regardless of backlog */
+	for (n = channels_noutq[CHAN_CLASS_INTERACTIVE]; n > 0; n--) {
+		if ((c = channel_sched_dequeue(CHAN_CLASS_INTERACTIVE)) == NULL)
+			break;
+		total = 0;
+		while (total < CHAN_SCHED_QUANTUM && channel_output_pending(c) &&
+		    (sent = channel_sched_send(ssh, c)) > 0)
+			total += sent;
+		channel_update_ready(c);
 	}
+
+	/* then deficit round-robin over the bulk channels */
+	backlog = channels_interactive > 0 ?
+	    CHAN_SCHED_BACKLOG_INTERACTIVE : CHAN_SCHED_BACKLOG;
+	do {
+		progress = waiting = 0;
+		for (n = channels_noutq[CHAN_CLASS_BULK];
+		    n > 0 && sshbuf_len(output) < backlog; n--) {
+			if ((c = channel_sched_dequeue(CHAN_CLASS_BULK)) == NULL)
+				break;
+			c->sched_deficit += CHAN_SCHED_QUANTUM;
+			while (c->sched_deficit > 0 &&
+			    sshbuf_len(output) < backlog &&
+			    channel_output_pending(c)) {
+				if ((sent = channel_sched_send(ssh, c)) == 0) {
+					/* nothing sendable, don't save up */
+					c->sched_deficit = 0;
+					break;
+				}
+				c->sched_deficit -= sent;
+				progress = 1;
+			}
+			if (!channel_output_pending(c))
+				c->sched_deficit = 0;
+			else if (c->sched_deficit < 0)
+				waiting = 1;	/* owes for a large packet */
+			channel_update_ready(c);
+		}
+	} while ((progress || waiting) && sshbuf_len(output) < backlog &&
+	    channels_noutq[CHAN_CLASS_BULK] > 0);
 }
 
 
 /* -- protocol input */
 
+/*
+ * Queue the frames of a packed tunnel packet, see channel_output_tun().
+ * They are kept as strings in c->output, like single datagrams.
+ */
+static void
+channel_input_tun(Channel *c, struct sshbuf *b)
+{
+	const u_char *p = sshbuf_ptr(b);
+	size_t n = 0, len = sshbuf_len(b);
+	u_int frames = 0;
+	int r;
+
+	/* the outer string header does not reach c->output */
+	c->local_consumed += 4;
+	while (n < len) {
+		if (len - n < 4 || PEEK_U32(p + n) > len - n - 4) {
+			logit("channel %d: bad tunnel packet", c->self);
+			c->local_consumed += len;
+			channel_update_ready(c);
+			return;
+		}
+		n += 4 + PEEK_U32(p + n);
+		frames++;
+	}
+	if ((r = sshbuf_putb(c->output, b)) != 0)
+		CHANNEL_BUFFER_ERROR(c, r);
+	c->tun_frames_in += frames;
+	c->tun_packets_in++;
+}
+
 /* ARGSUSED */
 int
 channel_input_data(int type, u_int32_t seq, struct ssh *ssh)
 {
 	int r, id;
-	const u_char *data;
+	struct sshbuf *b;
 	size_t data_len;
 	u_int win_len;
 	Channel *c;
@@ -2399,9 +3219,10 @@ channel_input_data(int type, u_int32_t seq, struct ssh *ssh)
 	    c->type != SSH_CHANNEL_X11_OPEN)
 		return 0;
 
-	/* Get the data. */
-	if ((r = sshpkt_get_string_direct(ssh, &data, &data_len)) != 0)
+	/* Get the data as a view of the packet, copied only if small. */
+	if ((r = sshpkt_getb_froms(ssh, &b)) != 0)
 		CHANNEL_PACKET_ERROR(c, r);
+	data_len = sshbuf_len(b);
 	win_len = data_len;
 	if (c->datagram)
 		win_len += 4;  /* string length header */
@@ -2417,7 +3238,10 @@ channel_input_data(int type, u_int32_t seq, struct ssh *ssh)
 		if (compat20) {
 			c->local_window -= win_len;
 			c->local_consumed += win_len;
+			channel_rtt_sample(c, win_len);
+			channel_update_ready(c);
 		}
+		sshbuf_free(b);
 		return 0;
 	}
 
@@ -2429,16 +3253,37 @@ channel_input_data(int type, u_int32_t seq, struct ssh *ssh)
 		if (win_len > c->local_window) {
 			logit("channel %d: rcvd too much data %d, win %d",
 			    c->self, win_len, c->local_window);
+			sshbuf_free(b);
 			return 0;
 		}
 		c->local_window -= win_len;
+		channel_rtt_sample(c, win_len);
+	}
+	if (c->tun_batch) {
+		channel_input_tun(c, b);
+		sshbuf_free(b);
+		if ((r = sshpkt_get_end(ssh)) != 0)
+			CHANNEL_PACKET_ERROR(c, r);
+		return 0;
+	}
+	/*
+	 * Keep large payloads in the packet buffer until they have been
+	 * written out.  Once views are queued, later data must follow them.
+	 */
+	if (compat20 && !c->datagram && c->output_filter == NULL &&
+	    c->type == SSH_CHANNEL_OPEN &&
+	    (data_len >= CHAN_OUTPUT_VIEW_MIN ||
+	    !TAILQ_EMPTY(&c->output_segs))) {
+		channel_output_queue(c, b);
+	} else {
+		if (c->datagram)
+			r = sshbuf_put_stringb(c->output, b);
+		else
+			r = sshbuf_putb(c->output, b);
+		sshbuf_free(b);
+		if (r != 0)
+			CHANNEL_BUFFER_ERROR(c, r);
 	}
-	if (c->datagram)
-		r = sshbuf_put_string(c->output, data, data_len);
-	else
-		r = sshbuf_put(c->output, data, data_len);
-	if (r != 0)
-		CHANNEL_BUFFER_ERROR(c, r);
 	if ((r = sshpkt_get_end(ssh)) != 0)
 		CHANNEL_PACKET_ERROR(c, r);
 	return 0;
@@ -2609,6 +3454,8 @@ int
 channel_input_open_confirmation(int type, u_int32_t seq, struct ssh *ssh)
 {
 	int r, id, remote_id;
+	u_int flags;
+	size_t len;
 	Channel *c;
 
 	if ((r = sshpkt_get_u32(ssh, &id)) != 0 ||
@@ -2624,9 +3471,17 @@ channel_input_open_confirmation(int type, u_int32_t seq, struct ssh *ssh)
 
 	if (compat20) {
 		if ((r = sshpkt_get_u32(ssh, &c->remote_window)) != 0 ||
-		    (r = sshpkt_get_u32(ssh, &c->remote_maxpacket)) != 0 ||
-		    (r = sshpkt_get_end(ssh)) != 0)
+		    (r = sshpkt_get_u32(ssh, &c->remote_maxpacket)) != 0)
+			CHANNEL_PACKET_ERROR(c, r);
+		/* tunnels: the server accepted packed frames */
+		if (c->datagram && sshpkt_ptr(ssh, &len) != NULL && len > 0) {
+			if ((r = sshpkt_get_u32(ssh, &flags)) != 0)
+				CHANNEL_PACKET_ERROR(c, r);
+			c->tun_batch = (flags & CHAN_TUN_BATCH) != 0;
+		}
+		if ((r = sshpkt_get_end(ssh)) != 0)
 			CHANNEL_PACKET_ERROR(c, r);
+		channel_update_ready(c);
 		if (c->open_confirm) {
 			debug2("callback start");
 			c->open_confirm(c->self, 1, c->open_confirm_ctx);
@@ -2723,6 +3578,7 @@ channel_input_window_adjust(int type, u_int32_t seq, struct ssh *ssh)
 	}
 	debug2("channel %d: rcvd adjust %u", id, adjust);
 	c->remote_window += adjust;
+	channel_update_ready(c);
 	return 0;
 }
 
@@ -2985,15 +3841,14 @@ channel_setup_fwd_listener(int type, const char *listen_addr,
 int
 channel_cancel_rport_listener(const char *host, u_short port)
 {
-	u_int i;
+	Channel *c, *tmp;
 	int found = 0;
 
-	for (i = 0; i < channels_alloc; i++) {
-		Channel *c = channels[i];
-		if (c == NULL || c->type != SSH_CHANNEL_RPORT_LISTENER)
+	TAILQ_FOREACH_SAFE(c, &channels_all, all_entry, tmp) {
+		if (c->type != SSH_CHANNEL_RPORT_LISTENER)
 			continue;
 		if (strcmp(c->path, host) == 0 && c->listening_port == port) {
-			debug2("%s: close channel %d", __func__, i);
+			debug2("%s: close channel %d", __func__, c->self);
 			channel_free(c);
 			found = 1;
 		}
@@ -3006,13 +3861,12 @@ int
 channel_cancel_lport_listener(const char *lhost, u_short lport,
     int cport, int gateway_ports)
 {
-	u_int i;
+	Channel *c, *tmp;
 	int found = 0;
 	const char *addr = channel_fwd_bind_addr(lhost, NULL, 1, gateway_ports);
 
-	for (i = 0; i < channels_alloc; i++) {
-		Channel *c = channels[i];
-		if (c == NULL || c->type != SSH_CHANNEL_PORT_LISTENER)
+	TAILQ_FOREACH_SAFE(c, &channels_all, all_entry, tmp) {
+		if (c->type != SSH_CHANNEL_PORT_LISTENER)
 			continue;
 		if (c->listening_port != lport)
 			continue;
@@ -3028,7 +3882,7 @@ channel_cancel_lport_listener(const char *lhost, u_short lport,
 		    (c->listening_addr != NULL && addr == NULL))
 			continue;
 		if (addr == NULL || strcmp(c->listening_addr, addr) == 0) {
-			debug2("%s: close channel %d", __func__, i);
+			debug2("%s: close channel %d", __func__, c->self);
 			channel_free(c);
 			found = 1;
 		}
@@ -3414,15 +4268,78 @@ connect_next(struct channel_connect *cctx)
 static void
 channel_connect_ctx_free(struct channel_connect *cctx)
 {
+	if (cctx->req != NULL)
+		resolver_cancel(cctx->req);
 	xfree(cctx->host);
 	if (cctx->aitop)
-		freeaddrinfo(cctx->aitop);
+		resolver_free(cctx->aitop);
 	bzero(cctx, sizeof(*cctx));
 	cctx->host = NULL;
 	cctx->ai = cctx->aitop = NULL;
+	cctx->req = NULL;
 }
 
-/* Return CONNECTING channel to remote host, port */
+/* Tell the peer that the channel could not be connected and drop it. */
+static void
+channel_connect_failed(Channel *c, const char *reason)
+{
+	struct ssh *ssh = active_state; /* XXX */
+	int r;
+
+	channel_connect_ctx_free(&c->connect_ctx);
+	if (compat20) {
+		if ((r = sshpkt_start(ssh, SSH2_MSG_CHANNEL_OPEN_FAILURE)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, SSH2_OPEN_CONNECT_FAILED)) != 0 ||
+		    (!(ssh->compat & SSH_BUG_OPENFAILURE) &&
+		    ((r = sshpkt_put_cstring(ssh, reason)) != 0 ||
+		    (r = sshpkt_put_cstring(ssh, "")) != 0)) ||
+		    (r = sshpkt_send(ssh)) != 0)
+			CHANNEL_PACKET_ERROR(c, r);
+	} else {
+		if ((r = sshpkt_start(ssh, SSH_MSG_CHANNEL_OPEN_FAILURE)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+		    (r = sshpkt_send(ssh)) != 0)
+			CHANNEL_PACKET_ERROR(c, r);
+	}
+	chan_mark_dead(c);
+}
+
+/*
+ * Resolver callback for a RESOLVING channel: start connecting to the
+ * addresses found, or give up.
+ */
+static void
+channel_resolved(int gaierr, struct addrinfo *ai, void *ctx)
+{
+	Channel *c = ctx;
+	struct channel_connect *cctx = &c->connect_ctx;
+	int sock;
+
+	cctx->req = NULL;
+	if (gaierr != 0) {
+		error("connect_to %.100s: unknown host (%s)", cctx->host,
+		    ssh_gai_strerror(gaierr));
+		channel_connect_failed(c, ssh_gai_strerror(gaierr));
+		return;
+	}
+	cctx->aitop = cctx->ai = ai;
+	if ((sock = connect_next(cctx)) == -1) {
+		error("connect to %.100s port %d failed: %s",
+		    cctx->host, cctx->port, strerror(errno));
+		channel_connect_failed(c, strerror(errno));
+		return;
+	}
+	channel_register_fds(c, sock, sock, -1, 0, 1, 0);
+	c->type = SSH_CHANNEL_CONNECTING;
+	channel_update_ready(c);
+}
+
+/*
+ * Return CONNECTING channel to remote host, port.  Names that are not
+ * numeric or cached are looked up in the background and the channel is
+ * RESOLVING until the answer arrives.
+ */
 static Channel *
 connect_to(const char *host, u_short port, char *ctype, char *rname)
 {
@@ -3438,7 +4355,22 @@ connect_to(const char *host, u_short port, char *ctype, char *rname)
 	hints.ai_family = IPv4or6;
 	hints.ai_socktype = SOCK_STREAM;
 	snprintf(strport, sizeof strport, "%d", port);
-	if ((gaierr = getaddrinfo(host, strport, &hints, &cctx.aitop)) != 0) {
+	if (!resolver_try(host, strport, &hints, &cctx.aitop, &gaierr)) {
+		c = channel_new(ctype, SSH_CHANNEL_RESOLVING, -1, -1, -1,
+		    CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT, 0,
+		    rname, 1);
+		c->connect_ctx.host = xstrdup(host);
+		c->connect_ctx.port = port;
+		if ((c->connect_ctx.req = resolver_start(host, strport,
+		    &hints, channel_resolved, c)) == NULL) {
+			error("connect_to %.100s: cannot resolve now", host);
+			channel_free(c);
+			return NULL;
+		}
+		debug("channel %d: resolving %.100s", c->self, host);
+		return c;
+	}
+	if (gaierr != 0) {
 		error("connect_to %.100s: unknown host (%s)", host,
 		    ssh_gai_strerror(gaierr));
 		return NULL;
@@ -3515,17 +4447,16 @@ void
 channel_send_window_changes(void)
 {
 	struct ssh *ssh = active_state; /* XXX */
-	u_int i;
+	Channel *c;
 	int r;
 	struct winsize ws;
 
-	for (i = 0; i < channels_alloc; i++) {
-		if (channels[i] == NULL || !channels[i]->client_tty ||
-		    channels[i]->type != SSH_CHANNEL_OPEN)
+	TAILQ_FOREACH(c, &channels_all, all_entry) {
+		if (!c->client_tty || c->type != SSH_CHANNEL_OPEN)
 			continue;
-		if (ioctl(channels[i]->rfd, TIOCGWINSZ, &ws) < 0)
+		if (ioctl(c->rfd, TIOCGWINSZ, &ws) < 0)
 			continue;
-		channel_request_start(i, "window-change", 0);
+		channel_request_start(c->self, "window-change", 0);
 		if ((r = sshpkt_put_u32(ssh, (u_int)ws.ws_col)) != 0 ||
 		    (r = sshpkt_put_u32(ssh, (u_int)ws.ws_row)) != 0 ||
 		    (r = sshpkt_put_u32(ssh, (u_int)ws.ws_xpixel)) != 0 ||
@@ -55,12 +55,14 @@
 #define SSH_CHANNEL_ZOMBIE		14	/* Almost dead. */
 #define SSH_CHANNEL_MUX_LISTENER	15	/* Listener for mux conn. */
 #define SSH_CHANNEL_MUX_CLIENT		16	/* Conn. to mux slave */
-#define SSH_CHANNEL_MAX_TYPE		17
+#define SSH_CHANNEL_RESOLVING		17	/* waiting for the resolver */
+#define SSH_CHANNEL_MAX_TYPE		18
 
 #define CHANNEL_CANCEL_PORT_STATIC	-1
 
 struct sshbuf;
 struct ssh;
+struct poller;
 struct Channel;
 typedef struct Channel Channel;
 
@@ -81,11 +83,19 @@ struct channel_confirm {
 };
 TAILQ_HEAD(channel_confirms, channel_confirm);
 
+/* Received data queued for output without copying, see channel_input_data() */
+struct channel_seg {
+	struct sshbuf *buf;	/* read-only view of a packet payload */
+	TAILQ_ENTRY(channel_seg) entry;
+};
+TAILQ_HEAD(channel_segs, channel_seg);
+
 /* Context for non-blocking connects */
 struct channel_connect {
 	char *host;
 	int port;
 	struct addrinfo *ai, *aitop;
+	struct resolver_req *req;	/* lookup in progress */
 };
 
 /* Callbacks for mux channels back into client-specific code */
@@ -116,6 +126,8 @@ struct Channel {
 				 * encrypted connection */
 	struct sshbuf *output;	/* data received over encrypted connection for
 				 * send on socket */
+	struct channel_segs output_segs; /* more output, queued after 'output' */
+	size_t	output_segs_len;
 	struct sshbuf *extended;
 	char    *path;
 		/* path for unix domain sockets, or host name for forwards */
@@ -151,6 +163,19 @@ struct Channel {
 	/* keep boundaries */
 	int     		datagram;
 
+	/* tunnel frames packed into packets, see channel_output_tun() */
+	int			tun_batch;
+	u_int64_t		tun_frames_out, tun_packets_out;
+	u_int64_t		tun_frames_in, tun_packets_in;
+
+	/* bulk transfer: large packets and reads, see channel_set_bulk() */
+	int			bulk;
+
+	/* output scheduling, see channel_output_poll() */
+	int			sched_class;	/* CHAN_CLASS_* */
+	int			sched_deficit;	/* bytes, may be negative */
+	struct timeval		sched_ready;	/* queued with output since */
+
 	/* non-blocking connect */
 	struct channel_connect	connect_ctx;
 
@@ -158,6 +183,24 @@ struct Channel {
 	mux_callback_fn		*mux_rcb;
 	void			*mux_ctx;
 	int			mux_pause;
+
+	/* channel list and ready queues, see channels.c */
+	TAILQ_ENTRY(Channel)	all_entry;
+	TAILQ_ENTRY(Channel)	output_entry;
+	TAILQ_ENTRY(Channel)	window_entry;
+	TAILQ_ENTRY(Channel)	pre_entry;
+	int			pre_queue;	/* which pre queue */
+	int			queued;
+	u_int			post_round;	/* last post handler run */
+
+	/* receive window auto-tuning, see channel_tune_window() */
+	u_int64_t		rx_bytes;	/* window bytes received */
+	u_int64_t		rtt_edge;	/* window edge before last adjust */
+	struct timeval		rtt_start;	/* when that adjust was sent */
+	u_int			rtt_us;		/* smoothed round trip time */
+	u_int64_t		tune_bytes;	/* consumed since tune_start */
+	struct timeval		tune_start;
+	u_int			window_grown;	/* growth charged to budget */
 };
 
 #define CHAN_EXTENDED_IGNORE		0
@@ -171,6 +214,11 @@ struct Channel {
 #define CHAN_TCP_WINDOW_DEFAULT	(64*CHAN_TCP_PACKET_DEFAULT)
 #define CHAN_X11_PACKET_DEFAULT	(16*1024)
 #define CHAN_X11_WINDOW_DEFAULT	(4*CHAN_X11_PACKET_DEFAULT)
+/* bulk channels: leaves room for headers within PACKET_MAX_SIZE (256KB) */
+#define CHAN_BULK_PACKET_DEFAULT	(252*1024)
+
+/* memory all channels together may add to their windows by auto-tuning */
+#define CHAN_WINDOW_BUDGET_DEFAULT	(64*1024*1024)
 
 /* possible input states */
 #define CHAN_INPUT_OPEN			0
@@ -192,11 +240,25 @@ struct Channel {
 
 #define CHAN_RBUF	16*1024
 
+/* tunnel forwarding: flag in tun@openssh.com open and confirmation */
+#define CHAN_TUN_BATCH		0x01
+#define CHAN_TUN_BATCH_FRAMES	32	/* per read/write wakeup and packet */
+
+/* output scheduling classes */
+#define CHAN_CLASS_BULK		0
+#define CHAN_CLASS_INTERACTIVE	1
+#define CHAN_CLASSES		2
+#define CHAN_BULK_RBUF	CHAN_BULK_PACKET_DEFAULT
+
 /* check whether 'efd' is still in use */
 #define CHANNEL_EFD_INPUT_ACTIVE(c) \
 	(compat20 && c->extended_usage == CHAN_EXTENDED_READ && \
 	(c->efd != -1 || \
 	sshbuf_len(c->extended) > 0))
+/* all data waiting to be written to 'wfd' */
+#define CHANNEL_OUTPUT_LEN(c) \
+	(sshbuf_len(c->output) + c->output_segs_len)
+
 #define CHANNEL_EFD_OUTPUT_ACTIVE(c) \
 	(compat20 && c->extended_usage == CHAN_EXTENDED_WRITE && \
 	c->efd != -1 && (!(c->flags & (CHAN_EOF_RCVD|CHAN_CLOSE_RCVD)) || \
@@ -212,6 +274,9 @@ Channel	*channel_lookup(int);
 Channel *channel_new(char *, int, int, int, int, u_int, u_int, int, char *, int);
 void	 channel_set_fds(int, int, int, int, int, int, int, u_int);
 void	 channel_free(Channel *);
+void	 channel_update_ready(Channel *);
+void	 channel_output_reset(Channel *);
+void	 channel_output_flush(Channel *);
 void	 channel_free_all(void);
 void	 channel_stop_listening(void);
 
@@ -244,15 +309,17 @@ int	 channel_input_status_confirm(int, u_int32_t, struct ssh *);
 
 /* file descriptor handling (read/write) */
 
-void	 channel_prepare_select(fd_set **, fd_set **, int *, u_int*,
-	     time_t*, int);
-void     channel_after_select(fd_set *, fd_set *);
+void	 channel_prepare_poll(struct poller *, time_t *, int);
+void	 channel_after_poll(struct poller *);
 void     channel_output_poll(void);
 
 int      channel_not_very_much_buffered_data(void);
 void     channel_close_all(void);
 int      channel_still_open(void);
 char	*channel_open_message(void);
+void	 channel_set_window_budget(u_int64_t);
+void	 channel_set_bulk(Channel *);
+void	 channel_set_interactive(Channel *, int);
 int	 channel_find_open(void);
 
 /* tcp forwarding */
@@ -102,6 +102,7 @@
 #include "match.h"
 #include "msg.h"
 #include "roaming.h"
+#include "poller.h"
 #include "err.h"
 
 /* import options */
@@ -583,53 +584,56 @@ server_alive_check(struct ssh *ssh)
  * one of the file descriptors).
  */
 static void
-client_wait_until_can_do_something(struct ssh *ssh,
-    fd_set **readsetp, fd_set **writesetp,
-    int *maxfdp, u_int *nallocp, int rekeying)
+client_wait_until_can_do_something(struct ssh *ssh, struct poller *poller,
+    int rekeying)
 {
-	struct timeval tv, *tvp;
 	int timeout_secs;
 	time_t minwait_secs = 0;
-	int r;
+	int r, conn_in = 0, conn_out = 0;
 
-	/* Add any selections by the channel mechanism. */
-	channel_prepare_select(readsetp, writesetp, maxfdp, nallocp,
-	    &minwait_secs, rekeying);
+	/* Update the interest of the channel mechanism. */
+	channel_prepare_poll(poller, &minwait_secs, rekeying);
 
 	if (!compat20) {
 		/* Read from the connection, unless our buffers are full. */
 		if (sshbuf_len(stdout_buffer) < buffer_high &&
 		    sshbuf_len(stderr_buffer) < buffer_high &&
 		    channel_not_very_much_buffered_data())
-			FD_SET(connection_in, *readsetp);
+			conn_in = POLLER_READ;
 		/*
 		 * Read from stdin, unless we have seen EOF or have very much
 		 * buffered data to send to the server.
 		 */
-		if (!stdin_eof && ssh_packet_not_very_much_data_to_write(ssh))
-			FD_SET(fileno(stdin), *readsetp);
-
-		/* Select stdout/stderr if have data in buffer. */
-		if (sshbuf_len(stdout_buffer) > 0)
-			FD_SET(fileno(stdout), *writesetp);
-		if (sshbuf_len(stderr_buffer) > 0)
-			FD_SET(fileno(stderr), *writesetp);
+		poller_set(poller, fileno(stdin), !stdin_eof &&
+		    ssh_packet_not_very_much_data_to_write(ssh) ?
+		    POLLER_READ : 0);
+
+		/* Wait for stdout/stderr if have data in buffer. */
+		poller_set(poller, fileno(stdout),
+		    sshbuf_len(stdout_buffer) > 0 ? POLLER_WRITE : 0);
+		poller_set(poller, fileno(stderr),
+		    sshbuf_len(stderr_buffer) > 0 ? POLLER_WRITE : 0);
 	} else {
-		/* channel_prepare_select could have closed the last channel */
+		/* channel_prepare_poll could have closed the last channel */
 		if (session_closed && !channel_still_open() &&
 		    !ssh_packet_have_data_to_write(ssh)) {
-			/* clear mask since we did not call select() */
-			memset(*readsetp, 0, *nallocp);
-			memset(*writesetp, 0, *nallocp);
+			/* clear results since we did not wait */
+			poller_clear(poller);
 			return;
 		} else {
-			FD_SET(connection_in, *readsetp);
+			conn_in = POLLER_READ;
 		}
 	}
 
-	/* Select server connection if have data to write to the server. */
+	/* Wait for server connection if have data to write to the server. */
 	if (ssh_packet_have_data_to_write(ssh))
-		FD_SET(connection_out, *writesetp);
+		conn_out = POLLER_WRITE;
+	if (connection_in == connection_out)
+		poller_set(poller, connection_in, conn_in | conn_out);
+	else {
+		poller_set(poller, connection_in, conn_in);
+		poller_set(poller, connection_out, conn_out);
+	}
 
 	/*
 	 * Wait for something to happen.  This will suspend the process until
@@ -649,41 +653,40 @@ client_wait_until_can_do_something(struct ssh *ssh,
 	}
 	if (minwait_secs != 0)
 		timeout_secs = MIN(timeout_secs, (int)minwait_secs);
-	if (timeout_secs == INT_MAX)
-		tvp = NULL;
-	else {
-		tv.tv_sec = timeout_secs;
-		tv.tv_usec = 0;
-		tvp = &tv;
-	}
 
-	r = select((*maxfdp)+1, *readsetp, *writesetp, NULL, tvp);
+	r = poller_wait(poller, timeout_secs == INT_MAX ? -1 :
+	    (int)MIN(timeout_secs, INT_MAX / 1000) * 1000);
 	if (r < 0) {
 		/*
-		 * We have to clear the select masks, because we return.
 		 * We have to return, because the mainloop checks for the flags
-		 * set by the signal handlers.
+		 * set by the signal handlers.  A failed wait reports nothing
+		 * ready.
 		 */
-		memset(*readsetp, 0, *nallocp);
-		memset(*writesetp, 0, *nallocp);
-
 		if (errno == EINTR)
 			return;
 		/* Note: we might still have data in the buffers. */
 		if ((r = sshbuf_putf(stderr_buffer,
-		    "select: %s\r\n", strerror(errno))) != 0)
+		    "%s: %s\r\n", poller_backend(poller),
+		    strerror(errno))) != 0)
 			fatal("%s: buffer error: %s", __func__, ssh_err(r));
 		quit_pending = 1;
 	} else if (r == 0)
 		server_alive_check(ssh);
 }
 
+/*
+ * Suspend after flushing stdout and stderr.  For a channel 'c', its output
+ * is flushed by the channel layer, which also holds queued packet views,
+ * and 'bout' is NULL.
+ */
 static void
-client_suspend_self(struct sshbuf **bin, struct sshbuf **bout,
+client_suspend_self(Channel *c, struct sshbuf **bin, struct sshbuf **bout,
     struct sshbuf **berr)
 {
 	/* Flush stdout and stderr buffers. */
-	if (sshbuf_len(*bout) > 0)
+	if (c != NULL)
+		channel_output_flush(c);
+	else if (sshbuf_len(*bout) > 0)
 		atomicio(vwrite, fileno(stdout), (u_char *)sshbuf_ptr(*bout),
 		    sshbuf_len(*bout));
 	if (sshbuf_len(*berr) > 0)
@@ -697,7 +700,8 @@ client_suspend_self(struct sshbuf **bin, struct sshbuf **bout,
 	 * written to swap.
 	 */
 	sshbuf_free(*bin);
-	sshbuf_free(*bout);
+	if (bout != NULL)
+		sshbuf_free(*bout);
 	sshbuf_free(*berr);
 
 	/* Send the suspend signal to the program itself. */
@@ -708,7 +712,7 @@ client_suspend_self(struct sshbuf **bin, struct sshbuf **bout,
 
 	/* OK, we have been continued by the user. Reinitialize buffers. */
 	if ((*bin = sshbuf_new()) == NULL ||
-	    (*bout = sshbuf_new()) == NULL ||
+	    (bout != NULL && (*bout = sshbuf_new()) == NULL) ||
 	    (*berr = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
 
@@ -716,7 +720,7 @@ client_suspend_self(struct sshbuf **bin, struct sshbuf **bout,
 }
 
 static void
-client_process_net_input(struct ssh *ssh, fd_set *readset)
+client_process_net_input(struct ssh *ssh, struct poller *poller)
 {
 	int r, len, cont = 0;
 	char buf[8192];
@@ -725,7 +729,7 @@ client_process_net_input(struct ssh *ssh, fd_set *readset)
 	 * Read input from the server, and add any such data to the buffer of
 	 * the packet subsystem.
 	 */
-	if (FD_ISSET(connection_in, readset)) {
+	if (poller_ready(poller, connection_in, POLLER_READ)) {
 		/* Read as much as possible. */
 		len = roaming_read(connection_in, buf, sizeof(buf), &cont);
 		if (len == 0 && cont == 0) {
@@ -1144,7 +1148,7 @@ process_escapes(struct ssh *ssh, Channel *c, struct sshbuf **binp,
 					    __func__, ssh_err(r));
 
 				/* Restore terminal modes and suspend. */
-				client_suspend_self(binp, boutp, berrp);
+				client_suspend_self(c, binp, boutp, berrp);
 
 				/* We have been continued. */
 				continue;
@@ -1327,13 +1331,13 @@ process_escapes(struct ssh *ssh, Channel *c, struct sshbuf **binp,
 }
 
 static void
-client_process_input(struct ssh *ssh, fd_set *readset)
+client_process_input(struct ssh *ssh, struct poller *poller)
 {
 	int r, len;
 	char buf[8192];
 
 	/* Read input from stdin. */
-	if (FD_ISSET(fileno(stdin), readset)) {
+	if (poller_ready(poller, fileno(stdin), POLLER_READ)) {
 		/* Read as much as possible. */
 		len = read(fileno(stdin), buf, sizeof(buf));
 		if (len < 0 && (errno == EAGAIN || errno == EINTR))
@@ -1386,12 +1390,12 @@ client_process_input(struct ssh *ssh, fd_set *readset)
 }
 
 static void
-client_process_output(struct ssh *ssh, fd_set *writeset)
+client_process_output(struct ssh *ssh, struct poller *poller)
 {
 	int r, len;
 
 	/* Write buffered output to stdout. */
-	if (FD_ISSET(fileno(stdout), writeset)) {
+	if (poller_ready(poller, fileno(stdout), POLLER_WRITE)) {
 		/* Write as much data as possible. */
 		len = write(fileno(stdout), sshbuf_ptr(stdout_buffer),
 		    sshbuf_len(stdout_buffer));
@@ -1417,7 +1421,7 @@ client_process_output(struct ssh *ssh, fd_set *writeset)
 			fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	}
 	/* Write buffered output to stderr. */
-	if (FD_ISSET(fileno(stderr), writeset)) {
+	if (poller_ready(poller, fileno(stderr), POLLER_WRITE)) {
 		/* Write as much data as possible. */
 		len = write(fileno(stderr), sshbuf_ptr(stderr_buffer),
 		    sshbuf_len(stderr_buffer));
@@ -1489,7 +1493,8 @@ client_simple_escape_filter(Channel *c, char *buf, int len)
 	if (c->extended_usage != CHAN_EXTENDED_WRITE)
 		return 0;
 
-	return process_escapes(ssh, c, &c->input, &c->output, &c->extended,
+	/* output to stdout goes through the channel layer */
+	return process_escapes(ssh, c, &c->input, NULL, &c->extended,
 	    buf, len);
 }
 
@@ -1511,11 +1516,10 @@ client_channel_closed(int id, void *arg)
 int
 client_loop(struct ssh *ssh, int have_pty, int escape_char_arg, int ssh2_chan_id)
 {
-	fd_set *readset = NULL, *writeset = NULL;
+	struct poller *poller;
 	double start_time, total_time;
-	int r, max_fd = 0, max_fd2 = 0, len, rekeying = 0;
+	int r, len, rekeying = 0;
 	u_int64_t ibytes, obytes;
-	u_int nalloc = 0;
 	char buf[100];
 
 	debug("Entering interactive session.");
@@ -1530,7 +1534,7 @@ client_loop(struct ssh *ssh, int have_pty, int escape_char_arg, int ssh2_chan_id
 	buffer_high = 64 * 1024;
 	connection_in = ssh_packet_get_connection_in(ssh);
 	connection_out = ssh_packet_get_connection_out(ssh);
-	max_fd = MAX(connection_in, connection_out);
+	poller = poller_new();
 
 	if (!compat20) {
 		/* enable nonblocking unless tty */
@@ -1540,9 +1544,6 @@ client_loop(struct ssh *ssh, int have_pty, int escape_char_arg, int ssh2_chan_id
 			set_nonblock(fileno(stdout));
 		if (!isatty(fileno(stderr)))
 			set_nonblock(fileno(stderr));
-		max_fd = MAX(max_fd, fileno(stdin));
-		max_fd = MAX(max_fd, fileno(stdout));
-		max_fd = MAX(max_fd, fileno(stderr));
 	}
 	quit_pending = 0;
 	escape_char1 = escape_char_arg;
@@ -1632,16 +1633,14 @@ client_loop(struct ssh *ssh, int have_pty, int escape_char_arg, int ssh2_chan_id
 		 * Wait until we have something to do (something becomes
 		 * available on one of the descriptors).
 		 */
-		max_fd2 = max_fd;
-		client_wait_until_can_do_something(ssh, &readset, &writeset,
-		    &max_fd2, &nalloc, rekeying);
+		client_wait_until_can_do_something(ssh, poller, rekeying);
 
 		if (quit_pending)
 			break;
 
 		/* Do channel operations unless rekeying in progress. */
 		if (!rekeying) {
-			channel_after_select(readset, writeset);
+			channel_after_poll(poller);
 			if (need_rekeying || ssh_packet_need_rekeying(ssh)) {
 				debug("need rekeying");
 				ssh->kex->done = 0;
@@ -1654,26 +1653,27 @@ client_loop(struct ssh *ssh, int have_pty, int escape_char_arg, int ssh2_chan_id
 		}
 
 		/* Buffer input from the connection.  */
-		client_process_net_input(ssh, readset);
+		client_process_net_input(ssh, poller);
 
 		if (quit_pending)
 			break;
 
 		if (!compat20) {
 			/* Buffer data from stdin */
-			client_process_input(ssh, readset);
+			client_process_input(ssh, poller);
 			/*
 			 * Process output to stdout and stderr.  Output to
 			 * the connection is processed elsewhere (above).
 			 */
-			client_process_output(ssh, writeset);
+			client_process_output(ssh, poller);
 		}
 
 		if (session_resumed) {
+			/* the old connection is gone, its numbers may be reused */
+			poller_forget(poller, connection_in);
+			poller_forget(poller, connection_out);
 			connection_in = ssh_packet_get_connection_in(ssh);
 			connection_out = ssh_packet_get_connection_out(ssh);
-			max_fd = MAX(max_fd, connection_out);
-			max_fd = MAX(max_fd, connection_in);
 			session_resumed = 0;
 		}
 
@@ -1681,7 +1681,7 @@ client_loop(struct ssh *ssh, int have_pty, int escape_char_arg, int ssh2_chan_id
 		 * Send as much buffered packet data as possible to the
 		 * sender.
 		 */
-		if (FD_ISSET(connection_out, writeset))
+		if (poller_ready(poller, connection_out, POLLER_WRITE))
 			ssh_packet_write_poll(ssh);
 
 		/*
@@ -1696,10 +1696,6 @@ client_loop(struct ssh *ssh, int have_pty, int escape_char_arg, int ssh2_chan_id
 			}
 		}
 	}
-	if (readset)
-		xfree(readset);
-	if (writeset)
-		xfree(writeset);
 
 	/* Terminate the session. */
 
@@ -1717,6 +1713,7 @@ client_loop(struct ssh *ssh, int have_pty, int escape_char_arg, int ssh2_chan_id
 	}
 
 	channel_free_all();
+	poller_free(poller);
 
 	if (have_pty)
 		leave_raw_mode(options.request_tty == REQUEST_TTY_FORCE);
@@ -2037,6 +2034,7 @@ client_request_tun_fwd(struct ssh *ssh, int tun_mode, int local_tun,
 	    (r = sshpkt_put_u32(ssh, c->local_maxpacket)) != 0 ||
 	    (r = sshpkt_put_u32(ssh, tun_mode)) != 0 ||
 	    (r = sshpkt_put_u32(ssh, remote_tun)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, CHAN_TUN_BATCH)) != 0 ||
 	    (r = sshpkt_send(ssh)) != 0)
 		fatal("%s: %s", __func__, ssh_err(r));
 
@@ -2075,7 +2073,8 @@ client_input_channel_open(int type, u_int32_t seq, struct ssh *ssh)
 		c->remote_id = rchan;
 		c->remote_window = rwindow;
 		c->remote_maxpacket = rmaxpack;
-		if (c->type != SSH_CHANNEL_CONNECTING) {
+		if (c->type != SSH_CHANNEL_CONNECTING &&
+		    c->type != SSH_CHANNEL_RESOLVING) {
 			if ((r = sshpkt_start(ssh,
 			    SSH2_MSG_CHANNEL_OPEN_CONFIRMATION)) != 0 ||
 			    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
@@ -2186,6 +2185,21 @@ client_input_global_request(int type, u_int32_t seq, struct ssh *ssh)
 	return 0;
 }
 
+/*
+ * Returns true if a session runs a subsystem or scp and should use bulk
+ * channel mode; sessions with a tty never do.
+ */
+int
+client_session_is_bulk(int want_tty, int want_subsystem, struct sshbuf *cmd)
+{
+	if (want_tty)
+		return 0;
+	if (want_subsystem)
+		return 1;
+	return cmd != NULL && sshbuf_len(cmd) > 4 &&
+	    memcmp(sshbuf_ptr(cmd), "scp ", 4) == 0;
+}
+
 void
 client_session2_setup(struct ssh *ssh, int id, int want_tty,
     int want_subsystem, const char *term, struct termios *tiop,
@@ -2202,6 +2216,7 @@ client_session2_setup(struct ssh *ssh, int id, int want_tty,
 
 	ssh_packet_set_interactive(ssh, want_tty,
 	    options.ip_qos_interactive, options.ip_qos_bulk);
+	channel_set_interactive(c, want_tty);
 
 	if (want_tty) {
 		struct winsize ws;
@@ -48,6 +48,7 @@ void	 client_global_request_reply_fwd(int, u_int32_t, void *);
 void	 client_session2_setup(struct ssh *, int, int, int, const char *,
 	    struct termios *, int, struct sshbuf *, char **);
 int	 client_request_tun_fwd(struct ssh *, int, int, int);
+int	 client_session_is_bulk(int, int, struct sshbuf *);
 void	 client_stop_mux(void);
 
 /* Escape filter for protocol 2 sessions */
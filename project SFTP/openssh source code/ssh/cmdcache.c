@@ -0,0 +1,196 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "misc.h"
+#include "sshbuf.h"
+#include "shmcache.h"
+#include "cmdcache.h"
+
+struct cmdcache_slot {
+	struct shmcache_slot slot;	/* expires in monotime() */
+	u_int32_t	status;		/* CMDCACHE_HIT or CMDCACHE_FAILED */
+	u_int32_t	len;		/* of the output in data */
+	char		data[1];
+};
+
+struct cmdcache_hdr {
+	volatile u_int32_t hits;
+	volatile u_int32_t misses;
+};
+
+static struct shmcache cmdcache;
+static struct cmdcache_hdr *cmdcache_hdr;
+static int cmdcache_ttl, cmdcache_negative_ttl;
+
+#define CMDCACHE_DATA_MAX \
+	(CMDCACHE_SLOT_SIZE - offsetof(struct cmdcache_slot, data))
+
+static int
+cmdcache_hash(const char *command, const char *runas, const char *user,
+    u_char *hash)
+{
+	EVP_MD_CTX ctx;
+	u_int dlen;
+
+	/* the NULs keep ("ab", "c") and ("a", "bc") apart */
+	if (EVP_DigestInit(&ctx, EVP_sha256()) != 1 ||
+	    EVP_DigestUpdate(&ctx, command, strlen(command) + 1) != 1 ||
+	    EVP_DigestUpdate(&ctx, runas, strlen(runas) + 1) != 1 ||
+	    EVP_DigestUpdate(&ctx, user, strlen(user) + 1) != 1 ||
+	    EVP_DigestFinal(&ctx, hash, &dlen) != 1 ||
+	    dlen != SHMCACHE_HASH_LEN)
+		return -1;
+	return 0;
+}
+
+/*
+ * Attach the cache passed as 'fd' by the listener (see cmdcache_fd()), or
+ * create one if 'fd' is -1 or unusable.  Size the cache to 'size' bytes
+ * and cache output for 'ttl' and failures for 'negative_ttl' seconds.
+ * Caching is off if 'ttl' is 0.
+ */
+void
+cmdcache_init(int fd, int ttl, int negative_ttl, int64_t size)
+{
+	u_int nsets;
+
+	cmdcache_detach();
+	nsets = size / (SHMCACHE_WAYS * CMDCACHE_SLOT_SIZE);
+	if (ttl <= 0 || nsets == 0) {
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	if (shmcache_init(&cmdcache, "cmdcache", fd,
+	    sizeof(struct cmdcache_hdr), CMDCACHE_SLOT_SIZE, nsets) != 0)
+		return;
+	cmdcache_hdr = (struct cmdcache_hdr *)cmdcache.map;
+	cmdcache_ttl = ttl;
+	cmdcache_negative_ttl = negative_ttl;
+	debug("%s: %u entries, ttl %d negative %d", __func__,
+	    nsets * SHMCACHE_WAYS, ttl, negative_ttl);
+}
+
+/* The descriptor to pass to a re-executed sshd, or -1 */
+int
+cmdcache_fd(void)
+{
+	return cmdcache.map == NULL ? -1 : cmdcache.fd;
+}
+
+void
+cmdcache_detach(void)
+{
+	shmcache_detach(&cmdcache);
+	cmdcache_hdr = NULL;
+}
+
+/*
+ * Looks up the output of 'command' run as 'runas' for 'user'.  Returns
+ * CMDCACHE_HIT with the output in 'out', CMDCACHE_FAILED if the command
+ * recently failed or CMDCACHE_MISS.
+ */
+int
+cmdcache_lookup(const char *command, const char *runas, const char *user,
+    struct sshbuf *out)
+{
+	struct cmdcache_slot *s;
+	u_char hash[SHMCACHE_HASH_LEN];
+	u_int32_t seq, status, len;
+	u_int64_t expires;
+	u_int i;
+
+	if (cmdcache.map == NULL ||
+	    cmdcache_hash(command, runas, user, hash) != 0)
+		return CMDCACHE_MISS;
+	for (i = 0; i < SHMCACHE_WAYS; i++) {
+		s = (struct cmdcache_slot *)shmcache_slot(&cmdcache, hash, i);
+		if (!shmcache_read_begin(&s->slot, &seq) ||
+		    memcmp(s->slot.hash, hash, sizeof(hash)) != 0)
+			continue;
+		status = s->status;
+		expires = s->slot.expires;
+		len = s->len;
+		if (len > CMDCACHE_DATA_MAX ||
+		    expires <= (u_int64_t)monotime())
+			continue;
+		sshbuf_reset(out);
+		if (status == CMDCACHE_HIT &&
+		    sshbuf_put(out, s->data, len) != 0)
+			break;
+		if (!shmcache_read_end(&s->slot, seq)) {
+			sshbuf_reset(out);
+			continue;
+		}
+		s->slot.used = monotime();
+		verbose("AuthorizedKeysCommand cache %s for %s: "
+		    "%u hits, %u misses", status == CMDCACHE_HIT ?
+		    "hit" : "negative hit", user,
+		    __sync_add_and_fetch(&cmdcache_hdr->hits, 1),
+		    cmdcache_hdr->misses);
+		return status == CMDCACHE_HIT ? CMDCACHE_HIT : CMDCACHE_FAILED;
+	}
+	verbose("AuthorizedKeysCommand cache miss for %s: %u hits, %u misses",
+	    user, cmdcache_hdr->hits,
+	    __sync_add_and_fetch(&cmdcache_hdr->misses, 1));
+	return CMDCACHE_MISS;
+}
+
+/*
+ * Remember the result of running 'command' as 'runas' for 'user': its
+ * output if 'ok', a failure otherwise.  Output that does not fit in an
+ * entry is not cached.
+ */
+void
+cmdcache_store(const char *command, const char *runas, const char *user,
+    int ok, const struct sshbuf *output)
+{
+	struct cmdcache_slot *s;
+	u_char hash[SHMCACHE_HASH_LEN];
+	time_t now = monotime();
+	u_int32_t seq;
+	size_t len = ok ? sshbuf_len(output) : 0;
+
+	if (cmdcache.map == NULL || (!ok && cmdcache_negative_ttl <= 0))
+		return;
+	if (len > CMDCACHE_DATA_MAX) {
+		debug("%s: output for %s too large to cache", __func__, user);
+		return;
+	}
+	if (cmdcache_hash(command, runas, user, hash) != 0)
+		return;
+	s = (struct cmdcache_slot *)shmcache_victim(&cmdcache, hash, now);
+	if (!shmcache_claim(&s->slot, &seq))
+		return;
+	memcpy(s->slot.hash, hash, sizeof(hash));
+	s->slot.expires = now + (ok ? cmdcache_ttl : cmdcache_negative_ttl);
+	s->slot.used = now;
+	s->status = ok ? CMDCACHE_HIT : CMDCACHE_FAILED;
+	s->len = len;
+	if (len > 0)
+		memcpy(s->data, sshbuf_ptr(output), len);
+	shmcache_publish(&s->slot, seq);
+}
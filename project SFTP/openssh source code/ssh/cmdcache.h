@@ -0,0 +1,46 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CMDCACHE_H
+#define _CMDCACHE_H
+
+/*
+ * Cache of AuthorizedKeysCommand output, per command, command user and
+ * user, so that the keys offered by a login and the logins soon after it
+ * need not run the command again.  Failures of the command are cached
+ * for their own, usually shorter, time.  Like the certificate cache it
+ * lives in shared memory created by the listener (see shmcache.h), and it
+ * must be detached before dropping privileges.
+ */
+
+#define CMDCACHE_SLOT_SIZE	16384	/* per entry, output and bookkeeping */
+
+#define CMDCACHE_MISS		(-1)
+#define CMDCACHE_FAILED		0
+#define CMDCACHE_HIT		1
+
+struct sshbuf;
+
+void	 cmdcache_init(int, int, int, int64_t);
+int	 cmdcache_fd(void);
+void	 cmdcache_detach(void);
+int	 cmdcache_lookup(const char *, const char *, const char *,
+	    struct sshbuf *);
+void	 cmdcache_store(const char *, const char *, const char *, int,
+	    const struct sshbuf *);
+
+#endif /* _CMDCACHE_H */
@@ -37,16 +37,23 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <netinet/in.h>
 
 #include <openssl/hmac.h>
 #include <openssl/sha.h>
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <resolv.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "xmalloc.h"
 #include "match.h"
@@ -59,6 +66,65 @@
 struct hostkeys {
 	struct hostkey_entry *entries;
 	u_int num_entries;
+	u_int alloc_entries;
+	u_int num_revoked;	/* entries marked @revoked */
+};
+
+/*
+ * Sidecar index of a known_hosts file, see hostfile_index_build().  All
+ * numbers are in host byte order; the index is a cache of the file next
+ * to it and is not meant to be copied between machines.
+ */
+#define HOSTIDX_MAGIC	"SSHKHIDX"
+#define HOSTIDX_VERSION	1
+
+struct hostidx_hdr {
+	char		magic[8];
+	u_int32_t	version;
+	u_int32_t	nnames;
+	u_int32_t	nsalts;
+	u_int32_t	nhashes;
+	u_int32_t	nwild;
+	u_int32_t	pad;
+	/* identity of the known_hosts file the index was built from */
+	u_int64_t	dev;
+	u_int64_t	ino;
+	u_int64_t	size;
+	u_int64_t	mtime;
+};
+
+/* a plain host name, sorted by hash */
+struct hostidx_name {
+	u_int32_t	hash;
+	u_int32_t	line;		/* line number before the entry */
+	u_int64_t	off;		/* offset of the entry */
+};
+
+/* hashed names sharing a salt are hashes[first .. first + count - 1] */
+struct hostidx_salt {
+	u_int32_t	first;
+	u_int32_t	count;
+	u_char		salt[SHA_DIGEST_LENGTH];
+	u_int32_t	pad;
+};
+
+/* a hashed host name, sorted by hash within its salt */
+struct hostidx_hashed {
+	u_int64_t	off;
+	u_int32_t	line;
+	u_char		hash[SHA_DIGEST_LENGTH];
+};
+
+/* an entry with wildcards, which is checked for every host */
+struct hostidx_wild {
+	u_int64_t	off;
+	u_int32_t	line;
+	u_int32_t	pad;
+};
+
+struct hostidx_cand {
+	u_int64_t	off;
+	u_int32_t	line;
 };
 
 static int
@@ -108,11 +174,21 @@ extract_salt(const char *s, u_int l, char *salt, size_t salt_len)
 	return (0);
 }
 
+static void
+hostfile_hmac(const char *salt, u_int len, const char *host, char *result)
+{
+	HMAC_CTX mac_ctx;
+
+	HMAC_Init(&mac_ctx, salt, len, EVP_sha1());
+	HMAC_Update(&mac_ctx, host, strlen(host));
+	HMAC_Final(&mac_ctx, result, NULL);
+	HMAC_cleanup(&mac_ctx);
+}
+
 char *
 host_hash(const char *host, const char *name_from_hostfile, u_int src_len)
 {
 	const EVP_MD *md = EVP_sha1();
-	HMAC_CTX mac_ctx;
 	char salt[256], result[256], uu_salt[512], uu_result[512];
 	static char encoded[1024];
 	u_int i, len;
@@ -130,10 +206,7 @@ host_hash(const char *host, const char *name_from_hostfile, u_int src_len)
 			return (NULL);
 	}
 
-	HMAC_Init(&mac_ctx, salt, len, md);
-	HMAC_Update(&mac_ctx, host, strlen(host));
-	HMAC_Final(&mac_ctx, result, NULL);
-	HMAC_cleanup(&mac_ctx);
+	hostfile_hmac(salt, len, host, result);
 
 	if (__b64_ntop(salt, len, uu_salt, sizeof(uu_salt)) == -1 ||
 	    __b64_ntop(result, len, uu_result, sizeof(uu_result)) == -1)
@@ -234,97 +307,603 @@ init_hostkeys(void)
 	return ret;
 }
 
-void
-load_hostkeys(struct hostkeys *hostkeys, const char *host, const char *path)
+static void
+hostkeys_add_entry(struct hostkeys *hostkeys, const char *host,
+    const char *path, u_long linenum, struct sshkey *key,
+    HostkeyMarker marker)
+{
+	struct hostkey_entry *e;
+
+	if (hostkeys->num_entries == hostkeys->alloc_entries) {
+		hostkeys->alloc_entries = hostkeys->alloc_entries == 0 ?
+		    8 : hostkeys->alloc_entries * 2;
+		hostkeys->entries = xrealloc(hostkeys->entries,
+		    hostkeys->alloc_entries, sizeof(*hostkeys->entries));
+	}
+	e = &hostkeys->entries[hostkeys->num_entries++];
+	e->host = xstrdup(host);
+	e->file = xstrdup(path);
+	e->line = linenum;
+	e->key = key;
+	e->marker = marker;
+	if (marker == MRK_REVOKE)
+		hostkeys->num_revoked++;
+}
+
+/*
+ * Adds the key of known_hosts entry 'line' to 'hostkeys' if the entry is
+ * for 'host'.  Returns 1 if a key was added, 0 if not and -1 on errors
+ * that should stop the loading.
+ */
+static int
+load_hostkeys_line(struct hostkeys *hostkeys, const char *host,
+    const char *path, char *line, u_long linenum)
 {
-	FILE *f;
-	char line[8192];
-	u_long linenum = 0, num_loaded = 0;
 	char *cp, *cp2, *hashed_host;
 	HostkeyMarker marker;
 	struct sshkey *key;
 	int kbits;
 
-	if ((f = fopen(path, "r")) == NULL)
-		return;
-	debug3("%s: loading entries for host \"%.100s\" from file \"%s\"",
-	    __func__, host, path);
-	while (read_keyfile_line(f, path, line, sizeof(line), &linenum) == 0) {
-		cp = line;
+	cp = line;
 
-		/* Skip any leading whitespace, comments and empty lines. */
-		for (; *cp == ' ' || *cp == '\t'; cp++)
-			;
-		if (!*cp || *cp == '#' || *cp == '\n')
-			continue;
+	/* Skip any leading whitespace, comments and empty lines. */
+	for (; *cp == ' ' || *cp == '\t'; cp++)
+		;
+	if (!*cp || *cp == '#' || *cp == '\n')
+		return 0;
 
-		if ((marker = check_markers(&cp)) == MRK_ERROR) {
-			verbose("%s: invalid marker at %s:%lu",
-			    __func__, path, linenum);
-			continue;
-		}
+	if ((marker = check_markers(&cp)) == MRK_ERROR) {
+		verbose("%s: invalid marker at %s:%lu",
+		    __func__, path, linenum);
+		return 0;
+	}
 
-		/* Find the end of the host name portion. */
-		for (cp2 = cp; *cp2 && *cp2 != ' ' && *cp2 != '\t'; cp2++)
-			;
+	/* Find the end of the host name portion. */
+	for (cp2 = cp; *cp2 && *cp2 != ' ' && *cp2 != '\t'; cp2++)
+		;
 
-		/* Check if the host name matches. */
-		if (match_hostname(host, cp, (u_int) (cp2 - cp)) != 1) {
-			if (*cp != HASH_DELIM)
-				continue;
-			hashed_host = host_hash(host, cp, (u_int) (cp2 - cp));
-			if (hashed_host == NULL) {
-				debug("Invalid hashed host line %lu of %s",
-				    linenum, path);
-				continue;
-			}
-			if (strncmp(hashed_host, cp, (u_int) (cp2 - cp)) != 0)
-				continue;
+	/* Check if the host name matches. */
+	if (match_hostname(host, cp, (u_int) (cp2 - cp)) != 1) {
+		if (*cp != HASH_DELIM)
+			return 0;
+		hashed_host = host_hash(host, cp, (u_int) (cp2 - cp));
+		if (hashed_host == NULL) {
+			debug("Invalid hashed host line %lu of %s",
+			    linenum, path);
+			return 0;
 		}
+		if (strncmp(hashed_host, cp, (u_int) (cp2 - cp)) != 0)
+			return 0;
+	}
 
-		/* Got a match.  Skip host name. */
-		cp = cp2;
+	/* Got a match.  Skip host name. */
+	cp = cp2;
 
-		/*
-		 * Extract the key from the line.  This will skip any leading
-		 * whitespace.  Ignore badly formatted lines.
-		 */
-		if ((key = sshkey_new(KEY_UNSPEC)) == NULL) {
+	/*
+	 * Extract the key from the line.  This will skip any leading
+	 * whitespace.  Ignore badly formatted lines.
+	 */
+	if ((key = sshkey_new(KEY_UNSPEC)) == NULL) {
+		error("%s: sshkey_new failed", __func__);
+		return -1;
+	}
+	if (!hostfile_read_key(&cp, &kbits, key)) {
+		sshkey_free(key);
+		if ((key = sshkey_new(KEY_RSA1)) == NULL) {
 			error("%s: sshkey_new failed", __func__);
-			break;
+			return -1;
 		}
 		if (!hostfile_read_key(&cp, &kbits, key)) {
 			sshkey_free(key);
-			if ((key = sshkey_new(KEY_RSA1)) == NULL) {
-				error("%s: sshkey_new failed", __func__);
-				break;
-			}
-			if (!hostfile_read_key(&cp, &kbits, key)) {
-				sshkey_free(key);
-				continue;
-			}
+			return 0;
+		}
+	}
+	if (!hostfile_check_key(kbits, key, host, path, linenum))
+		return 0;
+
+	debug3("%s: found %skey type %s in file %s:%lu", __func__,
+	    marker == MRK_NONE ? "" :
+	    (marker == MRK_CA ? "ca " : "revoked "),
+	    sshkey_type(key), path, linenum);
+	hostkeys_add_entry(hostkeys, host, path, linenum, key, marker);
+	return 1;
+}
+
+/* FNV-1a of a host name, folded to lower case as match_hostname() does */
+static u_int32_t
+hostidx_name_hash(const char *s, size_t len)
+{
+	u_int32_t h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= (u_char)tolower((u_char)*s++);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int
+hostidx_fresh(const struct hostidx_hdr *hdr, const struct stat *st)
+{
+	return memcmp(hdr->magic, HOSTIDX_MAGIC, sizeof(hdr->magic)) == 0 &&
+	    hdr->version == HOSTIDX_VERSION &&
+	    hdr->dev == (u_int64_t)st->st_dev &&
+	    hdr->ino == (u_int64_t)st->st_ino &&
+	    hdr->size == (u_int64_t)st->st_size &&
+	    hdr->mtime == (u_int64_t)st->st_mtime;
+}
+
+/* hashed name together with its salt, while building */
+struct hostidx_salted {
+	u_char			salt[SHA_DIGEST_LENGTH];
+	struct hostidx_hashed	h;
+};
+
+struct hostidx_build {
+	struct hostidx_name	*names;
+	u_int			nnames, anames;
+	struct hostidx_salted	*hashed;
+	u_int			nhashed, ahashed;
+	struct hostidx_wild	*wild;
+	u_int			nwild, awild;
+};
+
+static int
+hostidx_name_cmp(const void *a, const void *b)
+{
+	const struct hostidx_name *na = a, *nb = b;
+
+	if (na->hash != nb->hash)
+		return na->hash < nb->hash ? -1 : 1;
+	if (na->off != nb->off)
+		return na->off < nb->off ? -1 : 1;
+	return 0;
+}
+
+static int
+hostidx_salted_cmp(const void *a, const void *b)
+{
+	const struct hostidx_salted *sa = a, *sb = b;
+	int r;
+
+	if ((r = memcmp(sa->salt, sb->salt, sizeof(sa->salt))) != 0)
+		return r;
+	if ((r = memcmp(sa->h.hash, sb->h.hash, sizeof(sa->h.hash))) != 0)
+		return r;
+	if (sa->h.off != sb->h.off)
+		return sa->h.off < sb->h.off ? -1 : 1;
+	return 0;
+}
+
+/* Decodes the salt and hash of a "|1|salt|hash" host name. */
+static int
+hostidx_parse_hashed(const char *s, u_int len, u_char *salt, u_char *hash)
+{
+	char saltbuf[256], b64[1024], hashbuf[256];
+	const char *p;
+	size_t l;
+
+	if (extract_salt(s, len, saltbuf, sizeof(saltbuf)) == -1)
+		return -1;
+	s += sizeof(HASH_MAGIC) - 1;
+	len -= sizeof(HASH_MAGIC) - 1;
+	if ((p = memchr(s, HASH_DELIM, len)) == NULL)
+		return -1;
+	l = len - (p + 1 - s);
+	if (l == 0 || l >= sizeof(b64))
+		return -1;
+	memcpy(b64, p + 1, l);
+	b64[l] = '\0';
+	if (__b64_pton(b64, hashbuf, sizeof(hashbuf)) != SHA_DIGEST_LENGTH)
+		return -1;
+	memcpy(salt, saltbuf, SHA_DIGEST_LENGTH);
+	memcpy(hash, hashbuf, SHA_DIGEST_LENGTH);
+	return 0;
+}
+
+/* Records the host names of the known_hosts entry 'line' in 'b'. */
+static void
+hostidx_add_line(struct hostidx_build *b, char *line, u_int64_t off,
+    u_int32_t linenum)
+{
+	struct hostidx_salted *sh;
+	struct hostidx_name *n;
+	struct hostidx_wild *w;
+	char *cp, *cp2, *pat;
+	u_char salt[SHA_DIGEST_LENGTH], hash[SHA_DIGEST_LENGTH];
+	size_t len;
+	int wild = 0, nnames = b->nnames;
+
+	for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
+		;
+	if (!*cp || *cp == '#' || *cp == '\n')
+		return;
+	if (check_markers(&cp) == MRK_ERROR)
+		return;
+	for (cp2 = cp; *cp2 && *cp2 != ' ' && *cp2 != '\t'; cp2++)
+		;
+	*cp2 = '\0';
+
+	if (*cp == HASH_DELIM) {
+		if (hostidx_parse_hashed(cp, cp2 - cp, salt, hash) != 0)
+			return;
+		if (b->nhashed == b->ahashed) {
+			b->ahashed = b->ahashed == 0 ? 64 : b->ahashed * 2;
+			b->hashed = xrealloc(b->hashed, b->ahashed,
+			    sizeof(*b->hashed));
 		}
-		if (!hostfile_check_key(kbits, key, host, path, linenum))
+		sh = &b->hashed[b->nhashed++];
+		memset(sh, 0, sizeof(*sh));
+		memcpy(sh->salt, salt, sizeof(sh->salt));
+		memcpy(sh->h.hash, hash, sizeof(sh->h.hash));
+		sh->h.off = off;
+		sh->h.line = linenum;
+		return;
+	}
+
+	/*
+	 * A host can only match through a pattern that is not negated, so
+	 * index those.  Entries with wildcards are checked for every host.
+	 */
+	while ((pat = strsep(&cp, ",")) != NULL) {
+		if (*pat == '\0' || *pat == '!')
 			continue;
+		len = strlen(pat);
+		if (strcspn(pat, "*?") != len) {
+			wild = 1;
+			break;
+		}
+		if (b->nnames == b->anames) {
+			b->anames = b->anames == 0 ? 64 : b->anames * 2;
+			b->names = xrealloc(b->names, b->anames,
+			    sizeof(*b->names));
+		}
+		n = &b->names[b->nnames++];
+		n->hash = hostidx_name_hash(pat, len);
+		n->line = linenum;
+		n->off = off;
+	}
+	if (!wild)
+		return;
+	b->nnames = nnames;
+	if (b->nwild == b->awild) {
+		b->awild = b->awild == 0 ? 16 : b->awild * 2;
+		b->wild = xrealloc(b->wild, b->awild, sizeof(*b->wild));
+	}
+	w = &b->wild[b->nwild++];
+	memset(w, 0, sizeof(*w));
+	w->off = off;
+	w->line = linenum;
+}
 
-		debug3("%s: found %skey type %s in file %s:%lu", __func__,
-		    marker == MRK_NONE ? "" :
-		    (marker == MRK_CA ? "ca " : "revoked "),
-		    sshkey_type(key), path, linenum);
-		hostkeys->entries = xrealloc(hostkeys->entries,
-		    hostkeys->num_entries + 1, sizeof(*hostkeys->entries));
-		hostkeys->entries[hostkeys->num_entries].host = xstrdup(host);
-		hostkeys->entries[hostkeys->num_entries].file = xstrdup(path);
-		hostkeys->entries[hostkeys->num_entries].line = linenum;
-		hostkeys->entries[hostkeys->num_entries].key = key;
-		hostkeys->entries[hostkeys->num_entries].marker = marker;
-		hostkeys->num_entries++;
-		num_loaded++;
+/*
+ * Writes the sidecar index of the known_hosts file 'path' to
+ * path HOSTFILE_INDEX_SUFFIX.  The index maps each plain host name (by
+ * hash) and each hashed host name (by salt and HMAC) to the entries that
+ * may match it, so that load_hostkeys() only needs to read those and to
+ * compute one HMAC per distinct salt.  Returns 0 on success, -1 on error.
+ * Errors are only logged at debug level: without an index, load_hostkeys()
+ * reads the whole file.
+ */
+int
+hostfile_index_build(const char *path)
+{
+	struct hostidx_build b;
+	struct hostidx_hdr hdr;
+	struct hostidx_salt *salts = NULL;
+	struct stat st;
+	FILE *f, *out = NULL;
+	char line[8192], *idxpath, *tmp = NULL;
+	u_long linenum = 0;
+	u_int64_t off;
+	u_int i, nsalts = 0;
+	int fd, ret = -1;
+
+	memset(&b, 0, sizeof(b));
+	xasprintf(&idxpath, "%s%s", path, HOSTFILE_INDEX_SUFFIX);
+	if ((f = fopen(path, "r")) == NULL || fstat(fileno(f), &st) == -1) {
+		debug("%s: %s: %s", __func__, path, strerror(errno));
+		goto out;
 	}
+	for (;;) {
+		off = ftello(f);
+		i = linenum;
+		if (read_keyfile_line(f, path, line, sizeof(line),
+		    &linenum) != 0)
+			break;
+		hostidx_add_line(&b, line, off, i);
+	}
+
+	qsort(b.names, b.nnames, sizeof(*b.names), hostidx_name_cmp);
+	qsort(b.hashed, b.nhashed, sizeof(*b.hashed), hostidx_salted_cmp);
+	for (i = 0; i < b.nhashed; i++) {
+		if (nsalts > 0 && memcmp(salts[nsalts - 1].salt,
+		    b.hashed[i].salt, sizeof(salts->salt)) == 0) {
+			salts[nsalts - 1].count++;
+			continue;
+		}
+		salts = xrealloc(salts, nsalts + 1, sizeof(*salts));
+		memset(&salts[nsalts], 0, sizeof(*salts));
+		salts[nsalts].first = i;
+		salts[nsalts].count = 1;
+		memcpy(salts[nsalts].salt, b.hashed[i].salt,
+		    sizeof(salts->salt));
+		nsalts++;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HOSTIDX_MAGIC, sizeof(hdr.magic));
+	hdr.version = HOSTIDX_VERSION;
+	hdr.nnames = b.nnames;
+	hdr.nsalts = nsalts;
+	hdr.nhashes = b.nhashed;
+	hdr.nwild = b.nwild;
+	hdr.dev = st.st_dev;
+	hdr.ino = st.st_ino;
+	hdr.size = st.st_size;
+	hdr.mtime = st.st_mtime;
+
+	xasprintf(&tmp, "%s.XXXXXXXXXX", idxpath);
+	if ((fd = mkstemp(tmp)) == -1) {
+		debug("%s: mkstemp %s: %s", __func__, tmp, strerror(errno));
+		free(tmp);
+		tmp = NULL;
+		goto out;
+	}
+	if (fchmod(fd, st.st_mode & 0644) == -1 ||
+	    (out = fdopen(fd, "w")) == NULL) {
+		debug("%s: %s: %s", __func__, tmp, strerror(errno));
+		close(fd);
+		goto out;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	fwrite(b.names, sizeof(*b.names), b.nnames, out);
+	fwrite(salts, sizeof(*salts), nsalts, out);
+	for (i = 0; i < b.nhashed; i++)
+		fwrite(&b.hashed[i].h, sizeof(b.hashed[i].h), 1, out);
+	fwrite(b.wild, sizeof(*b.wild), b.nwild, out);
+	if (fclose(out) != 0) {
+		out = NULL;
+		debug("%s: write %s: %s", __func__, tmp, strerror(errno));
+		goto out;
+	}
+	out = NULL;
+	if (rename(tmp, idxpath) == -1) {
+		debug("%s: rename %s: %s", __func__, idxpath, strerror(errno));
+		goto out;
+	}
+	debug("%s: %s: %u names, %u hashed names with %u salts, "
+	    "%u wildcard entries", __func__, idxpath, b.nnames, b.nhashed,
+	    nsalts, b.nwild);
+	free(tmp);
+	tmp = NULL;
+	ret = 0;
+ out:
+	if (out != NULL)
+		fclose(out);
+	if (tmp != NULL) {
+		unlink(tmp);
+		free(tmp);
+	}
+	if (f != NULL)
+		fclose(f);
+	free(b.names);
+	free(b.hashed);
+	free(b.wild);
+	free(salts);
+	free(idxpath);
+	return ret;
+}
+
+/*
+ * Rebuilds the index of 'path' if there is one, it is out of date and we
+ * may replace it, i.e. the directory it is in is writable.  Otherwise the
+ * stale index is ignored by load_hostkeys().
+ */
+void
+hostfile_index_refresh(const char *path)
+{
+	struct hostidx_hdr hdr;
+	struct stat st;
+	char *idxpath, *dir, *cp;
+	ssize_t len;
+	int fd, writable;
+
+	dir = xstrdup(path);
+	writable = (cp = dirname(dir)) != NULL && access(cp, W_OK) == 0;
+	free(dir);
+	if (!writable)
+		return;
+
+	xasprintf(&idxpath, "%s%s", path, HOSTFILE_INDEX_SUFFIX);
+	fd = open(idxpath, O_RDONLY);
+	free(idxpath);
+	if (fd == -1)
+		return;
+	len = read(fd, &hdr, sizeof(hdr));
+	close(fd);
+	if (stat(path, &st) == -1)
+		return;
+	if (len == sizeof(hdr) && hostidx_fresh(&hdr, &st))
+		return;
+	debug("%s: index of %s is out of date", __func__, path);
+	hostfile_index_build(path);
+}
+
+static void
+hostidx_add_cand(struct hostidx_cand **cand, u_int *ncand, u_int64_t off,
+    u_int32_t line)
+{
+	if ((*ncand & (*ncand - 1)) == 0)
+		*cand = xrealloc(*cand, *ncand == 0 ? 8 : *ncand * 2,
+		    sizeof(**cand));
+	(*cand)[*ncand].off = off;
+	(*cand)[*ncand].line = line;
+	(*ncand)++;
+}
+
+static int
+hostidx_cand_cmp(const void *a, const void *b)
+{
+	const struct hostidx_cand *ca = a, *cb = b;
+
+	if (ca->off != cb->off)
+		return ca->off < cb->off ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Looks 'host' up in the index of the known_hosts file 'path', whose
+ * status is 'st'.  On success returns 0 and the entries that may match
+ * in file order.  Returns -1 if there is no usable index.
+ */
+static int
+hostidx_lookup(const char *path, const struct stat *st, const char *host,
+    struct hostidx_cand **candp, u_int *ncandp)
+{
+	const struct hostidx_hdr *hdr;
+	const struct hostidx_name *names;
+	const struct hostidx_salt *salts;
+	const struct hostidx_hashed *hashes;
+	const struct hostidx_wild *wild;
+	struct hostidx_cand *cand = NULL;
+	struct stat ist;
+	char *idxpath;
+	u_char hash[EVP_MAX_MD_SIZE];
+	u_int64_t need;
+	u_int32_t h;
+	u_int i, j, lo, hi, ncand = 0;
+	void *map;
+	int fd, ret = -1;
+
+	*candp = NULL;
+	*ncandp = 0;
+	xasprintf(&idxpath, "%s%s", path, HOSTFILE_INDEX_SUFFIX);
+	fd = open(idxpath, O_RDONLY);
+	free(idxpath);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &ist) == -1 || ist.st_size < (off_t)sizeof(*hdr) ||
+	    (map = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE,
+	    fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	hdr = map;
+	if (!hostidx_fresh(hdr, st)) {
+		debug2("%s: index of %s is out of date", __func__, path);
+		goto out;
+	}
+	need = sizeof(*hdr) + (u_int64_t)hdr->nnames * sizeof(*names) +
+	    (u_int64_t)hdr->nsalts * sizeof(*salts) +
+	    (u_int64_t)hdr->nhashes * sizeof(*hashes) +
+	    (u_int64_t)hdr->nwild * sizeof(*wild);
+	if (need != (u_int64_t)ist.st_size) {
+		debug2("%s: index of %s is truncated", __func__, path);
+		goto out;
+	}
+	names = (const struct hostidx_name *)(hdr + 1);
+	salts = (const struct hostidx_salt *)(names + hdr->nnames);
+	hashes = (const struct hostidx_hashed *)(salts + hdr->nsalts);
+	wild = (const struct hostidx_wild *)(hashes + hdr->nhashes);
+
+	/* plain names */
+	h = hostidx_name_hash(host, strlen(host));
+	for (lo = 0, hi = hdr->nnames; lo < hi; ) {
+		i = lo + (hi - lo) / 2;
+		if (names[i].hash < h)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	for (i = lo; i < hdr->nnames && names[i].hash == h; i++)
+		hostidx_add_cand(&cand, &ncand, names[i].off, names[i].line);
+
+	/* hashed names, one HMAC per salt */
+	for (j = 0; j < hdr->nsalts; j++) {
+		if (salts[j].first > hdr->nhashes ||
+		    salts[j].count > hdr->nhashes - salts[j].first)
+			goto out;
+		hostfile_hmac(salts[j].salt, SHA_DIGEST_LENGTH, host, hash);
+		for (lo = salts[j].first, hi = lo + salts[j].count; lo < hi; ) {
+			i = lo + (hi - lo) / 2;
+			if (memcmp(hashes[i].hash, hash,
+			    SHA_DIGEST_LENGTH) < 0)
+				lo = i + 1;
+			else
+				hi = i;
+		}
+		for (i = lo; i < salts[j].first + salts[j].count &&
+		    memcmp(hashes[i].hash, hash, SHA_DIGEST_LENGTH) == 0; i++)
+			hostidx_add_cand(&cand, &ncand, hashes[i].off,
+			    hashes[i].line);
+	}
+
+	for (i = 0; i < hdr->nwild; i++)
+		hostidx_add_cand(&cand, &ncand, wild[i].off, wild[i].line);
+
+	/* keep the order of the file, an entry may be listed twice */
+	qsort(cand, ncand, sizeof(*cand), hostidx_cand_cmp);
+	for (i = j = 0; i < ncand; i++) {
+		if (j > 0 && cand[j - 1].off == cand[i].off)
+			continue;
+		cand[j++] = cand[i];
+	}
+	*candp = cand;
+	*ncandp = j;
+	cand = NULL;
+	ret = 0;
+ out:
+	free(cand);
+	munmap(map, ist.st_size);
+	return ret;
+}
+
+void
+load_hostkeys(struct hostkeys *hostkeys, const char *host, const char *path)
+{
+	FILE *f;
+	char line[8192];
+	u_long linenum = 0, num_loaded = 0;
+	struct hostidx_cand *cand;
+	struct stat st;
+	u_int i, ncand;
+	int r;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	debug3("%s: loading entries for host \"%.100s\" from file \"%s\"",
+	    __func__, host, path);
+	if (fstat(fileno(f), &st) == 0 &&
+	    hostidx_lookup(path, &st, host, &cand, &ncand) == 0) {
+		debug3("%s: index lists %u entries", __func__, ncand);
+		for (i = 0; i < ncand; i++) {
+			linenum = cand[i].line;
+			if (fseeko(f, cand[i].off, SEEK_SET) == -1 ||
+			    read_keyfile_line(f, path, line, sizeof(line),
+			    &linenum) != 0)
+				break;
+			if ((r = load_hostkeys_line(hostkeys, host, path,
+			    line, linenum)) == -1)
+				break;
+			num_loaded += r;
+		}
+		free(cand);
+		goto done;
+	}
+	while (read_keyfile_line(f, path, line, sizeof(line), &linenum) == 0) {
+		if ((r = load_hostkeys_line(hostkeys, host, path,
+		    line, linenum)) == -1)
+			break;
+		num_loaded += r;
+	}
+ done:
 	debug3("%s: loaded %lu keys", __func__, num_loaded);
 	fclose(f);
 	return;
-}	
+}
 
 void
 free_hostkeys(struct hostkeys *hostkeys)
@@ -350,6 +929,9 @@ check_key_not_revoked(struct hostkeys *hostkeys, struct sshkey *k)
 	int is_cert = sshkey_is_cert(k);
 	u_int i;
 
+	/* most files have no @revoked entries at all */
+	if (hostkeys->num_revoked == 0)
+		return 0;
 	for (i = 0; i < hostkeys->num_entries; i++) {
 		if (hostkeys->entries[i].marker != MRK_REVOKE)
 			continue;
@@ -436,7 +1018,7 @@ check_hostkeys_by_key_or_type(struct hostkeys *hostkeys,
 	}
 	return end_return;
 }
-	
+
 HostStatus
 check_key_in_hostkeys(struct hostkeys *hostkeys, struct sshkey *key,
     const struct hostkey_entry **found)
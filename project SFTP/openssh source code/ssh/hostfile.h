@@ -52,4 +52,10 @@ int	 add_host_to_hostfile(const char *, const char *,
 
 char	*host_hash(const char *, const char *, u_int);
 
+#define HOSTFILE_INDEX_SUFFIX	".idx"
+#define HOSTFILE_SALT_GROUP	64	/* names hashed with one salt by ssh-keygen -H */
+
+int	 hostfile_index_build(const char *);
+void	 hostfile_index_refresh(const char *);
+
 #endif
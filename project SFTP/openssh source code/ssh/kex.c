@@ -177,8 +177,17 @@ kex_reset_dispatch(struct ssh *ssh)
 int
 kex_send_newkeys(struct ssh *ssh)
 {
+	struct kex *kex = ssh->kex;
 	int r;
 
+	if (kex->flags & KEX_HOSTKEY_FAILED)
+		return SSH_ERR_SIGNATURE_INVALID;
+	if (kex->flags & KEX_HOSTKEY_PENDING) {
+		/* resumed by kex_hostkey_verified() */
+		debug("SSH2_MSG_NEWKEYS deferred until host key is verified");
+		kex->flags |= KEX_NEWKEYS_PARKED;
+		return 0;
+	}
 	kex_reset_dispatch(ssh);
 	if ((r = sshpkt_start(ssh, SSH2_MSG_NEWKEYS)) != 0 ||
 	    (r = sshpkt_send(ssh)) != 0)
@@ -189,6 +198,50 @@ kex_send_newkeys(struct ssh *ssh)
 	return 0;
 }
 
+/*
+ * Ask the verify_host_key callback about the server host key.  If the
+ * callback returns KEX_VERIFY_DEFERRED the key exchange continues, but
+ * our NEWKEYS is held back until kex_hostkey_verified() is called.
+ */
+int
+kex_verify_host_key(struct ssh *ssh, struct sshkey *server_host_key)
+{
+	struct kex *kex = ssh->kex;
+	int r;
+
+	kex->flags &= ~(KEX_HOSTKEY_FAILED|KEX_NEWKEYS_PARKED);
+	kex->flags |= KEX_HOSTKEY_PENDING;
+	r = kex->verify_host_key(server_host_key, ssh);
+	if (r == KEX_VERIFY_DEFERRED) {
+		/* the callback may already have delivered the verdict */
+		if (kex->flags & KEX_HOSTKEY_FAILED)
+			return SSH_ERR_SIGNATURE_INVALID;
+		return 0;
+	}
+	kex->flags &= ~KEX_HOSTKEY_PENDING;
+	if (r == -1)
+		return SSH_ERR_SIGNATURE_INVALID;
+	return 0;
+}
+
+/* deliver a deferred host key verdict and resume the key exchange */
+int
+kex_hostkey_verified(struct ssh *ssh, int ok)
+{
+	struct kex *kex = ssh->kex;
+	int parked;
+
+	if (kex == NULL || !(kex->flags & KEX_HOSTKEY_PENDING))
+		return SSH_ERR_INVALID_ARGUMENT;
+	parked = (kex->flags & KEX_NEWKEYS_PARKED) != 0;
+	kex->flags &= ~(KEX_HOSTKEY_PENDING|KEX_NEWKEYS_PARKED);
+	if (!ok) {
+		kex->flags |= KEX_HOSTKEY_FAILED;
+		return SSH_ERR_SIGNATURE_INVALID;
+	}
+	return parked ? kex_send_newkeys(ssh) : 0;
+}
+
 static int
 kex_input_newkeys(int type, u_int32_t seq, struct ssh *ssh)
 {
@@ -246,9 +299,10 @@ kex_input_kexinit(int type, u_int32_t seq, struct ssh *ssh)
 {
 	struct kex *kex = ssh->kex;
 	const u_char *ptr;
+	char *kexalgs = NULL;
 	u_int i;
 	size_t dlen;
-	int r;
+	int r, resume;
 
 	debug("SSH2_MSG_KEXINIT received");
 	if (kex == NULL)
@@ -262,7 +316,11 @@ kex_input_kexinit(int type, u_int32_t seq, struct ssh *ssh)
 	for (i = 0; i < KEX_COOKIE_LEN; i++)
 		if ((r = sshpkt_get_u8(ssh, NULL)) != 0)
 			return r;
-	for (i = 0; i < PROPOSAL_MAX; i++)
+	if ((r = sshpkt_get_cstring(ssh, &kexalgs, NULL)) != 0)
+		return r;
+	resume = strcmp(kexalgs, KEX_RESUME) == 0;
+	free(kexalgs);
+	for (i = 1; i < PROPOSAL_MAX; i++)
 		if ((r = sshpkt_get_string(ssh, NULL, NULL)) != 0)
 			return r;
 	/*
@@ -283,6 +341,9 @@ kex_input_kexinit(int type, u_int32_t seq, struct ssh *ssh)
 	if (!(kex->flags & KEX_INIT_SENT))
 		if ((r = kex_send_kexinit(ssh)) != 0)
 			return r;
+	/* a roaming client resumes a session instead of a key exchange */
+	if (resume && kex->server && kex->resume != NULL)
+		return kex->resume(ssh);
 	if ((r = kex_choose_conf(ssh)) != 0)
 		return r;
 
@@ -494,10 +555,10 @@ choose_hostkeyalg(struct kex *k, char *client, char *server)
 static int
 proposals_match(char *my[PROPOSAL_MAX], char *peer[PROPOSAL_MAX])
 {
-	static int check[] = {
+	static const int check[] = {
 		PROPOSAL_KEX_ALGS, PROPOSAL_SERVER_HOST_KEY_ALGS, -1
 	};
-	int *idx;
+	const int *idx;
 	char *p;
 
 	for (idx = &check[0]; *idx != -1; idx++) {
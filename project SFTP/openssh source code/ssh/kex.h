@@ -78,6 +78,12 @@ enum kex_exchange {
 };
 
 #define KEX_INIT_SENT	0x0001
+#define KEX_HOSTKEY_PENDING	0x0002	/* host key verdict outstanding */
+#define KEX_HOSTKEY_FAILED	0x0004	/* deferred verdict was negative */
+#define KEX_NEWKEYS_PARKED	0x0008	/* NEWKEYS held back for verdict */
+
+/* verify_host_key() return value: verdict follows kex_hostkey_verified() */
+#define KEX_VERIFY_DEFERRED	1
 
 struct sshenc {
 	char	*name;
@@ -122,6 +128,7 @@ struct kex {
 	struct sshkey *(*load_host_public_key)(int, struct ssh *);
 	struct sshkey *(*load_host_private_key)(int, struct ssh *);
 	int	(*host_key_index)(struct sshkey *);
+	int	(*resume)(struct ssh *);	/* server: peer offers only resume */
 	int	(*kex[KEX_MAX])(struct ssh *);
 	/* kex specific state */
 	DH	*dh;			/* DH */
@@ -145,6 +152,8 @@ int	 kex_send_kexinit(struct ssh *);
 int	 kex_input_kexinit(int, u_int32_t, struct ssh *);
 int	 kex_derive_keys(struct ssh *, u_char *, u_int, BIGNUM *);
 int	 kex_send_newkeys(struct ssh *);
+int	 kex_verify_host_key(struct ssh *, struct sshkey *);
+int	 kex_hostkey_verified(struct ssh *, int);
 
 int	 kexdh_client(struct ssh *);
 int	 kexdh_server(struct ssh *);
@@ -155,18 +164,18 @@ int	 kexecdh_server(struct ssh *);
 
 int	 kex_dh_hash(const char *, const char *,
     const u_char *, size_t, const u_char *, size_t, const u_char *, size_t,
-    const BIGNUM *, const BIGNUM *, const BIGNUM *, u_char **, size_t *);
+    const BIGNUM *, const BIGNUM *, const BIGNUM *, u_char *, size_t *);
 
 int	 kexgex_hash(const EVP_MD *, const char *, const char *,
     const char *, size_t, const char *, size_t, const u_char *, size_t,
     int, int, int,
     const BIGNUM *, const BIGNUM *, const BIGNUM *,
     const BIGNUM *, const BIGNUM *,
-    u_char **, size_t *);
+    u_char *, size_t *);
 
 int kex_ecdh_hash(const EVP_MD *, const EC_GROUP *, const char *, const char *,
     const char *, size_t, const char *, size_t, const u_char *, size_t,
-    const EC_POINT *, const EC_POINT *, const BIGNUM *, u_char **, size_t *);
+    const EC_POINT *, const EC_POINT *, const BIGNUM *, u_char *, size_t *);
 
 int	kex_ecdh_name_to_nid(const char *);
 const EVP_MD *kex_ecdh_name_to_evpmd(const char *);
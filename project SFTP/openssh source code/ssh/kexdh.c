@@ -46,14 +46,15 @@ kex_dh_hash(
     const BIGNUM *client_dh_pub,
     const BIGNUM *server_dh_pub,
     const BIGNUM *shared_secret,
-    u_char **hash, size_t *hashlen)
+    u_char *hash, size_t *hashlen)
 {
 	struct sshbuf *b;
-	static u_char digest[EVP_MAX_MD_SIZE];
 	const EVP_MD *evp_md = EVP_sha1();
 	EVP_MD_CTX md;
 	int r;
 
+	if (*hashlen < (size_t)EVP_MD_size(evp_md))
+		return SSH_ERR_INVALID_ARGUMENT;
 	if ((b = sshbuf_new()) == NULL)
 		return SSH_ERR_ALLOC_FAIL;
 	if ((r = sshbuf_put_cstring(b, client_version_string)) != 0 ||
@@ -77,15 +78,14 @@ kex_dh_hash(
 #endif
 	if (EVP_DigestInit(&md, evp_md) != 1 ||
 	    EVP_DigestUpdate(&md, sshbuf_ptr(b), sshbuf_len(b)) != 1 ||
-	    EVP_DigestFinal(&md, digest, NULL) != 1) {
+	    EVP_DigestFinal(&md, hash, NULL) != 1) {
 		sshbuf_free(b);
 		return SSH_ERR_LIBCRYPTO_ERROR;
 	}
 	sshbuf_free(b);
-	*hash = digest;
 	*hashlen = EVP_MD_size(evp_md);
 #ifdef DEBUG_KEX
-	dump_digest("hash", digest, *hashlen);
+	dump_digest("hash", hash, *hashlen);
 #endif
 	return 0;
 }
@@ -93,7 +93,7 @@ input_kex_dh(int type, u_int32_t seq, struct ssh *ssh)
 	BIGNUM *dh_server_pub = NULL, *shared_secret = NULL;
 	struct sshkey *server_host_key = NULL;
 	u_char *kbuf = NULL, *server_host_key_blob = NULL, *signature = NULL;
-	u_char *hash;
+	u_char hash[EVP_MAX_MD_SIZE];
 	size_t klen = 0, slen, sbloblen, hashlen;
 	int kout, r;
 
@@ -111,10 +111,8 @@ input_kex_dh(int type, u_int32_t seq, struct ssh *ssh)
 		r = SSH_ERR_KEY_TYPE_MISMATCH;
 		goto out;
 	}
-	if (kex->verify_host_key(server_host_key, ssh) == -1) {
-		r = SSH_ERR_SIGNATURE_INVALID;
+	if ((r = kex_verify_host_key(ssh, server_host_key)) != 0)
 		goto out;
-	}
 	/* DH parameter f, server public DH key */
 	if ((dh_server_pub = BN_new()) == NULL) {
 		r = SSH_ERR_ALLOC_FAIL;
@@ -153,6 +151,7 @@ input_kex_dh(int type, u_int32_t seq, struct ssh *ssh)
 #endif
 
 	/* calc and verify H */
+	hashlen = sizeof(hash);
 	if ((r = kex_dh_hash(
 	    kex->client_version_string,
 	    kex->server_version_string,
@@ -162,7 +161,7 @@ input_kex_dh(int type, u_int32_t seq, struct ssh *ssh)
 	    kex->dh->pub_key,
 	    dh_server_pub,
 	    shared_secret,
-	    &hash, &hashlen)) != 0)
+	    hash, &hashlen)) != 0)
 		goto out;
 
 	if ((r = sshkey_verify(server_host_key, signature, slen, hash, hashlen,
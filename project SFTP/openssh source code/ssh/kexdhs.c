@@ -87,8 +87,8 @@ input_kex_dh_init(int type, u_int32_t seq, struct ssh *ssh)
 	BIGNUM *shared_secret = NULL, *dh_client_pub = NULL;
 	struct sshkey *server_host_public, *server_host_private;
 	u_char *kbuf = NULL, *signature = NULL, *server_host_key_blob = NULL;
-	u_char *hash;
 	size_t sbloblen, slen;
+	u_char hash[EVP_MAX_MD_SIZE];
 	size_t klen = 0, hashlen;
 	int kout, r;
 
@@ -151,6 +151,7 @@ input_kex_dh_init(int type, u_int32_t seq, struct ssh *ssh)
 	    &sbloblen)) != 0)
 		goto out;
 	/* calc H */
+	hashlen = sizeof(hash);
 	if ((r = kex_dh_hash(
 	    kex->client_version_string,
 	    kex->server_version_string,
@@ -160,7 +161,7 @@ input_kex_dh_init(int type, u_int32_t seq, struct ssh *ssh)
 	    dh_client_pub,
 	    kex->dh->pub_key,
 	    shared_secret,
-	    &hash, &hashlen)) != 0)
+	    hash, &hashlen)) != 0)
 		goto out;
 
 	/* save session id := H */
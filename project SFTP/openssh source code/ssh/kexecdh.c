@@ -73,13 +73,14 @@ kex_ecdh_hash(
     const EC_POINT *client_dh_pub,
     const EC_POINT *server_dh_pub,
     const BIGNUM *shared_secret,
-    u_char **hash, size_t *hashlen)
+    u_char *hash, size_t *hashlen)
 {
 	struct sshbuf *b;
 	EVP_MD_CTX md;
-	static u_char digest[EVP_MAX_MD_SIZE];
 	int r;
 
+	if (*hashlen < (size_t)EVP_MD_size(evp_md))
+		return SSH_ERR_INVALID_ARGUMENT;
 	if ((b = sshbuf_new()) == NULL)
 		return SSH_ERR_ALLOC_FAIL;
 	if ((r = sshbuf_put_cstring(b, client_version_string)) != 0 ||
@@ -103,15 +104,14 @@ kex_ecdh_hash(
 #endif
 	if (EVP_DigestInit(&md, evp_md) != 1 ||
 	    EVP_DigestUpdate(&md, sshbuf_ptr(b), sshbuf_len(b)) != 1 ||
-	    EVP_DigestFinal(&md, digest, NULL) != 1) {
+	    EVP_DigestFinal(&md, hash, NULL) != 1) {
 		sshbuf_free(b);
 		return SSH_ERR_LIBCRYPTO_ERROR;
 	}
 	sshbuf_free(b);
 #ifdef DEBUG_KEX
-	dump_digest("hash", digest, EVP_MD_size(evp_md));
+	dump_digest("hash", hash, EVP_MD_size(evp_md));
 #endif
-	*hash = digest;
 	*hashlen = EVP_MD_size(evp_md);
 	return 0;
 }
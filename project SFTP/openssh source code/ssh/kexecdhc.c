@@ -103,8 +103,9 @@ input_kex_ecdh_reply(int type, u_int32_t seq, struct ssh *ssh)
 	BIGNUM *shared_secret = NULL;
 	struct sshkey *server_host_key = NULL;
 	u_char *server_host_key_blob = NULL, *signature = NULL;
-	u_char *kbuf = NULL, *hash;
+	u_char *kbuf = NULL;
 	size_t slen, sbloblen;
+	u_char hash[EVP_MAX_MD_SIZE];
 	size_t klen = 0, hashlen;
 	int r;
 
@@ -125,10 +126,8 @@ input_kex_ecdh_reply(int type, u_int32_t seq, struct ssh *ssh)
 		r = SSH_ERR_KEY_TYPE_MISMATCH;
 		goto out;
 	}
-	if (kex->verify_host_key(server_host_key, ssh) == -1) {
-		r = SSH_ERR_SIGNATURE_INVALID;
+	if ((r = kex_verify_host_key(ssh, server_host_key)) != 0)
 		goto out;
-	}
 
 	/* Q_S, server public key */
 	/* signed H */
@@ -168,6 +167,7 @@ input_kex_ecdh_reply(int type, u_int32_t seq, struct ssh *ssh)
 	dump_digest("shared secret", kbuf, klen);
 #endif
 	/* calc and verify H */
+	hashlen = sizeof(hash);
 	if ((r = kex_ecdh_hash(
 	    kex->evp_md,
 	    group,
@@ -179,7 +179,7 @@ input_kex_ecdh_reply(int type, u_int32_t seq, struct ssh *ssh)
 	    EC_KEY_get0_public_key(client_key),
 	    server_public,
 	    shared_secret,
-	    &hash, &hashlen)) != 0)
+	    hash, &hashlen)) != 0)
 		goto out;
 
 	if ((r = sshkey_verify(server_host_key, signature, slen, hash,
@@ -67,8 +67,9 @@ input_kex_ecdh_init(int type, u_int32_t seq, struct ssh *ssh)
 	BIGNUM *shared_secret = NULL;
 	struct sshkey *server_host_private, *server_host_public;
 	u_char *server_host_key_blob = NULL, *signature = NULL;
-	u_char *kbuf = NULL, *hash;
+	u_char *kbuf = NULL;
 	size_t slen, sbloblen;
+	u_char hash[EVP_MAX_MD_SIZE];
 	size_t klen = 0, hashlen;
 	int curve_nid, r;
 
@@ -139,6 +140,7 @@ input_kex_ecdh_init(int type, u_int32_t seq, struct ssh *ssh)
 	dump_digest("shared secret", kbuf, klen);
 #endif
 	/* calc H */
+	hashlen = sizeof(hash);
 	if ((r = sshkey_to_blob(server_host_public, &server_host_key_blob,
 	    &sbloblen)) != 0)
 		goto out;
@@ -153,7 +155,7 @@ input_kex_ecdh_init(int type, u_int32_t seq, struct ssh *ssh)
 	    client_public,
 	    EC_KEY_get0_public_key(server_key),
 	    shared_secret,
-	    &hash, &hashlen)) != 0)
+	    hash, &hashlen)) != 0)
 		goto out;
 
 	/* save session id := H */
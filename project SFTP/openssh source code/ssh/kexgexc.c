@@ -146,7 +146,8 @@ input_kex_dh_gex_reply(int type, u_int32_t seq, struct ssh *ssh)
 	struct kex *kex = ssh->kex;
 	BIGNUM *dh_server_pub = NULL, *shared_secret = NULL;
 	struct sshkey *server_host_key;
-	u_char *kbuf = NULL, *hash, *signature = NULL, *server_host_key_blob = NULL;
+	u_char *kbuf = NULL, *signature = NULL, *server_host_key_blob = NULL;
+	u_char hash[EVP_MAX_MD_SIZE];
 	size_t klen = 0, slen, sbloblen, hashlen;
 	int kout, r;
 
@@ -165,10 +166,8 @@ input_kex_dh_gex_reply(int type, u_int32_t seq, struct ssh *ssh)
 		r = SSH_ERR_KEY_TYPE_MISMATCH;
 		goto out;
 	}
-	if (kex->verify_host_key(server_host_key, ssh) == -1) {
-		r = SSH_ERR_SIGNATURE_INVALID;
+	if ((r = kex_verify_host_key(ssh, server_host_key)) != 0)
 		goto out;
-	}
 	/* DH parameter f, server public DH key */
 	if ((dh_server_pub = BN_new()) == NULL) {
 		r = SSH_ERR_ALLOC_FAIL;
@@ -209,6 +208,7 @@ input_kex_dh_gex_reply(int type, u_int32_t seq, struct ssh *ssh)
 		kex->min = kex->max = -1;
 
 	/* calc and verify H */
+	hashlen = sizeof(hash);
 	if ((r = kexgex_hash(
 	    kex->evp_md,
 	    kex->client_version_string,
@@ -221,7 +221,7 @@ input_kex_dh_gex_reply(int type, u_int32_t seq, struct ssh *ssh)
 	    kex->dh->pub_key,
 	    dh_server_pub,
 	    shared_secret,
-	    &hash, &hashlen)) != 0)
+	    hash, &hashlen)) != 0)
 		goto out;
 
 	if ((r = sshkey_verify(server_host_key, signature, slen, hash,
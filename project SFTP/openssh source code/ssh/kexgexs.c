@@ -141,8 +141,8 @@ input_kex_dh_gex_init(int type, u_int32_t seq, struct ssh *ssh)
 	BIGNUM *shared_secret = NULL, *dh_client_pub = NULL;
 	struct sshkey *server_host_public, *server_host_private;
 	u_char *kbuf = NULL, *signature = NULL, *server_host_key_blob = NULL;
-	u_char *hash;
 	size_t sbloblen, slen;
+	u_char hash[EVP_MAX_MD_SIZE];
 	size_t klen = 0, hashlen;
 	int kout, r;
 
@@ -205,6 +205,7 @@ input_kex_dh_gex_init(int type, u_int32_t seq, struct ssh *ssh)
 	    &sbloblen)) != 0)
 		goto out;
 	/* calc H */
+	hashlen = sizeof(hash);
 	if ((r = kexgex_hash(
 	    kex->evp_md,
 	    kex->client_version_string,
@@ -217,7 +218,7 @@ input_kex_dh_gex_init(int type, u_int32_t seq, struct ssh *ssh)
 	    dh_client_pub,
 	    kex->dh->pub_key,
 	    shared_secret,
-	    &hash, &hashlen)) != 0)
+	    hash, &hashlen)) != 0)
 		goto out;
 
 	/* save session id := H */
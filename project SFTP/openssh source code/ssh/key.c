@@ -40,6 +40,15 @@
 #define SSHKEY_INTERNAL
 #include "key.h"
 
+/*
+ * Optional cache of certificates whose CA signature is known to be good.
+ * The lookup gets the whole certificate blob, including the CA key and
+ * signature, and returns 1 for a certificate verified before; the store
+ * is told about each newly verified one and its valid_before.
+ */
+static int (*cert_cache_lookup)(const u_char *, size_t);
+static void (*cert_cache_store)(const u_char *, size_t, u_int64_t);
+
 struct keytype {
 	int type;
 	char *name;
@@ -1506,9 +1515,16 @@ cert_parse(struct sshbuf *b, struct sshkey *key, const u_char *blob,
 		goto out;
 	}
 
+	if (cert_cache_lookup != NULL &&
+	    cert_cache_lookup(blob, blen) == 1) {
+		ret = 0;
+		goto out;
+	}
 	if ((ret = sshkey_verify(key->cert->signature_key, sig, slen, 
 	    sshbuf_ptr(key->cert->certblob), signed_len, 0)) != 0)
 		goto out;
+	if (cert_cache_store != NULL)
+		cert_cache_store(blob, blen, key->cert->valid_before);
 	ret = 0;
 
  out:
@@ -1521,6 +1537,14 @@ cert_parse(struct sshbuf *b, struct sshkey *key, const u_char *blob,
 	return ret;
 }
 
+void
+sshkey_set_cert_cache(int (*lookup)(const u_char *, size_t),
+    void (*store)(const u_char *, size_t, u_int64_t))
+{
+	cert_cache_lookup = lookup;
+	cert_cache_store = store;
+}
+
 int
 sshkey_from_blob(const u_char *blob, size_t blen, struct sshkey **keyp)
 {
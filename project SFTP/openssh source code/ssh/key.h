@@ -135,6 +135,8 @@ int	 sshkey_cert_check_authority(const struct sshkey *, int, int,
     const char *,
 	    const char **);
 int	 sshkey_cert_is_legacy(struct sshkey *);
+void	 sshkey_set_cert_cache(int (*)(const u_char *, size_t),
+    void (*)(const u_char *, size_t, u_int64_t));
 
 int		 sshkey_ecdsa_nid_from_name(const char *);
 int		 sshkey_curve_name_to_nid(const char *);
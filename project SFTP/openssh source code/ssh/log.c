@@ -309,6 +309,12 @@ log_is_on_stderr(void)
 	return log_on_stderr;
 }
 
+LogLevel
+log_level_get(void)
+{
+	return log_level;
+}
+
 #define MSGBUFSIZ 1024
 
 void
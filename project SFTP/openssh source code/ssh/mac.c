@@ -146,7 +146,7 @@ int
 mac_compute(struct sshmac *mac, u_int32_t seqno, const u_char *data, int datalen,
     u_char *digest, size_t dlen)
 {
-	static u_char m[MAC_DIGEST_LEN_MAX];
+	u_char m[MAC_DIGEST_LEN_MAX];
 	u_char b[4], nonce[8];
 
 	if (mac->mac_len > sizeof(m))
@@ -44,6 +44,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "xmalloc.h"
@@ -340,6 +341,51 @@ convtime(const char *s)
 	return total;
 }
 
+/*
+ * Convert a size specification to bytes.  The number may be followed by
+ * one of the suffixes K, M or G (case insensitive) for kilo-, mega- and
+ * gigabytes respectively.
+ *
+ * Return -1 if the size string is invalid or too large.
+ */
+long long
+convsize(const char *s)
+{
+	long long val, scale;
+	char *endp;
+
+	if (s == NULL || *s < '0' || *s > '9')
+		return -1;
+	errno = 0;
+	val = strtoll(s, &endp, 10);
+	if (s == endp || errno == ERANGE)
+		return -1;
+	switch (*endp) {
+	case '\0':
+		scale = 1;
+		break;
+	case 'k':
+	case 'K':
+		scale = 1LL << 10;
+		break;
+	case 'm':
+	case 'M':
+		scale = 1LL << 20;
+		break;
+	case 'g':
+	case 'G':
+		scale = 1LL << 30;
+		break;
+	default:
+		return -1;
+	}
+	if (scale != 1 && endp[1] != '\0')
+		return -1;
+	if (val > LLONG_MAX / scale)
+		return -1;
+	return val * scale;
+}
+
 /*
  * Returns a standardized host+port identifier string.
  * Caller must free returned string.
@@ -832,6 +878,39 @@ ms_to_timeval(struct timeval *tv, int ms)
 	tv->tv_usec = (ms % 1000) * 1000;
 }
 
+/* Return the current time from a clock that never steps backwards */
+void
+monotime_tv(struct timeval *tv)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		fatal("clock_gettime: %s", strerror(errno));
+	TIMESPEC_TO_TIMEVAL(tv, &ts);
+}
+
+time_t
+monotime(void)
+{
+	struct timeval tv;
+
+	monotime_tv(&tv);
+	return tv.tv_sec;
+}
+
+/* Microseconds elapsed on the monotonic clock since *start */
+u_int64_t
+monotime_since_us(const struct timeval *start)
+{
+	struct timeval now, diff;
+
+	monotime_tv(&now);
+	if (timercmp(&now, start, <))
+		return 0;
+	timersub(&now, start, &diff);
+	return (u_int64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
 void
 bandwidth_limit_init(struct bwlimit *bw, u_int64_t kbps, size_t buflen)
 {
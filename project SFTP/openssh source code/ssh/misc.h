@@ -29,12 +29,16 @@ char	*hpdelim(char **);
 char	*cleanhostname(char *);
 char	*colon(char *);
 long	 convtime(const char *);
+long long convsize(const char *);
 char	*tilde_expand_filename(const char *, uid_t);
 char	*percent_expand(const char *, ...) __attribute__((__sentinel__));
 char	*tohex(const void *, size_t);
 void	 sanitise_stdfd(void);
 void	 ms_subtract_diff(struct timeval *, int *);
 void	 ms_to_timeval(struct timeval *, int);
+void	 monotime_tv(struct timeval *);
+time_t	 monotime(void);
+u_int64_t monotime_since_us(const struct timeval *);
 void	*reallocn(void *, size_t, size_t);
 
 struct passwd *pwcopy(struct passwd *);
@@ -117,6 +117,7 @@ int mm_answer_jpake_step1(int, struct sshbuf *);
 int mm_answer_jpake_step2(int, struct sshbuf *);
 int mm_answer_jpake_key_confirm(int, struct sshbuf *);
 int mm_answer_jpake_check_confirm(int, struct sshbuf *);
+int mm_answer_roaming_resume(int, struct sshbuf *);
 
 #ifdef GSSAPI
 int mm_answer_gss_setup_ctx(int, struct sshbuf *);
@@ -181,6 +182,7 @@ struct mon_table mon_dispatch_proto20[] = {
     {MONITOR_REQ_JPAKE_KEY_CONFIRM, MON_ONCE, mm_answer_jpake_key_confirm},
     {MONITOR_REQ_JPAKE_CHECK_CONFIRM, MON_AUTH, mm_answer_jpake_check_confirm},
 #endif
+    {MONITOR_REQ_ROAMING_RESUME, MON_ONCE, mm_answer_roaming_resume},
     {0, 0, NULL}
 };
 
@@ -266,6 +268,9 @@ monitor_child_preauth(Authctxt *_authctxt, struct monitor *pmonitor)
 		/* Permit requests for moduli and signatures */
 		monitor_permit(mon_dispatch, MONITOR_REQ_MODULI, 1);
 		monitor_permit(mon_dispatch, MONITOR_REQ_SIGN, 1);
+		if (options.roaming_grace_time > 0)
+			monitor_permit(mon_dispatch,
+			    MONITOR_REQ_ROAMING_RESUME, 1);
 	} else {
 		mon_dispatch = mon_dispatch_proto15;
 
@@ -1503,6 +1508,36 @@ mm_answer_term(int sock, struct sshbuf *req)
 	exit(res);
 }
 
+/*
+ * The pre-auth child found that the client resumes a roaming session: pass
+ * the connection to that session and exit with the child.
+ */
+int
+mm_answer_roaming_resume(int sock, struct sshbuf *m)
+{
+	extern struct monitor *pmonitor;
+	struct ssh *ssh = active_state;			/* XXX */
+	u_int32_t id;
+	int r, ok, status;
+
+	if ((r = sshbuf_get_u32(m, &id)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	ok = roaming_server_pass(id, ssh_packet_get_connection_in(ssh)) == 0;
+	sshbuf_reset(m);
+	if ((r = sshbuf_put_u32(m, ok)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	mm_request_send(sock, MONITOR_ANS_ROAMING_RESUME, m);
+	if (!ok)
+		return (0);
+
+	verbose("Connection from %.200s resumes session %08x",
+	    ssh_remote_ipaddr(ssh), id);
+	while (waitpid(pmonitor->m_pid, &status, 0) == -1)
+		if (errno != EINTR)
+			break;
+	exit(0);
+}
+
 void
 monitor_apply_keystate(struct monitor *pmonitor)
 {
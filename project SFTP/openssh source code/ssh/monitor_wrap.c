@@ -616,6 +616,29 @@ mm_terminate(void)
 	sshbuf_free(m);
 }
 
+/* Ask the monitor to pass the connection to roaming session 'id' */
+int
+mm_roaming_resume(u_int32_t id)
+{
+	struct sshbuf *m;
+	u_int32_t ok;
+	int r;
+
+	debug3("%s entering", __func__);
+
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u32(m, id)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	mm_request_send(pmonitor->m_recvfd, MONITOR_REQ_ROAMING_RESUME, m);
+	mm_request_receive_expect(pmonitor->m_recvfd,
+	    MONITOR_ANS_ROAMING_RESUME, m);
+	if ((r = sshbuf_get_u32(m, &ok)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	sshbuf_free(m);
+	return ok ? 0 : -1;
+}
+
 int
 mm_ssh1_session_key(BIGNUM *num)
 {
@@ -93,6 +93,7 @@ chan_set_istate(Channel *c, u_int next)
 	debug2("channel %d: input %s -> %s", c->self, istates[c->istate],
 	    istates[next]);
 	c->istate = next;
+	channel_update_ready(c);
 }
 static void
 chan_set_ostate(Channel *c, u_int next)
@@ -102,6 +103,7 @@ chan_set_ostate(Channel *c, u_int next)
 	debug2("channel %d: output %s -> %s", c->self, ostates[c->ostate],
 	    ostates[next]);
 	c->ostate = next;
+	channel_update_ready(c);
 }
 
 /*
@@ -215,7 +217,7 @@ void
 chan_obuf_empty(Channel *c)
 {
 	debug2("channel %d: obuf empty", c->self);
-	if (sshbuf_len(c->output)) {
+	if (CHANNEL_OUTPUT_LEN(c)) {
 		error("channel %d: chan_obuf_empty for non empty buffer",
 		    c->self);
 		return;
@@ -429,7 +431,7 @@ chan_rcvd_ieof(Channel *c)
 	else
 		chan_rcvd_ieof1(c);
 	if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN &&
-	    sshbuf_len(c->output) == 0 &&
+	    CHANNEL_OUTPUT_LEN(c) == 0 &&
 	    !CHANNEL_EFD_OUTPUT_ACTIVE(c))
 		chan_obuf_empty(c);
 }
@@ -454,6 +456,7 @@ void
 chan_mark_dead(Channel *c)
 {
 	c->type = SSH_CHANNEL_ZOMBIE;
+	channel_update_ready(c);
 }
 
 int
@@ -505,7 +508,7 @@ chan_is_dead(Channel *c, int do_send)
 static void
 chan_shutdown_write(Channel *c)
 {
-	sshbuf_reset(c->output);
+	channel_output_reset(c);
 	if (compat20 && c->type == SSH_CHANNEL_LARVAL)
 		return;
 	/* shutdown failure is allowed if write failed already */
@@ -198,6 +198,9 @@ struct session_state {
 	/* One-off warning about weak ciphers */
 	int cipher_warning_done;
 
+	/* Guard against recursive ssh_packet_disconnect() */
+	int disconnecting;
+
 	/* SSH1 CRC compensation attack detector */
 	struct deattack_ctx deattack;
 
@@ -1350,6 +1353,26 @@ ssh_packet_read_expect(struct ssh *ssh, int expected_type)
 		    expected_type, type);
 }
 
+/*
+ * Prepare incoming_packet for the next packet.  If channels still hold
+ * views of the previous payload (see sshpkt_getb_froms()), leave that
+ * buffer to them and start afresh.
+ */
+static int
+ssh_packet_new_incoming(struct ssh *ssh)
+{
+	struct session_state *state = ssh->state;
+
+	if (sshbuf_refcount(state->incoming_packet) == 1) {
+		sshbuf_reset(state->incoming_packet);
+		return 0;
+	}
+	sshbuf_free(state->incoming_packet);
+	if ((state->incoming_packet = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	return 0;
+}
+
 /* Checks if a full packet is available in the data received so far via
  * packet_process_incoming.  If so, reads the packet; otherwise returns
  * SSH_MSG_NONE.  This does not wait for data from the connection.
@@ -1414,8 +1437,8 @@ ssh_packet_read_poll1(struct ssh *ssh, u_char *typep)
 	}
 
 	/* Decrypt data to incoming_packet. */
-	sshbuf_reset(state->incoming_packet);
-	if ((r = sshbuf_reserve(state->incoming_packet, padded_len, &p)) != 0)
+	if ((r = ssh_packet_new_incoming(ssh)) != 0 ||
+	    (r = sshbuf_reserve(state->incoming_packet, padded_len, &p)) != 0)
 		goto out;
 	if ((r = cipher_crypt(&state->receive_context, p,
 	    sshbuf_ptr(state->input), padded_len, 0)) != 0)
@@ -1512,7 +1535,8 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 			if ((r = sshpkt_disconnect(ssh, "Packet corrupt")) != 0)
 				return r;
 		}
-		sshbuf_reset(state->incoming_packet);
+		if ((r = ssh_packet_new_incoming(ssh)) != 0)
+			goto out;
 	} else if (state->packlen == 0) {
 		/*
 		 * check if input size is less than the cipher block size,
@@ -1520,8 +1544,8 @@ ssh_packet_read_poll2(struct ssh *ssh, u_char *typep, u_int32_t *seqnr_p)
 		 */
 		if (sshbuf_len(state->input) < block_size)
 			return 0;
-		sshbuf_reset(state->incoming_packet);
-		if ((r = sshbuf_reserve(state->incoming_packet, block_size,
+		if ((r = ssh_packet_new_incoming(ssh)) != 0 ||
+		    (r = sshbuf_reserve(state->incoming_packet, block_size,
 		    &cp)) != 0)
 			goto out;
 		if ((r = cipher_crypt(&state->receive_context, cp,
@@ -1837,12 +1861,11 @@ ssh_packet_disconnect(struct ssh *ssh, const char *fmt,...)
 {
 	char buf[1024];
 	va_list args;
-	static int disconnecting = 0;
 	int r;
 
-	if (disconnecting)	/* Guard against recursive invocations. */
+	if (ssh->state->disconnecting)	/* Guard against recursive invocations. */
 		fatal("packet_disconnect called recursively.");
-	disconnecting = 1;
+	ssh->state->disconnecting = 1;
 
 	/*
 	 * Format the message.  Note that the caller must make sure the
@@ -2131,6 +2154,19 @@ ssh_packet_set_authenticated(struct ssh *ssh)
 	ssh->state->after_authentication = 1;
 }
 
+int
+ssh_packet_is_authenticated(struct ssh *ssh)
+{
+	return ssh->state->after_authentication;
+}
+
+/* Undo the forced post-auth state of ssh_packet_set_state() */
+void
+ssh_packet_clear_authenticated(struct ssh *ssh)
+{
+	ssh->state->after_authentication = 0;
+}
+
 void *
 ssh_packet_get_input(struct ssh *ssh)
 {
@@ -2143,56 +2179,49 @@ ssh_packet_get_output(struct ssh *ssh)
 	return (void *)ssh->state->output;
 }
 
-/* XXX FIXME FIXME FIXME */
 /*
- * Save the state for the real connection, and use a separate state when
- * resuming a suspended connection.
+ * Drop the connection of a roaming session that was lost.  Keys, sequence
+ * numbers and buffered data are kept for ssh_packet_resume().
  */
 void
-ssh_packet_backup_state(struct ssh *ssh,
-    struct ssh *backup_state)
+ssh_packet_suspend(struct ssh *ssh)
 {
-	struct ssh *tmp;
+	struct session_state *state = ssh->state;
 
-	close(ssh->state->connection_in);
-	ssh->state->connection_in = -1;
-	close(ssh->state->connection_out);
-	ssh->state->connection_out = -1;
-	if (backup_state)
-		tmp = backup_state;
-	else
-		tmp = ssh_alloc_session_state();
-	backup_state = ssh;
-	ssh = tmp;
+	if (state->connection_out != -1 &&
+	    state->connection_out != state->connection_in)
+		close(state->connection_out);
+	if (state->connection_in != -1)
+		close(state->connection_in);
+	state->connection_in = -1;
+	state->connection_out = -1;
 }
 
-/* XXX FIXME FIXME FIXME */
 /*
- * Swap in the old state when resuming a connecion.
+ * Continue a session on the connection that 'nssh' used for the resume
+ * exchange.  Whatever 'nssh' has read beyond the exchange already belongs
+ * to the resumed stream.  'nssh' is freed.
  */
 void
-ssh_packet_restore_state(struct ssh *ssh,
-    struct ssh *backup_state)
+ssh_packet_resume(struct ssh *ssh, struct ssh *nssh)
 {
-	struct ssh *tmp;
-	u_int len;
+	struct session_state *state = ssh->state;
+	size_t len;
 	int r;
 
-	tmp = backup_state;
-	backup_state = ssh;
-	ssh = tmp;
-	ssh->state->connection_in = backup_state->state->connection_in;
-	backup_state->state->connection_in = -1;
-	ssh->state->connection_out = backup_state->state->connection_out;
-	backup_state->state->connection_out = -1;
-	len = sshbuf_len(backup_state->state->input);
-	if (len > 0) {
-		if ((r = sshbuf_putb(ssh->state->input,
-		    backup_state->state->input)) != 0)
+	ssh_packet_suspend(ssh);
+	state->connection_in = nssh->state->connection_in;
+	state->connection_out = nssh->state->connection_out;
+	nssh->state->connection_in = -1;
+	nssh->state->connection_out = -1;
+	if ((len = sshbuf_len(nssh->state->input)) > 0) {
+		if ((r = sshbuf_putb(state->input, nssh->state->input)) != 0)
 			fatal("%s: %s", __func__, ssh_err(r));
-		sshbuf_reset(backup_state->state->input);
 		add_recv_bytes(len);
 	}
+	ssh_packet_close(nssh);
+	free(nssh);
+	ssh_packet_set_nonblocking(ssh);
 }
 
 /* Reset after_authentication and reset compression in post-auth privsep */
@@ -2639,6 +2668,17 @@ sshpkt_get_string_direct(struct ssh *ssh, const u_char **valp, size_t *lenp)
 	return sshbuf_get_string_direct(ssh->state->incoming_packet, valp, lenp);
 }
 
+/*
+ * Returns a read-only view of the next string in the packet.  The view
+ * stays valid after the packet has been processed and must be released
+ * with sshbuf_free().
+ */
+int
+sshpkt_getb_froms(struct ssh *ssh, struct sshbuf **valp)
+{
+	return sshbuf_froms(ssh->state->incoming_packet, valp);
+}
+
 int
 sshpkt_get_cstring(struct ssh *ssh, char **valp, size_t *lenp)
 {
@@ -36,6 +36,7 @@ struct kex;
 struct sshkey;
 struct sshbuf;
 struct session_state;	/* private session data */
+struct ssh_chanctx;	/* ssh_api channels */
 
 struct ssh {
 	/* Session state */
@@ -68,6 +69,9 @@ struct ssh {
 	/* Lists for private and public keys */
 	TAILQ_HEAD(, key_entry) private_keys;
 	TAILQ_HEAD(, key_entry) public_keys;
+
+	/* Channels managed through ssh_api */
+	struct ssh_chanctx *chanctx;
 };
 
 struct ssh *ssh_alloc_session_state(void);
@@ -88,6 +92,8 @@ void     ssh_packet_set_interactive(struct ssh *, int, int, int);
 int      ssh_packet_is_interactive(struct ssh *);
 void     ssh_packet_set_server(struct ssh *);
 void     ssh_packet_set_authenticated(struct ssh *);
+int	 ssh_packet_is_authenticated(struct ssh *);
+void	 ssh_packet_clear_authenticated(struct ssh *);
 
 int	 ssh_packet_send1(struct ssh *);
 int	 ssh_packet_send2_wrapped(struct ssh *);
@@ -140,8 +146,8 @@ int	 ssh_packet_need_rekeying(struct ssh *);
 void	 ssh_packet_set_rekey_limit(struct ssh *, u_int32_t);
 
 /* XXX FIXME */
-void	 ssh_packet_backup_state(struct ssh *, struct ssh *);
-void	 ssh_packet_restore_state(struct ssh *, struct ssh *);
+void	 ssh_packet_suspend(struct ssh *);
+void	 ssh_packet_resume(struct ssh *, struct ssh *);
 
 void	*ssh_packet_get_input(struct ssh *);
 void	*ssh_packet_get_output(struct ssh *);
@@ -173,6 +179,7 @@ int	sshpkt_get_u32(struct ssh *ssh, u_int32_t *valp);
 int	sshpkt_get_u64(struct ssh *ssh, u_int64_t *valp);
 int	sshpkt_get_string(struct ssh *ssh, u_char **valp, size_t *lenp);
 int	sshpkt_get_string_direct(struct ssh *ssh, const u_char **valp, size_t *lenp);
+int	sshpkt_getb_froms(struct ssh *ssh, struct sshbuf **valp);
 int	sshpkt_get_cstring(struct ssh *ssh, char **valp, size_t *lenp);
 int	sshpkt_get_ec(struct ssh *ssh, EC_POINT *v, const EC_GROUP *g);
 int	sshpkt_get_bignum1(struct ssh *ssh, BIGNUM *v);
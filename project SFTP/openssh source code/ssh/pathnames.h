@@ -134,5 +134,8 @@
 /* chroot directory for unprivileged user when UsePrivilegeSeparation=yes */
 #define _PATH_PRIVSEP_CHROOT_DIR	"/var/empty"
 
+/* rendezvous sockets of sessions waiting for a roaming client */
+#define _PATH_SSHD_ROAMING_DIR		"/var/run/sshd.roaming"
+
 /* for passwd change */
 #define _PATH_PASSWD_PROG		"/usr/bin/passwd"
@@ -0,0 +1,256 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "misc.h"
+#include "phase.h"
+
+#define PHASE_BUCKETS	32	/* bucket i > 0 holds [2^(i-1), 2^i) us */
+#define PHASE_READ_MAX	16	/* records read per call of phase_collect() */
+
+/* Written in one piece, well below PIPE_BUF, so records never interleave. */
+struct phase_msg {
+	u_int32_t	phase;
+	u_int32_t	usec;
+};
+
+struct phase_hist {
+	u_int64_t	count;
+	u_int64_t	sum_us;
+	u_int32_t	max_us;
+	u_int64_t	bucket[PHASE_BUCKETS];
+};
+
+static const char *phase_names[PHASE_MAX] = {
+	"ident",
+	"kex",
+	"auth",
+	"auth-none",
+	"auth-publickey",
+	"auth-password",
+	"auth-keyboard-interactive",
+	"auth-hostbased",
+	"auth-gssapi-with-mic",
+	"auth-other",
+	"preauth",
+	"postauth",
+	"login",
+};
+
+static int phase_fd = -1;
+
+static struct phase_hist phase_hist[PHASE_MAX];
+static int phase_dirty;
+static time_t phase_written;
+
+/* Set the descriptor that phase records are sent to, -1 to stop sending. */
+void
+phase_set_fd(int fd)
+{
+	phase_fd = fd;
+}
+
+/* Map a userauth method name to its PHASE_AUTH_* */
+int
+phase_auth_method(const char *method)
+{
+	int i;
+
+	for (i = PHASE_AUTH_NONE; i < PHASE_AUTH_OTHER; i++)
+		if (strcmp(phase_names[i] + sizeof("auth-") - 1, method) == 0)
+			return i;
+	return PHASE_AUTH_OTHER;
+}
+
+/* Report that 'phase', which began at 'start', has finished. */
+void
+phase_done(int phase, const struct timeval *start)
+{
+	struct phase_msg msg;
+	u_int64_t us;
+
+	us = monotime_since_us(start);
+	debug3("%s: %s took %llu us", __func__, phase_names[phase],
+	    (unsigned long long)us);
+	if (phase_fd == -1)
+		return;
+	msg.phase = phase;
+	msg.usec = us > 0xffffffff ? 0xffffffff : (u_int32_t)us;
+	/* the listener may be gone; SIGPIPE is ignored in sshd */
+	while (write(phase_fd, &msg, sizeof(msg)) == -1 && errno == EINTR)
+		;
+}
+
+static void
+phase_add(u_int phase, u_int32_t us)
+{
+	struct phase_hist *h;
+	u_int b;
+
+	if (phase >= PHASE_MAX)
+		return;
+	h = &phase_hist[phase];
+	for (b = 0; b < PHASE_BUCKETS - 1 && (us >> b) != 0; b++)
+		;
+	h->bucket[b]++;
+	h->count++;
+	h->sum_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+	phase_dirty = 1;
+}
+
+/*
+ * Read the records waiting on the nonblocking read end of a startup pipe.
+ * Returns -1 once the pipe has been closed by the connection, 0 otherwise.
+ */
+int
+phase_collect(int fd)
+{
+	struct phase_msg msg[PHASE_READ_MAX];
+	ssize_t len;
+	size_t i;
+
+	while ((len = read(fd, msg, sizeof(msg))) == -1 && errno == EINTR)
+		;
+	if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (len <= 0)
+		return -1;
+	for (i = 0; i < (size_t)len / sizeof(*msg); i++)
+		phase_add(msg[i].phase, msg[i].usec);
+	return 0;
+}
+
+/* Upper bound of the bucket holding the pct'th percentile, in us */
+static u_int32_t
+phase_percentile(const struct phase_hist *h, u_int pct)
+{
+	u_int64_t want, seen = 0;
+	u_int b;
+
+	want = (h->count * pct + 99) / 100;
+	for (b = 0; b < PHASE_BUCKETS - 1; b++) {
+		if ((seen += h->bucket[b]) >= want)
+			break;
+	}
+	if (b == 0)
+		return 0;
+	if (b == PHASE_BUCKETS - 1 || (1ULL << b) - 1 > h->max_us)
+		return h->max_us;
+	return (1U << b) - 1;
+}
+
+void
+phase_stats_log(void)
+{
+	const struct phase_hist *h;
+	int i;
+
+	for (i = 0; i < PHASE_MAX; i++) {
+		h = &phase_hist[i];
+		if (h->count == 0)
+			continue;
+		logit("Phase %s: count %llu, mean %llu us, p50 %u us, "
+		    "p90 %u us, p99 %u us, max %u us", phase_names[i],
+		    (unsigned long long)h->count,
+		    (unsigned long long)(h->sum_us / h->count),
+		    phase_percentile(h, 50), phase_percentile(h, 90),
+		    phase_percentile(h, 99), h->max_us);
+	}
+}
+
+/*
+ * Milliseconds until LatencyStatsFile should be rewritten, or -1 if
+ * nothing new has been collected since the last write.
+ */
+int
+phase_stats_timeout(void)
+{
+	time_t now;
+
+	if (!phase_dirty)
+		return -1;
+	now = monotime();
+	if (now >= phase_written + PHASE_STATS_INTERVAL)
+		return 0;
+	return (phase_written + PHASE_STATS_INTERVAL - now) * 1000;
+}
+
+/*
+ * Replace 'path' with the current histograms, one line per phase:
+ * name, count, sum_us, max_us, p50, p90, p99 and the bucket counts.
+ */
+void
+phase_stats_write(const char *path)
+{
+	const struct phase_hist *h;
+	char *tmp;
+	FILE *f;
+	int i, b, fd;
+
+	phase_written = monotime();
+	phase_dirty = 0;
+	xasprintf(&tmp, "%s.XXXXXXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1) {
+		error("%s: mkstemp %s: %s", __func__, tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+	if (fchmod(fd, 0644) == -1 || (f = fdopen(fd, "w")) == NULL) {
+		error("%s: %s: %s", __func__, tmp, strerror(errno));
+		close(fd);
+		goto fail;
+	}
+	fprintf(f, "# phase count sum_us max_us p50_us p90_us p99_us "
+	    "log2_buckets\n");
+	for (i = 0; i < PHASE_MAX; i++) {
+		h = &phase_hist[i];
+		fprintf(f, "%s %llu %llu %u %u %u %u", phase_names[i],
+		    (unsigned long long)h->count,
+		    (unsigned long long)h->sum_us, h->max_us,
+		    phase_percentile(h, 50), phase_percentile(h, 90),
+		    phase_percentile(h, 99));
+		for (b = 0; b < PHASE_BUCKETS; b++)
+			fprintf(f, " %llu", (unsigned long long)h->bucket[b]);
+		fputc('\n', f);
+	}
+	if (fclose(f) != 0) {
+		error("%s: write %s: %s", __func__, tmp, strerror(errno));
+		goto fail;
+	}
+	if (rename(tmp, path) == -1) {
+		error("%s: rename %s: %s", __func__, path, strerror(errno));
+		goto fail;
+	}
+	free(tmp);
+	return;
+ fail:
+	unlink(tmp);
+	free(tmp);
+}
@@ -0,0 +1,61 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _PHASE_H
+#define _PHASE_H
+
+/*
+ * Latency of the phases of an sshd login.
+ *
+ * The processes handling a connection send a fixed size record for every
+ * finished phase over the startup pipe (see phase_set_fd()).  The listener
+ * reads them with phase_collect() before it closes its end of the pipe and
+ * keeps a log2 histogram per phase, which it logs with phase_stats_log()
+ * and writes to LatencyStatsFile with phase_stats_write().
+ */
+
+#define PHASE_IDENT		0	/* version exchange */
+#define PHASE_KEX		1	/* initial key exchange */
+#define PHASE_AUTH		2	/* first userauth request to success */
+#define PHASE_AUTH_NONE		3	/* per userauth request, by method */
+#define PHASE_AUTH_PUBKEY	4
+#define PHASE_AUTH_PASSWD	5
+#define PHASE_AUTH_KBDINT	6
+#define PHASE_AUTH_HOSTBASED	7
+#define PHASE_AUTH_GSSAPI	8
+#define PHASE_AUTH_OTHER	9
+#define PHASE_PREAUTH		10	/* privsep_preauth() in the monitor */
+#define PHASE_POSTAUTH		11	/* privsep_postauth() */
+#define PHASE_LOGIN		12	/* ident to authenticated */
+#define PHASE_MAX		13
+
+#define PHASE_STATS_INTERVAL	10	/* seconds between LatencyStatsFile writes */
+
+struct timeval;
+
+/* connection side */
+void	 phase_set_fd(int);
+int	 phase_auth_method(const char *);
+void	 phase_done(int, const struct timeval *);
+
+/* listener side */
+int	 phase_collect(int);
+void	 phase_stats_log(void);
+int	 phase_stats_timeout(void);
+void	 phase_stats_write(const char *);
+
+#endif /* _PHASE_H */
@@ -0,0 +1,427 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define HAVE_EPOLL
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "poller.h"
+
+#define POLLER_BACKEND_POLL	0
+#define POLLER_BACKEND_EPOLL	1
+
+/*
+ * Per descriptor state, indexed by fd.  A generation counter avoids having
+ * to clear the results of every descriptor for each wait.
+ */
+struct poller_fd {
+	int	want;		/* POLLER_* set by poller_set() */
+	int	have;		/* POLLER_* registered with the kernel */
+	int	changed;	/* on the changed list */
+	int	always;		/* not pollable (regular file), always ready */
+	u_int	ready_gen;	/* wait that produced 'ready' */
+	int	ready;		/* POLLER_* reported by the last wait */
+	int	slot;		/* index in the active list or -1 */
+};
+
+struct poller {
+	int	backend;
+	int	epfd;
+	u_int	wait_gen;	/* last completed wait */
+	struct poller_fd *fds;
+	int	nfds;
+	int	*active;	/* fds registered with the kernel */
+	u_int	nactive;
+	u_int	active_alloc;
+	u_int	nalways;	/* active fds that are always ready */
+	int	*changed;	/* fds whose interest changed since the wait */
+	u_int	nchanged;
+	u_int	changed_alloc;
+	int	*readyl;	/* fds reported ready by the last wait */
+	u_int	nready;
+	u_int	ready_alloc;
+	struct pollfd *pfd;	/* poll backend, parallel to 'active' */
+#ifdef HAVE_EPOLL
+	struct epoll_event *events;
+	u_int	nevents;
+#endif
+};
+
+struct poller *
+poller_new(void)
+{
+	struct poller *p;
+
+	p = xcalloc(1, sizeof(*p));
+	p->backend = POLLER_BACKEND_POLL;
+	p->epfd = -1;
+	p->wait_gen = 1;
+#ifdef HAVE_EPOLL
+	if ((p->epfd = epoll_create(64)) == -1)
+		debug("%s: epoll_create: %s", __func__, strerror(errno));
+	else {
+		fcntl(p->epfd, F_SETFD, FD_CLOEXEC);
+		p->backend = POLLER_BACKEND_EPOLL;
+	}
+#endif
+	debug2("%s: using %s", __func__, poller_backend(p));
+	return p;
+}
+
+void
+poller_free(struct poller *p)
+{
+	if (p == NULL)
+		return;
+	if (p->epfd != -1)
+		close(p->epfd);
+	free(p->fds);
+	free(p->active);
+	free(p->changed);
+	free(p->readyl);
+	free(p->pfd);
+#ifdef HAVE_EPOLL
+	free(p->events);
+#endif
+	free(p);
+}
+
+const char *
+poller_backend(struct poller *p)
+{
+	return p->backend == POLLER_BACKEND_EPOLL ? "epoll" : "poll";
+}
+
+static struct poller_fd *
+poller_fd(struct poller *p, int fd)
+{
+	int i, n;
+
+	if (fd >= p->nfds) {
+		n = MAX(fd + 1, p->nfds * 2);
+		n = MAX(n, 64);
+		p->fds = xrealloc(p->fds, n, sizeof(*p->fds));
+		memset(p->fds + p->nfds, 0, (n - p->nfds) * sizeof(*p->fds));
+		for (i = p->nfds; i < n; i++)
+			p->fds[i].slot = -1;
+		p->nfds = n;
+	}
+	return &p->fds[fd];
+}
+
+/* Append 'fd' to a list of descriptors, growing it as needed. */
+static void
+poller_list_add(int **list, u_int *n, u_int *alloc, int fd)
+{
+	if (*n == *alloc) {
+		*alloc = MAX(64, *alloc * 2);
+		*list = xrealloc(*list, *alloc, sizeof(int));
+	}
+	(*list)[(*n)++] = fd;
+}
+
+static void
+poller_activate(struct poller *p, int fd, struct poller_fd *f)
+{
+	if (f->slot != -1)
+		return;
+	if (p->nactive == p->active_alloc) {
+		p->active_alloc = MAX(64, p->active_alloc * 2);
+		p->active = xrealloc(p->active, p->active_alloc, sizeof(int));
+		if (p->backend == POLLER_BACKEND_POLL)
+			p->pfd = xrealloc(p->pfd, p->active_alloc,
+			    sizeof(*p->pfd));
+	}
+	f->slot = p->nactive;
+	p->active[p->nactive++] = fd;
+	if (p->backend == POLLER_BACKEND_POLL) {
+		p->pfd[f->slot].fd = fd;
+		p->pfd[f->slot].events = 0;
+		p->pfd[f->slot].revents = 0;
+	}
+}
+
+static void
+poller_deactivate(struct poller *p, struct poller_fd *f)
+{
+	int last;
+
+	if (f->slot == -1)
+		return;
+	if (f->always)
+		p->nalways--;
+	f->always = 0;
+	last = p->active[--p->nactive];
+	p->active[f->slot] = last;
+	if (p->backend == POLLER_BACKEND_POLL)
+		p->pfd[f->slot] = p->pfd[p->nactive];
+	p->fds[last].slot = f->slot;
+	f->slot = -1;
+}
+
+/*
+ * Set the interest in 'fd' to 'events' (0 for none) until it is set again.
+ * The kernel only hears about it at the next wait, and only if it differs
+ * from what is registered.
+ */
+void
+poller_set(struct poller *p, int fd, int events)
+{
+	struct poller_fd *f;
+
+	if (fd < 0)
+		return;
+	f = poller_fd(p, fd);
+	if (f->want == events)
+		return;
+	f->want = events;
+	if (!f->changed) {
+		f->changed = 1;
+		poller_list_add(&p->changed, &p->nchanged, &p->changed_alloc,
+		    fd);
+	}
+}
+
+#ifdef HAVE_EPOLL
+static void
+poller_epoll_ctl(struct poller *p, int fd, struct poller_fd *f, int want)
+{
+	struct epoll_event ev;
+	int op;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if (want & POLLER_READ)
+		ev.events |= EPOLLIN;
+	if (want & POLLER_WRITE)
+		ev.events |= EPOLLOUT;
+	if (want == 0)
+		op = EPOLL_CTL_DEL;
+	else if (f->have == 0)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+	if (epoll_ctl(p->epfd, op, fd, &ev) == 0)
+		return;
+	/* the kernel may have dropped or kept the fd behind our back */
+	if (op == EPOLL_CTL_ADD && errno == EEXIST)
+		op = EPOLL_CTL_MOD;
+	else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+		op = EPOLL_CTL_ADD;
+	else if (op == EPOLL_CTL_ADD && errno == EPERM) {
+		/* regular files are always ready, as with select() */
+		f->always = 1;
+		p->nalways++;
+		return;
+	} else {
+		if (op != EPOLL_CTL_DEL)
+			error("%s: epoll_ctl fd %d: %s", __func__, fd,
+			    strerror(errno));
+		return;
+	}
+	if (epoll_ctl(p->epfd, op, fd, &ev) == -1)
+		error("%s: epoll_ctl fd %d: %s", __func__, fd, strerror(errno));
+}
+#endif
+
+/* Drop a descriptor that is about to be closed. */
+void
+poller_forget(struct poller *p, int fd)
+{
+	struct poller_fd *f;
+
+	if (p == NULL || fd < 0 || fd >= p->nfds)
+		return;
+	f = &p->fds[fd];
+#ifdef HAVE_EPOLL
+	if (p->backend == POLLER_BACKEND_EPOLL && f->have != 0 && !f->always)
+		poller_epoll_ctl(p, fd, f, 0);
+#endif
+	poller_deactivate(p, f);
+	/* a stale entry on the changed list is skipped */
+	f->ready_gen = 0;
+	f->want = f->have = f->changed = f->ready = 0;
+}
+
+/* Forget the results of the last wait. */
+void
+poller_clear(struct poller *p)
+{
+	p->wait_gen++;
+	p->nready = 0;
+}
+
+static void
+poller_result(struct poller *p, int fd, int events)
+{
+	struct poller_fd *f;
+
+	if (fd < 0 || fd >= p->nfds)
+		return;
+	f = &p->fds[fd];
+	if ((events & f->have) == 0)
+		return;
+	if (f->ready_gen != p->wait_gen) {
+		f->ready_gen = p->wait_gen;
+		f->ready = 0;
+		poller_list_add(&p->readyl, &p->nready, &p->ready_alloc, fd);
+	}
+	f->ready |= events & f->have;
+}
+
+/* Pass the interest changed since the last wait to the kernel. */
+static void
+poller_sync(struct poller *p)
+{
+	struct poller_fd *f;
+	u_int i;
+	int fd;
+
+	for (i = 0; i < p->nchanged; i++) {
+		fd = p->changed[i];
+		f = &p->fds[fd];
+		if (!f->changed)
+			continue;
+		f->changed = 0;
+		if (f->want == f->have)
+			continue;
+#ifdef HAVE_EPOLL
+		if (p->backend == POLLER_BACKEND_EPOLL && !f->always)
+			poller_epoll_ctl(p, fd, f, f->want);
+#endif
+		f->have = f->want;
+		if (f->have == 0) {
+			poller_deactivate(p, f);
+			continue;
+		}
+		poller_activate(p, fd, f);
+		if (p->backend == POLLER_BACKEND_POLL) {
+			p->pfd[f->slot].events = 0;
+			if (f->have & POLLER_READ)
+				p->pfd[f->slot].events |= POLLIN;
+			if (f->have & POLLER_WRITE)
+				p->pfd[f->slot].events |= POLLOUT;
+		}
+	}
+	p->nchanged = 0;
+}
+
+/*
+ * Pass the changed interest to the kernel and wait up to 'timeout_ms'
+ * milliseconds (-1 = infinite).  Returns the number of ready descriptors,
+ * or -1 with errno set.
+ */
+int
+poller_wait(struct poller *p, int timeout_ms)
+{
+	struct poller_fd *f;
+	u_int i;
+	int ret, ev;
+
+	poller_sync(p);
+	p->wait_gen++;
+	p->nready = 0;
+	if (p->nalways > 0)
+		timeout_ms = 0;
+
+	if (p->backend == POLLER_BACKEND_POLL) {
+		if ((ret = poll(p->pfd, p->nactive, timeout_ms)) == -1)
+			return -1;
+		for (i = 0; i < p->nactive && ret > 0; i++) {
+			if (p->pfd[i].revents == 0)
+				continue;
+			ev = 0;
+			if (p->pfd[i].revents & (POLLIN|POLLHUP|POLLERR|POLLNVAL))
+				ev |= POLLER_READ;
+			if (p->pfd[i].revents & (POLLOUT|POLLHUP|POLLERR|POLLNVAL))
+				ev |= POLLER_WRITE;
+			poller_result(p, p->pfd[i].fd, ev);
+		}
+	}
+#ifdef HAVE_EPOLL
+	else {
+		if (p->nevents < p->nactive || p->events == NULL) {
+			p->nevents = MAX(64, p->nactive);
+			p->events = xrealloc(p->events, p->nevents,
+			    sizeof(*p->events));
+		}
+		if ((ret = epoll_wait(p->epfd, p->events, p->nevents,
+		    timeout_ms)) == -1)
+			return -1;
+		for (i = 0; i < (u_int)ret; i++) {
+			ev = 0;
+			if (p->events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+				ev |= POLLER_READ;
+			if (p->events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR))
+				ev |= POLLER_WRITE;
+			poller_result(p, p->events[i].data.fd, ev);
+		}
+	}
+#endif
+	if (p->nalways > 0) {
+		for (i = 0; i < p->nactive; i++) {
+			f = &p->fds[p->active[i]];
+			if (f->always) {
+				poller_result(p, p->active[i], f->have);
+				ret++;
+			}
+		}
+	}
+	return ret;
+}
+
+/* Returns true if 'fd' was reported ready for any of 'events'. */
+int
+poller_ready(struct poller *p, int fd, int events)
+{
+	struct poller_fd *f;
+
+	if (fd < 0 || fd >= p->nfds)
+		return 0;
+	f = &p->fds[fd];
+	return f->ready_gen == p->wait_gen && (f->ready & events) != 0;
+}
+
+/*
+ * Walk the descriptors reported ready by the last wait and not forgotten
+ * since: returns the next one after position '*ip', which must start at 0,
+ * or -1 at the end.
+ */
+int
+poller_next_ready(struct poller *p, u_int *ip)
+{
+	int fd;
+
+	while (*ip < p->nready) {
+		fd = p->readyl[(*ip)++];
+		if (poller_ready(p, fd, POLLER_READ|POLLER_WRITE))
+			return fd;
+	}
+	return -1;
+}
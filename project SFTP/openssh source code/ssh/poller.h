@@ -0,0 +1,50 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _POLLER_H
+#define _POLLER_H
+
+/*
+ * Descriptor readiness notification for the client and server main loops.
+ *
+ * Interest in a descriptor is set with poller_set() and stays registered
+ * until it is changed, so callers only need to call it when what they
+ * wait for changes; setting the same interest again is cheap.  Only the
+ * descriptors changed since the last wait are passed to the kernel.
+ * poller_wait() waits; until the next poller_wait() poller_ready() reports
+ * the result and poller_next_ready() walks the descriptors found ready.
+ * Descriptors must be dropped with poller_forget() before they are closed.
+ *
+ * Backends are epoll (level-triggered) where available and poll().
+ */
+
+#define POLLER_READ	0x01
+#define POLLER_WRITE	0x02
+
+struct poller;
+
+struct poller	*poller_new(void);
+void		 poller_free(struct poller *);
+const char	*poller_backend(struct poller *);
+void		 poller_set(struct poller *, int, int);
+void		 poller_forget(struct poller *, int);
+void		 poller_clear(struct poller *);
+int		 poller_wait(struct poller *, int);
+int		 poller_ready(struct poller *, int, int);
+int		 poller_next_ready(struct poller *, u_int *);
+
+#endif /* _POLLER_H */
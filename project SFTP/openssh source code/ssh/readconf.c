@@ -40,6 +40,7 @@
 #include "misc.h"
 #include "kex.h"
 #include "mac.h"
+#include "channels.h"
 
 /* Format of the configuration file:
 
@@ -130,7 +131,7 @@ typedef enum {
 	oHashKnownHosts,
 	oTunnel, oTunnelDevice, oLocalCommand, oPermitLocalCommand,
 	oVisualHostKey, oUseRoaming, oZeroKnowledgePasswordAuthentication,
-	oKexAlgorithms, oIPQoS, oRequestTTY,
+	oKexAlgorithms, oIPQoS, oRequestTTY, oChannelWindowBudget,
 	oDeprecated, oUnsupported
 } OpCodes;
 
@@ -242,6 +243,7 @@ static struct {
 	{ "kexalgorithms", oKexAlgorithms },
 	{ "ipqos", oIPQoS },
 	{ "requesttty", oRequestTTY },
+	{ "channelwindowbudget", oChannelWindowBudget },
 
 	{ NULL, oBadOption }
 };
@@ -1039,6 +1041,18 @@ parse_int:
 			*intptr = value;
 		break;
 
+	case oChannelWindowBudget:
+		arg = strdelim(&s);
+		if (!arg || *arg == '\0')
+			fatal("%.200s line %d: Missing argument.",
+			    filename, linenum);
+		if ((val64 = convsize(arg)) == -1)
+			fatal("%.200s line %d: invalid size.",
+			    filename, linenum);
+		if (*activep && options->channel_window_budget == -1)
+			options->channel_window_budget = val64;
+		break;
+
 	case oDeprecated:
 		debug("%s line %d: Deprecated option \"%s\"",
 		    filename, linenum, keyword);
@@ -1198,6 +1212,7 @@ initialize_options(Options * options)
 	options->ip_qos_interactive = -1;
 	options->ip_qos_bulk = -1;
 	options->request_tty = -1;
+	options->channel_window_budget = -1;
 }
 
 /*
@@ -1361,6 +1376,8 @@ fill_default_options(Options * options)
 		options->ip_qos_bulk = IPTOS_THROUGHPUT;
 	if (options->request_tty == -1)
 		options->request_tty = REQUEST_TTY_AUTO;
+	if (options->channel_window_budget == -1)
+		options->channel_window_budget = CHAN_WINDOW_BUDGET_DEFAULT;
 	/* options->local_command should not be set by default */
 	/* options->proxy_command should not be set by default */
 	/* options->user will be set in the main program if appropriate */
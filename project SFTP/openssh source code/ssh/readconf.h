@@ -135,6 +135,8 @@ typedef struct {
 	int	use_roaming;
 
 	int	request_tty;
+
+	int64_t	channel_window_budget;
 }       Options;
 
 #define SSHCTL_MASTER_NO	0
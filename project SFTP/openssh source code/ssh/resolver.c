@@ -0,0 +1,380 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "misc.h"
+#include "resolver.h"
+
+#define RESOLVER_THREADS	4
+#define RESOLVER_QUEUE_MAX	64	/* lookups queued or running */
+#define RESOLVER_CACHE_SIZE	64
+#define RESOLVER_CACHE_TTL	60	/* seconds, getaddrinfo has no TTL */
+#define RESOLVER_CACHE_NEG_TTL	10	/* for failed lookups */
+
+#define RESOLVER_PENDING	0
+#define RESOLVER_RUNNING	1
+#define RESOLVER_DONE		2
+
+struct resolver_req {
+	TAILQ_ENTRY(resolver_req) entry;
+	char	*host;
+	char	*port;
+	struct addrinfo hints;
+	int	state;			/* RESOLVER_* */
+	int	gaierr;
+	struct addrinfo *res;
+	resolver_done_fn *cb;		/* NULL once cancelled */
+	void	*ctx;
+};
+TAILQ_HEAD(resolver_queue, resolver_req);
+
+struct resolver_cache_entry {
+	char	*host;
+	char	*port;
+	int	family;
+	int	socktype;
+	int	flags;
+	int	gaierr;
+	struct addrinfo *res;
+	time_t	expires;
+};
+
+/* shared with the workers, protected by resolver_lock */
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_cond = PTHREAD_COND_INITIALIZER;
+static struct resolver_queue resolver_pending =
+    TAILQ_HEAD_INITIALIZER(resolver_pending);
+static struct resolver_queue resolver_done =
+    TAILQ_HEAD_INITIALIZER(resolver_done);
+static u_int resolver_nqueued = 0;
+
+/* main thread only */
+static int resolver_pipe[2] = { -1, -1 };
+static pid_t resolver_pid = -1;
+static struct resolver_cache_entry resolver_cache[RESOLVER_CACHE_SIZE];
+
+/* Copy an addrinfo list into memory released by resolver_free(). */
+static struct addrinfo *
+resolver_copy(const struct addrinfo *ai)
+{
+	struct addrinfo *head = NULL, **tail = &head, *n;
+
+	for (; ai != NULL; ai = ai->ai_next) {
+		n = xcalloc(1, sizeof(*n) + ai->ai_addrlen);
+		*n = *ai;
+		n->ai_addr = (struct sockaddr *)(n + 1);
+		memcpy(n->ai_addr, ai->ai_addr, ai->ai_addrlen);
+		n->ai_canonname = ai->ai_canonname == NULL ? NULL :
+		    xstrdup(ai->ai_canonname);
+		n->ai_next = NULL;
+		*tail = n;
+		tail = &n->ai_next;
+	}
+	return head;
+}
+
+void
+resolver_free(struct addrinfo *ai)
+{
+	struct addrinfo *next;
+
+	for (; ai != NULL; ai = next) {
+		next = ai->ai_next;
+		free(ai->ai_canonname);
+		free(ai);
+	}
+}
+
+static void
+resolver_req_free(struct resolver_req *req)
+{
+	free(req->host);
+	free(req->port);
+	resolver_free(req->res);
+	free(req);
+}
+
+static struct resolver_cache_entry *
+resolver_cache_find(const char *host, const char *port,
+    const struct addrinfo *hints)
+{
+	struct resolver_cache_entry *e;
+	time_t now = monotime();
+	u_int i;
+
+	for (i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+		e = &resolver_cache[i];
+		if (e->host == NULL || e->expires <= now)
+			continue;
+		if (strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0 &&
+		    e->family == hints->ai_family &&
+		    e->socktype == hints->ai_socktype &&
+		    e->flags == hints->ai_flags)
+			return e;
+	}
+	return NULL;
+}
+
+/* Remember a result, replacing the entry closest to expiry. */
+static void
+resolver_cache_add(const struct resolver_req *req)
+{
+	struct resolver_cache_entry *e, *victim = &resolver_cache[0];
+	u_int i;
+
+	if (resolver_cache_find(req->host, req->port, &req->hints) != NULL)
+		return;
+	/* only definite answers are worth keeping */
+	if (req->gaierr != 0 && req->gaierr != EAI_NONAME)
+		return;
+	for (i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+		e = &resolver_cache[i];
+		if (e->host == NULL) {
+			victim = e;
+			break;
+		}
+		if (e->expires < victim->expires)
+			victim = e;
+	}
+	free(victim->host);
+	free(victim->port);
+	resolver_free(victim->res);
+	victim->host = xstrdup(req->host);
+	victim->port = xstrdup(req->port);
+	victim->family = req->hints.ai_family;
+	victim->socktype = req->hints.ai_socktype;
+	victim->flags = req->hints.ai_flags;
+	victim->gaierr = req->gaierr;
+	victim->res = resolver_copy(req->res);
+	victim->expires = monotime() + (req->gaierr == 0 ?
+	    RESOLVER_CACHE_TTL : RESOLVER_CACHE_NEG_TTL);
+}
+
+/*
+ * Answer without blocking if possible: numeric addresses and cached
+ * results.  Returns 1 with *resp and *gaierrp filled in, or 0 if the
+ * lookup has to go through resolver_start().
+ */
+int
+resolver_try(const char *host, const char *port,
+    const struct addrinfo *hints, struct addrinfo **resp, int *gaierrp)
+{
+	struct resolver_cache_entry *e;
+	struct addrinfo numeric, *res;
+
+	*resp = NULL;
+	numeric = *hints;
+	numeric.ai_flags |= AI_NUMERICHOST;
+	if ((*gaierrp = getaddrinfo(host, port, &numeric, &res)) == 0) {
+		*resp = resolver_copy(res);
+		freeaddrinfo(res);
+		return 1;
+	}
+	if ((e = resolver_cache_find(host, port, hints)) != NULL) {
+		debug3("%s: cached %s port %s", __func__, host, port);
+		*gaierrp = e->gaierr;
+		*resp = resolver_copy(e->res);
+		return 1;
+	}
+	return 0;
+}
+
+static void *
+resolver_worker(void *arg)
+{
+	struct resolver_req *req;
+	struct addrinfo *res;
+	char c = 0;
+
+	pthread_mutex_lock(&resolver_lock);
+	for (;;) {
+		while ((req = TAILQ_FIRST(&resolver_pending)) == NULL)
+			pthread_cond_wait(&resolver_cond, &resolver_lock);
+		TAILQ_REMOVE(&resolver_pending, req, entry);
+		req->state = RESOLVER_RUNNING;
+		pthread_mutex_unlock(&resolver_lock);
+
+		res = NULL;
+		if ((req->gaierr = getaddrinfo(req->host, req->port,
+		    &req->hints, &res)) == 0) {
+			req->res = resolver_copy(res);
+			freeaddrinfo(res);
+		}
+
+		pthread_mutex_lock(&resolver_lock);
+		req->state = RESOLVER_DONE;
+		TAILQ_INSERT_TAIL(&resolver_done, req, entry);
+		/* a full pipe already guarantees a wakeup */
+		(void)write(resolver_pipe[1], &c, 1);
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+/* Start the worker threads on first use. */
+static int
+resolver_init(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t all, saved;
+	int i, n = 0;
+
+	if (resolver_pid == getpid())
+		return 0;
+	if (resolver_pid != -1) {
+		error("%s: resolver was started by another process", __func__);
+		return -1;
+	}
+	if (pipe(resolver_pipe) == -1) {
+		error("%s: pipe: %s", __func__, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(resolver_pipe[i], F_SETFD, FD_CLOEXEC);
+		set_nonblock(resolver_pipe[i]);
+	}
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < RESOLVER_THREADS; i++) {
+		if ((errno = pthread_create(&tid, &attr, resolver_worker,
+		    NULL)) != 0)
+			error("%s: pthread_create: %s", __func__,
+			    strerror(errno));
+		else
+			n++;
+	}
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (n == 0) {
+		close(resolver_pipe[0]);
+		close(resolver_pipe[1]);
+		resolver_pipe[0] = resolver_pipe[1] = -1;
+		return -1;
+	}
+	resolver_pid = getpid();
+	debug2("%s: %d resolver threads", __func__, n);
+	return 0;
+}
+
+/*
+ * Queue a lookup.  'cb' is called from resolver_dispatch() with the
+ * getaddrinfo() error and the result.  Returns NULL if the queue is full
+ * or the resolver could not be started.
+ */
+struct resolver_req *
+resolver_start(const char *host, const char *port,
+    const struct addrinfo *hints, resolver_done_fn *cb, void *ctx)
+{
+	struct resolver_req *req;
+
+	if (resolver_init() != 0)
+		return NULL;
+	pthread_mutex_lock(&resolver_lock);
+	if (resolver_nqueued >= RESOLVER_QUEUE_MAX) {
+		pthread_mutex_unlock(&resolver_lock);
+		logit("%s: too many pending lookups, refusing %.100s",
+		    __func__, host);
+		return NULL;
+	}
+	req = xcalloc(1, sizeof(*req));
+	req->host = xstrdup(host);
+	req->port = xstrdup(port);
+	req->hints = *hints;
+	req->state = RESOLVER_PENDING;
+	req->cb = cb;
+	req->ctx = ctx;
+	TAILQ_INSERT_TAIL(&resolver_pending, req, entry);
+	resolver_nqueued++;
+	pthread_cond_signal(&resolver_cond);
+	pthread_mutex_unlock(&resolver_lock);
+	debug3("%s: %s port %s", __func__, host, port);
+	return req;
+}
+
+/* Forget a lookup; its callback will not be called. */
+void
+resolver_cancel(struct resolver_req *req)
+{
+	pthread_mutex_lock(&resolver_lock);
+	if (req->state == RESOLVER_PENDING) {
+		TAILQ_REMOVE(&resolver_pending, req, entry);
+		resolver_nqueued--;
+		pthread_mutex_unlock(&resolver_lock);
+		resolver_req_free(req);
+		return;
+	}
+	/* running or done: resolver_dispatch() frees it */
+	req->cb = NULL;
+	pthread_mutex_unlock(&resolver_lock);
+}
+
+int
+resolver_fd(void)
+{
+	return resolver_pid == getpid() ? resolver_pipe[0] : -1;
+}
+
+/* Run the callbacks of finished lookups. */
+void
+resolver_dispatch(void)
+{
+	struct resolver_queue done;
+	struct resolver_req *req;
+	char buf[64];
+
+	if (resolver_fd() == -1)
+		return;
+	while (read(resolver_pipe[0], buf, sizeof(buf)) > 0)
+		;
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&resolver_lock);
+	while ((req = TAILQ_FIRST(&resolver_done)) != NULL) {
+		TAILQ_REMOVE(&resolver_done, req, entry);
+		TAILQ_INSERT_TAIL(&done, req, entry);
+		resolver_nqueued--;
+	}
+	pthread_mutex_unlock(&resolver_lock);
+
+	while ((req = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, req, entry);
+		resolver_cache_add(req);
+		if (req->cb != NULL) {
+			req->cb(req->gaierr, req->res, req->ctx);
+			req->res = NULL;	/* passed on */
+		}
+		resolver_req_free(req);
+	}
+}
@@ -0,0 +1,47 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+/*
+ * Asynchronous getaddrinfo() for the main loops.
+ *
+ * resolver_try() answers at once for numeric addresses and from a small
+ * cache of recent results.  Otherwise resolver_start() queues the lookup
+ * for a pool of threads; when resolver_fd() becomes readable the main
+ * loop calls resolver_dispatch(), which runs the callbacks of finished
+ * lookups.  Results are owned by the callee and must be released with
+ * resolver_free(), not freeaddrinfo().  The pool is not carried across
+ * fork(), so only the process that started it may use it.
+ */
+
+struct addrinfo;
+struct resolver_req;
+
+typedef void resolver_done_fn(int, struct addrinfo *, void *);
+
+int	 resolver_try(const char *, const char *, const struct addrinfo *,
+	    struct addrinfo **, int *);
+struct resolver_req *resolver_start(const char *, const char *,
+	    const struct addrinfo *, resolver_done_fn *, void *);
+void	 resolver_cancel(struct resolver_req *);
+int	 resolver_fd(void);
+void	 resolver_dispatch(void);
+void	 resolver_free(struct addrinfo *);
+
+#endif /* _RESOLVER_H */
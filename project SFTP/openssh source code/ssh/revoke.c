@@ -0,0 +1,445 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+#include "atomicio.h"
+#include "sshbuf.h"
+#include "key.h"
+#include "log.h"
+#include "misc.h"
+#include "err.h"
+#include "revoke.h"
+
+#define REVOKE_FP_LEN	32	/* SHA256 */
+#define REVOKE_HDR_LEN	32	/* magic, version, nkeys, ncas, nranges, pad */
+#define REVOKE_CA_LEN	(REVOKE_FP_LEN + 8)	/* fp, first range, count */
+#define REVOKE_RANGE_LEN 16	/* first and last serial */
+
+struct revoke_fp {
+	u_char			fp[REVOKE_FP_LEN];
+};
+
+struct revoke_range {
+	u_int64_t		lo, hi;
+};
+
+struct revoke_ca {
+	u_char			fp[REVOKE_FP_LEN];
+	struct revoke_range	*ranges;
+	u_int			nranges;
+};
+
+struct revoke_list {
+	struct revoke_fp	*keys;
+	u_int			nkeys, akeys;
+	struct revoke_ca	*cas;
+	u_int			ncas;
+};
+
+/* The list last used by revoke_check(), reloaded when the file changes */
+static struct {
+	char		*path;
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size;
+	time_t		 mtime;
+	int		 compiled;
+	u_char		*map;
+	size_t		 len;
+	u_int32_t	 nkeys, ncas, nranges;
+} revoke_cache;
+
+static int
+revoke_fingerprint(struct sshkey *key, u_char *fp)
+{
+	u_char *raw;
+	size_t len;
+
+	if ((raw = sshkey_fingerprint_raw(key, SSH_FP_SHA256, &len)) == NULL)
+		return SSH_ERR_LIBCRYPTO_ERROR;
+	if (len != REVOKE_FP_LEN) {
+		free(raw);
+		return SSH_ERR_INTERNAL_ERROR;
+	}
+	memcpy(fp, raw, REVOKE_FP_LEN);
+	free(raw);
+	return 0;
+}
+
+struct revoke_list *
+revoke_list_new(void)
+{
+	return xcalloc(1, sizeof(struct revoke_list));
+}
+
+void
+revoke_list_free(struct revoke_list *rl)
+{
+	u_int i;
+
+	if (rl == NULL)
+		return;
+	for (i = 0; i < rl->ncas; i++)
+		free(rl->cas[i].ranges);
+	free(rl->cas);
+	free(rl->keys);
+	free(rl);
+}
+
+/* Revoke 'key'; certificates are revoked by their key. */
+int
+revoke_list_add_key(struct revoke_list *rl, struct sshkey *key)
+{
+	int r;
+
+	if (rl->nkeys == rl->akeys) {
+		rl->akeys = rl->akeys == 0 ? 64 : rl->akeys * 2;
+		rl->keys = xrealloc(rl->keys, rl->akeys, sizeof(*rl->keys));
+	}
+	if ((r = revoke_fingerprint(key, rl->keys[rl->nkeys].fp)) != 0)
+		return r;
+	rl->nkeys++;
+	return 0;
+}
+
+/* Revoke the certificates signed by 'ca' with serials 'lo' to 'hi'. */
+int
+revoke_list_add_serials(struct revoke_list *rl, struct sshkey *ca,
+    u_int64_t lo, u_int64_t hi)
+{
+	struct revoke_ca *c;
+	u_char fp[REVOKE_FP_LEN];
+	u_int i;
+	int r;
+
+	if (lo > hi)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if ((r = revoke_fingerprint(ca, fp)) != 0)
+		return r;
+	for (i = 0; i < rl->ncas; i++)
+		if (memcmp(rl->cas[i].fp, fp, sizeof(fp)) == 0)
+			break;
+	if (i == rl->ncas) {
+		rl->cas = xrealloc(rl->cas, rl->ncas + 1, sizeof(*rl->cas));
+		c = &rl->cas[rl->ncas++];
+		memset(c, 0, sizeof(*c));
+		memcpy(c->fp, fp, sizeof(fp));
+	}
+	c = &rl->cas[i];
+	c->ranges = xrealloc(c->ranges, c->nranges + 1, sizeof(*c->ranges));
+	c->ranges[c->nranges].lo = lo;
+	c->ranges[c->nranges].hi = hi;
+	c->nranges++;
+	return 0;
+}
+
+static int
+revoke_fp_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, REVOKE_FP_LEN);
+}
+
+static int
+revoke_range_cmp(const void *a, const void *b)
+{
+	const struct revoke_range *ra = a, *rb = b;
+
+	if (ra->lo != rb->lo)
+		return ra->lo < rb->lo ? -1 : 1;
+	return 0;
+}
+
+/* Sort the ranges of 'c' and merge those that overlap or touch */
+static void
+revoke_ca_merge(struct revoke_ca *c)
+{
+	u_int i, n;
+
+	qsort(c->ranges, c->nranges, sizeof(*c->ranges), revoke_range_cmp);
+	for (i = n = 0; i < c->nranges; i++) {
+		if (n > 0 && (c->ranges[n - 1].hi == ~(u_int64_t)0 ||
+		    c->ranges[i].lo <= c->ranges[n - 1].hi + 1)) {
+			if (c->ranges[i].hi > c->ranges[n - 1].hi)
+				c->ranges[n - 1].hi = c->ranges[i].hi;
+			continue;
+		}
+		c->ranges[n++] = c->ranges[i];
+	}
+	c->nranges = n;
+}
+
+/* Sort 'rl' and replace 'path' with it. */
+int
+revoke_list_write(struct revoke_list *rl, const char *path)
+{
+	struct sshbuf *b;
+	char *tmp = NULL;
+	u_int i, j, n, nranges = 0;
+	int fd = -1, r;
+
+	qsort(rl->keys, rl->nkeys, sizeof(*rl->keys), revoke_fp_cmp);
+	for (i = n = 0; i < rl->nkeys; i++) {
+		if (n > 0 && memcmp(rl->keys[n - 1].fp, rl->keys[i].fp,
+		    REVOKE_FP_LEN) == 0)
+			continue;
+		rl->keys[n++] = rl->keys[i];
+	}
+	rl->nkeys = n;
+	qsort(rl->cas, rl->ncas, sizeof(*rl->cas), revoke_fp_cmp);
+	for (i = 0; i < rl->ncas; i++) {
+		revoke_ca_merge(&rl->cas[i]);
+		nranges += rl->cas[i].nranges;
+	}
+
+	if ((b = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = sshbuf_put(b, REVOKE_MAGIC, sizeof(REVOKE_MAGIC) - 1)) != 0 ||
+	    (r = sshbuf_put_u32(b, REVOKE_VERSION)) != 0 ||
+	    (r = sshbuf_put_u32(b, rl->nkeys)) != 0 ||
+	    (r = sshbuf_put_u32(b, rl->ncas)) != 0 ||
+	    (r = sshbuf_put_u32(b, nranges)) != 0 ||
+	    (r = sshbuf_put_u64(b, 0)) != 0 ||
+	    (r = sshbuf_put(b, rl->keys, rl->nkeys * sizeof(*rl->keys))) != 0)
+		goto out;
+	for (i = n = 0; i < rl->ncas; i++) {
+		if ((r = sshbuf_put(b, rl->cas[i].fp, REVOKE_FP_LEN)) != 0 ||
+		    (r = sshbuf_put_u32(b, n)) != 0 ||
+		    (r = sshbuf_put_u32(b, rl->cas[i].nranges)) != 0)
+			goto out;
+		n += rl->cas[i].nranges;
+	}
+	for (i = 0; i < rl->ncas; i++) {
+		for (j = 0; j < rl->cas[i].nranges; j++) {
+			if ((r = sshbuf_put_u64(b,
+			    rl->cas[i].ranges[j].lo)) != 0 ||
+			    (r = sshbuf_put_u64(b,
+			    rl->cas[i].ranges[j].hi)) != 0)
+				goto out;
+		}
+	}
+
+	xasprintf(&tmp, "%s.XXXXXXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1 || fchmod(fd, 0644) == -1 ||
+	    atomicio(vwrite, fd, (u_char *)sshbuf_ptr(b),
+	    sshbuf_len(b)) != sshbuf_len(b) || close(fd) == -1) {
+		r = SSH_ERR_SYSTEM_ERROR;
+		goto out;
+	}
+	fd = -1;
+	if (rename(tmp, path) == -1) {
+		r = SSH_ERR_SYSTEM_ERROR;
+		goto out;
+	}
+	free(tmp);
+	tmp = NULL;
+	r = 0;
+ out:
+	if (fd != -1)
+		close(fd);
+	if (tmp != NULL) {
+		unlink(tmp);
+		free(tmp);
+	}
+	sshbuf_free(b);
+	return r;
+}
+
+static void
+revoke_unload(void)
+{
+	if (revoke_cache.map != NULL)
+		munmap(revoke_cache.map, revoke_cache.len);
+	free(revoke_cache.path);
+	memset(&revoke_cache, 0, sizeof(revoke_cache));
+}
+
+/* Map 'path' unless the cached copy is still current */
+static int
+revoke_load(const char *path)
+{
+	struct stat st;
+	u_char hdr[REVOKE_HDR_LEN];
+	u_int64_t need;
+	void *map;
+	int fd;
+
+	if (stat(path, &st) == -1)
+		return errno == ENOENT ?
+		    SSH_ERR_KEY_NOT_FOUND : SSH_ERR_SYSTEM_ERROR;
+	if (revoke_cache.path != NULL &&
+	    strcmp(revoke_cache.path, path) == 0 &&
+	    revoke_cache.dev == st.st_dev && revoke_cache.ino == st.st_ino &&
+	    revoke_cache.size == st.st_size &&
+	    revoke_cache.mtime == st.st_mtime)
+		return 0;
+
+	revoke_unload();
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return SSH_ERR_SYSTEM_ERROR;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return SSH_ERR_SYSTEM_ERROR;
+	}
+	if (st.st_size < REVOKE_HDR_LEN ||
+	    atomicio(read, fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr, REVOKE_MAGIC, sizeof(REVOKE_MAGIC) - 1) != 0)
+		goto done;	/* a list of public keys */
+
+	if (get_u32(hdr + 8) != REVOKE_VERSION) {
+		close(fd);
+		return SSH_ERR_INVALID_FORMAT;
+	}
+	need = REVOKE_HDR_LEN +
+	    (u_int64_t)get_u32(hdr + 12) * REVOKE_FP_LEN +
+	    (u_int64_t)get_u32(hdr + 16) * REVOKE_CA_LEN +
+	    (u_int64_t)get_u32(hdr + 20) * REVOKE_RANGE_LEN;
+	if (need != (u_int64_t)st.st_size) {
+		close(fd);
+		return SSH_ERR_INVALID_FORMAT;
+	}
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+	    fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return SSH_ERR_SYSTEM_ERROR;
+	}
+	revoke_cache.compiled = 1;
+	revoke_cache.map = map;
+	revoke_cache.len = st.st_size;
+	revoke_cache.nkeys = get_u32(hdr + 12);
+	revoke_cache.ncas = get_u32(hdr + 16);
+	revoke_cache.nranges = get_u32(hdr + 20);
+	debug("%s: %s: %u keys, %u CAs, %u serial ranges", __func__, path,
+	    revoke_cache.nkeys, revoke_cache.ncas, revoke_cache.nranges);
+ done:
+	close(fd);
+	revoke_cache.path = xstrdup(path);
+	revoke_cache.dev = st.st_dev;
+	revoke_cache.ino = st.st_ino;
+	revoke_cache.size = st.st_size;
+	revoke_cache.mtime = st.st_mtime;
+	return 0;
+}
+
+/* Binary search of 'n' records of 'len' bytes that start with a key fp */
+static const u_char *
+revoke_search(const u_char *tab, u_int n, size_t len, const u_char *fp)
+{
+	u_int lo = 0, hi = n, i;
+	int c;
+
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if ((c = memcmp(tab + i * len, fp, REVOKE_FP_LEN)) == 0)
+			return tab + i * len;
+		if (c < 0)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	return NULL;
+}
+
+static int
+revoke_key_listed(struct sshkey *key)
+{
+	u_char fp[REVOKE_FP_LEN];
+	int r;
+
+	if ((r = revoke_fingerprint(key, fp)) != 0)
+		return r;
+	if (revoke_search(revoke_cache.map + REVOKE_HDR_LEN,
+	    revoke_cache.nkeys, REVOKE_FP_LEN, fp) != NULL)
+		return 0;
+	return SSH_ERR_KEY_NOT_FOUND;
+}
+
+static int
+revoke_serial_listed(struct sshkey *key)
+{
+	const u_char *ca, *ranges;
+	u_char fp[REVOKE_FP_LEN];
+	u_int32_t first, count, lo, hi, i;
+	u_int64_t serial = key->cert->serial;
+	int r;
+
+	if ((r = revoke_fingerprint(key->cert->signature_key, fp)) != 0)
+		return r;
+	ca = revoke_search(revoke_cache.map + REVOKE_HDR_LEN +
+	    revoke_cache.nkeys * REVOKE_FP_LEN, revoke_cache.ncas,
+	    REVOKE_CA_LEN, fp);
+	if (ca == NULL)
+		return SSH_ERR_KEY_NOT_FOUND;
+	first = get_u32(ca + REVOKE_FP_LEN);
+	count = get_u32(ca + REVOKE_FP_LEN + 4);
+	if (first > revoke_cache.nranges ||
+	    count > revoke_cache.nranges - first)
+		return SSH_ERR_INVALID_FORMAT;
+	ranges = revoke_cache.map + REVOKE_HDR_LEN +
+	    revoke_cache.nkeys * REVOKE_FP_LEN +
+	    revoke_cache.ncas * REVOKE_CA_LEN +
+	    (size_t)first * REVOKE_RANGE_LEN;
+
+	/* last range starting at or below the serial */
+	for (lo = 0, hi = count; lo < hi; ) {
+		i = lo + (hi - lo) / 2;
+		if (get_u64(ranges + i * REVOKE_RANGE_LEN) <= serial)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	if (lo > 0 &&
+	    serial <= get_u64(ranges + (lo - 1) * REVOKE_RANGE_LEN + 8))
+		return 0;
+	return SSH_ERR_KEY_NOT_FOUND;
+}
+
+/*
+ * Checks 'key' against the revocation list 'path'.  Returns 0 if the key,
+ * its CA or its certificate serial is revoked and SSH_ERR_KEY_NOT_FOUND if
+ * not.  '*compiled' is cleared if 'path' is missing or not a compiled list,
+ * in which case the caller has to check it as a list of public keys.
+ */
+int
+revoke_check(const char *path, struct sshkey *key, int *compiled)
+{
+	int r;
+
+	*compiled = 0;
+	if ((r = revoke_load(path)) != 0)
+		return r;
+	if (!revoke_cache.compiled)
+		return SSH_ERR_KEY_NOT_FOUND;
+	*compiled = 1;
+	if ((r = revoke_key_listed(key)) != SSH_ERR_KEY_NOT_FOUND ||
+	    !sshkey_is_cert(key))
+		return r;
+	if ((r = revoke_key_listed(key->cert->signature_key)) !=
+	    SSH_ERR_KEY_NOT_FOUND)
+		return r;
+	return revoke_serial_listed(key);
+}
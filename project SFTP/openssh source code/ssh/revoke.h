@@ -0,0 +1,46 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _REVOKE_H
+#define _REVOKE_H
+
+/*
+ * Compiled revocation lists.
+ *
+ * A revocation list holds the SHA256 fingerprints of revoked keys and, per
+ * CA key, ranges of revoked certificate serial numbers, each table sorted
+ * so that a check is a few binary searches over the mapped file.  All
+ * numbers are stored in network byte order.  ssh-keygen -k writes them;
+ * RevokedKeys may name either one of these or a list of public keys.
+ */
+
+#define REVOKE_MAGIC		"SSHREVK1"
+#define REVOKE_VERSION		1
+
+struct sshkey;
+struct revoke_list;
+
+struct revoke_list *revoke_list_new(void);
+void	 revoke_list_free(struct revoke_list *);
+int	 revoke_list_add_key(struct revoke_list *, struct sshkey *);
+int	 revoke_list_add_serials(struct revoke_list *, struct sshkey *,
+	    u_int64_t, u_int64_t);
+int	 revoke_list_write(struct revoke_list *, const char *);
+
+int	 revoke_check(const char *, struct sshkey *, int *);
+
+#endif /* _REVOKE_H */
@@ -26,7 +26,6 @@ struct ssh;
 
 extern int roaming_enabled;
 extern int resume_in_progress;
-struct ssh;
 
 void	request_roaming(struct ssh *ssh);
 int	get_snd_buf_size(struct ssh *ssh);
@@ -41,8 +40,20 @@ size_t	roaming_atomicio(ssize_t (*)(int, void *, size_t), int, void *, size_t);
 u_int64_t	get_recv_bytes(void);
 u_int64_t	get_sent_bytes(void);
 void	roam_set_bytes(u_int64_t, u_int64_t);
-void	resend_bytes(int, u_int64_t *);
+int	resend_bytes(int, u_int64_t *);
 void	calculate_new_key(u_int64_t *, u_int64_t, u_int64_t);
 int	resume_kex(void);
+int	roaming_flush(struct ssh *);
+int	roaming_read_packet(struct ssh *, u_char *);
+
+/* server */
+void	roaming_server_listen(void);
+void	roaming_server_cleanup(void);
+int	roaming_server_fd(void);
+int	roaming_server_enable(struct ssh *, u_int);
+int	roaming_server_reply(struct ssh *);
+void	roaming_server_takeover(struct ssh *);
+int	roaming_server_resume_id(struct ssh *, u_int32_t *);
+int	roaming_server_pass(u_int32_t, int);
 
 #endif /* ROAMING */
@@ -17,11 +17,14 @@
 
 #include <sys/queue.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 
 #include <inttypes.h>
-#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <openssl/crypto.h>
@@ -47,6 +50,11 @@
 #include "sshconnect.h"
 #include "err.h"
 
+/* when the server does not tell */
+#define ROAMING_DEFAULT_GRACE	60
+/* longest pause between reconnection attempts */
+#define ROAMING_RETRY_MAX	16
+
 /* import */
 extern Options options;
 extern char *host;
@@ -57,6 +65,7 @@ static u_int32_t roaming_id;
 static u_int64_t cookie;
 static u_int64_t lastseenchall;
 static u_int64_t key1, key2, oldkey1, oldkey2;
+static u_int grace;		/* seconds the server keeps the session */
 
 void
 roaming_reply(struct ssh *ssh, int type, u_int32_t seq, void *ctxt)
@@ -75,9 +84,13 @@ roaming_reply(struct ssh *ssh, int type, u_int32_t seq, void *ctxt)
 	    (r = sshpkt_get_u64(ssh, &oldkey2)) != 0 ||
 	    (r = sshpkt_get_u32(ssh, &size)) != 0)
 		fatal("%s: %s", __func__, ssh_err(r));
+	/* newer servers say how long they keep the session */
+	if (sshpkt_get_u32(ssh, &grace) != 0 || grace == 0)
+		grace = ROAMING_DEFAULT_GRACE;
 	key1 = oldkey1;
 	key2 = oldkey2;
-	set_out_buffer_size(size + get_snd_buf_size(ssh));
+	set_out_buffer_size(MIN((size_t)size + get_snd_buf_size(ssh),
+	    MAX_ROAMBUF));
 	roaming_enabled = 1;
 }
 
@@ -151,15 +164,19 @@ resume_kex(void)
 	return 1;
 }
 
+/*
+ * Run the resume exchange on the new connection 'ssh'.  Returns 0 if the
+ * session continues, -1 if the connection failed and 1 if the server
+ * refused to resume.
+ */
 static int
-roaming_resume(void)
+roaming_resume(struct ssh *ssh)
 {
-	struct ssh *ssh = active_state;	/* XXX */
 	u_int64_t recv_bytes;
 	char *str = NULL, *kexlist = NULL, *c;
-	int r = 0, i, type;
+	int r = 0, i, ret = 1;
 	int timeout_ms = options.connection_timeout * 1000;
-	u_char first_kex_packet_follows, kex_cookie[KEX_COOKIE_LEN];
+	u_char type, first_kex_packet_follows, kex_cookie[KEX_COOKIE_LEN];
 
 	resume_in_progress = 1;
 
@@ -172,26 +189,28 @@ roaming_resume(void)
 	if ((r = sshpkt_start(ssh, SSH2_MSG_KEXINIT)) != 0 ||
 	    (r = sshpkt_put(ssh, kex_cookie, KEX_COOKIE_LEN)) != 0 ||
 	    (r = sshpkt_put_cstring(ssh, KEX_RESUME)) != 0)
-		goto fail;
+		fatal("%s: %s", __func__, ssh_err(r));
 	for (i = 1; i < PROPOSAL_MAX; i++) {
 		/* kex algorithm added so start with i=1 and not 0 */
 		/* Not used when we resume */
 		if ((r = sshpkt_put_cstring(ssh, "")) != 0)
-			goto fail;
+			fatal("%s: %s", __func__, ssh_err(r));
 	}
 	if ((r = sshpkt_put_u8(ssh, 1)) != 0 || /* first kex_packet follows */
 	    (r = sshpkt_put_u32(ssh, 0)) != 0 || /* reserved */
 	    (r = sshpkt_send(ssh)) != 0)
-		goto fail;
+		fatal("%s: %s", __func__, ssh_err(r));
 
 	/* Assume that resume@appgate.com will be accepted */
 	if ((r = sshpkt_start(ssh, SSH2_MSG_KEX_ROAMING_RESUME)) != 0 ||
 	    (r = sshpkt_put_u32(ssh, roaming_id)) != 0 ||
 	    (r = sshpkt_send(ssh)) != 0)
-		goto fail;
+		fatal("%s: %s", __func__, ssh_err(r));
 
 	/* Read the server's kexinit and check for resume@appgate.com */
-	if ((type = ssh_packet_read(ssh)) != SSH2_MSG_KEXINIT) {
+	if ((r = roaming_read_packet(ssh, &type)) != 0)
+		goto fail;
+	if (type != SSH2_MSG_KEXINIT) {
 		debug("expected kexinit on resume, got %d", type);
 		goto fail;
 	}
@@ -214,21 +233,27 @@ roaming_resume(void)
 		*c = 0;
 	if (first_kex_packet_follows && strcmp(kexlist, KEX_RESUME)) {
 		debug("server's kex guess (%s) was wrong, skipping", kexlist);
-		ssh_packet_read(ssh); /* Wrong guess - discard packet */
+		/* Wrong guess - discard packet */
+		if ((r = roaming_read_packet(ssh, &type)) != 0)
+			goto fail;
 	}
 
 	/*
 	 * Read the ROAMING_AUTH_REQUIRED challenge from the server and
 	 * send ROAMING_AUTH
 	 */
-	if ((type = ssh_packet_read(ssh)) != SSH2_MSG_KEX_ROAMING_AUTH_REQUIRED) {
+	if ((r = roaming_read_packet(ssh, &type)) != 0)
+		goto fail;
+	if (type != SSH2_MSG_KEX_ROAMING_AUTH_REQUIRED) {
 		debug("expected roaming_auth_required, got %d", type);
 		goto fail;
 	}
 	roaming_auth_required(ssh);
 
 	/* Read ROAMING_AUTH_OK from the server */
-	if ((type = ssh_packet_read(ssh)) != SSH2_MSG_KEX_ROAMING_AUTH_OK) {
+	if ((r = roaming_read_packet(ssh, &type)) != 0)
+		goto fail;
+	if (type != SSH2_MSG_KEX_ROAMING_AUTH_OK) {
 		debug("expected roaming_auth_ok, got %d", type);
 		goto fail;
 	}
@@ -237,69 +262,77 @@ roaming_resume(void)
 	recv_bytes = recv_bytes ^ oldkey2;
 
 	debug("Peer received %llu bytes", (unsigned long long)recv_bytes);
-	resend_bytes(ssh_packet_get_connection_out(ssh), &recv_bytes);
+	if (resend_bytes(ssh_packet_get_connection_out(ssh), &recv_bytes) != 0)
+		fatal("Needed to resend more data than in the cache");
 
 	resume_in_progress = 0;
-
-	session_resumed = 1; /* Tell clientloop */
-
+	if (kexlist)
+		xfree(kexlist);
 	return 0;
 
 fail:
-	if (r != 0)
-		fatal("%s: %s", __func__, ssh_err(r));
+	if (r != 0) {
+		debug("%s: %s", __func__, ssh_err(r));
+		/* try again if only the new connection broke */
+		if (r == SSH_ERR_SYSTEM_ERROR)
+			ret = -1;
+	}
+	resume_in_progress = 0;
 	if (kexlist)
 		xfree(kexlist);
-	if (ssh_packet_get_connection_in(ssh) ==
-	    ssh_packet_get_connection_out(ssh))
-		close(ssh_packet_get_connection_in(ssh));
-	else {
-		close(ssh_packet_get_connection_in(ssh));
-		close(ssh_packet_get_connection_out(ssh));
-	}
-	return 1;
+	return ret;
 }
 
+/*
+ * Called when the connection is lost.  Reconnect, backing off between
+ * attempts, for as long as the server keeps the session.  Returns 0 once
+ * the session continues on a new connection.
+ */
 int
 wait_for_roaming_reconnect(void)
 {
 	static int reenter_guard = 0;
+	struct ssh *ssh = active_state;	/* XXX */
 	struct ssh *nssh;
-	int timeout_ms = options.connection_timeout * 1000;
-	int c;
+	int r, timeout_ms, delay = 1;
+	time_t deadline;
 
 	if (reenter_guard != 0)
 		fatal("Server refused resume, roaming timeout may be exceeded");
 	reenter_guard = 1;
 
-	fprintf(stderr, "[connection suspended, press return to resume]");
+	fprintf(stderr, "[connection suspended, reconnecting]\r\n");
 	fflush(stderr);
-	ssh_packet_backup_state(NULL, NULL);	/* XXX FIXME */
-	/* TODO Perhaps we should read from tty here */
-	while ((c = fgetc(stdin)) != EOF) {
-		if (c == 'Z' - 64) {
-			kill(getpid(), SIGTSTP);
-			continue;
+	ssh_packet_suspend(ssh);
+	deadline = monotime() + grace;
+	for (;;) {
+		timeout_ms = options.connection_timeout * 1000;
+		nssh = ssh_reconnect(host, &hostaddr, options.port,
+		    &timeout_ms, options.tcp_keep_alive,
+		    options.use_privileged_port, options.proxy_command);
+		if (nssh != NULL) {
+			if ((r = roaming_resume(nssh)) == 0) {
+				ssh_packet_resume(ssh, nssh);
+				session_resumed = 1; /* Tell clientloop */
+				reenter_guard = 0;
+				fprintf(stderr, "[connection resumed]\r\n");
+				fflush(stderr);
+				return 0;
+			}
+			ssh_packet_close(nssh);
+			free(nssh);
+			if (r > 0) {
+				fprintf(stderr, "[server refused resume]\r\n");
+				break;
+			}
 		}
-		if (c != '\n' && c != '\r')
-			continue;
-
-		nssh = ssh_connect(host, &hostaddr, options.port,
-		    options.address_family, 1, &timeout_ms,
-		    options.tcp_keep_alive, options.use_privileged_port,
-		    options.proxy_command);
-		if (nssh && roaming_resume()) {
-			ssh_packet_restore_state(NULL, NULL); /* XXX FIXME */
-			reenter_guard = 0;
-			fprintf(stderr, "[connection resumed]\n");
-			fflush(stderr);
-			return 0;
+		if (monotime() + delay >= deadline) {
+			fprintf(stderr, "[reconnect failed]\r\n");
+			break;
 		}
-
-		fprintf(stderr, "[reconnect failed, press return to retry]");
-		fflush(stderr);
+		sleep(delay);
+		delay = MIN(delay * 2, ROAMING_RETRY_MAX);
 	}
-	fprintf(stderr, "[exiting]\n");
 	fflush(stderr);
-	exit(0);
+	return 1;
 }
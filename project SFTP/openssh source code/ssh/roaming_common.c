@@ -16,11 +16,13 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 
 #include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
@@ -28,16 +30,19 @@
 #include "atomicio.h"
 #include "log.h"
 #include "packet.h"
+#include "ssh1.h"	/* For SSH_MSG_NONE */
 #include "xmalloc.h"
 #include "cipher.h"
 #include "sshbuf.h"
 #include "err.h"
 #include "roaming.h"
 
+#define ROAMING_IO_TIMEOUT	(30*1000)	/* ms per step of a resume */
+
 static size_t out_buf_size = 0;
 static char *out_buf = NULL;
-static size_t out_start;
 static size_t out_last;
+static u_int64_t out_total;	/* bytes ever appended to out_buf */
 
 static u_int64_t write_bytes = 0;
 static u_int64_t read_bytes = 0;
@@ -81,7 +86,6 @@ set_out_buffer_size(size_t size)
 	if (out_buf == NULL) {
 		out_buf_size = size;
 		out_buf = xmalloc(size);
-		out_start = 0;
 		out_last = 0;
 	}
 }
@@ -114,14 +118,13 @@ roam_set_bytes(u_int64_t sent, u_int64_t recvd)
 static void
 buf_append(const char *buf, size_t count)
 {
+	out_total += count;
 	if (count > out_buf_size) {
 		buf += count - out_buf_size;
 		count = out_buf_size;
 	}
 	if (count < out_buf_size - out_last) {
 		memcpy(out_buf + out_last, buf, count);
-		if (out_start > out_last)
-			out_start += count;
 		out_last += count;
 	} else {
 		/* data will wrap */
@@ -129,7 +132,6 @@ buf_append(const char *buf, size_t count)
 		memcpy(out_buf + out_last, buf, chunk);
 		memcpy(out_buf, buf + chunk, count - chunk);
 		out_last = count - chunk;
-		out_start = out_last + 1;
 	}
 }
 
@@ -144,14 +146,14 @@ roaming_write(int fd, const void *buf, size_t count, int *cont)
 		if (out_buf_size > 0)
 			buf_append(buf, ret);
 	}
-	if (out_buf_size > 0 &&
+	if (out_buf_size > 0 && !resume_in_progress &&
 	    (ret == 0 || (ret == -1 && errno == EPIPE))) {
-		if (wait_for_roaming_reconnect() != 0) {
+		if (wait_for_roaming_reconnect() == 0) {
 			ret = 0;
 			*cont = 1;
 		} else {
 			ret = -1;
-			errno = EAGAIN;
+			errno = EPIPE;
 		}
 	}
 	return ret;
@@ -165,7 +167,7 @@ roaming_read(int fd, void *buf, size_t count, int *cont)
 		if (!resume_in_progress) {
 			read_bytes += ret;
 		}
-	} else if (out_buf_size > 0 &&
+	} else if (out_buf_size > 0 && !resume_in_progress &&
 	    (ret == 0 || (ret == -1 && (errno == ECONNRESET
 	    || errno == ECONNABORTED || errno == ETIMEDOUT
 	    || errno == EHOSTUNREACH)))) {
@@ -192,27 +194,112 @@ roaming_atomicio(ssize_t(*f)(int, void*, size_t), int fd, void *buf,
 	return ret;
 }
 
-void
+/*
+ * Send again what the peer has not received before the connection was
+ * lost.  Returns -1 if that is no longer in the buffer or cannot be sent.
+ */
+int
 resend_bytes(int fd, u_int64_t *offset)
 {
 	size_t available, needed;
 
-	if (out_start < out_last)
-		available = out_last - out_start;
-	else
-		available = out_buf_size;
+	/* data written before the buffer was set up cannot be resent */
+	available = MIN(out_total, out_buf_size);
+	if (*offset > write_bytes || write_bytes - *offset > available) {
+		debug("%s: peer received %llu of %llu bytes, %lu cached",
+		    __func__, (unsigned long long)*offset,
+		    (unsigned long long)write_bytes, (u_long)available);
+		return -1;
+	}
 	needed = write_bytes - *offset;
 	debug3("resend_bytes: resend %lu bytes from %llu",
 	    (unsigned long)needed, (unsigned long long)*offset);
-	if (needed > available)
-		fatal("Needed to resend more data than in the cache");
 	if (out_last < needed) {
-		int chunkend = needed - out_last;
-		atomicio(vwrite, fd, out_buf + out_buf_size - chunkend,
-		    chunkend);
-		atomicio(vwrite, fd, out_buf, out_last);
-	} else {
-		atomicio(vwrite, fd, out_buf + (out_last - needed), needed);
+		size_t chunkend = needed - out_last;
+
+		if (atomicio(vwrite, fd, out_buf + out_buf_size - chunkend,
+		    chunkend) != chunkend ||
+		    atomicio(vwrite, fd, out_buf, out_last) != out_last)
+			return -1;
+	} else if (atomicio(vwrite, fd, out_buf + (out_last - needed),
+	    needed) != needed)
+		return -1;
+	return 0;
+}
+
+static int
+roaming_poll(int fd, short events)
+{
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	while ((r = poll(&pfd, 1, ROAMING_IO_TIMEOUT)) == -1 &&
+	    (errno == EINTR || errno == EAGAIN))
+		;
+	if (r == 0)
+		errno = ETIMEDOUT;
+	return r == 1 ? 0 : -1;
+}
+
+/*
+ * Send the packets queued on the connection of a resume exchange.  Unlike
+ * ssh_packet_write_wait() this fails rather than exits if the connection
+ * breaks again.
+ */
+int
+roaming_flush(struct ssh *ssh)
+{
+	struct sshbuf *output = ssh_packet_get_output(ssh);
+	int fd = ssh_packet_get_connection_out(ssh);
+	ssize_t len;
+
+	while (sshbuf_len(output) > 0) {
+		if (roaming_poll(fd, POLLOUT) != 0)
+			return SSH_ERR_SYSTEM_ERROR;
+		len = write(fd, sshbuf_ptr(output), sshbuf_len(output));
+		if (len == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (len <= 0)
+			return SSH_ERR_SYSTEM_ERROR;
+		if (sshbuf_consume(output, len) != 0)
+			return SSH_ERR_INTERNAL_ERROR;
+	}
+	return 0;
+}
+
+/*
+ * Read the next packet of a resume exchange, waiting a bounded time for it.
+ * Returns an SSH_ERR_* code; SSH_ERR_DISCONNECTED if the peer gave up.
+ */
+int
+roaming_read_packet(struct ssh *ssh, u_char *typep)
+{
+	int fd = ssh_packet_get_connection_in(ssh);
+	u_int32_t seqnr;
+	char buf[8192];
+	ssize_t len;
+	int r;
+
+	if ((r = roaming_flush(ssh)) != 0)
+		return r;
+	for (;;) {
+		if ((r = ssh_packet_read_poll_seqnr(ssh, typep, &seqnr)) != 0)
+			return r;
+		if (*typep != SSH_MSG_NONE)
+			return 0;
+		if (roaming_poll(fd, POLLIN) != 0)
+			return SSH_ERR_SYSTEM_ERROR;
+		len = read(fd, buf, sizeof(buf));
+		if (len == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (len == 0)
+			errno = EPIPE;
+		if (len <= 0)
+			return SSH_ERR_SYSTEM_ERROR;
+		if ((r = sshbuf_put(ssh_packet_get_input(ssh), buf, len)) != 0)
+			return r;
 	}
 }
 
@@ -16,14 +16,389 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "xmalloc.h"
+#include "sshbuf.h"
+#include "err.h"
+#include "log.h"
+#include "misc.h"
+#include "packet.h"
+#include "kex.h"
+#include "ssh2.h"
+#include "servconf.h"
+#include "pathnames.h"
+#include "monitor_fdpass.h"
 #include "roaming.h"
 
 /*
- * Wait for the roaming client to reconnect. Returns 0 if a connect ocurred.
+ * A session that allows roaming listens on a unix domain socket named after
+ * its roaming id.  When a client resumes, the pre-auth child of the sshd
+ * that accepted the new connection reads the id and the privileged process
+ * passes the connection over that socket (roaming_server_pass()), and the
+ * session authenticates the client and continues on the new connection.
+ * The socket is created by the privileged process, so only root can pass
+ * connections to it.
+ */
+
+/* import */
+extern ServerOptions options;
+extern int session_resumed;
+
+static struct ssh *roam_ssh;
+static int listen_sock = -1;
+static pid_t listen_pid = -1;
+static char listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static u_int32_t roaming_id;
+static u_int64_t cookie;
+static u_int64_t lastchall;
+static u_int64_t key1, key2;
+
+static int
+roaming_path(u_int32_t id, struct sockaddr_un *sunaddr)
+{
+	int len;
+
+	memset(sunaddr, 0, sizeof(*sunaddr));
+	sunaddr->sun_family = AF_UNIX;
+	len = snprintf(sunaddr->sun_path, sizeof(sunaddr->sun_path),
+	    "%s/%08x", _PATH_SSHD_ROAMING_DIR, id);
+	return (len < 0 || (size_t)len >= sizeof(sunaddr->sun_path)) ? -1 : 0;
+}
+
+/*
+ * Prepare the rendezvous socket of an authenticated session.  Called by
+ * the privileged process before the session starts; the socket is only
+ * used if the client asks for roaming.
+ */
+void
+roaming_server_listen(void)
+{
+	struct sockaddr_un sunaddr;
+	struct stat st;
+	int i, sock;
+
+	if (mkdir(_PATH_SSHD_ROAMING_DIR, 0700) == -1 && errno != EEXIST) {
+		error("mkdir %s: %s", _PATH_SSHD_ROAMING_DIR, strerror(errno));
+		return;
+	}
+	if (lstat(_PATH_SSHD_ROAMING_DIR, &st) == -1 || !S_ISDIR(st.st_mode) ||
+	    st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+		error("Bad owner or modes for %s", _PATH_SSHD_ROAMING_DIR);
+		return;
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		error("%s: socket: %s", __func__, strerror(errno));
+		return;
+	}
+	for (i = 0; i < 8; i++) {
+		roaming_id = arc4random();
+		if (roaming_path(roaming_id, &sunaddr) == -1) {
+			error("%s: path too long", __func__);
+			break;
+		}
+		if (bind(sock, (struct sockaddr *)&sunaddr,
+		    sizeof(sunaddr)) == 0) {
+			strlcpy(listen_path, sunaddr.sun_path,
+			    sizeof(listen_path));
+			break;
+		}
+		if (errno != EADDRINUSE) {
+			error("%s: bind %s: %s", __func__, sunaddr.sun_path,
+			    strerror(errno));
+			break;
+		}
+	}
+	if (listen_path[0] == '\0' || listen(sock, 4) == -1) {
+		close(sock);
+		return;
+	}
+	set_nonblock(sock);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	listen_sock = sock;
+	listen_pid = getpid();
+	debug("%s: session %08x", __func__, roaming_id);
+}
+
+void
+roaming_server_cleanup(void)
+{
+	if (listen_pid == getpid() && listen_path[0] != '\0') {
+		unlink(listen_path);
+		listen_path[0] = '\0';
+	}
+}
+
+/* Socket on which resuming clients arrive, -1 unless roaming is on. */
+int
+roaming_server_fd(void)
+{
+	return roaming_enabled ? listen_sock : -1;
+}
+
+/* Accept a roaming request; 'size' is the receive buffer of the client. */
+int
+roaming_server_enable(struct ssh *ssh, u_int size)
+{
+	size_t bufsize;
+
+	if (listen_sock == -1 || roaming_enabled)
+		return -1;
+	bufsize = (size_t)MIN(size, MAX_ROAMBUF) + get_snd_buf_size(ssh);
+	set_out_buffer_size(MIN(bufsize, MAX_ROAMBUF));
+	arc4random_buf(&cookie, sizeof(cookie));
+	arc4random_buf(&key1, sizeof(key1));
+	arc4random_buf(&key2, sizeof(key2));
+	lastchall = 0;
+	roam_ssh = ssh;
+	roaming_enabled = 1;
+	verbose("Roaming enabled for session %08x", roaming_id);
+	return 0;
+}
+
+/*
+ * Append the parameters of the session to the reply to the roaming request.
+ * The grace time is an extension that older clients ignore.
+ */
+int
+roaming_server_reply(struct ssh *ssh)
+{
+	u_int size = MIN(get_recv_buf_size(ssh), MAX_ROAMBUF / 2);
+	int r;
+
+	if ((r = sshpkt_put_u32(ssh, roaming_id)) != 0 ||
+	    (r = sshpkt_put_u64(ssh, cookie)) != 0 ||
+	    (r = sshpkt_put_u64(ssh, key1)) != 0 ||
+	    (r = sshpkt_put_u64(ssh, key2)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, size)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, options.roaming_grace_time)) != 0)
+		return r;
+	return 0;
+}
+
+static void
+roaming_digest(u_int64_t chall, u_char *digest)
+{
+	const EVP_MD *evp_md = EVP_sha1();
+	EVP_MD_CTX md;
+	struct sshbuf *b;
+	int r;
+
+	if ((b = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u64(b, cookie)) != 0 ||
+	    (r = sshbuf_put_u64(b, chall)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	EVP_DigestInit(&md, evp_md);
+	EVP_DigestUpdate(&md, sshbuf_ptr(b), sshbuf_len(b));
+	EVP_DigestFinal(&md, digest, NULL);
+	sshbuf_free(b);
+}
+
+/*
+ * Server side of the exchange in roaming_resume() of roaming_client.c:
+ * challenge the client, tell it how much we have received and send again
+ * what it has missed.
+ */
+static int
+roaming_auth(struct ssh *nssh)
+{
+	u_char digest[SHA_DIGEST_LENGTH], expect[SHA_DIGEST_LENGTH];
+	u_char type;
+	u_int64_t chall, val, peer_recv, okkey;
+	int r;
+
+	/* the pre-auth child has sent our KEXINIT, offering resume */
+	arc4random_buf(&chall, sizeof(chall));
+	if ((r = sshpkt_start(nssh, SSH2_MSG_KEX_ROAMING_AUTH_REQUIRED)) != 0 ||
+	    (r = sshpkt_put_u64(nssh, chall)) != 0 ||
+	    (r = sshpkt_put_u64(nssh, lastchall)) != 0 ||
+	    (r = sshpkt_send(nssh)) != 0 ||
+	    (r = roaming_read_packet(nssh, &type)) != 0)
+		return r;
+	if (type != SSH2_MSG_KEX_ROAMING_AUTH) {
+		debug("expected roaming_auth, got %u", type);
+		return SSH_ERR_INVALID_FORMAT;
+	}
+	if ((r = sshpkt_get_u64(nssh, &val)) != 0 ||
+	    (r = sshpkt_get(nssh, digest, sizeof(digest))) != 0 ||
+	    (r = sshpkt_get_end(nssh)) != 0)
+		return r;
+	roaming_digest(chall, expect);
+	if (timingsafe_bcmp(digest, expect, sizeof(digest)) != 0) {
+		if (sshpkt_start(nssh, SSH2_MSG_KEX_ROAMING_AUTH_FAIL) == 0 &&
+		    sshpkt_send(nssh) == 0)
+			roaming_flush(nssh);
+		return SSH_ERR_SIGNATURE_INVALID;
+	}
+	peer_recv = val ^ key1;
+
+	/* the client has moved on to the next keys */
+	okkey = key2;
+	lastchall = chall;
+	calculate_new_key(&key1, cookie, chall);
+	calculate_new_key(&key2, cookie, chall);
+
+	if ((r = sshpkt_start(nssh, SSH2_MSG_KEX_ROAMING_AUTH_OK)) != 0 ||
+	    (r = sshpkt_put_u64(nssh, get_recv_bytes() ^ okkey)) != 0 ||
+	    (r = sshpkt_send(nssh)) != 0 ||
+	    (r = roaming_flush(nssh)) != 0)
+		return r;
+	debug("Peer received %llu bytes", (unsigned long long)peer_recv);
+	if (resend_bytes(ssh_packet_get_connection_out(nssh), &peer_recv) != 0)
+		return SSH_ERR_SYSTEM_ERROR;
+	return 0;
+}
+
+/*
+ * Take a connection passed by roaming_server_pass() and continue the session
+ * on it if the client proves that it holds the session.
+ */
+static int
+roaming_accept(struct ssh *ssh)
+{
+	struct ssh *nssh;
+	int fd, r, sock;
+
+	if ((sock = accept(listen_sock, NULL, NULL)) == -1) {
+		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			error("%s: accept: %s", __func__, strerror(errno));
+		return -1;
+	}
+	fd = mm_receive_fd(sock);
+	close(sock);
+	if (fd == -1)
+		return -1;
+	nssh = ssh_packet_set_connection(NULL, fd, fd);
+	resume_in_progress = 1;
+	r = roaming_auth(nssh);
+	resume_in_progress = 0;
+	if (r != 0) {
+		logit("Resume of session %08x failed: %s", roaming_id,
+		    ssh_err(r));
+		ssh_packet_close(nssh);
+		free(nssh);
+		return -1;
+	}
+	ssh_packet_resume(ssh, nssh);
+	session_resumed = 1;
+	return 0;
+}
+
+/*
+ * Called when the connection is lost.  Keep the session for the grace time
+ * and return 0 if the client came back.
  */
 int
 wait_for_roaming_reconnect(void)
 {
+	struct pollfd pfd;
+	time_t deadline, now;
+
+	if (roam_ssh == NULL || !roaming_enabled)
+		return 1;
+	logit("Connection from %.200s lost, keeping session %08x for %d "
+	    "seconds", ssh_remote_ipaddr(roam_ssh), roaming_id,
+	    options.roaming_grace_time);
+	ssh_packet_suspend(roam_ssh);
+	deadline = monotime() + options.roaming_grace_time;
+	pfd.fd = listen_sock;
+	pfd.events = POLLIN;
+	while ((now = monotime()) < deadline) {
+		if (poll(&pfd, 1, (int)(deadline - now) * 1000) <= 0)
+			continue;
+		if (roaming_accept(roam_ssh) == 0) {
+			logit("Session %08x resumed", roaming_id);
+			return 0;
+		}
+	}
+	logit("Session %08x was not resumed", roaming_id);
 	return 1;
 }
+
+/*
+ * A client resumed while the old connection still looked alive to us.
+ */
+void
+roaming_server_takeover(struct ssh *ssh)
+{
+	if (roaming_accept(ssh) == 0)
+		logit("Session %08x resumed on a new connection", roaming_id);
+}
+
+/*
+ * A resuming client starts with a KEXINIT that offers only resume@appgate.com,
+ * followed by the id of the session.  Called by the key exchange of the
+ * unprivileged pre-auth child, see kex_input_kexinit().
+ */
+int
+roaming_server_resume_id(struct ssh *ssh, u_int32_t *idp)
+{
+	u_char type;
+	int r;
+
+	if ((r = roaming_read_packet(ssh, &type)) != 0)
+		return r;
+	if (type != SSH2_MSG_KEX_ROAMING_RESUME) {
+		debug("expected roaming resume, got %u", type);
+		return SSH_ERR_INVALID_FORMAT;
+	}
+	if ((r = sshpkt_get_u32(ssh, idp)) != 0 ||
+	    (r = sshpkt_get_end(ssh)) != 0)
+		return r;
+	return 0;
+}
+
+static int
+roaming_connect(u_int32_t id)
+{
+	struct sockaddr_un sunaddr;
+	int sock;
+
+	if (roaming_path(id, &sunaddr) == -1)
+		return -1;
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		error("%s: socket: %s", __func__, strerror(errno));
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&sunaddr, sizeof(sunaddr)) == -1) {
+		debug("%s: connect %s: %s", __func__, sunaddr.sun_path,
+		    strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Pass the connection 'fd', which asks to resume, to session 'id'.
+ * Needs root, as the rendezvous sockets are only accessible to root.
+ */
+int
+roaming_server_pass(u_int32_t id, int fd)
+{
+	int r, sock;
+
+	if ((sock = roaming_connect(id)) == -1)
+		return -1;
+	if ((r = mm_send_fd(sock, fd)) == -1)
+		error("%s: cannot pass connection to session %08x",
+		    __func__, id);
+	close(sock);
+	return r;
+}
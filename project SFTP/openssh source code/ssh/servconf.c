@@ -20,6 +20,7 @@
 #include <netinet/ip.h>
 
 #include <netdb.h>
+#include <ctype.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -133,6 +134,9 @@ initialize_server_options(ServerOptions *options)
 	options->chroot_directory = NULL;
 	options->authorized_keys_command = NULL;
 	options->authorized_keys_command_user = NULL;
+	options->authorized_keys_command_cache_time = -1;
+	options->authorized_keys_command_cache_negative = -1;
+	options->authorized_keys_command_cache_size = -1;
 	options->zero_knowledge_password_authentication = -1;
 	options->revoked_keys_file = NULL;
 	options->trusted_user_ca_keys = NULL;
@@ -140,6 +144,10 @@ initialize_server_options(ServerOptions *options)
 	options->ip_qos_interactive = -1;
 	options->ip_qos_bulk = -1;
 	options->version_addendum = NULL;
+	options->channel_window_budget = -1;
+	options->roaming_grace_time = -1;
+	options->use_zygote = -1;
+	options->latency_stats_file = NULL;
 }
 
 void
@@ -274,6 +282,18 @@ fill_default_server_options(ServerOptions *options)
 		options->ip_qos_bulk = IPTOS_THROUGHPUT;
 	if (options->version_addendum == NULL)
 		options->version_addendum = xstrdup("");
+	if (options->channel_window_budget == -1)
+		options->channel_window_budget = CHAN_WINDOW_BUDGET_DEFAULT;
+	if (options->roaming_grace_time == -1)
+		options->roaming_grace_time = 0;
+	if (options->use_zygote == -1)
+		options->use_zygote = 0;
+	if (options->authorized_keys_command_cache_time == -1)
+		options->authorized_keys_command_cache_time = 0;
+	if (options->authorized_keys_command_cache_negative == -1)
+		options->authorized_keys_command_cache_negative = 0;
+	if (options->authorized_keys_command_cache_size == -1)
+		options->authorized_keys_command_cache_size = 1024 * 1024;
 	/* Turn privilege separation on by default */
 	if (use_privsep == -1)
 		use_privsep = PRIVSEP_NOSANDBOX;
@@ -308,7 +328,9 @@ typedef enum {
 	sRevokedKeys, sTrustedUserCAKeys, sAuthorizedPrincipalsFile,
 	sKexAlgorithms, sIPQoS, sVersionAddendum,
 	sAuthorizedKeysCommand, sAuthorizedKeysCommandUser,
-	sAuthenticationMethods,
+	sAuthenticationMethods, sChannelWindowBudget, sRoamingGraceTime,
+	sUseZygote, sLatencyStatsFile,
+	sAuthorizedKeysCommandCacheTime, sAuthorizedKeysCommandCacheSize,
 	sDeprecated, sUnsupported
 } ServerOpCodes;
 
@@ -423,8 +445,14 @@ static struct {
 	{ "ipqos", sIPQoS, SSHCFG_ALL },
 	{ "authorizedkeyscommand", sAuthorizedKeysCommand, SSHCFG_ALL },
 	{ "authorizedkeyscommanduser", sAuthorizedKeysCommandUser, SSHCFG_ALL },
+	{ "authorizedkeyscommandcachetime", sAuthorizedKeysCommandCacheTime, SSHCFG_GLOBAL },
+	{ "authorizedkeyscommandcachesize", sAuthorizedKeysCommandCacheSize, SSHCFG_GLOBAL },
 	{ "versionaddendum", sVersionAddendum, SSHCFG_GLOBAL },
 	{ "authenticationmethods", sAuthenticationMethods, SSHCFG_ALL },
+	{ "channelwindowbudget", sChannelWindowBudget, SSHCFG_GLOBAL },
+	{ "roaminggracetime", sRoamingGraceTime, SSHCFG_GLOBAL },
+	{ "usezygote", sUseZygote, SSHCFG_GLOBAL },
+	{ "latencystatsfile", sLatencyStatsFile, SSHCFG_GLOBAL },
 	{ NULL, sBadOption, 0 }
 };
 
@@ -529,18 +557,16 @@ get_connection_info(int populate, int use_dns)
 }
 
 /*
- * The strategy for the Match blocks is that the config file is parsed twice.
+ * The strategy for the Match blocks is that the config file is parsed once.
  *
- * The first time is at startup.  activep is initialized to 1 and the
- * directives in the global context are processed and acted on.  Hitting a
- * Match directive unsets activep and the directives inside the block are
- * checked for syntax only.
+ * At startup activep is initialized to 1 and the directives in the global
+ * context are processed and acted on.  Hitting a Match directive unsets
+ * activep and the directives inside the block are checked for syntax only.
+ * The Match blocks are then compiled by match_compile().
  *
- * The second time is after a connection has been established but before
- * authentication.  activep is initialized to 2 and global config directives
- * are ignored since they have already been processed.  If the criteria in a
- * Match block is met, activep is set and the subsequent directives
- * processed and actioned until EOF or another Match block unsets it.  Any
+ * After a connection has been established but before authentication, the
+ * criteria of the compiled blocks are evaluated and the directives of the
+ * blocks that are met are processed and actioned, in file order.  Any
  * options set are copied into the main server config.
  *
  * Potential additions/improvements:
@@ -765,6 +791,7 @@ process_server_config_line(ServerOptions *options, char *line,
 {
 	char *cp, **charptr, *arg, *p;
 	int cmdline = 0, *intptr, value, value2, n;
+	long long val64;
 	SyslogFacility *log_facility_ptr;
 	LogLevel *log_level_ptr;
 	ServerOpCodes opcode;
@@ -1439,6 +1466,10 @@ process_server_config_line(ServerOptions *options, char *line,
 		charptr = &options->revoked_keys_file;
 		goto parse_filename;
 
+	case sLatencyStatsFile:
+		charptr = &options->latency_stats_file;
+		goto parse_filename;
+
 	case sIPQoS:
 		arg = strdelim(&cp);
 		if ((value = parse_ipqos(arg)) == -1)
@@ -1472,6 +1503,58 @@ process_server_config_line(ServerOptions *options, char *line,
 		}
 		return 0;
 
+	case sChannelWindowBudget:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing size.", filename, linenum);
+		if ((val64 = convsize(arg)) == -1)
+			fatal("%s line %d: invalid size.", filename, linenum);
+		if (*activep && options->channel_window_budget == -1)
+			options->channel_window_budget = val64;
+		break;
+
+	case sRoamingGraceTime:
+		intptr = &options->roaming_grace_time;
+		goto parse_time;
+
+	case sUseZygote:
+		intptr = &options->use_zygote;
+		goto parse_flag;
+
+	case sAuthorizedKeysCommandCacheTime:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing time value.",
+			    filename, linenum);
+		if ((value = convtime(arg)) == -1)
+			fatal("%s line %d: invalid time value.",
+			    filename, linenum);
+		/* failures are not cached unless a second time is given */
+		value2 = 0;
+		arg = strdelim(&cp);
+		if (arg != NULL && *arg != '\0' &&
+		    (value2 = convtime(arg)) == -1)
+			fatal("%s line %d: invalid time value.",
+			    filename, linenum);
+		if (*activep &&
+		    options->authorized_keys_command_cache_time == -1) {
+			options->authorized_keys_command_cache_time = value;
+			options->authorized_keys_command_cache_negative =
+			    value2;
+		}
+		break;
+
+	case sAuthorizedKeysCommandCacheSize:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing size.", filename, linenum);
+		if ((val64 = convsize(arg)) == -1)
+			fatal("%s line %d: invalid size.", filename, linenum);
+		if (*activep &&
+		    options->authorized_keys_command_cache_size == -1)
+			options->authorized_keys_command_cache_size = val64;
+		break;
+
 	case sAuthorizedKeysCommand:
 		len = strspn(cp, WHITESPACE);
 		if (*activep && options->authorized_keys_command == NULL) {
@@ -1569,14 +1652,309 @@ load_server_config(const char *filename, struct sshbuf *conf)
 	debug2("%s: done config len = %zu", __func__, sshbuf_len(conf));
 }
 
+/*
+ * Match blocks are compiled when the configuration is first parsed, so
+ * that connections need not reparse the whole configuration.  Each block
+ * keeps its criteria as predicates, ordered so that the cheap ones are
+ * tried first, and its directives as lines.  parse_server_match_config()
+ * evaluates the predicates and replays the directives of the blocks that
+ * match, in file order, which gives the same result as reparsing: several
+ * directives accumulate over blocks (e.g. AllowUsers) or act as they are
+ * parsed (PermitOpen), so they cannot be merged ahead of time.
+ */
+enum match_crit {
+	MATCH_LPORT,		/* in order of cost */
+	MATCH_USER,
+	MATCH_HOST,
+	MATCH_LADDRESS,
+	MATCH_ADDRESS,
+	MATCH_GROUP
+};
+
+struct match_pattern {
+	char	*pat;
+	int	 negate;
+	int	 literal;	/* no wildcards, compared with strcmp() */
+};
+
+struct match_pred {
+	enum match_crit crit;
+	char	*arg;		/* as written */
+	struct match_pattern *pats;	/* User and Host */
+	u_int	 npats;
+	int	 never;		/* a pattern is too long to ever match */
+	int	 port;		/* LocalPort */
+};
+
+struct match_block {
+	int	 line;		/* of the Match directive */
+	struct match_pred *preds;
+	u_int	 npreds;
+	char	**body;		/* directives of the block */
+	int	*body_line;
+	u_int	 nbody;
+};
+
+static struct match_block *match_blocks;
+static u_int num_match_blocks;
+
+static void
+match_compile_patterns(struct match_pred *p, int dolower)
+{
+	char *list, *cp, *sub;
+	struct match_pattern *m;
+
+	list = cp = xstrdup(p->arg);
+	while ((sub = strsep(&cp, ",")) != NULL) {
+		p->pats = xrealloc(p->pats, p->npats + 1, sizeof(*p->pats));
+		m = &p->pats[p->npats++];
+		if ((m->negate = (*sub == '!')))
+			sub++;
+		/* as match_pattern_list(), which truncates at 1023 */
+		if (strlen(sub) >= 1023)
+			p->never = 1;
+		m->pat = xstrdup(sub);
+		for (sub = m->pat; dolower && *sub != '\0'; sub++)
+			*sub = tolower((u_char)*sub);
+		m->literal = strcspn(m->pat, "*?") == strlen(m->pat);
+	}
+	free(list);
+}
+
+/* As match_pattern_list(): 1 on a match, -1 on a negated match, else 0 */
+static int
+match_patterns(const struct match_pred *p, const char *s)
+{
+	const struct match_pattern *m;
+	int got_positive = 0;
+	u_int i;
+
+	if (p->never)
+		return 0;
+	for (i = 0; i < p->npats; i++) {
+		m = &p->pats[i];
+		if (m->literal ? strcmp(s, m->pat) != 0 :
+		    !match_pattern(s, m->pat))
+			continue;
+		if (m->negate)
+			return -1;
+		got_positive = 1;
+	}
+	return got_positive;
+}
+
+static int
+match_pred_cmp(const void *a, const void *b)
+{
+	const struct match_pred *pa = a, *pb = b;
+
+	return (int)pa->crit - (int)pb->crit;
+}
+
+/* Compile the criteria of the "Match" line 'line' into 'b' */
+static void
+match_compile_criteria(struct match_block *b, char *cp, int line)
+{
+	struct match_pred *p;
+	char *attrib, *arg;
+
+	while ((attrib = strdelim(&cp)) && *attrib != '\0') {
+		if ((arg = strdelim(&cp)) == NULL || *arg == '\0')
+			fatal("line %d: Missing Match criteria for %s",
+			    line, attrib);
+		b->preds = xrealloc(b->preds, b->npreds + 1,
+		    sizeof(*b->preds));
+		p = &b->preds[b->npreds++];
+		memset(p, 0, sizeof(*p));
+		p->arg = xstrdup(arg);
+		if (strcasecmp(attrib, "user") == 0) {
+			p->crit = MATCH_USER;
+			match_compile_patterns(p, 0);
+		} else if (strcasecmp(attrib, "group") == 0)
+			p->crit = MATCH_GROUP;
+		else if (strcasecmp(attrib, "host") == 0) {
+			p->crit = MATCH_HOST;
+			match_compile_patterns(p, 1);
+		} else if (strcasecmp(attrib, "address") == 0)
+			p->crit = MATCH_ADDRESS;
+		else if (strcasecmp(attrib, "localaddress") == 0)
+			p->crit = MATCH_LADDRESS;
+		else if (strcasecmp(attrib, "localport") == 0) {
+			p->crit = MATCH_LPORT;
+			if ((p->port = a2port(arg)) == -1)
+				fatal("line %d: Invalid LocalPort '%s' on "
+				    "Match line", line, arg);
+		} else
+			fatal("line %d: Unsupported Match attribute %s",
+			    line, attrib);
+	}
+	qsort(b->preds, b->npreds, sizeof(*b->preds), match_pred_cmp);
+}
+
+static void
+match_free_blocks(void)
+{
+	struct match_block *b;
+	u_int i, j, k;
+
+	for (i = 0; i < num_match_blocks; i++) {
+		b = &match_blocks[i];
+		for (j = 0; j < b->npreds; j++) {
+			for (k = 0; k < b->preds[j].npats; k++)
+				free(b->preds[j].pats[k].pat);
+			free(b->preds[j].pats);
+			free(b->preds[j].arg);
+		}
+		free(b->preds);
+		for (j = 0; j < b->nbody; j++)
+			free(b->body[j]);
+		free(b->body);
+		free(b->body_line);
+	}
+	free(match_blocks);
+	match_blocks = NULL;
+	num_match_blocks = 0;
+}
+
+/* Split the Match blocks out of 'conf', which has been parsed already */
+static void
+match_compile(struct sshbuf *conf)
+{
+	struct match_block *b = NULL;
+	char *obuf, *cbuf, *line, *copy, *cp, *arg;
+	int linenum, directive;
+
+	match_free_blocks();
+	obuf = cbuf = xstrdup(sshbuf_ptr(conf));
+	for (linenum = 1; (line = strsep(&cbuf, "\n")) != NULL; linenum++) {
+		/* strdelim() cuts the line, so look at a copy */
+		cp = copy = xstrdup(line);
+		if ((arg = strdelim(&cp)) != NULL && *arg == '\0')
+			arg = strdelim(&cp);
+		if (arg != NULL && strcasecmp(arg, "match") == 0) {
+			match_blocks = xrealloc(match_blocks,
+			    num_match_blocks + 1, sizeof(*match_blocks));
+			b = &match_blocks[num_match_blocks++];
+			memset(b, 0, sizeof(*b));
+			b->line = linenum;
+			match_compile_criteria(b, cp, linenum);
+		}
+		directive = arg != NULL && *arg != '\0' && *arg != '#';
+		free(copy);
+		/* skip the global section, blank lines and the Match itself */
+		if (b == NULL || b->line == linenum || !directive)
+			continue;
+		b->body = xrealloc(b->body, b->nbody + 1, sizeof(*b->body));
+		b->body_line = xrealloc(b->body_line, b->nbody + 1,
+		    sizeof(*b->body_line));
+		b->body[b->nbody] = xstrdup(line);
+		b->body_line[b->nbody] = linenum;
+		b->nbody++;
+	}
+	free(obuf);
+	debug2("%s: %u Match blocks", __func__, num_match_blocks);
+}
+
+/*
+ * Returns 1 if the connection 'ci' matches all criteria of 'b', 0 if not.
+ * '*groups' tracks whether the groups of ci->user have been looked up.
+ */
+static int
+match_block_eval(const struct match_block *b, struct connection_info *ci,
+    int *groups)
+{
+	const struct match_pred *p;
+	struct passwd *pw;
+	u_int i;
+	int r;
+
+	for (i = 0; i < b->npreds; i++) {
+		p = &b->preds[i];
+		switch (p->crit) {
+		case MATCH_LPORT:
+			if (ci->lport == 0 || ci->lport != p->port)
+				return 0;
+			break;
+		case MATCH_USER:
+			if (ci->user == NULL ||
+			    match_patterns(p, ci->user) != 1)
+				return 0;
+			break;
+		case MATCH_HOST:
+			if (ci->host == NULL ||
+			    match_patterns(p, ci->host) != 1)
+				return 0;
+			break;
+		case MATCH_ADDRESS:
+		case MATCH_LADDRESS:
+			r = addr_match_list(p->crit == MATCH_ADDRESS ?
+			    ci->address : ci->laddress, p->arg);
+			if (r == -2)
+				fatal("line %d: Bad Match condition", b->line);
+			if (r != 1)
+				return 0;
+			break;
+		case MATCH_GROUP:
+			if (ci->user == NULL)
+				return 0;
+			/* look the groups up once for all blocks */
+			if (*groups == 0) {
+				*groups = -1;
+				if ((pw = getpwnam(ci->user)) == NULL)
+					debug("Can't match group because user "
+					    "%.100s does not exist", ci->user);
+				else if (ga_init(pw->pw_name, pw->pw_gid) == 0)
+					debug("Can't Match group because user "
+					    "%.100s not in any group",
+					    ci->user);
+				else
+					*groups = 1;
+			}
+			if (*groups != 1 || ga_match_pattern_list(p->arg) != 1)
+				return 0;
+			break;
+		}
+	}
+	return 1;
+}
+
 void
 parse_server_match_config(ServerOptions *options,
    struct connection_info *connectinfo)
 {
 	ServerOptions mo;
-
+	const struct match_block *b;
+	char *line;
+	u_int i, j;
+	int active, groups = 0, bad_options = 0;
+
+	debug3("checking match for user %s host %s addr %s laddr %s lport %d",
+	    connectinfo->user ? connectinfo->user : "(null)",
+	    connectinfo->host ? connectinfo->host : "(null)",
+	    connectinfo->address ? connectinfo->address : "(null)",
+	    connectinfo->laddress ? connectinfo->laddress : "(null)",
+	    connectinfo->lport);
 	initialize_server_options(&mo);
-	parse_server_config(&mo, "reprocess config", cfg, connectinfo);
+	for (i = 0; i < num_match_blocks; i++) {
+		b = &match_blocks[i];
+		if (!match_block_eval(b, connectinfo, &groups))
+			continue;
+		debug("connection matched Match block at line %d", b->line);
+		active = 1;
+		for (j = 0; j < b->nbody; j++) {
+			line = xstrdup(b->body[j]);
+			if (process_server_config_line(&mo, line,
+			    "reprocess config", b->body_line[j], &active,
+			    connectinfo) != 0)
+				bad_options++;
+			free(line);
+		}
+	}
+	if (groups != 0)
+		ga_free();
+	if (bad_options > 0)
+		fatal("reprocess config: terminating, %d bad configuration "
+		    "options", bad_options);
 	copy_set_server_options(options, &mo, 0);
 }
 
@@ -1716,6 +2094,8 @@ parse_server_config(ServerOptions *options, const char *filename,
 	if (bad_options > 0)
 		fatal("%s: terminating, %d bad configuration options",
 		    filename, bad_options);
+	if (connectinfo == NULL)
+		match_compile(conf);
 }
 
 static const char *
@@ -1861,6 +2241,7 @@ dump_config(ServerOptions *o)
 	dump_cfg_int(sMaxSessions, o->max_sessions);
 	dump_cfg_int(sClientAliveInterval, o->client_alive_interval);
 	dump_cfg_int(sClientAliveCountMax, o->client_alive_count_max);
+	dump_cfg_int(sRoamingGraceTime, o->roaming_grace_time);
 
 	/* formatted integer arguments */
 	dump_cfg_fmtint(sPermitRootLogin, o->permit_root_login);
@@ -1903,6 +2284,7 @@ dump_config(ServerOptions *o)
 	dump_cfg_fmtint(sCompression, o->compression);
 	dump_cfg_fmtint(sGatewayPorts, o->gateway_ports);
 	dump_cfg_fmtint(sUseDNS, o->use_dns);
+	dump_cfg_fmtint(sUseZygote, o->use_zygote);
 	dump_cfg_fmtint(sAllowTcpForwarding, o->allow_tcp_forwarding);
 	dump_cfg_fmtint(sUsePrivilegeSeparation, use_privsep);
 
@@ -1916,11 +2298,23 @@ dump_config(ServerOptions *o)
 	dump_cfg_string(sChrootDirectory, o->chroot_directory);
 	dump_cfg_string(sTrustedUserCAKeys, o->trusted_user_ca_keys);
 	dump_cfg_string(sRevokedKeys, o->revoked_keys_file);
+	dump_cfg_string(sLatencyStatsFile, o->latency_stats_file);
 	dump_cfg_string(sAuthorizedPrincipalsFile,
 	    o->authorized_principals_file);
 	dump_cfg_string(sVersionAddendum, o->version_addendum);
 	dump_cfg_string(sAuthorizedKeysCommand, o->authorized_keys_command);
 	dump_cfg_string(sAuthorizedKeysCommandUser, o->authorized_keys_command_user);
+	printf("%s %d %d\n",
+	    lookup_opcode_name(sAuthorizedKeysCommandCacheTime),
+	    o->authorized_keys_command_cache_time,
+	    o->authorized_keys_command_cache_negative);
+	printf("%s %lld\n",
+	    lookup_opcode_name(sAuthorizedKeysCommandCacheSize),
+	    (long long)o->authorized_keys_command_cache_size);
+
+	/* size arguments */
+	printf("%s %lld\n", lookup_opcode_name(sChannelWindowBudget),
+	    (long long)o->channel_window_budget);
 
 	/* string arguments requiring a lookup */
 	dump_cfg_string(sLogLevel, log_level_name(o->log_level));
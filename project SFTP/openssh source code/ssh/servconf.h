@@ -173,9 +173,17 @@ typedef struct {
 	char   *authorized_principals_file;
 	char   *authorized_keys_command;
 	char   *authorized_keys_command_user;
+	int	authorized_keys_command_cache_time;	/* output, seconds */
+	int	authorized_keys_command_cache_negative;	/* failures */
+	int64_t	authorized_keys_command_cache_size;	/* bytes */
 
 	char   *version_addendum;	/* Appended to SSH banner */
 
+	int64_t	channel_window_budget;	/* window auto-tuning memory */
+	int	roaming_grace_time;	/* keep suspended sessions this long */
+	int	use_zygote;		/* fork connections from a helper */
+	char   *latency_stats_file;	/* login phase histograms */
+
 	u_int	num_auth_methods;
 	char   *auth_methods[MAX_AUTH_METHODS];
 }       ServerOptions;
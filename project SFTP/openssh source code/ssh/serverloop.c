@@ -46,6 +46,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
 #include <signal.h>
 #include <string.h>
@@ -75,6 +76,7 @@
 #include "misc.h"
 #include "roaming.h"
 #include "err.h"
+#include "poller.h"
 
 extern ServerOptions options;
 
@@ -101,6 +103,9 @@ static int connection_closed = 0;	/* Connection to client closed. */
 static u_int buffer_high;	/* "Soft" max buffer size. */
 static int no_more_sessions = 0; /* Disallow further sessions. */
 
+/* Set by the roaming code when the client has reconnected. */
+int session_resumed = 0;
+
 /*
  * This SIGCHLD kludge is used to detect when the child exits.  The server
  * will exit after that, as soon as forwarded connections have terminated.
@@ -116,7 +121,7 @@ static void server_init_dispatch(struct ssh *);
 
 /*
  * we write to this pipe if a SIGCHLD is caught in order to avoid
- * the race between select() and child_terminated
+ * the race between waiting and child_terminated
  */
 static int notify_pipe[2];
 static void
@@ -144,17 +149,18 @@ notify_parent(void)
 		write(notify_pipe[1], "", 1);
 }
 static void
-notify_prepare(fd_set *readset)
+notify_prepare(struct poller *poller)
 {
 	if (notify_pipe[0] != -1)
-		FD_SET(notify_pipe[0], readset);
+		poller_set(poller, notify_pipe[0], POLLER_READ);
 }
 static void
-notify_done(fd_set *readset)
+notify_done(struct poller *poller)
 {
 	char c;
 
-	if (notify_pipe[0] != -1 && FD_ISSET(notify_pipe[0], readset))
+	if (notify_pipe[0] != -1 &&
+	    poller_ready(poller, notify_pipe[0], POLLER_READ))
 		while (read(notify_pipe[0], &c, 1) != -1)
 			debug2("notify_done: reading");
 }
@@ -272,23 +278,21 @@ client_alive_check(struct ssh *ssh)
 }
 
 /*
- * Sleep in select() until we can do something.  This will initialize the
- * select masks.  Upon return, the masks will indicate which descriptors
- * have data or can accept data.  Optionally, a maximum time can be specified
- * for the duration of the wait (0 = infinite).
+ * Sleep in the poller until we can do something.  This will update the
+ * interest in all descriptors.  Upon return, the poller will indicate which
+ * descriptors have data or can accept data.  Optionally, a maximum time can
+ * be specified for the duration of the wait (0 = infinite).
  */
 static void
-wait_until_can_do_something(struct ssh *ssh, fd_set **readsetp, fd_set **writesetp,
-    int *maxfdp, u_int *nallocp, u_int max_time_milliseconds)
+wait_until_can_do_something(struct ssh *ssh, struct poller *poller,
+    u_int max_time_milliseconds)
 {
-	struct timeval tv, *tvp;
-	int ret;
+	int ret, conn_in = 0, conn_out = 0;
 	time_t minwait_secs = 0;
 	int client_alive_scheduled = 0;
 
-	/* Allocate and update select() masks for channel descriptors. */
-	channel_prepare_select(readsetp, writesetp, maxfdp, nallocp,
-	    &minwait_secs, 0);
+	/* Update the interest in the channel descriptors. */
+	channel_prepare_poll(poller, &minwait_secs, 0);
 
 	if (minwait_secs != 0)
 		max_time_milliseconds = MIN(max_time_milliseconds,
@@ -313,7 +317,7 @@ wait_until_can_do_something(struct ssh *ssh, fd_set **readsetp, fd_set **writese
 		/* wrong: bad condition XXX */
 		if (channel_not_very_much_buffered_data())
 #endif
-		FD_SET(connection_in, *readsetp);
+		conn_in = POLLER_READ;
 	} else {
 		/*
 		 * Read packets from the client unless we have too much
@@ -321,32 +325,39 @@ wait_until_can_do_something(struct ssh *ssh, fd_set **readsetp, fd_set **writese
 		 */
 		if (sshbuf_len(stdin_buffer) < buffer_high &&
 		    channel_not_very_much_buffered_data())
-			FD_SET(connection_in, *readsetp);
+			conn_in = POLLER_READ;
 		/*
 		 * If there is not too much data already buffered going to
 		 * the client, try to get some more data from the program.
 		 */
-		if (ssh_packet_not_very_much_data_to_write(ssh)) {
-			if (!fdout_eof)
-				FD_SET(fdout, *readsetp);
-			if (!fderr_eof)
-				FD_SET(fderr, *readsetp);
-		}
+		poller_set(poller, fdout, !fdout_eof &&
+		    ssh_packet_not_very_much_data_to_write(ssh) ?
+		    POLLER_READ : 0);
+		poller_set(poller, fderr, !fderr_eof &&
+		    ssh_packet_not_very_much_data_to_write(ssh) ?
+		    POLLER_READ : 0);
 		/*
 		 * If we have buffered data, try to write some of that data
 		 * to the program.
 		 */
-		if (fdin != -1 && sshbuf_len(stdin_buffer) > 0)
-			FD_SET(fdin, *writesetp);
+		poller_set(poller, fdin,
+		    sshbuf_len(stdin_buffer) > 0 ? POLLER_WRITE : 0);
 	}
-	notify_prepare(*readsetp);
+	notify_prepare(poller);
+	poller_set(poller, roaming_server_fd(), POLLER_READ);
 
 	/*
 	 * If we have buffered packet data going to the client, mark that
 	 * descriptor.
 	 */
 	if (ssh_packet_have_data_to_write(ssh))
-		FD_SET(connection_out, *writesetp);
+		conn_out = POLLER_WRITE;
+	if (connection_in == connection_out)
+		poller_set(poller, connection_in, conn_in | conn_out);
+	else {
+		poller_set(poller, connection_in, conn_in);
+		poller_set(poller, connection_out, conn_out);
+	}
 
 	/*
 	 * If child has terminated and there is enough buffer space to read
@@ -356,26 +367,18 @@ wait_until_can_do_something(struct ssh *ssh, fd_set **readsetp, fd_set **writese
 		if (max_time_milliseconds == 0 || client_alive_scheduled)
 			max_time_milliseconds = 100;
 
-	if (max_time_milliseconds == 0)
-		tvp = NULL;
-	else {
-		tv.tv_sec = max_time_milliseconds / 1000;
-		tv.tv_usec = 1000 * (max_time_milliseconds % 1000);
-		tvp = &tv;
-	}
-
 	/* Wait for something to happen, or the timeout to expire. */
-	ret = select((*maxfdp)+1, *readsetp, *writesetp, NULL, tvp);
+	ret = poller_wait(poller, max_time_milliseconds == 0 ? -1 :
+	    (int)MIN(max_time_milliseconds, INT_MAX));
 
 	if (ret == -1) {
-		memset(*readsetp, 0, *nallocp);
-		memset(*writesetp, 0, *nallocp);
 		if (errno != EINTR)
-			error("select: %.100s", strerror(errno));
+			error("%s: %.100s", poller_backend(poller),
+			    strerror(errno));
 	} else if (ret == 0 && client_alive_scheduled)
 		client_alive_check(ssh);
 
-	notify_done(*readsetp);
+	notify_done(poller);
 }
 
 /*
@@ -383,13 +386,13 @@ wait_until_can_do_something(struct ssh *ssh, fd_set **readsetp, fd_set **writese
  * in buffers and processed later.
  */
 static void
-process_input(struct ssh *ssh, fd_set *readset)
+process_input(struct ssh *ssh, struct poller *poller)
 {
 	int len, r;
 	char buf[16384];
 
 	/* Read and buffer any input data from the client. */
-	if (FD_ISSET(connection_in, readset)) {
+	if (poller_ready(poller, connection_in, POLLER_READ)) {
 		int cont = 0;
 		len = roaming_read(connection_in, buf, sizeof(buf), &cont);
 		if (len == 0) {
@@ -417,7 +420,7 @@ process_input(struct ssh *ssh, fd_set *readset)
 		return;
 
 	/* Read and buffer any available stdout data from the program. */
-	if (!fdout_eof && FD_ISSET(fdout, readset)) {
+	if (!fdout_eof && poller_ready(poller, fdout, POLLER_READ)) {
 		len = read(fdout, buf, sizeof(buf));
 		if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
 			/* do nothing */
@@ -431,7 +434,7 @@ process_input(struct ssh *ssh, fd_set *readset)
 		}
 	}
 	/* Read and buffer any available stderr data from the program. */
-	if (!fderr_eof && FD_ISSET(fderr, readset)) {
+	if (!fderr_eof && poller_ready(poller, fderr, POLLER_READ)) {
 		len = read(fderr, buf, sizeof(buf));
 		if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
 			/* do nothing */
@@ -449,7 +452,7 @@ process_input(struct ssh *ssh, fd_set *readset)
  * Sends data from internal buffers to client program stdin.
  */
 static void
-process_output(struct ssh *ssh, fd_set *writeset)
+process_output(struct ssh *ssh, struct poller *poller)
 {
 	struct termios tio;
 	const u_char *data;
@@ -457,13 +460,15 @@ process_output(struct ssh *ssh, fd_set *writeset)
 	int r, len;
 
 	/* Write buffered data to program stdin. */
-	if (!compat20 && fdin != -1 && FD_ISSET(fdin, writeset)) {
+	if (!compat20 && fdin != -1 &&
+	    poller_ready(poller, fdin, POLLER_WRITE)) {
 		data = sshbuf_ptr(stdin_buffer);
 		dlen = sshbuf_len(stdin_buffer);
 		len = write(fdin, data, dlen);
 		if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
 			/* do nothing */
 		} else if (len <= 0) {
+			poller_forget(poller, fdin);
 			if (fdin != fdout)
 				close(fdin);
 			else
@@ -491,7 +496,7 @@ process_output(struct ssh *ssh, fd_set *writeset)
 		}
 	}
 	/* Send any buffered packet data to the client. */
-	if (FD_ISSET(connection_out, writeset))
+	if (poller_ready(poller, connection_out, POLLER_WRITE))
 		ssh_packet_write_poll(ssh);
 }
 
@@ -547,9 +552,7 @@ void
 server_loop(pid_t pid, int fdin_arg, int fdout_arg, int fderr_arg)
 {
 	struct ssh *ssh = active_state; /* XXX */
-	fd_set *readset = NULL, *writeset = NULL;
-	int max_fd = 0;
-	u_int nalloc = 0;
+	struct poller *poller;
 	int wait_status;	/* Status returned by wait(). */
 	pid_t wait_pid;		/* pid returned by wait(). */
 	int waiting_termination = 0;	/* Have displayed waiting close message. */
@@ -624,6 +627,7 @@ server_loop(pid_t pid, int fdin_arg, int fdout_arg, int fderr_arg)
 	if (fderr == -1)
 		fderr_eof = 1;
 
+	poller = poller_new();
 	server_init_dispatch(ssh);
 
 	/* Main loop of the server for the interactive session mode. */
@@ -637,6 +641,7 @@ server_loop(pid_t pid, int fdin_arg, int fdout_arg, int fderr_arg)
 		 * input data, cause a real eof by closing fdin.
 		 */
 		if (stdin_eof && fdin != -1 && sshbuf_len(stdin_buffer) == 0) {
+			poller_forget(poller, fdin);
 			if (fdin != fdout)
 				close(fdin);
 			else
@@ -693,15 +698,8 @@ server_loop(pid_t pid, int fdin_arg, int fdout_arg, int fderr_arg)
 				xfree(cp);
 			}
 		}
-		max_fd = MAX(connection_in, connection_out);
-		max_fd = MAX(max_fd, fdin);
-		max_fd = MAX(max_fd, fdout);
-		max_fd = MAX(max_fd, fderr);
-		max_fd = MAX(max_fd, notify_pipe[0]);
-
-		/* Sleep in select() until we can do something. */
-		wait_until_can_do_something(ssh, &readset, &writeset, &max_fd,
-		    &nalloc, max_time_milliseconds);
+		/* Sleep until we can do something. */
+		wait_until_can_do_something(ssh, poller, max_time_milliseconds);
 
 		if (received_sigterm) {
 			logit("Exiting on signal %d", (int)received_sigterm);
@@ -710,18 +708,14 @@ server_loop(pid_t pid, int fdin_arg, int fdout_arg, int fderr_arg)
 		}
 
 		/* Process any channel events. */
-		channel_after_select(readset, writeset);
+		channel_after_poll(poller);
 
 		/* Process input from the client and from program stdout/stderr. */
-		process_input(ssh, readset);
+		process_input(ssh, poller);
 
 		/* Process output to the client and to program stdin. */
-		process_output(ssh, writeset);
+		process_output(ssh, poller);
 	}
-	if (readset)
-		xfree(readset);
-	if (writeset)
-		xfree(writeset);
 
 	/* Cleanup and termination code. */
 
@@ -750,6 +744,7 @@ server_loop(pid_t pid, int fdin_arg, int fdout_arg, int fderr_arg)
 	fdin = -1;
 
 	channel_free_all();
+	poller_free(poller);
 
 	/* We no longer want our SIGCHLD handler to be called. */
 	signal(SIGCHLD, SIG_DFL);
@@ -821,8 +816,8 @@ collect_children(void)
 void
 server_loop2(struct ssh *ssh)
 {
-	fd_set *readset = NULL, *writeset = NULL;
-	int r, rekeying = 0, max_fd, nalloc = 0;
+	struct poller *poller;
+	int r, rekeying = 0;
 
 	debug("Entering interactive session for SSH2.");
 
@@ -838,13 +833,19 @@ server_loop2(struct ssh *ssh)
 	}
 
 	notify_setup();
-
-	max_fd = MAX(connection_in, connection_out);
-	max_fd = MAX(max_fd, notify_pipe[0]);
+	poller = poller_new();
 
 	server_init_dispatch(ssh);
 
 	for (;;) {
+		if (session_resumed) {
+			/* the old connection is gone, its numbers may be reused */
+			poller_forget(poller, connection_in);
+			poller_forget(poller, connection_out);
+			connection_in = ssh_packet_get_connection_in(ssh);
+			connection_out = ssh_packet_get_connection_out(ssh);
+			session_resumed = 0;
+		}
 		process_buffered_input_packets(ssh);
 
 		rekeying = (ssh->kex != NULL &&
@@ -852,8 +853,7 @@ server_loop2(struct ssh *ssh)
 
 		if (!rekeying && ssh_packet_not_very_much_data_to_write(ssh))
 			channel_output_poll();
-		wait_until_can_do_something(ssh, &readset, &writeset, &max_fd,
-		    &nalloc, 0);
+		wait_until_can_do_something(ssh, poller, 0);
 
 		if (received_sigterm) {
 			logit("Exiting on signal %d", (int)received_sigterm);
@@ -863,7 +863,7 @@ server_loop2(struct ssh *ssh)
 
 		collect_children();
 		if (!rekeying) {
-			channel_after_select(readset, writeset);
+			channel_after_poll(poller);
 			if (ssh_packet_need_rekeying(ssh)) {
 				debug("need rekeying");
 				ssh->kex->done = 0;
@@ -873,20 +873,18 @@ server_loop2(struct ssh *ssh)
 				}
 			}
 		}
-		process_input(ssh, readset);
+		process_input(ssh, poller);
 		if (connection_closed)
 			break;
-		process_output(ssh, writeset);
+		if (poller_ready(poller, roaming_server_fd(), POLLER_READ))
+			roaming_server_takeover(ssh);
+		process_output(ssh, poller);
 	}
 	collect_children();
 
-	if (readset)
-		xfree(readset);
-	if (writeset)
-		xfree(writeset);
-
 	/* free all channels, no more reads and writes */
 	channel_free_all();
+	poller_free(poller);
 
 	/* free remaining sessions, e.g. remove wtmp entries */
 	session_destroy_all(NULL);
@@ -1004,10 +1002,16 @@ server_request_tun(struct ssh *ssh)
 {
 	Channel *c = NULL;
 	int r, mode, tun, sock;
+	u_int flags = 0;
+	size_t len;
 
 	if ((r = sshpkt_get_u32(ssh, &mode)) != 0 ||
 	    (r = sshpkt_get_u32(ssh, &tun)) != 0)
 		fatal("%s: %s", __func__, ssh_err(r));
+	/* newer clients offer to pack several frames per packet */
+	if (sshpkt_ptr(ssh, &len) != NULL && len > 0 &&
+	    (r = sshpkt_get_u32(ssh, &flags)) != 0)
+		fatal("%s: %s", __func__, ssh_err(r));
 	switch (mode) {
 	case SSH_TUNMODE_POINTOPOINT:
 	case SSH_TUNMODE_ETHERNET:
@@ -1032,6 +1036,7 @@ server_request_tun(struct ssh *ssh)
 	c = channel_new("tun", SSH_CHANNEL_OPEN, sock, sock, -1,
 	    CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT, 0, "tun", 1);
 	c->datagram = 1;
+	c->tun_batch = (flags & CHAN_TUN_BATCH) != 0;
 
  done:
 	if (c == NULL)
@@ -1103,13 +1108,19 @@ server_input_channel_open(int type, u_int32_t seq, struct ssh *ssh)
 		c->remote_id = rchan;
 		c->remote_window = rwindow;
 		c->remote_maxpacket = rmaxpack;
-		if (c->type != SSH_CHANNEL_CONNECTING) {
+		/* the client asks for bulk mode by offering large packets */
+		if (rmaxpack > CHAN_SES_PACKET_DEFAULT)
+			channel_set_bulk(c);
+		if (c->type != SSH_CHANNEL_CONNECTING &&
+		    c->type != SSH_CHANNEL_RESOLVING) {
 			if ((r = sshpkt_start(ssh,
 			    SSH2_MSG_CHANNEL_OPEN_CONFIRMATION)) != 0 ||
 			    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
 			    (r = sshpkt_put_u32(ssh, c->self)) != 0 ||
 			    (r = sshpkt_put_u32(ssh, c->local_window)) != 0 ||
 			    (r = sshpkt_put_u32(ssh, c->local_maxpacket)) != 0||
+			    (c->tun_batch &&
+			    (r = sshpkt_put_u32(ssh, CHAN_TUN_BATCH)) != 0) ||
 			    (r = sshpkt_send(ssh)) != 0)
 				goto out;
 		}
@@ -1137,8 +1148,8 @@ server_input_global_request(int type, u_int32_t seq, struct ssh *ssh)
 {
 	char *rtype = NULL, *listen_address = NULL, *cancel_address = NULL;
 	char want_reply;
-	u_int listen_port, cancel_port;
-	int r, success = 0, allocated_listen_port = 0;
+	u_int listen_port, cancel_port, roambuf;
+	int r, success = 0, allocated_listen_port = 0, roaming = 0;
 
 	if ((r = sshpkt_get_cstring(ssh, &rtype, NULL)) != 0 ||
 	    (r = sshpkt_get_u8(ssh, &want_reply)) != 0)
@@ -1183,12 +1194,18 @@ server_input_global_request(int type, u_int32_t seq, struct ssh *ssh)
 	} else if (strcmp(rtype, "no-more-sessions@openssh.com") == 0) {
 		no_more_sessions = 1;
 		success = 1;
+	} else if (strcmp(rtype, ROAMING_REQUEST) == 0) {
+		if ((r = sshpkt_get_u32(ssh, &roambuf)) != 0)
+			goto out;
+		success = roaming = want_reply &&
+		    roaming_server_enable(ssh, roambuf) == 0;
 	}
 	if (want_reply) {
 		if ((r = sshpkt_start(ssh, success ?
 		    SSH2_MSG_REQUEST_SUCCESS : SSH2_MSG_REQUEST_FAILURE)) != 0 ||
 		    (success && allocated_listen_port > 0 &&
 		    (r = sshpkt_put_u32(ssh, allocated_listen_port)) != 0) ||
+		    (roaming && (r = roaming_server_reply(ssh)) != 0) ||
 		    (r = sshpkt_send(ssh)) != 0) 
 			goto out;
 		ssh_packet_write_wait(ssh);
@@ -40,6 +40,7 @@
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/queue.h>
+#include <sys/time.h>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -82,6 +83,8 @@
 #endif
 #include "monitor_wrap.h"
 #include "sftp.h"
+#include "certcache.h"
+#include "cmdcache.h"
 #include "err.h"
 #include "sshbuf.h"
 
@@ -732,8 +735,11 @@ do_exec_pty(Session *s, const char *command)
 int
 do_exec(Session *s, const char *command)
 {
+	struct timeval start;
 	int ret;
 
+	monotime_tv(&start);
+
 	if (options.adm_forced_command) {
 		original_command = command;
 		command = options.adm_forced_command;
@@ -775,6 +781,10 @@ do_exec(Session *s, const char *command)
 	 */
 	sshbuf_reset(loginmsg);
 
+	/* the startup pipe is closed by now, so this is only logged */
+	debug("%s: session setup took %llu us", __func__,
+	    (unsigned long long)monotime_since_us(&start));
+
 	return ret;
 }
 
@@ -1215,6 +1225,10 @@ do_setusercontext(struct passwd *pw)
 {
 	char *chroot_path, *tmp;
 
+	/* the shared caches must not be writable by the user */
+	certcache_detach();
+	cmdcache_detach();
+
 	if (getuid() == 0 || geteuid() == 0) {
 		/* Prepare groups */
 		if (setusercontext(lc, pw, pw->pw_uid,
@@ -1974,6 +1988,9 @@ session_set_fds(Session *s, int fdin, int fdout, int fderr, int ignore_fderr,
 	    fdout, fdin, fderr,
 	    ignore_fderr ? CHAN_EXTENDED_IGNORE : CHAN_EXTENDED_READ,
 	    1, is_tty, CHAN_SES_WINDOW_DEFAULT);
+	/* tty sessions are interactive, as for ssh_packet_set_interactive() */
+	if (is_tty)
+		channel_set_interactive(channel_by_id(s->chanid), 1);
 }
 
 /*
@@ -0,0 +1,176 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "misc.h"
+#include "shmcache.h"
+
+/* A new, already unlinked, shared memory object of 'len' bytes */
+static int
+shmcache_new(const char *name, size_t len)
+{
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), "/sshd.%s.%ld.%08x", name,
+	    (long)getpid(), arc4random());
+	if ((fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL, 0600)) == -1) {
+		error("%s: %s: shm_open: %s", __func__, name, strerror(errno));
+		return -1;
+	}
+	shm_unlink(path);
+	if (ftruncate(fd, len) == -1) {
+		error("%s: %s: ftruncate: %s", __func__, name,
+		    strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Map a cache of 'nsets' sets of slots of 'slot_size' bytes, after 'off'
+ * bytes for the caller's header.  'fd' is the descriptor of the cache
+ * passed by the listener; if it is -1 or does not fit, a new cache is
+ * created.  Returns 0 on success, -1 if there is no cache.
+ */
+int
+shmcache_init(struct shmcache *sc, const char *name, int fd, size_t off,
+    size_t slot_size, u_int nsets)
+{
+	struct stat st;
+	size_t len = off + (size_t)nsets * SHMCACHE_WAYS * slot_size;
+	void *p;
+
+	memset(sc, 0, sizeof(*sc));
+	sc->fd = -1;
+	if (fd != -1 && (fstat(fd, &st) == -1 || st.st_size != (off_t)len)) {
+		error("%s: %s: unusable cache from listener", __func__, name);
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1 && (fd = shmcache_new(name, len)) == -1)
+		return -1;
+	if ((p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED,
+	    fd, 0)) == MAP_FAILED) {
+		error("%s: %s: mmap: %s", __func__, name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	/* keep it from commands run by the monitor */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	sc->name = name;
+	sc->map = p;
+	sc->len = len;
+	sc->fd = fd;
+	sc->off = off;
+	sc->slot_size = slot_size;
+	sc->nsets = nsets;
+	return 0;
+}
+
+void
+shmcache_detach(struct shmcache *sc)
+{
+	if (sc->map == NULL)
+		return;
+	munmap(sc->map, sc->len);
+	close(sc->fd);
+	memset(sc, 0, sizeof(*sc));
+	sc->fd = -1;
+}
+
+/* Slot 'way' of the set that 'hash' belongs to */
+struct shmcache_slot *
+shmcache_slot(const struct shmcache *sc, const u_char *hash, u_int way)
+{
+	u_int set = get_u32(hash) % sc->nsets;
+
+	return (struct shmcache_slot *)(sc->map + sc->off +
+	    (set * SHMCACHE_WAYS + way) * sc->slot_size);
+}
+
+/*
+ * The slot to store 'hash' in: the one that already holds it, else an
+ * expired one, else the least recently used one.
+ */
+struct shmcache_slot *
+shmcache_victim(const struct shmcache *sc, const u_char *hash, u_int64_t now)
+{
+	struct shmcache_slot *s, *victim = NULL;
+	u_int i;
+
+	for (i = 0; i < SHMCACHE_WAYS; i++) {
+		s = shmcache_slot(sc, hash, i);
+		if (memcmp(s->hash, hash, sizeof(s->hash)) == 0)
+			return s;
+		if (victim == NULL || s->expires <= now ||
+		    (victim->expires > now && s->used < victim->used))
+			victim = s;
+	}
+	return victim;
+}
+
+/* Claim 's' for writing.  Returns 0 if somebody else is writing it. */
+int
+shmcache_claim(struct shmcache_slot *s, u_int32_t *seqp)
+{
+	u_int32_t seq = s->seq;
+
+	if ((seq & 1) || !__sync_bool_compare_and_swap(&s->seq, seq, seq + 1))
+		return 0;
+	__sync_synchronize();
+	*seqp = seq;
+	return 1;
+}
+
+/* Make the slot claimed with 'seq' visible to readers */
+void
+shmcache_publish(struct shmcache_slot *s, u_int32_t seq)
+{
+	__sync_synchronize();
+	s->seq = seq + 2;
+}
+
+/* Start reading 's'.  Returns 0 if it is being written. */
+int
+shmcache_read_begin(const struct shmcache_slot *s, u_int32_t *seqp)
+{
+	if ((*seqp = s->seq) & 1)
+		return 0;
+	__sync_synchronize();
+	return 1;
+}
+
+/* Returns 1 if what was read of 's' since shmcache_read_begin() is valid */
+int
+shmcache_read_end(const struct shmcache_slot *s, u_int32_t seq)
+{
+	__sync_synchronize();
+	return s->seq == seq;
+}
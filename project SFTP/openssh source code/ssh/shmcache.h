@@ -0,0 +1,70 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2013 The OpenBSD project.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SHMCACHE_H
+#define _SHMCACHE_H
+
+/*
+ * Set-associative caches in shared memory, used by certcache.c and
+ * cmdcache.c.  Each set holds SHMCACHE_WAYS slots, chosen by the hash of
+ * their key and replaced by LRU.  The listener creates the memory and
+ * passes its descriptor to every re-executed sshd, so that the cache is
+ * shared by all connections.
+ *
+ * Every slot is guarded by a sequence number, which is odd while the slot
+ * is being written.  A writer claims a slot by making its sequence number
+ * odd and leaves it if somebody else got there first: not caching is
+ * harmless.  Readers never block: a slot is used only if its sequence
+ * number was even and unchanged while it was read, otherwise it counts as
+ * a miss.
+ */
+
+#define SHMCACHE_HASH_LEN	32	/* SHA256 */
+#define SHMCACHE_WAYS		4	/* slots per set, replaced by LRU */
+
+/* Start of every slot */
+struct shmcache_slot {
+	volatile u_int32_t seq;		/* odd while being written */
+	u_int32_t	pad;
+	u_int64_t	expires;	/* in the caller's clock */
+	u_int64_t	used;		/* monotime() of the last hit */
+	u_char		hash[SHMCACHE_HASH_LEN];
+};
+
+struct shmcache {
+	const char	*name;
+	u_char		*map;
+	size_t		 len;
+	int		 fd;
+	size_t		 off;		/* of the first slot */
+	size_t		 slot_size;
+	u_int		 nsets;
+};
+
+int	 shmcache_init(struct shmcache *, const char *, int, size_t, size_t,
+	    u_int);
+void	 shmcache_detach(struct shmcache *);
+struct shmcache_slot *shmcache_slot(const struct shmcache *,
+	    const u_char *, u_int);
+struct shmcache_slot *shmcache_victim(const struct shmcache *,
+	    const u_char *, u_int64_t);
+int	 shmcache_claim(struct shmcache_slot *, u_int32_t *);
+void	 shmcache_publish(struct shmcache_slot *, u_int32_t);
+int	 shmcache_read_begin(const struct shmcache_slot *, u_int32_t *);
+int	 shmcache_read_end(const struct shmcache_slot *, u_int32_t);
+
+#endif /* _SHMCACHE_H */
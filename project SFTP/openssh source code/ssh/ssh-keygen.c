@@ -39,7 +39,9 @@
 #include "misc.h"
 #include "match.h"
 #include "hostfile.h"
+#include "revoke.h"
 #include "dns.h"
+#include "ssh.h"
 #include "ssh2.h"
 #include "err.h"
 
@@ -79,6 +81,9 @@ int delete_host = 0;
 /* Flag indicating that we want to show the contents of a certificate */
 int show_cert = 0;
 
+/* Flag indicating that we want to compile a revocation list */
+int gen_revocation = 0;
+
 /* Flag indicating that we just want to see the key fingerprint */
 int print_fingerprint = 0;
 int print_bubblebabble = 0;
@@ -976,10 +981,27 @@ printhost(FILE *f, const char *name, struct sshkey *public, int ca, int hash)
 		xfree(ra);
 		xfree(fp);
 	} else {
+		static char prev[256];
+		static u_int nsalted;
 		int r;
 
-		if (hash && (name = host_hash(name, NULL, 0)) == NULL)
-			fatal("hash_host failed");
+		/*
+		 * Names are hashed in groups of HOSTFILE_SALT_GROUP sharing
+		 * one salt, taken from the previous hashed name, so that a
+		 * lookup through the index needs one HMAC per group.
+		 */
+		if (hash) {
+			if (nsalted == 0 || nsalted >= HOSTFILE_SALT_GROUP) {
+				name = host_hash(name, NULL, 0);
+				nsalted = 0;
+			} else
+				name = host_hash(name, prev, strlen(prev));
+			if (name == NULL)
+				fatal("hash_host failed");
+			if (strlcpy(prev, name, sizeof(prev)) >= sizeof(prev))
+				fatal("hash_host result too long");
+			nsalted++;
+		}
 		fprintf(f, "%s%s%s ", ca ? CA_MARKER : "", ca ? " " : "", name);
 		if ((r = sshkey_write(public, f)) != 0)
 			fatal("key_write failed: %s", ssh_err(r));
@@ -1194,6 +1216,17 @@ do_known_hosts(struct passwd *pw, const char *name)
 
 		fprintf(stderr, "%s updated.\n", identity_file);
 		fprintf(stderr, "Original contents retained as %s\n", old);
+
+		/* Index hashed files, keep an existing index up to date */
+		snprintf(tmp, sizeof(tmp), "%s%s", identity_file,
+		    HOSTFILE_INDEX_SUFFIX);
+		if (hash_hosts || access(tmp, F_OK) == 0) {
+			if (hostfile_index_build(identity_file) == 0)
+				fprintf(stderr, "Index written to %s\n", tmp);
+			else
+				fprintf(stderr, "Could not write index %s\n",
+				    tmp);
+		}
 		if (has_unhashed) {
 			fprintf(stderr, "WARNING: %s contains unhashed "
 			    "entries\n", old);
@@ -1858,6 +1891,85 @@ show_options(struct sshbuf *optbuf, int v00, int in_critical)
 	sshbuf_free(options);
 }
 
+/*
+ * Compile the public keys and "serial: N[-M]" lines of the files given as
+ * arguments into the revocation list identity_file.  Serials refer to
+ * certificates signed by the CA public key given with -s.
+ */
+static void
+do_gen_revocation(struct passwd *pw, int argc, char **argv)
+{
+	struct revoke_list *rl;
+	struct sshkey *ca = NULL, *key;
+	FILE *f;
+	char line[SSH_MAX_PUBKEY_BYTES], *cp, *ep, *path;
+	unsigned long long lo, hi;
+	u_long linenum;
+	int i, r;
+
+	if (!have_identity)
+		fatal("Revocation list must be specified with -f");
+	if (ca_key_path != NULL) {
+		path = tilde_expand_filename(ca_key_path, pw->pw_uid);
+		if ((r = sshkey_load_public(path, &ca, NULL)) != 0)
+			fatal("Cannot load CA public key %s: %s",
+			    path, ssh_err(r));
+		xfree(path);
+	}
+	rl = revoke_list_new();
+	for (i = 0; i < argc; i++) {
+		if ((f = fopen(argv[i], "r")) == NULL)
+			fatal("open %s: %s", argv[i], strerror(errno));
+		linenum = 0;
+		while (read_keyfile_line(f, argv[i], line, sizeof(line),
+		    &linenum) != -1) {
+			cp = line + strspn(line, " \t");
+			if (*cp == '#' || *cp == '\n' || *cp == '\0')
+				continue;
+			if (strncasecmp(cp, "serial:", 7) == 0) {
+				if (ca == NULL)
+					fatal("%s:%lu: revoking serials "
+					    "requires a CA key (-s)",
+					    argv[i], linenum);
+				cp += 7;
+				cp += strspn(cp, " \t");
+				errno = 0;
+				lo = hi = strtoull(cp, &ep, 10);
+				if (*cp >= '0' && *cp <= '9' && *ep == '-' &&
+				    ep[1] >= '0' && ep[1] <= '9')
+					hi = strtoull(ep + 1, &ep, 10);
+				if (*cp < '0' || *cp > '9' || errno == ERANGE ||
+				    ep[strspn(ep, " \t\n")] != '\0' || lo > hi)
+					fatal("%s:%lu: invalid serial",
+					    argv[i], linenum);
+				if ((r = revoke_list_add_serials(rl, ca,
+				    lo, hi)) != 0)
+					fatal("%s:%lu: %s", argv[i], linenum,
+					    ssh_err(r));
+				continue;
+			}
+			if ((key = sshkey_new(KEY_UNSPEC)) == NULL)
+				fatal("sshkey_new failed");
+			if ((r = sshkey_read(key, &cp)) != 0)
+				fatal("%s:%lu: invalid key: %s", argv[i],
+				    linenum, ssh_err(r));
+			if ((r = revoke_list_add_key(rl, key)) != 0)
+				fatal("%s:%lu: %s", argv[i], linenum,
+				    ssh_err(r));
+			sshkey_free(key);
+		}
+		fclose(f);
+	}
+	if ((r = revoke_list_write(rl, identity_file)) != 0)
+		fatal("Unable to write %s: %s", identity_file, ssh_err(r));
+	if (!quiet)
+		printf("Revocation list written to %s\n", identity_file);
+	revoke_list_free(rl);
+	if (ca != NULL)
+		sshkey_free(ca);
+	exit(0);
+}
+
 static void
 do_show_cert(struct passwd *pw)
 {
@@ -1949,6 +2061,7 @@ usage(void)
 	fprintf(stderr, "  -J number   Screen this number of moduli lines.\n");
 	fprintf(stderr, "  -j number   Start screening moduli at specified line.\n");
 	fprintf(stderr, "  -K checkpt  Write checkpoints to this file.\n");
+	fprintf(stderr, "  -k          Compile keys and serials into a revocation list.\n");
 	fprintf(stderr, "  -L          Print the contents of a certificate.\n");
 	fprintf(stderr, "  -l          Show fingerprint of key file.\n");
 	fprintf(stderr, "  -M memory   Amount of memory (MB) to use for generating DH-GEX moduli.\n");
@@ -2015,7 +2128,7 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
-	while ((opt = getopt(argc, argv, "AegiqpclBHLhvxXyF:b:f:t:D:I:J:j:K:P:"
+	while ((opt = getopt(argc, argv, "AegikqpclBHLhvxXyF:b:f:t:D:I:J:j:K:P:"
 	    "m:N:n:O:C:r:g:R:T:G:M:S:s:a:V:W:z:")) != -1) {
 		switch (opt) {
 		case 'A':
@@ -2034,6 +2147,9 @@ main(int argc, char **argv)
 		case 'H':
 			hash_hosts = 1;
 			break;
+		case 'k':
+			gen_revocation = 1;
+			break;
 		case 'I':
 			cert_key_id = optarg;
 			break;
@@ -2204,7 +2320,7 @@ main(int argc, char **argv)
 	argv += optind;
 	argc -= optind;
 
-	if (ca_key_path != NULL) {
+	if (ca_key_path != NULL || gen_revocation) {
 		if (argc < 1) {
 			printf("Too few arguments.\n");
 			usage();
@@ -2221,6 +2337,8 @@ main(int argc, char **argv)
 		printf("Cannot use -l with -D or -R.\n");
 		usage();
 	}
+	if (gen_revocation)
+		do_gen_revocation(pw, argc, argv);
 	if (ca_key_path != NULL) {
 		if (cert_key_id == NULL)
 			fatal("Must specify key id (-I) when certifying");
@@ -18,12 +18,16 @@
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <errno.h>
 #include <event.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -36,6 +40,50 @@
 #include "authfile.h"
 #include "err.h"
 #include "sshbuf.h"
+#include "xmalloc.h"
+#include "msg.h"
+#include "monitor_fdpass.h"
+
+/*
+ * A backend the proxy may forward to.  The -L target is the first
+ * upstream, additional ones are added with -U.
+ */
+struct upstream {
+	char *host;
+	int port;
+	u_int idx;			/* bit in session tried mask */
+	u_int weight;
+	int current;			/* smooth weighted round-robin state */
+	int healthy;
+	u_int sessions;			/* sessions currently assigned */
+	u_int64_t connects;		/* successful connects */
+	u_int64_t failures;		/* failed connects and probes */
+	u_int64_t latency_us;		/* sum of connect latencies */
+	u_int64_t latency_max_us;
+	int probe_fd;
+	struct event probe_ev;
+	TAILQ_ENTRY(upstream) next;
+};
+#define MAX_UPSTREAMS		64
+#define UPSTREAM_BIT(u)		(((u_int64_t)1) << (u)->idx)
+
+#define BALANCE_LEASTCONN	0
+#define BALANCE_WEIGHTED	1
+
+#define CONNECT_TIMEOUT		5	/* seconds */
+#define PROBE_TIMEOUT		5	/* seconds */
+#define PROBE_INTERVAL		10	/* seconds */
+
+/* handover to a new proxy, see migrate_listen() */
+#define MIGRATE_VERSION		1
+#define MIGRATE_HELLO		1	/* new -> old: version */
+#define MIGRATE_LISTENER	2	/* old -> new, followed by the socket */
+#define MIGRATE_SESSION		3	/* old -> new, followed by 2 sockets */
+#define MIGRATE_DONE		4	/* old -> new: no sessions left */
+#define MIGRATE_MAX_STATE	(200*1024)	/* below ssh_msg_recv() limit */
+#define MIGRATE_RETRY		1	/* seconds */
+#define MIGRATE_HELLO_LEN	9	/* length, type and version */
+#define MIGRATE_HELLO_TIMEOUT	5	/* seconds */
 
 struct side {
 	int fd;
@@ -48,6 +96,9 @@ struct session {
 	struct side client, server;
 	TAILQ_ENTRY(session) next;
 	int flags;
+	struct upstream *upstream;
+	u_int64_t tried;		/* upstreams already attempted */
+	struct timeval connect_start;
 };
 Forward fwd;
 
@@ -55,19 +106,55 @@ void accept_cb(int, short, void *);
 void connect_cb(int, short, void *);
 void input_cb(int, short, void *);
 void output_cb(int, short, void *);
+void probe_cb(int, short, void *);
+void probe_timer_cb(int, short, void *);
+void stats_cb(int, short, void *);
+void migrate_accept_cb(int, short, void *);
+void migrate_hello_cb(int, short, void *);
+void migrate_input_cb(int, short, void *);
+void migrate_timer_cb(int, short, void *);
 
 int do_connect(const char *, int);
 int do_listen(const char *, int);
 void session_close(struct session *);
+int session_connect(struct session *);
+void upstream_add(const char *, int, u_int);
+void upstream_failed(struct upstream *);
+struct upstream *upstream_select(u_int64_t, int);
 int ssh_packet_fwd(struct side *, struct side *);
 int ssh_prepare_output(struct side *);
 void usage(void);
+int migrate_listen(const char *);
+int migrate_connect(const char *);
+int migrate_path_live(const char *);
+void migrate_start(int);
+int migrate_takeover(const char *);
+void migrate_abort(void);
+int session_migrate(struct session *);
+int session_import(struct sshbuf *);
 
 uid_t original_real_uid;	/* XXX */
 TAILQ_HEAD(, session) sessions;
+u_int nsessions;		/* including those still connecting */
+TAILQ_HEAD(, upstream) upstreams;
+u_int nupstreams;
+int balance_mode = BALANCE_LEASTCONN;
+int probe_interval = PROBE_INTERVAL;
+struct event probe_timer;
 struct kex_params kex_params;
 int foreground;
 int dump_packets;
+int listen_fd = -1;
+struct event listen_ev;
+char *migrate_path;		/* control socket */
+int migrate_listen_fd = -1;
+struct event migrate_listen_ev;
+int migrate_fd = -1;		/* handover in progress */
+int migrate_hello_fd = -1;	/* control connection not yet identified */
+struct event migrate_hello_ev;
+u_char migrate_hello[MIGRATE_HELLO_LEN];
+size_t migrate_hello_len;
+struct event migrate_ev, migrate_timer;
 
 #define BUFSZ 16*1024
 struct sshkey *hostkey, *known_hostkey;
@@ -162,9 +249,169 @@ do_connect(const char *addr, int port)
 	return sock;
 }
 
+void
+upstream_add(const char *host, int port, u_int weight)
+{
+	struct upstream *u;
+
+	if (nupstreams >= MAX_UPSTREAMS)
+		fatal("too many upstreams (max %d)", MAX_UPSTREAMS);
+	u = xcalloc(1, sizeof(*u));
+	u->host = xstrdup(host);
+	u->port = port;
+	u->idx = nupstreams++;
+	u->weight = weight;
+	u->healthy = 1;
+	u->probe_fd = -1;
+	TAILQ_INSERT_TAIL(&upstreams, u, next);
+	debug("upstream %u: %s:%d weight %u", u->idx, host, port, weight);
+}
+
+/*
+ * Pick an upstream that is not in the exclude mask.  With least-connections
+ * the upstream with the lowest sessions/weight ratio wins, otherwise smooth
+ * weighted round-robin is used.  Unhealthy upstreams are only considered
+ * if 'any' is set.
+ */
+struct upstream *
+upstream_select(u_int64_t exclude, int any)
+{
+	struct upstream *u, *best = NULL;
+	int total = 0;
+
+	TAILQ_FOREACH(u, &upstreams, next) {
+		if ((exclude & UPSTREAM_BIT(u)) || (!u->healthy && !any))
+			continue;
+		if (balance_mode == BALANCE_WEIGHTED) {
+			u->current += u->weight;
+			total += u->weight;
+			if (best == NULL || u->current > best->current)
+				best = u;
+		} else if (best == NULL ||
+		    (u_int64_t)u->sessions * best->weight <
+		    (u_int64_t)best->sessions * u->weight)
+			best = u;
+	}
+	if (best != NULL && balance_mode == BALANCE_WEIGHTED)
+		best->current -= total;
+	return best;
+}
+
+/* take an upstream out of rotation until the next successful probe */
+void
+upstream_failed(struct upstream *u)
+{
+	u->failures++;
+	if (u->healthy) {
+		logit("upstream %s:%d marked down", u->host, u->port);
+		u->healthy = 0;
+	}
+}
+
+/*
+ * Start a non-blocking connect to the next upstream this session has not
+ * tried yet.  Returns -1 once every upstream has failed.
+ */
+int
+session_connect(struct session *s)
+{
+	struct upstream *u;
+	struct timeval tv;
+
+	for (;;) {
+		if ((u = upstream_select(s->tried, 0)) == NULL &&
+		    (u = upstream_select(s->tried, 1)) == NULL)
+			return -1;
+		s->tried |= UPSTREAM_BIT(u);
+		monotime_tv(&s->connect_start);
+		if ((s->server.fd = do_connect(u->host, u->port)) >= 0)
+			break;
+		upstream_failed(u);
+	}
+	s->upstream = u;
+	u->sessions++;
+	tv.tv_sec = CONNECT_TIMEOUT;
+	tv.tv_usec = 0;
+	event_set(&s->server.output, s->server.fd, EV_WRITE, connect_cb, s);
+	event_add(&s->server.output, &tv);
+	debug2("session %p: connecting to %s:%d", s, u->host, u->port);
+	return 0;
+}
+
+void
+probe_cb(int fd, short type, void *arg)
+{
+	struct upstream *u = arg;
+	char buf[256];
+	ssize_t len = -1;
+
+	if (type & EV_READ)
+		len = read(fd, buf, sizeof(buf));
+	close(u->probe_fd);
+	u->probe_fd = -1;
+	/* XXX servers may send other lines before the banner */
+	if (len >= 4 && memcmp(buf, "SSH-", 4) == 0) {
+		if (!u->healthy)
+			logit("upstream %s:%d marked up", u->host, u->port);
+		u->healthy = 1;
+		return;
+	}
+	debug("probe %s:%d failed: %s", u->host, u->port,
+	    (type & EV_TIMEOUT) ? "timeout" : "no banner");
+	upstream_failed(u);
+}
+
+/* periodically check every upstream by waiting for its banner */
+void
+probe_timer_cb(int fd, short type, void *arg)
+{
+	struct upstream *u;
+	struct timeval tv;
+
+	TAILQ_FOREACH(u, &upstreams, next) {
+		if (u->probe_fd != -1)
+			continue;
+		if ((u->probe_fd = do_connect(u->host, u->port)) < 0) {
+			upstream_failed(u);
+			continue;
+		}
+		tv.tv_sec = PROBE_TIMEOUT;
+		tv.tv_usec = 0;
+		event_set(&u->probe_ev, u->probe_fd, EV_READ, probe_cb, u);
+		event_add(&u->probe_ev, &tv);
+	}
+	tv.tv_sec = probe_interval;
+	tv.tv_usec = 0;
+	evtimer_add(&probe_timer, &tv);
+}
+
+void
+stats_cb(int fd, short type, void *arg)
+{
+	struct upstream *u;
+	u_int64_t avg;
+
+	TAILQ_FOREACH(u, &upstreams, next) {
+		avg = u->connects ? u->latency_us / u->connects : 0;
+		logit("upstream %s:%d %s weight %u sessions %u connects %llu "
+		    "failures %llu latency avg %llu.%03llums max %llu.%03llums",
+		    u->host, u->port, u->healthy ? "up" : "down", u->weight,
+		    u->sessions, (unsigned long long)u->connects,
+		    (unsigned long long)u->failures,
+		    (unsigned long long)avg / 1000,
+		    (unsigned long long)avg % 1000,
+		    (unsigned long long)u->latency_max_us / 1000,
+		    (unsigned long long)u->latency_max_us % 1000);
+	}
+}
+
 void
 session_close(struct session *s)
 {
+	if (s->upstream) {
+		s->upstream->sessions--;
+		s->upstream = NULL;
+	}
 	if (s->client.fd != -1)
 		close(s->client.fd);
 	if (s->server.fd != -1)
@@ -184,6 +431,7 @@ session_close(struct session *s)
 		}
 		TAILQ_REMOVE(&sessions, s, next);
 	}
+	nsessions--;
 	debug2("closing session %p", s);
 	free(s);
 }
@@ -213,12 +461,11 @@ accept_cb(int fd, short type, void *arg)
 	s->client.fd = acceptfd;
 	event_add(ev, NULL);
 	addrlen = sizeof(addr);
-	if ((s->server.fd = do_connect(fwd.connect_host, fwd.connect_port)) < 0) {
-		error("do_connect() failed");
+	if (session_connect(s) < 0) {
+		error("no upstream available");
 		goto fail;
 	}
-	event_set(&s->server.output, s->server.fd, EV_WRITE, connect_cb, s);
-	event_add(&s->server.output, NULL);
+	nsessions++;
 	debug2("new session %p", s);
 	return;
 fail:
@@ -232,17 +479,38 @@ void
 connect_cb(int fd, short type, void *arg)
 {
 	struct session *s = arg;
+	struct upstream *u = s->upstream;
+	u_int64_t latency;
 	int soerr;
 	int r;
 	socklen_t sz = sizeof(soerr);
 
 	event_del(&s->server.output);
-	if (getsockopt(s->server.fd, SOL_SOCKET, SO_ERROR, &soerr, &sz) < 0) {
+	if (type & EV_TIMEOUT)
+		soerr = ETIMEDOUT;
+	else if (getsockopt(s->server.fd, SOL_SOCKET, SO_ERROR, &soerr,
+	    &sz) < 0) {
 		soerr = errno;
 		error("connect_cb: getsockopt: %s", strerror(errno));
 	}
-	if (soerr != 0)
+	if (soerr != 0) {
+		error("connect to %s:%d failed: %s", u->host, u->port,
+		    strerror(soerr));
+		upstream_failed(u);
+		u->sessions--;
+		s->upstream = NULL;
+		close(s->server.fd);
+		s->server.fd = -1;
+		/* fail over to the next upstream */
+		if (session_connect(s) == 0)
+			return;
 		goto fail;
+	}
+	latency = monotime_since_us(&s->connect_start);
+	u->connects++;
+	u->latency_us += latency;
+	if (latency > u->latency_max_us)
+		u->latency_max_us = latency;
 	memcpy(kex_params.proposal, myproposal, sizeof(kex_params.proposal));
 	if ((r = ssh_init(&s->client.ssh, 1, &kex_params)) != 0) {
 		error("could init client context: %s", ssh_err(r));
@@ -417,14 +685,452 @@ output_cb(int fd, short type, void *arg)
 	}
 }
 
+/*
+ * Connection migration.  A new proxy started with the same -M control
+ * socket as a running one takes over its listening socket and, one by
+ * one, its sessions: the transport state of both sides is exported with
+ * ssh_export_state() and sent along with the sockets.  Sessions that are
+ * still connecting or in the middle of a key exchange are retried until
+ * none are left, then the old proxy exits.
+ *
+ * The control socket is only accessible to the user running the proxy,
+ * and connections from other users are refused, as the sessions and
+ * their keys are handed to whoever connects.
+ */
+int
+migrate_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	mode_t old_umask;
+	int sock;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		error("control path too long: %s", path);
+		return -1;
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		error("socket: %s", strerror(errno));
+		return -1;
+	}
+	unlink(path);
+	old_umask = umask(0177);
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(sock, 1) < 0) {
+		error("control socket %s: %s", path, strerror(errno));
+		umask(old_umask);
+		close(sock);
+		return -1;
+	}
+	umask(old_umask);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	event_set(&migrate_listen_ev, sock, EV_READ | EV_PERSIST,
+	    migrate_accept_cb, NULL);
+	event_add(&migrate_listen_ev, NULL);
+	migrate_listen_fd = sock;
+	return 0;
+}
+
+/* Ask the proxy running at 'path' to hand over; returns the channel. */
+int
+migrate_connect(const char *path)
+{
+	struct sockaddr_un sun;
+	struct sshbuf *m;
+	int sock, r;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		return -1;
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		debug("no proxy to take over at %s: %s", path,
+		    strerror(errno));
+		close(sock);
+		return -1;
+	}
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_u32(m, MIGRATE_VERSION)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if (ssh_msg_send(sock, MIGRATE_HELLO, m) < 0) {
+		sshbuf_free(m);
+		close(sock);
+		return -1;
+	}
+	sshbuf_free(m);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	return sock;
+}
+
+/* Returns 1 if a proxy is accepting on the control socket 'path'. */
+int
+migrate_path_live(const char *path)
+{
+	struct sockaddr_un sun;
+	int sock, live;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		return 0;
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return 0;
+	live = connect(sock, (struct sockaddr *)&sun, sizeof(sun)) == 0;
+	close(sock);
+	return live;
+}
+
+/* Hand over one established session.  Returns 0 if it was sent. */
+int
+session_migrate(struct session *s)
+{
+	struct sshbuf *m;
+	int r, ret = -1;
+
+	if (s->flags != SESSION_CONNECTED)
+		return -1;
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if ((r = sshbuf_put_cstring(m, s->upstream ?
+	    s->upstream->host : "")) != 0 ||
+	    (r = sshbuf_put_u32(m, s->upstream ?
+	    s->upstream->port : 0)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	/* try again later if a key exchange is running */
+	if (ssh_export_state(s->client.ssh, m) != 0 ||
+	    ssh_export_state(s->server.ssh, m) != 0 ||
+	    sshbuf_len(m) > MIGRATE_MAX_STATE)
+		goto out;
+	if (ssh_msg_send(migrate_fd, MIGRATE_SESSION, m) < 0 ||
+	    mm_send_fd(migrate_fd, s->client.fd) < 0 ||
+	    mm_send_fd(migrate_fd, s->server.fd) < 0) {
+		migrate_abort();
+		goto out;
+	}
+	debug2("session %p: migrated", s);
+	session_close(s);
+	ret = 0;
+ out:
+	sshbuf_free(m);
+	return ret;
+}
+
+/* Give up on a failed handover and carry on serving. */
+void
+migrate_abort(void)
+{
+	error("handover failed, resuming service");
+	evtimer_del(&migrate_timer);
+	close(migrate_fd);
+	migrate_fd = -1;
+	if (listen_fd != -1)
+		event_add(&listen_ev, NULL);
+	/* the new proxy may have bound the control socket already */
+	if (migrate_path == NULL)
+		return;
+	if (migrate_path_live(migrate_path))
+		logit("control socket %s taken by another proxy", migrate_path);
+	else
+		migrate_listen(migrate_path);
+}
+
+/* Send all sessions that can be moved; exit once none are left. */
+void
+migrate_timer_cb(int fd, short type, void *arg)
+{
+	struct session *s, *tmp;
+	struct sshbuf *m;
+	struct timeval tv;
+	u_int n = 0;
+
+	for (s = TAILQ_FIRST(&sessions); s != NULL; s = tmp) {
+		tmp = TAILQ_NEXT(s, next);
+		if (session_migrate(s) == 0)
+			n++;
+		if (migrate_fd == -1)
+			return;	/* aborted */
+	}
+	if (n > 0)
+		logit("migrated %u sessions, %u left", n, nsessions);
+	if (nsessions > 0) {
+		tv.tv_sec = MIGRATE_RETRY;
+		tv.tv_usec = 0;
+		evtimer_add(&migrate_timer, &tv);
+		return;
+	}
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if (ssh_msg_send(migrate_fd, MIGRATE_DONE, m) < 0) {
+		sshbuf_free(m);
+		migrate_abort();
+		return;
+	}
+	sshbuf_free(m);
+	logit("handover complete, exiting");
+	exit(0);
+}
+
+/* A new proxy wants to take over. */
+void
+migrate_accept_cb(int fd, short type, void *arg)
+{
+	struct timeval tv;
+	uid_t euid;
+	gid_t egid;
+	int sock;
+
+	if ((sock = accept(fd, NULL, NULL)) < 0) {
+		error("accept control: %s", strerror(errno));
+		return;
+	}
+	if (getpeereid(sock, &euid, &egid) < 0) {
+		error("getpeereid %d failed: %s", sock, strerror(errno));
+		close(sock);
+		return;
+	}
+	if (euid != 0 && euid != getuid()) {
+		error("handover request from uid %u refused", (u_int)euid);
+		close(sock);
+		return;
+	}
+	if (migrate_hello_fd != -1) {
+		debug("handover request already pending");
+		close(sock);
+		return;
+	}
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+		error("fcntl control: %s", strerror(errno));
+		close(sock);
+		return;
+	}
+	migrate_hello_fd = sock;
+	migrate_hello_len = 0;
+	event_set(&migrate_hello_ev, sock, EV_READ, migrate_hello_cb, NULL);
+	tv.tv_sec = MIGRATE_HELLO_TIMEOUT;
+	tv.tv_usec = 0;
+	event_add(&migrate_hello_ev, &tv);
+}
+
+/* Read the request of a new proxy without blocking the event loop. */
+void
+migrate_hello_cb(int fd, short type, void *arg)
+{
+	struct timeval tv;
+	ssize_t len;
+
+	if (type & EV_TIMEOUT) {
+		error("handover request timed out");
+		goto fail;
+	}
+	len = read(fd, migrate_hello + migrate_hello_len,
+	    sizeof(migrate_hello) - migrate_hello_len);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		len = 0;
+	else if (len <= 0) {
+		debug("control connection closed");
+		goto fail;
+	}
+	migrate_hello_len += len;
+	if (migrate_hello_len < sizeof(migrate_hello)) {
+		tv.tv_sec = MIGRATE_HELLO_TIMEOUT;
+		tv.tv_usec = 0;
+		event_add(&migrate_hello_ev, &tv);
+		return;
+	}
+	if (get_u32(migrate_hello) != MIGRATE_HELLO_LEN - 4 ||
+	    migrate_hello[4] != MIGRATE_HELLO ||
+	    get_u32(migrate_hello + 5) != MIGRATE_VERSION) {
+		error("bad handover request");
+		goto fail;
+	}
+	migrate_hello_fd = -1;
+	if (fcntl(fd, F_SETFL, 0) < 0) {
+		error("fcntl control: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+	migrate_start(fd);
+	return;
+ fail:
+	close(fd);
+	migrate_hello_fd = -1;
+}
+
+/* Hand the listener and then the sessions over to the proxy at 'sock'. */
+void
+migrate_start(int sock)
+{
+	struct sshbuf *m;
+
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if (ssh_msg_send(sock, MIGRATE_LISTENER, m) < 0 ||
+	    mm_send_fd(sock, listen_fd) < 0) {
+		error("handover of listener failed");
+		sshbuf_free(m);
+		close(sock);
+		return;
+	}
+	sshbuf_free(m);
+	logit("handing over to a new proxy");
+	/* the new proxy accepts from now on and owns the control socket */
+	event_del(&listen_ev);
+	event_del(&migrate_listen_ev);
+	close(migrate_listen_fd);
+	migrate_listen_fd = -1;
+	migrate_fd = sock;
+	evtimer_set(&migrate_timer, migrate_timer_cb, NULL);
+	migrate_timer_cb(-1, 0, NULL);
+}
+
+/* Continue a session handed over by the old proxy. */
+int
+session_import(struct sshbuf *m)
+{
+	struct session *s;
+	struct upstream *u;
+	char *host = NULL;
+	u_int port;
+	int r, r1, r2, pending;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		fatal("%s: calloc failed", __func__);
+	s->client.fd = s->server.fd = -1;
+	if ((s->client.fd = mm_receive_fd(migrate_fd)) < 0 ||
+	    (s->server.fd = mm_receive_fd(migrate_fd)) < 0) {
+		r = SSH_ERR_SYSTEM_ERROR;
+		goto fail;
+	}
+	memcpy(kex_params.proposal, myproposal, sizeof(kex_params.proposal));
+	if ((r = sshbuf_get_cstring(m, &host, NULL)) != 0 ||
+	    (r = sshbuf_get_u32(m, &port)) != 0 ||
+	    (r = ssh_import_state(&s->client.ssh, 1, &kex_params, m)) != 0 ||
+	    (r = ssh_import_state(&s->server.ssh, 0, &kex_params, m)) != 0 ||
+	    (r = ssh_add_hostkey(s->client.ssh, hostkey)) != 0 ||
+	    (r = ssh_add_hostkey(s->server.ssh, known_hostkey)) != 0)
+		goto fail;
+	TAILQ_FOREACH(u, &upstreams, next) {
+		if (u->port == (int)port && strcmp(u->host, host) == 0) {
+			s->upstream = u;
+			u->sessions++;
+			break;
+		}
+	}
+	free(host);
+	fcntl(s->client.fd, F_SETFL, O_NONBLOCK);
+	fcntl(s->server.fd, F_SETFL, O_NONBLOCK);
+	event_set(&s->client.input,  s->client.fd, EV_READ, input_cb, s);
+	event_set(&s->client.output, s->client.fd, EV_WRITE, output_cb, s);
+	event_set(&s->server.input,  s->server.fd, EV_READ, input_cb, s);
+	event_set(&s->server.output, s->server.fd, EV_WRITE, output_cb, s);
+	event_add(&s->server.input, NULL);
+	event_add(&s->client.input, NULL);
+	s->flags = SESSION_CONNECTED;
+	TAILQ_INSERT_TAIL(&sessions, s, next);
+	nsessions++;
+	debug2("session %p: taken over", s);
+	/* the old proxy may have left complete packets and output behind */
+	r1 = ssh_packet_fwd(&s->client, &s->server);
+	r2 = ssh_packet_fwd(&s->server, &s->client);
+	pending = ssh_prepare_output(&s->client) +
+	    ssh_prepare_output(&s->server);
+	if (r1 || r2) {
+		error("ssh_packet_fwd: %s/%s", ssh_err(r1), ssh_err(r2));
+		if (pending)
+			s->flags |= SESSION_NEEDS_FLUSH;
+		else
+			session_close(s);
+	}
+	return 0;
+ fail:
+	error("could not take over session: %s", ssh_err(r));
+	free(host);
+	if (s->client.ssh)
+		ssh_free(s->client.ssh);
+	if (s->server.ssh)
+		ssh_free(s->server.ssh);
+	if (s->client.fd != -1)
+		close(s->client.fd);
+	if (s->server.fd != -1)
+		close(s->server.fd);
+	free(s);
+	return -1;
+}
+
+/* Sessions arriving from the old proxy. */
+void
+migrate_input_cb(int fd, short type, void *arg)
+{
+	struct sshbuf *m;
+	u_char msgtype;
+
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if (ssh_msg_recv(fd, m) < 0 || sshbuf_get_u8(m, &msgtype) != 0)
+		msgtype = 0;
+	switch (msgtype) {
+	case MIGRATE_SESSION:
+		session_import(m);
+		event_add(&migrate_ev, NULL);
+		break;
+	case MIGRATE_DONE:
+		logit("takeover complete");
+		close(fd);
+		migrate_fd = -1;
+		break;
+	default:
+		error("takeover aborted by the old proxy");
+		close(fd);
+		migrate_fd = -1;
+		break;
+	}
+	sshbuf_free(m);
+}
+
+/* Take over the listener of the old proxy; -1 if there is none. */
+int
+migrate_takeover(const char *path)
+{
+	struct sshbuf *m;
+	u_char msgtype;
+	int fd;
+
+	if ((migrate_fd = migrate_connect(path)) < 0)
+		return -1;
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	if (ssh_msg_recv(migrate_fd, m) < 0 ||
+	    sshbuf_get_u8(m, &msgtype) != 0 || msgtype != MIGRATE_LISTENER ||
+	    (fd = mm_receive_fd(migrate_fd)) < 0) {
+		error("takeover from %s failed", path);
+		sshbuf_free(m);
+		close(migrate_fd);
+		migrate_fd = -1;
+		return -1;
+	}
+	sshbuf_free(m);
+	logit("taking over from the proxy at %s", path);
+	event_set(&migrate_ev, migrate_fd, EV_READ, migrate_input_cb, NULL);
+	event_add(&migrate_ev, NULL);
+	return fd;
+}
+
 void
 usage(void)
 {
 	extern char *__progname;
 
 	fprintf(stderr,
-	    "usage: %s [-dfh] [-L [laddr:]lport:saddr:sport]"
-	    " [-C knownkey] [-S serverkey]\n",
+	    "usage: %s [-dfh] [-b leastconn | weighted] [-C knownkey]\n"
+	    "           [-H interval] [-L [laddr:]lport:saddr:sport]\n"
+	    "           [-M control] [-S serverkey] [-U saddr:sport[:weight]]\n",
 	    __progname);
 	exit(1);
 }
@@ -432,17 +1138,29 @@ usage(void)
 int
 main(int argc, char **argv)
 {
-	int ch, log_stderr = 1, fd, r;
-	struct event ev;
+	int ch, log_stderr = 1, r, port;
+	long weight;
+	struct event ev_usr1;
+	struct timeval tv;
 	char *hostkey_file = NULL, *known_hostkey_file = NULL;
+	char *cp, *host, *sport, *sweight, *ep;
 	SyslogFacility log_facility = SYSLOG_FACILITY_AUTH;
 	LogLevel log_level = SYSLOG_LEVEL_VERBOSE;
 	extern char *__progname;
 
 	TAILQ_INIT(&sessions);
+	TAILQ_INIT(&upstreams);
 
-	while ((ch = getopt(argc, argv, "dfC:DL:S:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:dfC:DH:L:M:S:U:")) != -1) {
 		switch (ch) {
+		case 'b':
+			if (strcmp(optarg, "leastconn") == 0)
+				balance_mode = BALANCE_LEASTCONN;
+			else if (strcmp(optarg, "weighted") == 0)
+				balance_mode = BALANCE_WEIGHTED;
+			else
+				fatal("unknown balance mode: %s", optarg);
+			break;
 		case 'd':
 			if (log_level == SYSLOG_LEVEL_VERBOSE)
 				log_level = SYSLOG_LEVEL_DEBUG1;
@@ -461,21 +1179,46 @@ main(int argc, char **argv)
 			foreground = 1;
 			dump_packets++;
 			break;
+		case 'H':
+			if ((probe_interval = convtime(optarg)) == -1)
+				fatal("invalid probe interval: %s", optarg);
+			break;
 		case 'L':
 			if (parse_forward(&fwd, optarg, 0, 0) == 0)
 				fatal("cannot parse: %s", optarg);
 			if (fwd.listen_host == NULL)
 				fwd.listen_host = "0.0.0.0";
+			upstream_add(fwd.connect_host, fwd.connect_port, 1);
+			break;
+		case 'M':
+			migrate_path = optarg;
 			break;
 		case 'S':
 			hostkey_file = optarg;
 			break;
+		case 'U':
+			cp = xstrdup(optarg);
+			if ((host = hpdelim(&cp)) == NULL ||
+			    (sport = hpdelim(&cp)) == NULL ||
+			    (port = a2port(sport)) <= 0)
+				fatal("cannot parse: %s", optarg);
+			weight = 1;
+			if ((sweight = hpdelim(&cp)) != NULL) {
+				weight = strtol(sweight, &ep, 10);
+				if (*sweight == '\0' || *ep != '\0' ||
+				    weight < 1 || weight > 1000)
+					fatal("invalid weight: %s", sweight);
+			}
+			upstream_add(cleanhostname(host), port, weight);
+			break;
 		default:
 			usage();
 			break;
 		}
 	}
 	log_init(__progname, log_level, log_facility, log_stderr);
+	if (fwd.listen_port == 0 || TAILQ_EMPTY(&upstreams))
+		usage();
 	if (hostkey_file &&
 	    (r = sshkey_load_private(hostkey_file, "", &hostkey, NULL)) != 0)
 		fatal("sshkey_load_private: %s: %s", hostkey_file, ssh_err(r));
@@ -487,10 +1230,25 @@ main(int argc, char **argv)
 	if (!foreground)
 		daemon(0, 0);
 	event_init();
-	if ((fd = do_listen(fwd.listen_host, fwd.listen_port)) < 0)
+	signal(SIGPIPE, SIG_IGN);
+	/* take over from a running proxy or start afresh */
+	if (migrate_path != NULL)
+		listen_fd = migrate_takeover(migrate_path);
+	if (listen_fd == -1 &&
+	    (listen_fd = do_listen(fwd.listen_host, fwd.listen_port)) < 0)
 		fatal(" do_listen failed");
-	event_set(&ev, fd, EV_READ, accept_cb, &ev);
-	event_add(&ev, NULL);
+	event_set(&listen_ev, listen_fd, EV_READ, accept_cb, &listen_ev);
+	event_add(&listen_ev, NULL);
+	if (migrate_path != NULL && migrate_listen(migrate_path) < 0)
+		fatal("cannot create control socket %s", migrate_path);
+	signal_set(&ev_usr1, SIGUSR1, stats_cb, NULL);
+	signal_add(&ev_usr1, NULL);
+	if (probe_interval > 0) {
+		evtimer_set(&probe_timer, probe_timer_cb, NULL);
+		tv.tv_sec = probe_interval;
+		tv.tv_usec = 0;
+		evtimer_add(&probe_timer, &tv);
+	}
 	event_dispatch();
 	exit(1);
 }
@@ -92,6 +92,7 @@
 #include "sshpty.h"
 #include "match.h"
 #include "msg.h"
+#include "hostfile.h"
 #include "uidswap.h"
 #include "roaming.h"
 #include "version.h"
@@ -695,6 +696,7 @@ main(int ac, char **av)
 	fill_default_options(&options);
 
 	channel_set_af(options.address_family);
+	channel_set_window_budget(options.channel_window_budget);
 
 	/* reinit */
 	log_init(argv0, options.log_level, SYSLOG_FACILITY_USER, !use_syslog);
@@ -886,6 +888,10 @@ main(int ac, char **av)
 	tilde_expand_paths(options.system_hostfiles,
 	    options.num_system_hostfiles);
 	tilde_expand_paths(options.user_hostfiles, options.num_user_hostfiles);
+	for (i = 0; i < (int)options.num_system_hostfiles; i++)
+		hostfile_index_refresh(options.system_hostfiles[i]);
+	for (i = 0; i < (int)options.num_user_hostfiles; i++)
+		hostfile_index_refresh(options.user_hostfiles[i]);
 
 	signal(SIGPIPE, SIG_IGN); /* ignore SIGPIPE early */
 	signal(SIGCHLD, main_sigchld_handler);
@@ -1399,6 +1405,8 @@ ssh_session2_open(struct ssh *ssh)
 	    "session", SSH_CHANNEL_OPENING, in, out, err,
 	    window, packetmax, CHAN_EXTENDED_WRITE,
 	    "client-session", /*nonblock*/0);
+	if (client_session_is_bulk(tty_flag, subsystem_flag, command))
+		channel_set_bulk(c);
 
 	debug3("ssh_session2_open: channel_new: %d", c->self);
 
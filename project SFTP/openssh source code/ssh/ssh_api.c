@@ -29,6 +29,7 @@
 #include "err.h"
 #include "sshbuf.h"
 
+#include <pthread.h>
 #include <string.h>
 
 int	_ssh_exchange_banner(struct ssh *);
@@ -38,6 +39,7 @@ int	_ssh_order_hostkeyalgs(struct ssh *);
 int	_ssh_verify_host_key(struct sshkey *, struct ssh *);
 struct sshkey *_ssh_host_public_key(int, struct ssh *);
 struct sshkey *_ssh_host_private_key(int, struct ssh *);
+void	_ssh_init_once(void);
 
 /*
  * stubs for the server side implementation of kex.
@@ -65,20 +67,28 @@ mm_choose_dh(int min, int nbits, int max)
 	return (NULL);
 }
 
+/*
+ * process wide state touched by the API, set up exactly once so that
+ * independent connections can be driven from different threads.
+ */
+void
+_ssh_init_once(void)
+{
+	OpenSSL_add_all_algorithms();
+	enable_compat20();
+}
+
 /* API */
 
 int
 ssh_init(struct ssh **sshp, int is_server, struct kex_params *kex_params)
 {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
 	struct ssh *ssh;
 	char **proposal;
-	static int called;
 	int r;
 
-	if (!called) {
-		OpenSSL_add_all_algorithms();
-		called = 1;
-	}
+	pthread_once(&once, _ssh_init_once);
 
 	ssh = ssh_packet_set_connection(NULL, -1, -1);
 	if (is_server)
@@ -133,6 +143,7 @@ ssh_free(struct ssh *ssh)
 	}
 	if (ssh->kex)
 		kex_free(ssh->kex);
+	ssh_channel_free_all(ssh);
 	free(ssh);
 }
 
@@ -196,6 +207,12 @@ ssh_set_verify_host_key_callback(struct ssh *ssh,
 	return 0;
 }
 
+int
+ssh_hostkey_verified(struct ssh *ssh, int ok)
+{
+	return kex_hostkey_verified(ssh, ok);
+}
+
 int
 ssh_input_append(struct ssh *ssh, const char *data, size_t len)
 {
@@ -217,6 +234,11 @@ ssh_packet_next(struct ssh *ssh, u_char *typep)
 	if (ssh->kex->client_version_string == NULL ||
 	    ssh->kex->server_version_string == NULL)
 		return _ssh_exchange_banner(ssh);
+	/* waiting for a deferred host key verdict */
+	if (ssh->kex->flags & KEX_HOSTKEY_FAILED)
+		return SSH_ERR_SIGNATURE_INVALID;
+	if (ssh->kex->flags & KEX_HOSTKEY_PENDING)
+		return 0;
 	/*
 	 * If we enough data and a dispatch function then
 	 * call the function and get the next packet.
@@ -236,6 +258,14 @@ ssh_packet_next(struct ssh *ssh, u_char *typep)
 		    ssh->dispatch[type] != NULL) {
 			if ((r = (*ssh->dispatch[type])(type, seqnr, ssh)) != 0)
 				return r;
+			/*
+			 * Leave the peer's NEWKEYS queued until
+			 * ssh_hostkey_verified() resumes the key exchange.
+			 */
+			if (ssh->kex->flags & KEX_HOSTKEY_FAILED)
+				return SSH_ERR_SIGNATURE_INVALID;
+			if (ssh->kex->flags & KEX_HOSTKEY_PENDING)
+				return 0;
 		} else {
 			*typep = type;
 			return 0;
@@ -349,7 +379,6 @@ _ssh_read_banner(struct ssh *ssh, char **bannerp)
 	}
 	if (remote_major != 2)
 		return SSH_ERR_PROTOCOL_MISMATCH;
-	enable_compat20();
 	chop(buf);
 	debug("Remote version string %.100s", buf);
 	if ((*bannerp = strdup(buf)) == NULL)
@@ -509,3 +538,95 @@ _ssh_order_hostkeyalgs(struct ssh *ssh)
 	kex_prop_free(proposal);
 	return r;
 }
+
+/* Connection migration */
+
+#define SSH_STATE_VERSION	1
+
+int
+ssh_export_state(struct ssh *ssh, struct sshbuf *m)
+{
+	struct kex *kex = ssh->kex;
+	struct sshbuf *b;
+	int r;
+
+	if (kex == NULL || !kex->done || kex->flags != 0 ||
+	    kex->client_version_string == NULL ||
+	    kex->server_version_string == NULL ||
+	    ssh_channel_count(ssh) != 0)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if ((b = sshbuf_new()) == NULL)
+		return SSH_ERR_ALLOC_FAIL;
+	if ((r = ssh_packet_get_state(ssh, b)) != 0 ||
+	    (r = sshbuf_put_u32(m, SSH_STATE_VERSION)) != 0 ||
+	    (r = sshbuf_put_u32(m, kex->server)) != 0 ||
+	    (r = sshbuf_put_u32(m, ssh->compat)) != 0 ||
+	    (r = sshbuf_put_u32(m, ssh_packet_is_authenticated(ssh))) != 0 ||
+	    (r = sshbuf_put_stringb(m, b)) != 0)
+		goto out;
+	r = 0;
+ out:
+	sshbuf_free(b);
+	return r;
+}
+
+int
+ssh_import_state(struct ssh **sshp, int is_server,
+    struct kex_params *kex_params, struct sshbuf *m)
+{
+	struct ssh *ssh = NULL;
+	struct kex *kex = NULL, *restored;
+	struct sshbuf *b = NULL;
+	u_int version, server, compat, authenticated;
+	int r;
+
+	*sshp = NULL;
+	if ((r = sshbuf_get_u32(m, &version)) != 0 ||
+	    (r = sshbuf_get_u32(m, &server)) != 0 ||
+	    (r = sshbuf_get_u32(m, &compat)) != 0 ||
+	    (r = sshbuf_get_u32(m, &authenticated)) != 0 ||
+	    (r = sshbuf_froms(m, &b)) != 0)
+		goto out;
+	if (version != SSH_STATE_VERSION || (server != 0) != (is_server != 0)) {
+		r = SSH_ERR_INVALID_FORMAT;
+		goto out;
+	}
+	if ((r = ssh_init(&ssh, is_server, kex_params)) != 0)
+		goto out;
+	ssh->compat = compat;
+	/*
+	 * ssh_packet_set_state() replaces the kex with a bare one; keep
+	 * ours for its methods and callbacks and take over the results
+	 * of the previous key exchange.
+	 */
+	kex = ssh->kex;
+	r = ssh_packet_set_state(ssh, b);
+	restored = ssh->kex;
+	ssh->kex = kex;
+	if (restored == kex || restored == NULL)
+		goto out;	/* failed before the kex was restored */
+	kex->session_id = restored->session_id;
+	kex->session_id_len = restored->session_id_len;
+	kex->we_need = restored->we_need;
+	kex->hostkey_type = restored->hostkey_type;
+	kex->kex_type = restored->kex_type;
+	kex->client_version_string = restored->client_version_string;
+	kex->server_version_string = restored->server_version_string;
+	kex->done = 1;
+	restored->session_id = NULL;
+	restored->client_version_string = NULL;
+	restored->server_version_string = NULL;
+	kex_free(restored);
+	if (r != 0)
+		goto out;
+	if (!authenticated)
+		ssh_packet_clear_authenticated(ssh);
+	*sshp = ssh;
+	ssh = NULL;
+ out:
+	if (ssh != NULL)
+		ssh_free(ssh);
+	if (b != NULL)
+		sshbuf_free(b);
+	return r;
+}
@@ -35,6 +35,14 @@ struct kex_params {
 
 /* public SSH API functions */
 
+/*
+ * Distinct ssh connection objects share no mutable state, so they
+ * may be used concurrently from different threads.  A single object
+ * must not be used by more than one thread at a time.  Multi-threaded
+ * applications must set up libcrypto locking themselves and should
+ * configure logging before the first thread is started.
+ */
+
 /*
  * ssh_init() create a ssh connection object with given (optional)
  * key exchange parameters.
@@ -67,10 +75,22 @@ int	ssh_add_hostkey(struct ssh *ssh, struct sshkey *key);
  * which should be called instead of the default verification. The
  * function given must return 0 if the hostkey is ok, -1 if the
  * verification has failed.
+ * if the verdict is not available yet, the function may return
+ * KEX_VERIFY_DEFERRED instead.  the key exchange is then parked and
+ * ssh_packet_next() returns no further packets until the verdict has
+ * been delivered with ssh_hostkey_verified().
  */
 int	ssh_set_verify_host_key_callback(struct ssh *ssh,
     int (*cb)(struct sshkey *, struct ssh *));
 
+/*
+ * ssh_hostkey_verified() delivers a deferred host key verdict: 'ok' is
+ * non-zero if the key was accepted.  accepting resumes the key exchange
+ * (output may be appended to the output byte-stream), rejecting makes
+ * the connection fail with SSH_ERR_SIGNATURE_INVALID.
+ */
+int	ssh_hostkey_verified(struct ssh *ssh, int ok);
+
 /*
  * ssh_packet_next() advances to the next input packet and returns
  * the packet type in typep.
@@ -132,4 +152,137 @@ const u_char	*ssh_output_ptr(struct ssh *ssh, size_t *len);
  */
 int	ssh_output_consume(struct ssh *ssh, size_t len);
 
+/* channel API */
+
+struct ssh_channel;
+
+/*
+ * callbacks for events on a channel. every callback is optional and
+ * gets the context passed to ssh_channel_open() or
+ * ssh_channel_set_callbacks().
+ *
+ * open: the peer confirmed (ok != 0) or refused a channel opened with
+ * ssh_channel_open(). a refused channel is freed after the callback.
+ * data, extended_data: the peer sent data. once the application has
+ * processed it, it must report the number of bytes with
+ * ssh_channel_consume() so that the peer's window is reopened.
+ * data arriving without a callback is consumed immediately.
+ * eof: the peer will send no more data.
+ * close: the channel has been closed in both directions and is freed
+ * when the callback returns.
+ * window: the peer granted more window, 'space' bytes may be written.
+ * request: a channel request arrived. return 0 to report success,
+ * -1 for failure. without a callback all requests fail.
+ */
+struct ssh_channel_callbacks {
+	void	(*open)(struct ssh_channel *, int ok, void *ctx);
+	void	(*data)(struct ssh_channel *, const u_char *, size_t,
+	    void *ctx);
+	void	(*extended_data)(struct ssh_channel *, u_int code,
+	    const u_char *, size_t, void *ctx);
+	void	(*eof)(struct ssh_channel *, void *ctx);
+	void	(*close)(struct ssh_channel *, void *ctx);
+	void	(*window)(struct ssh_channel *, size_t space, void *ctx);
+	int	(*request)(struct ssh_channel *, const char *rtype,
+	    const u_char *, size_t, void *ctx);
+};
+
+/*
+ * called when the peer opens a channel. 'extra' holds the type specific
+ * part of the open message. return 0 to accept the channel (and set its
+ * callbacks with ssh_channel_set_callbacks()), or a SSH2_OPEN_* reason
+ * code to refuse it.
+ */
+typedef int ssh_channel_accept_fn(struct ssh *, struct ssh_channel *,
+    const char *ctype, const u_char *extra, size_t extralen, void *ctx);
+
+/*
+ * ssh_channel_set_accept_callback() registers the function that decides
+ * on channels opened by the peer. without it every open is refused.
+ */
+int	ssh_channel_set_accept_callback(struct ssh *, ssh_channel_accept_fn *,
+    void *ctx);
+
+/*
+ * ssh_channel_input() handles the current input packet if it belongs
+ * to the connection protocol's channel messages and sets *handledp.
+ * it should be called for every packet type returned by
+ * ssh_packet_next(). callbacks run from within ssh_channel_input(),
+ * and any replies are appended to the output byte-stream.
+ */
+int	ssh_channel_input(struct ssh *, u_char type, int *handledp);
+
+/*
+ * ssh_channel_open() requests a new channel of type 'ctype' with the
+ * type specific data 'extra'. the open callback reports the outcome.
+ */
+int	ssh_channel_open(struct ssh *, const char *ctype, const u_char *extra,
+    size_t extralen, const struct ssh_channel_callbacks *, void *ctx,
+    struct ssh_channel **);
+void	ssh_channel_set_callbacks(struct ssh_channel *,
+    const struct ssh_channel_callbacks *, void *ctx);
+
+/*
+ * ssh_channel_set_window() changes the receive window and maximum packet
+ * size we advertise. it must be called before the window is first
+ * announced, i.e. from the accept callback.
+ */
+int	ssh_channel_set_window(struct ssh_channel *, u_int window,
+    u_int maxpacket);
+
+/*
+ * ssh_channel_write() packetizes as much of 'data' as the peer's window
+ * allows and returns the number of bytes taken in *writtenp. the rest
+ * should be retried from the window callback.
+ * ssh_channel_write_space() returns the number of bytes that can be
+ * written right now.
+ */
+int	ssh_channel_write(struct ssh_channel *, const u_char *data, size_t len,
+    size_t *writtenp);
+size_t	ssh_channel_write_space(struct ssh_channel *);
+
+/*
+ * ssh_channel_consume() reports that 'len' bytes of received data have
+ * been processed and sends a window adjust once enough has accumulated.
+ */
+int	ssh_channel_consume(struct ssh_channel *, size_t len);
+
+/*
+ * ssh_channel_eof() tells the peer we will send no more data.
+ * ssh_channel_close() closes the channel. it is freed (after the close
+ * callback) once the peer has closed it, too.
+ */
+int	ssh_channel_eof(struct ssh_channel *);
+int	ssh_channel_close(struct ssh_channel *);
+
+u_int	 ssh_channel_id(struct ssh_channel *);
+const char *ssh_channel_type(struct ssh_channel *);
+struct ssh *ssh_channel_get_ssh(struct ssh_channel *);
+u_int	 ssh_channel_count(struct ssh *);
+void	 ssh_channel_free_all(struct ssh *);
+
+/* connection migration */
+
+/*
+ * ssh_export_state() serializes an established connection: keys,
+ * sequence numbers, compression state and the buffered input and output
+ * byte-streams.  together with the connection's socket (see
+ * mm_send_fd()) this lets another process continue the connection with
+ * ssh_import_state() as if nothing had happened.
+ * a connection can only be exported between key exchanges and while it
+ * has no channels; otherwise SSH_ERR_INVALID_ARGUMENT is returned and the
+ * caller should try again later.  the exported connection must not be
+ * used any further and should be released with ssh_free().
+ */
+int	ssh_export_state(struct ssh *, struct sshbuf *);
+
+/*
+ * ssh_import_state() creates a connection object from the output of
+ * ssh_export_state().  'kex_params' are used for later key exchanges.
+ * host keys and callbacks are not part of the state and need to be set
+ * up again before the next key exchange.
+ */
+int	ssh_import_state(struct ssh **, int is_server,
+    struct kex_params *kex_params, struct sshbuf *);
+
 #endif
@@ -0,0 +1,608 @@
+/* $OpenBSD: $ */
+/*
+ * Copyright (c) 2012 Markus Friedl.  All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Connection protocol (RFC 4254) channels for ssh_api users.  Unlike
+ * channels.c this code never touches file descriptors: data is handed
+ * to and taken from the application through callbacks, so any number
+ * of channels can be driven from the application's own event loop.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssh_api.h"
+#include "ssh2.h"
+#include "log.h"
+#include "misc.h"
+#include "err.h"
+
+#define SSH_CHANNEL_WINDOW_DEFAULT	(2*1024*1024)
+#define SSH_CHANNEL_PACKET_DEFAULT	(32*1024)
+#define SSH_CHANNEL_ALLOC_INITIAL	16
+
+/* channel flags */
+#define CHAN_F_OPENING		0x01	/* waiting for open confirmation */
+#define CHAN_F_EOF_SENT		0x02
+#define CHAN_F_EOF_RCVD		0x04
+#define CHAN_F_CLOSE_SENT	0x08
+#define CHAN_F_CLOSE_RCVD	0x10
+
+struct ssh_channel {
+	struct ssh *ssh;
+	u_int self;			/* our channel id */
+	u_int remote_id;		/* peer's channel id */
+	int flags;
+	char *ctype;
+	u_int local_window;		/* bytes the peer may still send */
+	u_int local_window_max;
+	u_int local_consumed;		/* consumed but not yet adjusted */
+	u_int local_maxpacket;
+	u_int remote_window;		/* bytes we may still send */
+	u_int remote_maxpacket;
+	const struct ssh_channel_callbacks *cb;
+	void *ctx;
+};
+
+struct ssh_chanctx {
+	struct ssh_channel **chans;
+	u_int nalloc;
+	u_int nfree;			/* lowest slot that may be free */
+	ssh_channel_accept_fn *accept;
+	void *accept_ctx;
+};
+
+static int
+chan_ctx(struct ssh *ssh, struct ssh_chanctx **ctxp)
+{
+	struct ssh_chanctx *cc;
+
+	if ((cc = ssh->chanctx) == NULL) {
+		if ((cc = calloc(1, sizeof(*cc))) == NULL)
+			return SSH_ERR_ALLOC_FAIL;
+		ssh->chanctx = cc;
+	}
+	*ctxp = cc;
+	return 0;
+}
+
+static int
+chan_new(struct ssh *ssh, const char *ctype, struct ssh_channel **cp)
+{
+	struct ssh_chanctx *cc;
+	struct ssh_channel *c, **tmp;
+	u_int i, n;
+	int r;
+
+	*cp = NULL;
+	if ((r = chan_ctx(ssh, &cc)) != 0)
+		return r;
+	for (i = cc->nfree; i < cc->nalloc; i++)
+		if (cc->chans[i] == NULL)
+			break;
+	if (i == cc->nalloc) {
+		n = cc->nalloc ? cc->nalloc * 2 : SSH_CHANNEL_ALLOC_INITIAL;
+		if (n <= cc->nalloc ||
+		    (tmp = reallocn(cc->chans, n, sizeof(*tmp))) == NULL)
+			return SSH_ERR_ALLOC_FAIL;
+		memset(tmp + cc->nalloc, 0, (n - cc->nalloc) * sizeof(*tmp));
+		cc->chans = tmp;
+		cc->nalloc = n;
+	}
+	if ((c = calloc(1, sizeof(*c))) == NULL ||
+	    (c->ctype = strdup(ctype)) == NULL) {
+		free(c);
+		return SSH_ERR_ALLOC_FAIL;
+	}
+	c->ssh = ssh;
+	c->self = i;
+	c->local_window = c->local_window_max = SSH_CHANNEL_WINDOW_DEFAULT;
+	c->local_maxpacket = SSH_CHANNEL_PACKET_DEFAULT;
+	cc->chans[i] = c;
+	cc->nfree = i + 1;
+	*cp = c;
+	return 0;
+}
+
+static void
+chan_free(struct ssh_channel *c)
+{
+	struct ssh_chanctx *cc = c->ssh->chanctx;
+
+	debug3("%s: channel %u", __func__, c->self);
+	cc->chans[c->self] = NULL;
+	if (c->self < cc->nfree)
+		cc->nfree = c->self;
+	free(c->ctype);
+	free(c);
+}
+
+static struct ssh_channel *
+chan_lookup(struct ssh *ssh, u_int id)
+{
+	struct ssh_chanctx *cc = ssh->chanctx;
+
+	if (cc == NULL || id >= cc->nalloc)
+		return NULL;
+	return cc->chans[id];
+}
+
+/* free the channel once CLOSE went both ways */
+static void
+chan_check_closed(struct ssh_channel *c)
+{
+	if ((c->flags & (CHAN_F_CLOSE_SENT|CHAN_F_CLOSE_RCVD)) !=
+	    (CHAN_F_CLOSE_SENT|CHAN_F_CLOSE_RCVD))
+		return;
+	if (c->cb != NULL && c->cb->close != NULL)
+		c->cb->close(c, c->ctx);
+	chan_free(c);
+}
+
+static int
+chan_send_open_failure(struct ssh *ssh, u_int remote_id, int reason)
+{
+	int r;
+
+	if ((r = sshpkt_start(ssh, SSH2_MSG_CHANNEL_OPEN_FAILURE)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, remote_id)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, reason)) != 0 ||
+	    (r = sshpkt_put_cstring(ssh, "")) != 0 ||
+	    (r = sshpkt_put_cstring(ssh, "")) != 0 ||
+	    (r = sshpkt_send(ssh)) != 0)
+		return r;
+	return 0;
+}
+
+static int
+chan_input_open(struct ssh *ssh)
+{
+	struct ssh_chanctx *cc;
+	struct ssh_channel *c;
+	char *ctype = NULL;
+	const u_char *extra;
+	u_int32_t remote_id, window, maxpacket;
+	size_t extralen;
+	int r, reason;
+
+	if ((r = sshpkt_get_cstring(ssh, &ctype, NULL)) != 0 ||
+	    (r = sshpkt_get_u32(ssh, &remote_id)) != 0 ||
+	    (r = sshpkt_get_u32(ssh, &window)) != 0 ||
+	    (r = sshpkt_get_u32(ssh, &maxpacket)) != 0)
+		goto out;
+	extra = sshpkt_ptr(ssh, &extralen);
+	debug2("%s: ctype %s rchan %u win %u max %u", __func__,
+	    ctype, remote_id, window, maxpacket);
+	if ((r = chan_ctx(ssh, &cc)) != 0)
+		goto out;
+	/* we could never send anything on it */
+	if (maxpacket == 0) {
+		r = chan_send_open_failure(ssh, remote_id,
+		    SSH2_OPEN_CONNECT_FAILED);
+		goto out;
+	}
+	if (cc->accept == NULL) {
+		r = chan_send_open_failure(ssh, remote_id,
+		    SSH2_OPEN_ADMINISTRATIVELY_PROHIBITED);
+		goto out;
+	}
+	if ((r = chan_new(ssh, ctype, &c)) != 0) {
+		r = chan_send_open_failure(ssh, remote_id,
+		    SSH2_OPEN_RESOURCE_SHORTAGE);
+		goto out;
+	}
+	c->remote_id = remote_id;
+	c->remote_window = window;
+	c->remote_maxpacket = maxpacket;
+	if ((reason = cc->accept(ssh, c, ctype, extra, extralen,
+	    cc->accept_ctx)) != 0) {
+		chan_free(c);
+		r = chan_send_open_failure(ssh, remote_id, reason);
+		goto out;
+	}
+	if ((r = sshpkt_start(ssh,
+	    SSH2_MSG_CHANNEL_OPEN_CONFIRMATION)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->self)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->local_window)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->local_maxpacket)) != 0 ||
+	    (r = sshpkt_send(ssh)) != 0)
+		goto out;
+	r = 0;
+ out:
+	free(ctype);
+	return r;
+}
+
+static int
+chan_input_open_reply(struct ssh *ssh, struct ssh_channel *c, u_char type)
+{
+	u_int32_t id, window, maxpacket, reason;
+	int r;
+
+	if (!(c->flags & CHAN_F_OPENING))
+		return SSH_ERR_INVALID_FORMAT;
+	c->flags &= ~CHAN_F_OPENING;
+	if (type == SSH2_MSG_CHANNEL_OPEN_FAILURE) {
+		if ((r = sshpkt_get_u32(ssh, &reason)) != 0)
+			return r;
+		debug2("channel %u: open failed: reason %u", c->self, reason);
+		if (c->cb != NULL && c->cb->open != NULL)
+			c->cb->open(c, 0, c->ctx);
+		chan_free(c);
+		return 0;
+	}
+	if ((r = sshpkt_get_u32(ssh, &id)) != 0 ||
+	    (r = sshpkt_get_u32(ssh, &window)) != 0 ||
+	    (r = sshpkt_get_u32(ssh, &maxpacket)) != 0)
+		return r;
+	c->remote_id = id;
+	c->remote_window = window;
+	c->remote_maxpacket = maxpacket;
+	debug2("channel %u: open confirm rwindow %u rmax %u", c->self,
+	    window, maxpacket);
+	if (maxpacket == 0) {
+		/* fail the open and free the channel once the peer closes */
+		debug2("channel %u: zero max packet size", c->self);
+		if (c->cb != NULL && c->cb->open != NULL)
+			c->cb->open(c, 0, c->ctx);
+		c->cb = NULL;
+		return ssh_channel_close(c);
+	}
+	if (c->cb != NULL && c->cb->open != NULL)
+		c->cb->open(c, 1, c->ctx);
+	return 0;
+}
+
+static int
+chan_input_data(struct ssh *ssh, struct ssh_channel *c, u_char type)
+{
+	const u_char *data;
+	u_int32_t code = 0;
+	size_t len;
+	int r;
+
+	if (type == SSH2_MSG_CHANNEL_EXTENDED_DATA &&
+	    (r = sshpkt_get_u32(ssh, &code)) != 0)
+		return r;
+	if ((r = sshpkt_get_string_direct(ssh, &data, &len)) != 0)
+		return r;
+	if (c->flags & (CHAN_F_OPENING|CHAN_F_EOF_RCVD))
+		return SSH_ERR_INVALID_FORMAT;
+	if (len > c->local_maxpacket)
+		logit("channel %u: rcvd big packet %zu, maxpack %u",
+		    c->self, len, c->local_maxpacket);
+	if (len > c->local_window) {
+		logit("channel %u: rcvd too much data %zu, win %u",
+		    c->self, len, c->local_window);
+		return SSH_ERR_INVALID_FORMAT;
+	}
+	c->local_window -= len;
+	/* data nobody listens for is consumed right away */
+	if (c->cb == NULL || c->cb->data == NULL ||
+	    (type == SSH2_MSG_CHANNEL_EXTENDED_DATA &&
+	    c->cb->extended_data == NULL))
+		return ssh_channel_consume(c, len);
+	if (type == SSH2_MSG_CHANNEL_EXTENDED_DATA)
+		c->cb->extended_data(c, code, data, len, c->ctx);
+	else
+		c->cb->data(c, data, len, c->ctx);
+	return 0;
+}
+
+static int
+chan_input_request(struct ssh *ssh, struct ssh_channel *c)
+{
+	char *rtype = NULL;
+	const u_char *extra;
+	size_t extralen;
+	u_char want_reply;
+	int r, ok = 0;
+
+	if ((r = sshpkt_get_cstring(ssh, &rtype, NULL)) != 0 ||
+	    (r = sshpkt_get_u8(ssh, &want_reply)) != 0)
+		goto out;
+	extra = sshpkt_ptr(ssh, &extralen);
+	if (c->cb != NULL && c->cb->request != NULL)
+		ok = c->cb->request(c, rtype, extra, extralen, c->ctx) == 0;
+	debug2("channel %u: request %s reply %d ok %d", c->self, rtype,
+	    want_reply, ok);
+	if (want_reply && !(c->flags & CHAN_F_CLOSE_SENT)) {
+		if ((r = sshpkt_start(ssh, ok ? SSH2_MSG_CHANNEL_SUCCESS :
+		    SSH2_MSG_CHANNEL_FAILURE)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+		    (r = sshpkt_send(ssh)) != 0)
+			goto out;
+	}
+	r = 0;
+ out:
+	free(rtype);
+	return r;
+}
+
+int
+ssh_channel_set_accept_callback(struct ssh *ssh, ssh_channel_accept_fn *fn,
+    void *ctx)
+{
+	struct ssh_chanctx *cc;
+	int r;
+
+	if ((r = chan_ctx(ssh, &cc)) != 0)
+		return r;
+	cc->accept = fn;
+	cc->accept_ctx = ctx;
+	return 0;
+}
+
+void
+ssh_channel_set_callbacks(struct ssh_channel *c,
+    const struct ssh_channel_callbacks *cb, void *ctx)
+{
+	c->cb = cb;
+	c->ctx = ctx;
+}
+
+int
+ssh_channel_set_window(struct ssh_channel *c, u_int window, u_int maxpacket)
+{
+	/* the window is advertised in the open or its confirmation */
+	if (window == 0 || maxpacket == 0 || maxpacket > window ||
+	    c->local_window != c->local_window_max)
+		return SSH_ERR_INVALID_ARGUMENT;
+	c->local_window = c->local_window_max = window;
+	c->local_maxpacket = maxpacket;
+	return 0;
+}
+
+int
+ssh_channel_open(struct ssh *ssh, const char *ctype, const u_char *extra,
+    size_t extralen, const struct ssh_channel_callbacks *cb, void *ctx,
+    struct ssh_channel **cp)
+{
+	struct ssh_channel *c;
+	int r;
+
+	*cp = NULL;
+	if ((r = chan_new(ssh, ctype, &c)) != 0)
+		return r;
+	c->flags = CHAN_F_OPENING;
+	ssh_channel_set_callbacks(c, cb, ctx);
+	if ((r = sshpkt_start(ssh, SSH2_MSG_CHANNEL_OPEN)) != 0 ||
+	    (r = sshpkt_put_cstring(ssh, ctype)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->self)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->local_window)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->local_maxpacket)) != 0 ||
+	    (extralen > 0 && (r = sshpkt_put(ssh, extra, extralen)) != 0) ||
+	    (r = sshpkt_send(ssh)) != 0) {
+		chan_free(c);
+		return r;
+	}
+	*cp = c;
+	return 0;
+}
+
+int
+ssh_channel_input(struct ssh *ssh, u_char type, int *handledp)
+{
+	struct ssh_channel *c;
+	u_int32_t id, adjust;
+	int r;
+
+	*handledp = 0;
+	if (type < SSH2_MSG_CHANNEL_OPEN || type > SSH2_MSG_CHANNEL_FAILURE)
+		return 0;
+	*handledp = 1;
+	if (type == SSH2_MSG_CHANNEL_OPEN)
+		return chan_input_open(ssh);
+	if ((r = sshpkt_get_u32(ssh, &id)) != 0)
+		return r;
+	if ((c = chan_lookup(ssh, id)) == NULL) {
+		logit("%s: type %u for unknown channel %u", __func__,
+		    type, id);
+		return SSH_ERR_INVALID_FORMAT;
+	}
+	switch (type) {
+	case SSH2_MSG_CHANNEL_OPEN_CONFIRMATION:
+	case SSH2_MSG_CHANNEL_OPEN_FAILURE:
+		return chan_input_open_reply(ssh, c, type);
+	case SSH2_MSG_CHANNEL_WINDOW_ADJUST:
+		if ((r = sshpkt_get_u32(ssh, &adjust)) != 0)
+			return r;
+		if (c->remote_window + adjust < c->remote_window)
+			return SSH_ERR_INVALID_FORMAT;
+		c->remote_window += adjust;
+		debug3("channel %u: rcvd adjust %u", c->self, adjust);
+		if (c->cb != NULL && c->cb->window != NULL &&
+		    !(c->flags & (CHAN_F_EOF_SENT|CHAN_F_CLOSE_SENT)))
+			c->cb->window(c, c->remote_window, c->ctx);
+		return 0;
+	case SSH2_MSG_CHANNEL_DATA:
+	case SSH2_MSG_CHANNEL_EXTENDED_DATA:
+		return chan_input_data(ssh, c, type);
+	case SSH2_MSG_CHANNEL_EOF:
+		if (c->flags & CHAN_F_EOF_RCVD)
+			return SSH_ERR_INVALID_FORMAT;
+		c->flags |= CHAN_F_EOF_RCVD;
+		if (c->cb != NULL && c->cb->eof != NULL)
+			c->cb->eof(c, c->ctx);
+		return 0;
+	case SSH2_MSG_CHANNEL_CLOSE:
+		if (c->flags & CHAN_F_CLOSE_RCVD)
+			return SSH_ERR_INVALID_FORMAT;
+		c->flags |= CHAN_F_CLOSE_RCVD;
+		/* answering the close frees the channel */
+		return ssh_channel_close(c);
+	case SSH2_MSG_CHANNEL_REQUEST:
+		return chan_input_request(ssh, c);
+	case SSH2_MSG_CHANNEL_SUCCESS:
+	case SSH2_MSG_CHANNEL_FAILURE:
+		/* we never send requests that want a reply */
+		return SSH_ERR_INVALID_FORMAT;
+	}
+	return SSH_ERR_INTERNAL_ERROR;
+}
+
+size_t
+ssh_channel_write_space(struct ssh_channel *c)
+{
+	if (c->flags & (CHAN_F_OPENING|CHAN_F_EOF_SENT|CHAN_F_CLOSE_SENT))
+		return 0;
+	return c->remote_window;
+}
+
+int
+ssh_channel_write(struct ssh_channel *c, const u_char *data, size_t len,
+    size_t *writtenp)
+{
+	struct ssh *ssh = c->ssh;
+	size_t n, done = 0;
+	int r;
+
+	*writtenp = 0;
+	if (c->flags & (CHAN_F_EOF_SENT|CHAN_F_CLOSE_SENT))
+		return SSH_ERR_INVALID_ARGUMENT;
+	while (done < len && ssh_channel_write_space(c) > 0) {
+		n = MIN(len - done, c->remote_window);
+		n = MIN(n, c->remote_maxpacket);
+		if (n == 0)
+			break;
+		if ((r = sshpkt_start(ssh, SSH2_MSG_CHANNEL_DATA)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+		    (r = sshpkt_put_string(ssh, data + done, n)) != 0 ||
+		    (r = sshpkt_send(ssh)) != 0)
+			return r;
+		c->remote_window -= n;
+		done += n;
+	}
+	*writtenp = done;
+	return 0;
+}
+
+int
+ssh_channel_consume(struct ssh_channel *c, size_t len)
+{
+	struct ssh *ssh = c->ssh;
+	int r;
+
+	if (len > c->local_window_max - c->local_window - c->local_consumed)
+		return SSH_ERR_INVALID_ARGUMENT;
+	c->local_consumed += len;
+	/* same policy as channel_check_window() */
+	if (c->flags & (CHAN_F_EOF_RCVD|CHAN_F_CLOSE_SENT) ||
+	    c->local_consumed == 0 ||
+	    (c->local_window >= c->local_window_max / 2 &&
+	    c->local_consumed < c->local_maxpacket * 3))
+		return 0;
+	if ((r = sshpkt_start(ssh, SSH2_MSG_CHANNEL_WINDOW_ADJUST)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->local_consumed)) != 0 ||
+	    (r = sshpkt_send(ssh)) != 0)
+		return r;
+	debug3("channel %u: window %u sent adjust %u", c->self,
+	    c->local_window, c->local_consumed);
+	c->local_window += c->local_consumed;
+	c->local_consumed = 0;
+	return 0;
+}
+
+int
+ssh_channel_eof(struct ssh_channel *c)
+{
+	struct ssh *ssh = c->ssh;
+	int r;
+
+	if (c->flags & (CHAN_F_OPENING|CHAN_F_EOF_SENT|CHAN_F_CLOSE_SENT))
+		return 0;
+	if ((r = sshpkt_start(ssh, SSH2_MSG_CHANNEL_EOF)) != 0 ||
+	    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+	    (r = sshpkt_send(ssh)) != 0)
+		return r;
+	c->flags |= CHAN_F_EOF_SENT;
+	return 0;
+}
+
+int
+ssh_channel_close(struct ssh_channel *c)
+{
+	struct ssh *ssh = c->ssh;
+	int r;
+
+	/* the peer has not told us its channel id yet */
+	if (c->flags & CHAN_F_OPENING)
+		return SSH_ERR_INVALID_ARGUMENT;
+	if (!(c->flags & CHAN_F_CLOSE_SENT)) {
+		if ((r = sshpkt_start(ssh, SSH2_MSG_CHANNEL_CLOSE)) != 0 ||
+		    (r = sshpkt_put_u32(ssh, c->remote_id)) != 0 ||
+		    (r = sshpkt_send(ssh)) != 0)
+			return r;
+		c->flags |= CHAN_F_CLOSE_SENT;
+	}
+	chan_check_closed(c);
+	return 0;
+}
+
+u_int
+ssh_channel_id(struct ssh_channel *c)
+{
+	return c->self;
+}
+
+const char *
+ssh_channel_type(struct ssh_channel *c)
+{
+	return c->ctype;
+}
+
+struct ssh *
+ssh_channel_get_ssh(struct ssh_channel *c)
+{
+	return c->ssh;
+}
+
+u_int
+ssh_channel_count(struct ssh *ssh)
+{
+	struct ssh_chanctx *cc = ssh->chanctx;
+	u_int i, n = 0;
+
+	if (cc == NULL)
+		return 0;
+	for (i = 0; i < cc->nalloc; i++)
+		if (cc->chans[i] != NULL)
+			n++;
+	return n;
+}
+
+/* called from ssh_free() */
+void
+ssh_channel_free_all(struct ssh *ssh)
+{
+	struct ssh_chanctx *cc = ssh->chanctx;
+	u_int i;
+
+	if (cc == NULL)
+		return;
+	for (i = 0; i < cc->nalloc; i++)
+		if (cc->chans[i] != NULL)
+			chan_free(cc->chans[i]);
+	free(cc->chans);
+	free(cc);
+	ssh->chanctx = NULL;
+}
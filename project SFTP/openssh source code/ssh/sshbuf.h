@@ -248,6 +248,11 @@ int	sshbuf_b64tod(struct sshbuf *buf, const char *b64);
 		((u_char *)(p))[1] = ((u_int64_t)(v)) & 0xff; \
 	} while (0)
 
+/*
+ * Return the reference count of buf: 1 plus the number of its live children
+ */
+u_int	sshbuf_refcount(const struct sshbuf *buf);
+
 /* Internal definitions follow. Exposed for regress tests */
 #ifdef SSHBUF_INTERNAL
 
@@ -266,11 +271,6 @@ int	sshbuf_set_parent(struct sshbuf *child, struct sshbuf *parent);
  */
 const struct sshbuf *sshbuf_parent(const struct sshbuf *buf);
 
-/*
- * Return the reference count of buf
- */
-u_int	sshbuf_refcount(const struct sshbuf *buf);
-
 # define SSHBUF_SIZE_INIT		256		/* Initial allocation */
 # define SSHBUF_SIZE_INC		256		/* Preferred increment length */
 # define SSHBUF_PACK_MIN		8192		/* Minimim packable offset */
@@ -19,6 +19,8 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 
+#include <sys/param.h>
+
 #include <netinet/in.h>
 
 #include <ctype.h>
@@ -26,6 +28,7 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <paths.h>
+#include <poll.h>
 #include <signal.h>
 #include <pwd.h>
 #include <stdio.h>
@@ -231,87 +234,226 @@ ssh_create_socket(int privileged, struct addrinfo *ai)
 	return sock;
 }
 
-static int
-timeout_connect(int sockfd, const struct sockaddr *serv_addr,
-    socklen_t addrlen, int *timeoutp)
-{
-	fd_set *fdset;
-	struct timeval tv, t_start;
-	socklen_t optlen;
-	int optval, rc, result = -1;
+/* Delay before racing the next address, as suggested by RFC 6555. */
+#define CONNECT_STAGGER_MS	250
 
-	gettimeofday(&t_start, NULL);
+struct connect_attempt {
+	struct addrinfo *ai;
+	int	sock;
+	struct timeval start;
+	char	ntop[NI_MAXHOST];
+};
 
-	if (*timeoutp <= 0) {
-		result = connect(sockfd, serv_addr, addrlen);
-		goto done;
-	}
+/*
+ * Order the usable addresses for racing: alternate between address
+ * families, starting with the family the resolver listed first and
+ * otherwise keeping its order.  Returns the number of addresses.
+ */
+static u_int
+connect_attempts_order(struct addrinfo *aitop, struct connect_attempt **attp)
+{
+	struct connect_attempt *att;
+	struct addrinfo *ai, *a, *b;
+	u_int n = 0, i;
+	int first = -1;
 
-	set_nonblock(sockfd);
-	rc = connect(sockfd, serv_addr, addrlen);
-	if (rc == 0) {
-		unset_nonblock(sockfd);
-		result = 0;
-		goto done;
+	for (ai = aitop; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+			continue;
+		if (first == -1)
+			first = ai->ai_family;
+		n++;
 	}
-	if (errno != EINPROGRESS) {
-		result = -1;
-		goto done;
+	*attp = att = xcalloc(MAX(n, 1), sizeof(*att));
+	a = b = aitop;
+	for (i = 0; i < n; i++) {
+		/* a walks the first family, b the other one */
+		while (a != NULL && a->ai_family != first)
+			a = a->ai_next;
+		while (b != NULL && (b->ai_family == first ||
+		    (b->ai_family != AF_INET && b->ai_family != AF_INET6)))
+			b = b->ai_next;
+		if (a != NULL && (b == NULL || (i % 2) == 0)) {
+			att[i].ai = a;
+			a = a->ai_next;
+		} else {
+			att[i].ai = b;
+			b = b->ai_next;
+		}
+		att[i].sock = -1;
 	}
+	return n;
+}
 
-	fdset = (fd_set *)xcalloc(howmany(sockfd + 1, NFDBITS),
-	    sizeof(fd_mask));
-	FD_SET(sockfd, fdset);
-	ms_to_timeval(&tv, *timeoutp);
+/* Create a socket for the attempt and start connecting it. */
+static int
+connect_attempt_start(const char *host, struct connect_attempt *at,
+    int needpriv)
+{
+	struct addrinfo *ai = at->ai;
+	char strport[NI_MAXSERV];
 
-	for (;;) {
-		rc = select(sockfd + 1, NULL, fdset, NULL, &tv);
-		if (rc != -1 || errno != EINTR)
-			break;
+	if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
+	    at->ntop, sizeof(at->ntop), strport, sizeof(strport),
+	    NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+		error("ssh_connect: getnameinfo failed");
+		return -1;
 	}
+	debug("Connecting to %.200s [%.100s] port %s.", host, at->ntop,
+	    strport);
 
-	switch (rc) {
-	case 0:
-		/* Timed out */
-		errno = ETIMEDOUT;
-		break;
-	case -1:
-		/* Select error */
-		debug("select: %s", strerror(errno));
-		break;
-	case 1:
-		/* Completed or failed */
-		optval = 0;
-		optlen = sizeof(optval);
-		if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &optval,
-		    &optlen) == -1) {
-			debug("getsockopt: %s", strerror(errno));
+	/* Create a socket for connecting. */
+	if ((at->sock = ssh_create_socket(needpriv, ai)) < 0)
+		/* Any error is already output */
+		return -1;
+	monotime_tv(&at->start);
+	set_nonblock(at->sock);
+	if (connect(at->sock, ai->ai_addr, ai->ai_addrlen) == 0)
+		return 1;
+	if (errno == EINPROGRESS)
+		return 0;
+	debug("connect to address %s port %s: %s", at->ntop, strport,
+	    strerror(errno));
+	close(at->sock);
+	at->sock = -1;
+	return -1;
+}
+
+static u_int
+connect_attempt_ms(struct connect_attempt *at)
+{
+	return monotime_since_us(&at->start) / 1000;
+}
+
+/*
+ * Connect to one of the addresses in 'aitop', racing them: a new attempt
+ * starts whenever the previous one failed or has not completed within
+ * CONNECT_STAGGER_MS, and the first to complete wins while the others
+ * are abandoned.  *timeout_ms bounds the whole race (no limit if <= 0)
+ * and is reduced by the time spent.  Returns the connected socket or -1
+ * with errno set.
+ */
+static int
+ssh_connect_race(const char *host, struct addrinfo *aitop, int needpriv,
+    int *timeout_ms, struct sockaddr_storage *hostaddr)
+{
+	struct connect_attempt *att, *at;
+	struct pollfd *pfd;
+	struct timeval t_start, t_last;
+	socklen_t optlen;
+	u_int i, n, next = 0, npending = 0, elapsed;
+	int r, wait, optval, sock = -1, saved_errno = ENETUNREACH, hurry = 0;
+
+	n = connect_attempts_order(aitop, &att);
+	pfd = xcalloc(MAX(n, 1), sizeof(*pfd));
+	monotime_tv(&t_start);
+	t_last = t_start;
+	for (;;) {
+		elapsed = monotime_since_us(&t_start) / 1000;
+		if (*timeout_ms > 0 && elapsed >= (u_int)*timeout_ms) {
+			saved_errno = ETIMEDOUT;
 			break;
 		}
-		if (optval != 0) {
-			errno = optval;
+		/*
+		 * Start the next address if nothing is pending, an attempt
+		 * just failed or the current ones are taking too long.
+		 */
+		if (next < n && (npending == 0 || hurry ||
+		    monotime_since_us(&t_last) / 1000 >= CONNECT_STAGGER_MS)) {
+			at = &att[next];
+			pfd[next].fd = -1;
+			next++;
+			if ((r = connect_attempt_start(host, at,
+			    needpriv)) == -1) {
+				saved_errno = errno;
+				hurry = 1;
+				continue;
+			}
+			hurry = 0;
+			monotime_tv(&t_last);
+			if (r == 1) {
+				sock = at->sock;
+				break;
+			}
+			pfd[next - 1].fd = at->sock;
+			pfd[next - 1].events = POLLOUT;
+			npending++;
+			continue;
+		}
+		if (npending == 0)
+			break;	/* all addresses failed */
+
+		wait = -1;
+		if (next < n)
+			wait = CONNECT_STAGGER_MS -
+			    (int)(monotime_since_us(&t_last) / 1000);
+		if (*timeout_ms > 0 && (wait == -1 ||
+		    *timeout_ms - (int)elapsed < wait))
+			wait = *timeout_ms - elapsed;
+		if ((r = poll(pfd, next, MAX(wait, 0))) == -1) {
+			if (errno == EINTR)
+				continue;
+			saved_errno = errno;
+			debug("poll: %s", strerror(errno));
 			break;
 		}
-		result = 0;
-		unset_nonblock(sockfd);
-		break;
-	default:
-		/* Should not occur */
-		fatal("Bogus return (%d) from select()", rc);
+		for (i = 0; i < next && r > 0; i++) {
+			if (pfd[i].fd == -1 || pfd[i].revents == 0)
+				continue;
+			r--;
+			at = &att[i];
+			optval = 0;
+			optlen = sizeof(optval);
+			if (getsockopt(at->sock, SOL_SOCKET, SO_ERROR, &optval,
+			    &optlen) == -1)
+				optval = errno;
+			if (optval == 0) {
+				sock = at->sock;
+				break;
+			}
+			debug("connect to address %s: %s after %u ms",
+			    at->ntop, strerror(optval), connect_attempt_ms(at));
+			saved_errno = optval;
+			close(at->sock);
+			at->sock = pfd[i].fd = -1;
+			npending--;
+			hurry = 1;
+		}
+		if (sock != -1)
+			break;
 	}
 
-	xfree(fdset);
+	for (i = 0; i < next; i++) {
+		at = &att[i];
+		if (at->sock == -1)
+			continue;
+		if (at->sock == sock) {
+			debug("Connected to [%s] after %u ms (attempt %u of %u)",
+			    at->ntop, connect_attempt_ms(at), i + 1, n);
+			memcpy(hostaddr, at->ai->ai_addr, at->ai->ai_addrlen);
+			continue;
+		}
+		debug("connect to address %s: abandoned after %u ms",
+		    at->ntop, connect_attempt_ms(at));
+		close(at->sock);
+	}
+	xfree(att);
+	xfree(pfd);
 
- done:
- 	if (result == 0 && *timeoutp > 0) {
-		ms_subtract_diff(&t_start, timeoutp);
-		if (*timeoutp <= 0) {
+	if (sock == -1) {
+		errno = saved_errno;
+		return -1;
+	}
+	unset_nonblock(sock);
+	if (*timeout_ms > 0) {
+		*timeout_ms -= monotime_since_us(&t_start) / 1000;
+		if (*timeout_ms <= 0) {
+			close(sock);
 			errno = ETIMEDOUT;
-			result = -1;
+			return -1;
 		}
 	}
-
-	return (result);
+	return sock;
 }
 
 /*
@@ -325,17 +467,35 @@ timeout_connect(int sockfd, const struct sockaddr *serv_addr,
  * and %p substituted for host and port, respectively) to use to contact
  * the daemon.
  */
+static struct ssh *
+ssh_connect_setup(int sock, int want_keepalive)
+{
+	struct ssh *ssh;
+	int on = 1;
+
+	/* Set SO_KEEPALIVE if requested. */
+	if (want_keepalive &&
+	    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *)&on,
+	    sizeof(on)) < 0)
+		error("setsockopt SO_KEEPALIVE: %.100s", strerror(errno));
+
+	/* Set the connection. */
+	ssh = ssh_packet_set_connection(NULL, sock, sock);
+	ssh_packet_set_timeout(ssh, options.server_alive_interval,
+	    options.server_alive_count_max);
+
+	return (ssh);
+}
+
 struct ssh *
 ssh_connect(const char *host, struct sockaddr_storage * hostaddr,
     u_short port, int family, int connection_attempts, int *timeout_ms,
     int want_keepalive, int needpriv, const char *proxy_command)
 {
-	struct ssh *ssh;
 	int gaierr;
-	int on = 1;
 	int sock = -1, attempt;
-	char ntop[NI_MAXHOST], strport[NI_MAXSERV];
-	struct addrinfo hints, *ai, *aitop;
+	char strport[NI_MAXSERV];
+	struct addrinfo hints, *aitop;
 
 	debug2("ssh_connect: needpriv %d", needpriv);
 
@@ -359,40 +519,8 @@ ssh_connect(const char *host, struct sockaddr_storage * hostaddr,
 			sleep(1);
 			debug("Trying again...");
 		}
-		/*
-		 * Loop through addresses for this host, and try each one in
-		 * sequence until the connection succeeds.
-		 */
-		for (ai = aitop; ai; ai = ai->ai_next) {
-			if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
-				continue;
-			if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
-			    ntop, sizeof(ntop), strport, sizeof(strport),
-			    NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
-				error("ssh_connect: getnameinfo failed");
-				continue;
-			}
-			debug("Connecting to %.200s [%.100s] port %s.",
-				host, ntop, strport);
-
-			/* Create a socket for connecting. */
-			sock = ssh_create_socket(needpriv, ai);
-			if (sock < 0)
-				/* Any error is already output */
-				continue;
-
-			if (timeout_connect(sock, ai->ai_addr, ai->ai_addrlen,
-			    timeout_ms) >= 0) {
-				/* Successful connection. */
-				memcpy(hostaddr, ai->ai_addr, ai->ai_addrlen);
-				break;
-			} else {
-				debug("connect to address %s port %s: %s",
-				    ntop, strport, strerror(errno));
-				close(sock);
-				sock = -1;
-			}
-		}
+		sock = ssh_connect_race(host, aitop, needpriv, timeout_ms,
+		    hostaddr);
 		if (sock != -1)
 			break;	/* Successful connection. */
 	}
@@ -407,19 +535,49 @@ ssh_connect(const char *host, struct sockaddr_storage * hostaddr,
 	}
 
 	debug("Connection established.");
+	return ssh_connect_setup(sock, want_keepalive);
+}
 
-	/* Set SO_KEEPALIVE if requested. */
-	if (want_keepalive &&
-	    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *)&on,
-	    sizeof(on)) < 0)
-		error("setsockopt SO_KEEPALIVE: %.100s", strerror(errno));
+/*
+ * Connect again to the address of an earlier connection, without a new
+ * name lookup.  Used by roaming clients, which may have lost the network
+ * and with it the resolver.  Returns NULL on failure.
+ */
+struct ssh *
+ssh_reconnect(const char *host, struct sockaddr_storage *hostaddr,
+    u_short port, int *timeout_ms, int want_keepalive, int needpriv,
+    const char *proxy_command)
+{
+	struct sockaddr_storage to, winner;
+	struct addrinfo ai;
+	int sock;
 
-	/* Set the connection. */
-	ssh = ssh_packet_set_connection(NULL, sock, sock);
-	ssh_packet_set_timeout(ssh, options.server_alive_interval,
-	    options.server_alive_count_max);
+	if (proxy_command != NULL)
+		return ssh_proxy_connect(host, port, proxy_command);
 
-	return (ssh);
+	memcpy(&to, hostaddr, sizeof(to));
+	memset(&ai, 0, sizeof(ai));
+	ai.ai_family = to.ss_family;
+	ai.ai_socktype = SOCK_STREAM;
+	ai.ai_addr = (struct sockaddr *)&to;
+	switch (to.ss_family) {
+	case AF_INET:
+		ai.ai_addrlen = sizeof(struct sockaddr_in);
+		break;
+	case AF_INET6:
+		ai.ai_addrlen = sizeof(struct sockaddr_in6);
+		break;
+	default:
+		error("%s: unknown address family %d", __func__, to.ss_family);
+		return NULL;
+	}
+	if ((sock = ssh_connect_race(host, &ai, needpriv, timeout_ms,
+	    &winner)) == -1) {
+		debug("%s: connect to host %s: %s", __func__, host,
+		    strerror(errno));
+		return NULL;
+	}
+	return ssh_connect_setup(sock, want_keepalive);
 }
 
 static void
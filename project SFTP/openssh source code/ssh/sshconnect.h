@@ -35,6 +35,9 @@ struct Sensitive {
 struct ssh *
 ssh_connect(const char *, struct sockaddr_storage *, u_short, int, int,
     int *, int, int, const char *);
+struct ssh *
+ssh_reconnect(const char *, struct sockaddr_storage *, u_short, int *, int,
+    int, const char *);
 void	 ssh_kill_proxy_command(void);
 
 void	 ssh_login(struct ssh *, Sensitive *, const char *, struct sockaddr *,
@@ -55,6 +55,7 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <paths.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
@@ -92,6 +93,7 @@
 #include "auth.h"
 #include "misc.h"
 #include "msg.h"
+#include "monitor_fdpass.h"
 #include "dispatch.h"
 #include "channels.h"
 #include "session.h"
@@ -102,6 +104,10 @@
 #endif
 #include "monitor_wrap.h"
 #include "roaming.h"
+#include "poller.h"
+#include "phase.h"
+#include "certcache.h"
+#include "cmdcache.h"
 #include "ssh-sandbox.h"
 #include "version.h"
 #include "err.h"
@@ -122,6 +128,14 @@ int deny_severity = LOG_WARNING;
 #define REEXEC_STARTUP_PIPE_FD		(STDERR_FILENO + 2)
 #define REEXEC_CONFIG_PASS_FD		(STDERR_FILENO + 3)
 #define REEXEC_MIN_FREE_FD		(STDERR_FILENO + 4)
+/* the zygote has no startup pipe of its own */
+#define REEXEC_ZYGOTE_FD		REEXEC_STARTUP_PIPE_FD
+
+/* don't restart a failing zygote more often than this (seconds) */
+#define ZYGOTE_RESTART_DELAY		10
+/* re-execute the zygote after this many children or seconds */
+#define ZYGOTE_MAX_FORKS		256
+#define ZYGOTE_MAX_AGE			600
 
 extern char *__progname;
 
@@ -159,6 +173,16 @@ int rexeced_flag = 0;
 int rexec_flag = 1;
 int rexec_argc = 0;
 char **rexec_argv;
+static int rexec_certcache_fd = -1;	/* passed by the listener */
+static int rexec_cmdcache_fd = -1;
+
+/* zygote, see zygote_start() */
+int zygote_flag = 0;			/* we are the zygote */
+static int zygote_fd = -1;		/* in the listener */
+static time_t zygote_next_start = 0;
+static time_t zygote_started = 0;
+static u_int zygote_forks = 0;
+static volatile sig_atomic_t zygote_child_signalled = 0;
 
 /*
  * The sockets that the server is listening; this is used in the SIGHUP
@@ -168,6 +192,20 @@ char **rexec_argv;
 int listen_socks[MAX_LISTEN_SOCKS];
 int num_listen_socks = 0;
 
+/* per listening socket counters, logged on exit and restart */
+struct listen_stats {
+	char	*addr;		/* [host]:port */
+	u_int64_t accepted;	/* handed to a child */
+	u_int64_t dropped;	/* refused by MaxStartups */
+	u_int64_t failed;	/* accept or setup errors */
+	u_int	batch_max;	/* most connections accepted in one wakeup */
+} listen_stats[MAX_LISTEN_SOCKS];
+
+/* connections accepted per listener and wakeup before looking around */
+#define SSHD_ACCEPT_BATCH	64
+
+static struct poller *accept_poller = NULL;
+
 /*
  * the client's version string, passed by sshd2 in compat mode. if != NULL,
  * sshd will skip the version-number exchange
@@ -213,14 +251,19 @@ u_int session_id2_len = 0;
 /* record remote hostname or ip */
 u_int utmp_len = MAXHOSTNAMELEN;
 
-/* options.max_startup sized array of fd ints */
+/* options.max_startup sized array of fd ints, first 'startups' in use */
 int *startup_pipes = NULL;
+static int startups = 0;
 int startup_pipe;		/* in child */
 
+/* the ephemeral server key has been given to a child */
+static int key_used = 0;
+
 /* variables used for privilege separation */
 int use_privsep = -1;
 struct monitor *pmonitor = NULL;
 int privsep_is_preauth = 1;
+static int privsep_preauth_signalled = 0;	/* network child crashed */
 
 /* global authentication context */
 static Authctxt *the_authctxt = NULL;	/* XXX */
@@ -257,9 +300,41 @@ close_startup_pipes(void)
 	int i;
 
 	if (startup_pipes)
-		for (i = 0; i < options.max_startups; i++)
-			if (startup_pipes[i] != -1)
-				close(startup_pipes[i]);
+		for (i = 0; i < startups; i++)
+			close(startup_pipes[i]);
+}
+
+static void
+listen_stats_log(void)
+{
+	struct listen_stats *ls;
+	int i;
+
+	for (i = 0; i < num_listen_socks; i++) {
+		ls = &listen_stats[i];
+		logit("Listener %s: accepted %llu, dropped %llu, failed %llu, "
+		    "max batch %u", ls->addr,
+		    (unsigned long long)ls->accepted,
+		    (unsigned long long)ls->dropped,
+		    (unsigned long long)ls->failed, ls->batch_max);
+	}
+	phase_stats_log();
+	if (options.latency_stats_file != NULL)
+		phase_stats_write(options.latency_stats_file);
+}
+
+/*
+ * Let the listener count this connection out of MaxStartups.  This also
+ * ends the reporting of phase latencies.
+ */
+static void
+startup_pipe_close(void)
+{
+	if (startup_pipe == -1)
+		return;
+	phase_set_fd(-1);
+	close(startup_pipe);
+	startup_pipe = -1;
 }
 
 /*
@@ -287,6 +362,7 @@ static void
 sighup_restart(void)
 {
 	logit("Received SIGHUP; restarting.");
+	listen_stats_log();
 	close_listen_socks();
 	close_startup_pipes();
 	alarm(0);  /* alarm timer persists across exec */
@@ -591,6 +667,9 @@ privsep_preauth_child(void)
 	gid_t gidset[1];
 	struct passwd *pw;
 
+	certcache_detach();
+	cmdcache_detach();
+
 	/* Enable challenge-response authentication for privilege separation */
 	privsep_challenge_enable();
 
@@ -634,6 +713,9 @@ privsep_preauth(Authctxt *authctxt)
 	int status;
 	pid_t pid;
 	struct ssh_sandbox *box = NULL;
+	struct timeval start;
+
+	monotime_tv(&start);
 
 	/* Set up unprivileged child process to deal with network data */
 	pmonitor = monitor_init();
@@ -669,11 +751,14 @@ privsep_preauth(Authctxt *authctxt)
 			if (WEXITSTATUS(status) != 0)
 				fatal("%s: preauth child exited with status %d",
 				    __func__, WEXITSTATUS(status));
-		} else if (WIFSIGNALED(status))
+		} else if (WIFSIGNALED(status)) {
+			privsep_preauth_signalled = 1;
 			fatal("%s: preauth child terminated by signal %d",
 			    __func__, WTERMSIG(status));
+		}
 		if (box != NULL)
 			ssh_sandbox_parent_finish(box);
+		phase_done(PHASE_PREAUTH, &start);
 		return 1;
 	} else {
 		/* child */
@@ -699,6 +784,9 @@ privsep_postauth(struct ssh *ssh)
 {
 	Authctxt *authctxt = ssh->authctxt;
 	u_int32_t rnd[256];
+	struct timeval start;
+
+	monotime_tv(&start);
 
 	if (authctxt->pw->pw_uid == 0 || options.use_login) {
 		/* File descriptor passing is broken or root login */
@@ -714,6 +802,8 @@ privsep_postauth(struct ssh *ssh)
 		fatal("fork of unprivileged child failed");
 	else if (pmonitor->m_pid != 0) {
 		verbose("User child is on pid %ld", (long)pmonitor->m_pid);
+		/* the child reports the rest of the phase */
+		startup_pipe_close();
 		sshbuf_reset(loginmsg);
 		monitor_child_postauth(pmonitor);
 
@@ -745,6 +835,7 @@ privsep_postauth(struct ssh *ssh)
 	 * this information is not part of the key state.
 	 */
 	ssh_packet_set_authenticated(ssh);
+	phase_done(PHASE_POSTAUTH, &start);
 }
 
 static char *
@@ -868,7 +959,7 @@ get_hostkey_index(struct sshkey *key)
  * all connections are dropped for startups > max_startups
  */
 static int
-drop_connection(int startups)
+drop_connection(void)
 {
 	int p, r;
 
@@ -902,6 +993,65 @@ usage(void)
 	exit(1);
 }
 
+/* The ephemeral protocol 1 key, as passed to re-executed children */
+static void
+put_server_key(struct sshbuf *m)
+{
+	int r;
+
+	if (sensitive_data.server_key != NULL &&
+	    sensitive_data.server_key->type == KEY_RSA1) {
+		if ((r = sshbuf_put_u32(m, 1)) != 0 ||
+		    (r = sshbuf_put_bignum1(m,
+		    sensitive_data.server_key->rsa->e)) != 0 ||
+		    (r = sshbuf_put_bignum1(m,
+		    sensitive_data.server_key->rsa->n)) != 0 ||
+		    (r = sshbuf_put_bignum1(m,
+		    sensitive_data.server_key->rsa->d)) != 0 ||
+		    (r = sshbuf_put_bignum1(m,
+		    sensitive_data.server_key->rsa->iqmp)) != 0 ||
+		    (r = sshbuf_put_bignum1(m,
+		    sensitive_data.server_key->rsa->p)) != 0 ||
+		    (r = sshbuf_put_bignum1(m,
+		    sensitive_data.server_key->rsa->q)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	} else if ((r = sshbuf_put_u32(m, 0)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+}
+
+static void
+get_server_key(struct sshbuf *m)
+{
+	u_int key_follows;
+	int r;
+
+	if ((r = sshbuf_get_u32(m, &key_follows)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if (!key_follows)
+		return;
+	if (sensitive_data.server_key != NULL)
+		sshkey_free(sensitive_data.server_key);
+	sensitive_data.server_key = sshkey_new_private(KEY_RSA1);
+	if (sensitive_data.server_key == NULL)
+		fatal("%s: sshkey_new_private failed", __func__);
+	if ((r = sshbuf_get_bignum1(m,
+	    sensitive_data.server_key->rsa->e)) != 0 ||
+	    (r = sshbuf_get_bignum1(m,
+	    sensitive_data.server_key->rsa->n)) != 0 ||
+	    (r = sshbuf_get_bignum1(m,
+	    sensitive_data.server_key->rsa->d)) != 0 ||
+	    (r = sshbuf_get_bignum1(m,
+	    sensitive_data.server_key->rsa->iqmp)) != 0 ||
+	    (r = sshbuf_get_bignum1(m,
+	    sensitive_data.server_key->rsa->p)) != 0 ||
+	    (r = sshbuf_get_bignum1(m,
+	    sensitive_data.server_key->rsa->q)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
+	if ((r = rsa_generate_additional_parameters(
+	    sensitive_data.server_key->rsa)) != 0)
+		fatal("generate RSA parameters failed: %s", ssh_err(r));
+}
+
 static void
 send_rexec_state(int fd, struct sshbuf *conf)
 {
@@ -921,49 +1071,58 @@ send_rexec_state(int fd, struct sshbuf *conf)
 	 *	bignum	iqmp			"
 	 *	bignum	p			"
 	 *	bignum	q			"
+	 *	u_int	certcache_follows
+	 *	u_int	cmdcache_follows
+	 *	fd	certificate cache	(only if certcache_follows == 1)
+	 *	fd	command cache		(only if cmdcache_follows == 1)
 	 */
 	if ((m = sshbuf_new()) == NULL)
 		fatal("%s: sshbuf_new failed", __func__);
 	/* servconf.c:load_server_config() ensures a \0 at the end of cfg */
 	if ((r = sshbuf_put_cstring(m, sshbuf_ptr(conf))) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
-
-	if (sensitive_data.server_key != NULL &&
-	    sensitive_data.server_key->type == KEY_RSA1) {
-		if ((r = sshbuf_put_u32(m, 1)) != 0 ||
-		    (r = sshbuf_put_bignum1(m,
-		    sensitive_data.server_key->rsa->e)) != 0 ||
-		    (r = sshbuf_put_bignum1(m,
-		    sensitive_data.server_key->rsa->n)) != 0 ||
-		    (r = sshbuf_put_bignum1(m,
-		    sensitive_data.server_key->rsa->d)) != 0 ||
-		    (r = sshbuf_put_bignum1(m,
-		    sensitive_data.server_key->rsa->iqmp)) != 0 ||
-		    (r = sshbuf_put_bignum1(m,
-		    sensitive_data.server_key->rsa->p)) != 0 ||
-		    (r = sshbuf_put_bignum1(m,
-		    sensitive_data.server_key->rsa->q)) != 0)
-			fatal("%s: buffer error: %s", __func__, ssh_err(r));
-	} else if ((r = sshbuf_put_u32(m, 0)) != 0)
+	put_server_key(m);
+	if ((r = sshbuf_put_u32(m, certcache_fd() != -1)) != 0 ||
+	    (r = sshbuf_put_u32(m, cmdcache_fd() != -1)) != 0)
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 
 	if (ssh_msg_send(fd, 0, m) == -1)
 		fatal("%s: ssh_msg_send failed", __func__);
+	if ((certcache_fd() != -1 && mm_send_fd(fd, certcache_fd()) == -1) ||
+	    (cmdcache_fd() != -1 && mm_send_fd(fd, cmdcache_fd()) == -1))
+		fatal("%s: mm_send_fd failed", __func__);
 
 	sshbuf_free(m);
 
 	debug3("%s: done", __func__);
 }
 
+/*
+ * Receive a cache descriptor.  It is 'unused' after a failed re-exec, which
+ * still has the listener's mapping.
+ */
+static int
+recv_rexec_fd(int sock, int unused)
+{
+	int fd;
+
+	if ((fd = mm_receive_fd(sock)) == -1)
+		fatal("%s: mm_receive_fd failed", __func__);
+	if (!unused)
+		return fd;
+	close(fd);
+	return -1;
+}
+
 static void
 recv_rexec_state(int fd, struct sshbuf *conf)
 {
 	struct sshbuf *m;
 	char *cp;
 	size_t len;
+	u_int certcache_follows, cmdcache_follows;
 	int r;
 	u_char ver;
-	u_int key_follows;
 
 	debug3("%s: entering fd = %d", __func__, fd);
 
@@ -977,35 +1136,18 @@ recv_rexec_state(int fd, struct sshbuf *conf)
 	if (ver != 0)
 		fatal("%s: rexec version mismatch", __func__);
 	if ((r = sshbuf_get_cstring(m, &cp, &len)) != 0 ||
-	    (conf != NULL && (r = sshbuf_put(conf, cp, len + 1)) != 0) ||
-	    (r = sshbuf_get_u32(m, &key_follows)) != 0)
+	    (conf != NULL && (r = sshbuf_put(conf, cp, len + 1)) != 0))
 		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	xfree(cp);
-
-	if (key_follows) {
-		if (sensitive_data.server_key != NULL)
-			sshkey_free(sensitive_data.server_key);
-		sensitive_data.server_key = sshkey_new_private(KEY_RSA1);
-		if (sensitive_data.server_key == NULL)
-			fatal("%s: sshkey_new_private failed", __func__);
-		if ((r = sshbuf_get_bignum1(m,
-		    sensitive_data.server_key->rsa->e)) != 0 ||
-		    (r = sshbuf_get_bignum1(m,
-		    sensitive_data.server_key->rsa->n)) != 0 ||
-		    (r = sshbuf_get_bignum1(m,
-		    sensitive_data.server_key->rsa->d)) != 0 ||
-		    (r = sshbuf_get_bignum1(m,
-		    sensitive_data.server_key->rsa->iqmp)) != 0 ||
-		    (r = sshbuf_get_bignum1(m,
-		    sensitive_data.server_key->rsa->p)) != 0 ||
-		    (r = sshbuf_get_bignum1(m,
-		    sensitive_data.server_key->rsa->q)) != 0)
-			fatal("%s: buffer error: %s", __func__, ssh_err(r));
-		if ((r = rsa_generate_additional_parameters(
-		    sensitive_data.server_key->rsa)) != 0)
-			fatal("generate RSA parameters failed: %s", ssh_err(r));
-	}
+	get_server_key(m);
+	if ((r = sshbuf_get_u32(m, &certcache_follows)) != 0 ||
+	    (r = sshbuf_get_u32(m, &cmdcache_follows)) != 0)
+		fatal("%s: buffer error: %s", __func__, ssh_err(r));
 	sshbuf_free(m);
+	if (certcache_follows)
+		rexec_certcache_fd = recv_rexec_fd(fd, conf == NULL);
+	if (cmdcache_follows)
+		rexec_cmdcache_fd = recv_rexec_fd(fd, conf == NULL);
 
 	debug3("%s: done", __func__);
 }
@@ -1042,6 +1184,252 @@ server_accept_inetd(int *sock_in, int *sock_out)
 	debug("inetd sockets after dupping: %d, %d", *sock_in, *sock_out);
 }
 
+/*
+ * The zygote is sshd re-executed once with the -Z flag instead of once per
+ * connection.  It reads the configuration and the host keys, then forks a
+ * child for each connection that the listener passes to it over
+ * REEXEC_ZYGOTE_FD.  It exits when the listener closes its end, e.g. on
+ * SIGHUP, after which the restarted listener starts a fresh zygote.
+ *
+ * All children of one zygote share its address space layout and stack
+ * protector, so it is replaced after ZYGOTE_MAX_FORKS children or
+ * ZYGOTE_MAX_AGE seconds, and exits as soon as one of its children (or
+ * their pre-auth child, see cleanup_exit()) is killed by a signal.  While
+ * there is no zygote, connections are handed to a re-executed sshd.
+ *
+ * Listener to zygote, per connection:
+ *	u_int	ephemeral_key_follows
+ *	bignum	e, n, d, iqmp, p, q	(only if ephemeral_key_follows == 1)
+ *	fd	connection socket
+ *	fd	startup pipe
+ * Zygote to listener:
+ *	u_int	pid of the child, or -1 if fork failed
+ */
+static void
+zygote_start(void)
+{
+	int ctl[2], config_s[2], fd;
+	pid_t pid;
+
+	zygote_next_start = monotime() + ZYGOTE_RESTART_DELAY;
+	zygote_started = monotime();
+	zygote_forks = 0;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) == -1) {
+		error("%s: socketpair: %s", __func__, strerror(errno));
+		return;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, config_s) == -1) {
+		error("%s: socketpair: %s", __func__, strerror(errno));
+		close(ctl[0]);
+		close(ctl[1]);
+		return;
+	}
+	if ((pid = fork()) == -1) {
+		error("%s: fork: %s", __func__, strerror(errno));
+		close(ctl[0]);
+		close(ctl[1]);
+		close(config_s[0]);
+		close(config_s[1]);
+		return;
+	}
+	if (pid == 0) {
+		close_listen_socks();
+		close_startup_pipes();
+		close(ctl[0]);
+		close(config_s[0]);
+		/* move out of the way of the fixed descriptors first */
+		ctl[1] = fcntl(ctl[1], F_DUPFD, REEXEC_MIN_FREE_FD);
+		config_s[1] = fcntl(config_s[1], F_DUPFD, REEXEC_MIN_FREE_FD);
+		if (ctl[1] == -1 || config_s[1] == -1 ||
+		    dup2(ctl[1], REEXEC_ZYGOTE_FD) == -1 ||
+		    dup2(config_s[1], REEXEC_CONFIG_PASS_FD) == -1) {
+			error("%s: dup: %s", __func__, strerror(errno));
+			_exit(1);
+		}
+		if ((fd = open(_PATH_DEVNULL, O_RDWR, 0)) != -1) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			if (fd > STDERR_FILENO)
+				close(fd);
+		}
+		rexec_argv[rexec_argc] = "-Z";
+		execv(rexec_argv[0], rexec_argv);
+		error("%s: exec of %s failed: %s", __func__, rexec_argv[0],
+		    strerror(errno));
+		_exit(1);
+	}
+	close(ctl[1]);
+	close(config_s[1]);
+	send_rexec_state(config_s[0], cfg);
+	close(config_s[0]);
+	fcntl(ctl[0], F_SETFD, FD_CLOEXEC);
+	zygote_fd = ctl[0];
+	/* the zygote only speaks when asked, unless it exits */
+	poller_set(accept_poller, zygote_fd, POLLER_READ);
+	debug("%s: zygote pid %ld", __func__, (long)pid);
+}
+
+/* Close our end of the zygote's socket, which makes it exit. */
+static void
+zygote_stop(void)
+{
+	poller_forget(accept_poller, zygote_fd);
+	close(zygote_fd);
+	zygote_fd = -1;
+}
+
+/*
+ * Have the zygote fork a child for a new connection.  Returns the pid of
+ * the child or -1, in which case the caller forks the child itself.  On
+ * errors talking to the zygote it is abandoned, and a worn one is retired
+ * for the accept loop to replace.
+ */
+static pid_t
+zygote_spawn(int sock, int pipe_fd)
+{
+	struct sshbuf *m;
+	u_int pid = (u_int)-1;
+	u_char ver;
+
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	put_server_key(m);
+	if (ssh_msg_send(zygote_fd, 0, m) == -1 ||
+	    mm_send_fd(zygote_fd, sock) == -1 ||
+	    mm_send_fd(zygote_fd, pipe_fd) == -1) {
+		error("%s: cannot pass connection to zygote", __func__);
+		goto fail;
+	}
+	sshbuf_reset(m);
+	if (ssh_msg_recv(zygote_fd, m) == -1 ||
+	    sshbuf_get_u8(m, &ver) != 0 || ver != 0 ||
+	    sshbuf_get_u32(m, &pid) != 0) {
+		error("%s: no reply from zygote", __func__);
+		goto fail;
+	}
+	sshbuf_free(m);
+	if ((int)pid == -1) {
+		error("%s: zygote could not fork", __func__);
+		return -1;
+	}
+	if (++zygote_forks >= ZYGOTE_MAX_FORKS) {
+		debug("%s: replacing zygote after %u children", __func__,
+		    zygote_forks);
+		zygote_stop();
+		zygote_next_start = 0;
+	}
+	return (pid_t)(int)pid;
+ fail:
+	sshbuf_free(m);
+	zygote_stop();
+	return -1;
+}
+
+/*
+ * Reap the zygote's children and note whether one of them was killed by
+ * a signal, which may be someone probing for the layout they share.
+ */
+/*ARGSUSED*/
+static void
+zygote_sigchld_handler(int sig)
+{
+	int save_errno = errno;
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0 ||
+	    (pid < 0 && errno == EINTR))
+		if (pid > 0 && WIFSIGNALED(status))
+			zygote_child_signalled = 1;
+
+	signal(SIGCHLD, zygote_sigchld_handler);
+	errno = save_errno;
+}
+
+/* Exit if a child was killed by a signal; the listener starts a new zygote */
+static void
+zygote_check_children(void)
+{
+	if (!zygote_child_signalled)
+		return;
+	logit("zygote child terminated by a signal, re-executing zygote");
+	exit(0);
+}
+
+/*
+ * Main loop of the zygote: fork a child for each connection passed by the
+ * listener.  Returns in the child.
+ */
+static void
+zygote_loop(int *sock_in, int *sock_out)
+{
+	struct sshbuf *m;
+	struct pollfd pfd;
+	int r, sock, pipe_fd;
+	u_char ver;
+	pid_t pid;
+
+	close(REEXEC_CONFIG_PASS_FD);
+	setproctitle("%s", "[zygote]");
+	signal(SIGCHLD, zygote_sigchld_handler);
+	if ((m = sshbuf_new()) == NULL)
+		fatal("%s: sshbuf_new failed", __func__);
+	for (;;) {
+		/* wait interruptibly so that a crashed child is noticed */
+		zygote_check_children();
+		pfd.fd = REEXEC_ZYGOTE_FD;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno != EINTR)
+				fatal("%s: poll: %s", __func__, strerror(errno));
+			continue;
+		}
+		sshbuf_reset(m);
+		if (ssh_msg_recv(REEXEC_ZYGOTE_FD, m) == -1) {
+			debug("%s: listener has gone away", __func__);
+			exit(0);
+		}
+		if ((r = sshbuf_get_u8(m, &ver)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (ver != 0)
+			fatal("%s: version mismatch", __func__);
+		if ((sock = mm_receive_fd(REEXEC_ZYGOTE_FD)) == -1 ||
+		    (pipe_fd = mm_receive_fd(REEXEC_ZYGOTE_FD)) == -1)
+			fatal("%s: no descriptors from listener", __func__);
+		/* without a reply the listener forks this child itself */
+		zygote_check_children();
+
+		if ((pid = fork()) == 0) {
+			/* Child.  Proceed as a re-executed sshd would. */
+			close(REEXEC_ZYGOTE_FD);
+			get_server_key(m);
+			sshbuf_free(m);
+			signal(SIGCHLD, SIG_DFL);
+			if (setsid() < 0)
+				error("setsid: %.100s", strerror(errno));
+			log_init(__progname, options.log_level,
+			    options.log_facility, log_stderr);
+			arc4random_stir();
+			startup_pipe = pipe_fd;
+			*sock_in = *sock_out = sock;
+			debug("zygote child sock %d pipe %d", sock,
+			    startup_pipe);
+			return;
+		}
+		if (pid < 0)
+			error("fork: %.100s", strerror(errno));
+		close(sock);
+		close(pipe_fd);
+		sshbuf_reset(m);
+		if ((r = sshbuf_put_u32(m, (u_int)pid)) != 0)
+			fatal("%s: buffer error: %s", __func__, ssh_err(r));
+		if (ssh_msg_send(REEXEC_ZYGOTE_FD, 0, m) == -1)
+			exit(0);
+		/* Ensure that our random state differs from that of the child */
+		arc4random_stir();
+	}
+}
+
 /*
  * Listen for TCP connections
  */
@@ -1095,6 +1483,8 @@ server_listen(void)
 			continue;
 		}
 		listen_socks[num_listen_socks] = listen_sock;
+		xasprintf(&listen_stats[num_listen_socks].addr, "[%s]:%s",
+		    ntop, strport);
 		num_listen_socks++;
 
 		/* Start listening on the port. */
@@ -1110,30 +1500,211 @@ server_listen(void)
 }
 
 /*
- * The main TCP accept loop. Note that, for the non-debug case, returns
- * from this function are in a forked subprocess.
+ * Startup pipes of unauthenticated children, packed at the front of
+ * startup_pipes so that adding and removing one does not need a scan.
  */
 static void
-server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
+startup_add(int fd)
+{
+	startup_pipes[startups++] = fd;
+	poller_set(accept_poller, fd, POLLER_READ);
+}
+
+static void
+startup_remove(int i)
 {
-	fd_set *fdset;
-	int i, j, ret, maxfd;
-	int key_used = 0, startups = 0;
+	poller_forget(accept_poller, startup_pipes[i]);
+	close(startup_pipes[i]);
+	startup_pipes[i] = startup_pipes[--startups];
+	startup_pipes[startups] = -1;
+}
+
+/*
+ * Accept the connections pending on listener 'i', up to SSHD_ACCEPT_BATCH
+ * of them.  Returns 1 in the child that is to handle a connection (and in
+ * debugging mode), 0 in the listener.
+ */
+static int
+server_accept_batch(int i, int *sock_in, int *sock_out, int *newsock,
+    int *config_s)
+{
+	struct listen_stats *ls = &listen_stats[i];
 	int startup_p[2] = { -1 , -1 };
 	struct sockaddr_storage from;
 	socklen_t fromlen;
+	u_int n, got = 0;
+	int zygote;
 	pid_t pid;
 
-	/* setup fd set for accept */
-	fdset = NULL;
-	maxfd = 0;
-	for (i = 0; i < num_listen_socks; i++)
-		if (listen_socks[i] > maxfd)
-			maxfd = listen_socks[i];
+	for (n = 0; n < SSHD_ACCEPT_BATCH; n++) {
+		fromlen = sizeof(from);
+#ifdef SOCK_NONBLOCK
+		/* unlike accept(), the new socket is always blocking */
+		*newsock = accept4(listen_socks[i],
+		    (struct sockaddr *)&from, &fromlen, 0);
+#else
+		*newsock = accept(listen_socks[i],
+		    (struct sockaddr *)&from, &fromlen);
+#endif
+		if (*newsock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EWOULDBLOCK)
+				break;
+			error("accept: %.100s", strerror(errno));
+			ls->failed++;
+			if (errno == EMFILE || errno == ENFILE)
+				usleep(100 * 1000);
+			break;
+		}
+#ifndef SOCK_NONBLOCK
+		if (unset_nonblock(*newsock) == -1) {
+			close(*newsock);
+			ls->failed++;
+			continue;
+		}
+#endif
+		if (drop_connection() == 1) {
+			debug("drop connection #%d", startups);
+			close(*newsock);
+			ls->dropped++;
+			continue;
+		}
+		if (pipe(startup_p) == -1) {
+			close(*newsock);
+			ls->failed++;
+			continue;
+		}
+		/* read by phase_collect() from the accept loop */
+		set_nonblock(startup_p[0]);
+
+		/* the zygote forks the child, see zygote_loop() */
+		pid = -1;
+		if (zygote_fd != -1)
+			pid = zygote_spawn(*newsock, startup_p[1]);
+		zygote = pid > 0;
+		if (rexec_flag && !zygote && socketpair(AF_UNIX,
+		    SOCK_STREAM, 0, config_s) == -1) {
+			error("reexec socketpair: %s",
+			    strerror(errno));
+			close(*newsock);
+			close(startup_p[0]);
+			close(startup_p[1]);
+			ls->failed++;
+			continue;
+		}
+
+		startup_add(startup_p[0]);
+		ls->accepted++;
+		if (++got > ls->batch_max)
+			ls->batch_max = got;
+
+		/*
+		 * Got connection.  Fork a child to handle it, unless
+		 * we are in debugging mode.
+		 */
+		if (debug_flag) {
+			/*
+			 * In debugging mode.  Close the listening
+			 * socket, and start processing the
+			 * connection without forking.
+			 */
+			debug("Server will not fork when running in debugging mode.");
+			close_listen_socks();
+			*sock_in = *newsock;
+			*sock_out = *newsock;
+			close(startup_p[0]);
+			close(startup_p[1]);
+			startup_pipe = -1;
+			if (rexec_flag) {
+				send_rexec_state(config_s[0], cfg);
+				close(config_s[0]);
+			}
+			return 1;
+		}
+
+		/*
+		 * Normal production daemon.  Fork, and have
+		 * the child process the connection. The
+		 * parent continues listening.
+		 */
+		if (!zygote && (pid = fork()) == 0) {
+			/*
+			 * Child.  Close the listening and
+			 * max_startup sockets.  Start using
+			 * the accepted socket. Reinitialize
+			 * logging (since our pid has changed).
+			 * We return to handle the connection.
+			 */
+			startup_pipe = startup_p[1];
+			close_startup_pipes();
+			close_listen_socks();
+			poller_free(accept_poller);
+			accept_poller = NULL;
+			*sock_in = *newsock;
+			*sock_out = *newsock;
+			log_init(__progname,
+			    options.log_level,
+			    options.log_facility,
+			    log_stderr);
+			if (rexec_flag)
+				close(config_s[0]);
+			return 1;
+		}
+
+		/* Parent.  Stay in the loop. */
+		if (pid < 0)
+			error("fork: %.100s", strerror(errno));
+		else if (pid > 0)
+			debug("Forked child %ld.", (long)pid);
+
+		close(startup_p[1]);
+
+		if (rexec_flag && !zygote) {
+			send_rexec_state(config_s[0], cfg);
+			close(config_s[0]);
+			close(config_s[1]);
+		}
+
+		/*
+		 * Mark that the key has been used (it
+		 * was "given" to the child).
+		 */
+		if ((options.protocol & SSH_PROTO_1) &&
+		    key_used == 0) {
+			/* Schedule server key regeneration alarm. */
+			signal(SIGALRM, key_regeneration_alarm);
+			alarm(options.key_regeneration_time);
+			key_used = 1;
+		}
+
+		close(*newsock);
+
+		/*
+		 * Ensure that our random state differs
+		 * from that of the child
+		 */
+		arc4random_stir();
+	}
+	return 0;
+}
+
+/*
+ * The main TCP accept loop. Note that, for the non-debug case, returns
+ * from this function are in a forked subprocess.
+ */
+static void
+server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
+{
+	int i, ret, timeout;
+
+	accept_poller = poller_new();
 	/* pipes connected to unauthenticated childs */
 	startup_pipes = xcalloc(options.max_startups, sizeof(int));
 	for (i = 0; i < options.max_startups; i++)
 		startup_pipes[i] = -1;
+	for (i = 0; i < num_listen_socks; i++)
+		poller_set(accept_poller, listen_socks[i], POLLER_READ);
 
 	/*
 	 * Stay listening for connections until the system crashes or
@@ -1142,24 +1713,31 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 	for (;;) {
 		if (received_sighup)
 			sighup_restart();
-		if (fdset != NULL)
-			xfree(fdset);
-		fdset = (fd_set *)xcalloc(howmany(maxfd + 1, NFDBITS),
-		    sizeof(fd_mask));
-
-		for (i = 0; i < num_listen_socks; i++)
-			FD_SET(listen_socks[i], fdset);
-		for (i = 0; i < options.max_startups; i++)
-			if (startup_pipes[i] != -1)
-				FD_SET(startup_pipes[i], fdset);
-
-		/* Wait in select until there is a connection. */
-		ret = select(maxfd+1, fdset, NULL, NULL, NULL);
+		if (zygote_fd != -1 &&
+		    monotime() >= zygote_started + ZYGOTE_MAX_AGE) {
+			debug("replacing zygote after %d seconds",
+			    ZYGOTE_MAX_AGE);
+			zygote_stop();
+			zygote_next_start = 0;
+		}
+		if (options.use_zygote && rexec_flag && !debug_flag &&
+		    zygote_fd == -1 && monotime() >= zygote_next_start)
+			zygote_start();
+
+		/* Wait until there is a connection. */
+		timeout = -1;
+		if (options.latency_stats_file != NULL &&
+		    (timeout = phase_stats_timeout()) == 0) {
+			phase_stats_write(options.latency_stats_file);
+			timeout = -1;
+		}
+		ret = poller_wait(accept_poller, timeout);
 		if (ret < 0 && errno != EINTR)
-			error("select: %.100s", strerror(errno));
+			error("poller_wait: %.100s", strerror(errno));
 		if (received_sigterm) {
 			logit("Received signal %d; terminating.",
 			    (int) received_sigterm);
+			listen_stats_log();
 			close_listen_socks();
 			unlink(options.pid_file);
 			exit(received_sigterm == SIGTERM ? 0 : 255);
@@ -1172,161 +1750,32 @@ server_accept_loop(int *sock_in, int *sock_out, int *newsock, int *config_s)
 		if (ret < 0)
 			continue;
 
-		for (i = 0; i < options.max_startups; i++)
-			if (startup_pipes[i] != -1 &&
-			    FD_ISSET(startup_pipes[i], fdset)) {
-				/*
-				 * the read end of the pipe is ready
-				 * if the child has closed the pipe
-				 * after successful authentication
-				 * or if the child has died
-				 */
-				close(startup_pipes[i]);
-				startup_pipes[i] = -1;
-				startups--;
-			}
+		/*
+		 * the read end of a startup pipe is ready if the child
+		 * has sent phase latencies, has closed the pipe after
+		 * successful authentication or has died
+		 */
+		for (i = startups - 1; i >= 0; i--)
+			if (poller_ready(accept_poller, startup_pipes[i],
+			    POLLER_READ) &&
+			    phase_collect(startup_pipes[i]) == -1)
+				startup_remove(i);
+		if (zygote_fd != -1 &&
+		    poller_ready(accept_poller, zygote_fd, POLLER_READ)) {
+			debug("zygote has exited");
+			zygote_stop();
+		}
 		for (i = 0; i < num_listen_socks; i++) {
-			if (!FD_ISSET(listen_socks[i], fdset))
-				continue;
-			fromlen = sizeof(from);
-			*newsock = accept(listen_socks[i],
-			    (struct sockaddr *)&from, &fromlen);
-			if (*newsock < 0) {
-				if (errno != EINTR && errno != EWOULDBLOCK)
-					error("accept: %.100s",
-					    strerror(errno));
-				if (errno == EMFILE || errno == ENFILE)
-					usleep(100 * 1000);
-				continue;
-			}
-			if (unset_nonblock(*newsock) == -1) {
-				close(*newsock);
-				continue;
-			}
-			if (drop_connection(startups) == 1) {
-				debug("drop connection #%d", startups);
-				close(*newsock);
-				continue;
-			}
-			if (pipe(startup_p) == -1) {
-				close(*newsock);
-				continue;
-			}
-
-			if (rexec_flag && socketpair(AF_UNIX,
-			    SOCK_STREAM, 0, config_s) == -1) {
-				error("reexec socketpair: %s",
-				    strerror(errno));
-				close(*newsock);
-				close(startup_p[0]);
-				close(startup_p[1]);
+			if (!poller_ready(accept_poller, listen_socks[i],
+			    POLLER_READ))
 				continue;
-			}
-
-			for (j = 0; j < options.max_startups; j++)
-				if (startup_pipes[j] == -1) {
-					startup_pipes[j] = startup_p[0];
-					if (maxfd < startup_p[0])
-						maxfd = startup_p[0];
-					startups++;
-					break;
-				}
-
-			/*
-			 * Got connection.  Fork a child to handle it, unless
-			 * we are in debugging mode.
-			 */
-			if (debug_flag) {
-				/*
-				 * In debugging mode.  Close the listening
-				 * socket, and start processing the
-				 * connection without forking.
-				 */
-				debug("Server will not fork when running in debugging mode.");
-				close_listen_socks();
-				*sock_in = *newsock;
-				*sock_out = *newsock;
-				close(startup_p[0]);
-				close(startup_p[1]);
-				startup_pipe = -1;
-				pid = getpid();
-				if (rexec_flag) {
-					send_rexec_state(config_s[0], cfg);
-					close(config_s[0]);
-				}
-				break;
-			}
-
-			/*
-			 * Normal production daemon.  Fork, and have
-			 * the child process the connection. The
-			 * parent continues listening.
-			 */
-			if ((pid = fork()) == 0) {
-				/*
-				 * Child.  Close the listening and
-				 * max_startup sockets.  Start using
-				 * the accepted socket. Reinitialize
-				 * logging (since our pid has changed).
-				 * We break out of the loop to handle
-				 * the connection.
-				 */
-				startup_pipe = startup_p[1];
-				close_startup_pipes();
-				close_listen_socks();
-				*sock_in = *newsock;
-				*sock_out = *newsock;
-				log_init(__progname,
-				    options.log_level,
-				    options.log_facility,
-				    log_stderr);
-				if (rexec_flag)
-					close(config_s[0]);
-				break;
-			}
-
-			/* Parent.  Stay in the loop. */
-			if (pid < 0)
-				error("fork: %.100s", strerror(errno));
-			else
-				debug("Forked child %ld.", (long)pid);
-
-			close(startup_p[1]);
-
-			if (rexec_flag) {
-				send_rexec_state(config_s[0], cfg);
-				close(config_s[0]);
-				close(config_s[1]);
-			}
-
-			/*
-			 * Mark that the key has been used (it
-			 * was "given" to the child).
-			 */
-			if ((options.protocol & SSH_PROTO_1) &&
-			    key_used == 0) {
-				/* Schedule server key regeneration alarm. */
-				signal(SIGALRM, key_regeneration_alarm);
-				alarm(options.key_regeneration_time);
-				key_used = 1;
-			}
-
-			close(*newsock);
-
-			/*
-			 * Ensure that our random state differs
-			 * from that of the child
-			 */
-			arc4random_stir();
+			if (server_accept_batch(i, sock_in, sock_out,
+			    newsock, config_s))
+				return;
 		}
-
-		/* child process check (or debug mode) */
-		if (num_listen_socks < 0)
-			break;
 	}
 }
 
-
 /*
  * Main program for the daemon.
  */
@@ -1344,6 +1793,7 @@ main(int ac, char **av)
 	int config_s[2] = { -1 , -1 };
 	u_int n;
 	u_int64_t ibytes, obytes;
+	struct timeval login_start, start;
 	mode_t new_umask;
 	struct sshkey *key;
 	Authctxt *authctxt;
@@ -1360,7 +1810,7 @@ main(int ac, char **av)
 	initialize_server_options(&options);
 
 	/* Parse command-line arguments. */
-	while ((opt = getopt(ac, av, "f:p:b:k:h:g:u:o:C:dDeiqrtQRT46")) != -1) {
+	while ((opt = getopt(ac, av, "f:p:b:k:h:g:u:o:C:dDeiqrtQRTZ46")) != -1) {
 		switch (opt) {
 		case '4':
 			options.address_family = AF_INET;
@@ -1402,6 +1852,11 @@ main(int ac, char **av)
 			rexeced_flag = 1;
 			inetd_flag = 1;
 			break;
+		case 'Z':
+			rexeced_flag = 1;
+			inetd_flag = 1;
+			zygote_flag = 1;
+			break;
 		case 'Q':
 			/* ignored */
 			break;
@@ -1561,6 +2016,7 @@ main(int ac, char **av)
 
 	/* set default channel AF */
 	channel_set_af(options.address_family);
+	channel_set_window_budget(options.channel_window_budget);
 
 	/* Check that there are no remaining arguments. */
 	if (optind < ac) {
@@ -1752,8 +2208,20 @@ main(int ac, char **av)
 	/* ignore SIGPIPE */
 	signal(SIGPIPE, SIG_IGN);
 
-	/* Get a connection, either from inetd or a listening TCP socket */
-	if (inetd_flag) {
+	/* created by the listener, shared by the monitors of all connections */
+	certcache_init(rexec_certcache_fd);
+	cmdcache_init(rexec_cmdcache_fd,
+	    options.authorized_keys_command_cache_time,
+	    options.authorized_keys_command_cache_negative,
+	    options.authorized_keys_command_cache_size);
+
+	/*
+	 * Get a connection, either from the listener via the zygote, from
+	 * inetd or a listening TCP socket
+	 */
+	if (zygote_flag) {
+		zygote_loop(&sock_in, &sock_out);
+	} else if (inetd_flag) {
 		server_accept_inetd(&sock_in, &sock_out);
 	} else {
 		server_listen();
@@ -1916,7 +2384,12 @@ main(int ac, char **av)
 	if (!debug_flag)
 		alarm(options.login_grace_time);
 
+	/* phase latencies go to the listener until startup_pipe_close() */
+	phase_set_fd(startup_pipe);
+	monotime_tv(&login_start);
+	start = login_start;
 	sshd_exchange_identification(ssh, sock_in, sock_out);
+	phase_done(PHASE_IDENT, &start);
 
 	/* In inetd mode, generate ephemeral key only for proto 1 connections */
 	if (!compat20 && inetd_flag && sensitive_data.server_key == NULL)
@@ -1942,11 +2415,14 @@ main(int ac, char **av)
 
 	/* perform the key exchange */
 	/* authenticate user and start session */
+	monotime_tv(&start);
 	if (compat20) {
 		do_ssh2_kex(ssh);
+		phase_done(PHASE_KEX, &start);
 		do_authentication2(ssh);
 	} else {
 		do_ssh1_kex(ssh);
+		phase_done(PHASE_KEX, &start);
 		do_authentication(ssh);
 	}
 	/*
@@ -1966,10 +2442,10 @@ main(int ac, char **av)
 	alarm(0);
 	signal(SIGALRM, SIG_DFL);
 	authctxt->authenticated = 1;
-	if (startup_pipe != -1) {
-		close(startup_pipe);
-		startup_pipe = -1;
-	}
+	phase_done(PHASE_LOGIN, &login_start);
+
+	if (compat20 && options.roaming_grace_time > 0)
+		roaming_server_listen();
 
 	/*
 	 * In privilege separation, we fork another child and prepare
@@ -1981,6 +2457,7 @@ main(int ac, char **av)
 		if (!compat20)
 			destroy_sensitive_data();
 	}
+	startup_pipe_close();
 
 	ssh_packet_set_timeout(ssh, options.client_alive_interval,
 	    options.client_alive_count_max);
@@ -1995,6 +2472,7 @@ main(int ac, char **av)
 
 	verbose("Closing connection to %.500s port %d", remote_ip, remote_port);
 	ssh_packet_close(ssh);
+	roaming_server_cleanup();
 
 	if (use_privsep)
 		mm_terminate();
@@ -2244,6 +2722,30 @@ do_ssh1_kex(struct ssh *ssh)
 	ssh_packet_write_wait(ssh);
 }
 
+/*
+ * A roaming client comes back to a session it lost: have the connection
+ * passed to that session by the privileged process.  Called by the key
+ * exchange; does not return unless the connection could not be passed.
+ */
+static int
+sshd_roaming_resume(struct ssh *ssh)
+{
+	u_int32_t id;
+	int r;
+
+	if ((r = roaming_server_resume_id(ssh, &id)) != 0)
+		return r;
+	if (use_privsep)
+		r = mm_roaming_resume(id);
+	else if ((r = roaming_server_pass(id,
+	    ssh_packet_get_connection_in(ssh))) == 0)
+		verbose("Connection from %.200s resumes session %08x",
+		    ssh_remote_ipaddr(ssh), id);
+	if (r != 0)
+		ssh_packet_disconnect(ssh, "No session to resume");
+	exit(0);
+}
+
 /*
  * SSH2 key exchange: diffie-hellman-group1-sha1
  */
@@ -2280,6 +2782,10 @@ do_ssh2_kex(struct ssh *ssh)
 	}
 	if (options.kex_algorithms != NULL)
 		myproposal[PROPOSAL_KEX_ALGS] = options.kex_algorithms;
+	/* tell roaming clients that they may resume */
+	if (options.roaming_grace_time > 0)
+		xasprintf(&myproposal[PROPOSAL_KEX_ALGS], "%s,%s",
+		    myproposal[PROPOSAL_KEX_ALGS], KEX_RESUME);
 
 	myproposal[PROPOSAL_SERVER_HOST_KEY_ALGS] = list_hostkey_types();
 
@@ -2298,10 +2804,14 @@ do_ssh2_kex(struct ssh *ssh)
 	kex->load_host_public_key=&get_hostkey_public_by_type;
 	kex->load_host_private_key=&get_hostkey_private_by_type;
 	kex->host_key_index=&get_hostkey_index;
+	if (options.roaming_grace_time > 0)
+		kex->resume = sshd_roaming_resume;
 
 	if ((r = ssh_dispatch_run(ssh, DISPATCH_BLOCK,
 	    &kex->done)) != 0)
 		fatal("%s: key exchange failed: %s", __func__, ssh_err(r));
+	/* only a new connection may resume, never one rekeying */
+	kex->resume = NULL;
 
 	session_id2 = kex->session_id;
 	session_id2_len = kex->session_id_len;
@@ -2321,7 +2831,11 @@ do_ssh2_kex(struct ssh *ssh)
 void
 cleanup_exit(int i)
 {
+	pid_t pid;
+	int status;
+
 	channel_close_all();
+	roaming_server_cleanup();
 
 	if (the_authctxt) {
 		do_cleanup(the_authctxt);
@@ -2331,7 +2845,18 @@ cleanup_exit(int i)
 			    errno != ESRCH)
 				error("%s: kill(%d): %s", __func__,
 				    pmonitor->m_pid, strerror(errno));
+			if (zygote_flag) {
+				while ((pid = waitpid(pmonitor->m_pid,
+				    &status, 0)) == -1 && errno == EINTR)
+					;
+				if (pid > 0 && WIFSIGNALED(status) &&
+				    WTERMSIG(status) != SIGKILL)
+					privsep_preauth_signalled = 1;
+			}
 		}
 	}
+	/* let the zygote see the crash, see zygote_sigchld_handler() */
+	if (zygote_flag && privsep_preauth_signalled)
+		kill(getpid(), SIGKILL);
 	_exit(i);
 }
@@ -0,0 +1,305 @@
+/* 	$OpenBSD$ */
+/*
+ * Regress test for the ssh_api channel layer
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_helper.h"
+
+#include "err.h"
+#include "ssh_api.h"
+#include "ssh2.h"
+#include "sshbuf.h"
+#include "packet.h"
+#include "myproposal.h"
+
+#define TEST_WINDOW	(64*1024)
+#define TEST_PACKET	(16*1024)
+#define TEST_TOTAL	(1024*1024)
+
+void channel_tests(void);
+
+struct peer {
+	struct ssh *ssh;
+	struct ssh_channel *chan;
+	int opened, refused, eof, closed, requests;
+	size_t sent, received;
+	u_char expect;			/* next byte of the test pattern */
+};
+
+static void
+pump_data(struct peer *p)
+{
+	u_char buf[8192];
+	size_t i, n, written;
+
+	while (p->sent < TEST_TOTAL && ssh_channel_write_space(p->chan) > 0) {
+		n = MIN(sizeof(buf), TEST_TOTAL - p->sent);
+		for (i = 0; i < n; i++)
+			buf[i] = (p->sent + i) & 0xff;
+		ASSERT_INT_EQ(ssh_channel_write(p->chan, buf, n, &written), 0);
+		p->sent += written;
+		if (written < n)
+			break;
+	}
+	if (p->sent == TEST_TOTAL)
+		ASSERT_INT_EQ(ssh_channel_eof(p->chan), 0);
+}
+
+static void
+open_cb(struct ssh_channel *c, int ok, void *ctx)
+{
+	struct peer *p = ctx;
+
+	ASSERT_INT_EQ(ok, 1);
+	p->opened = 1;
+	pump_data(p);
+}
+
+static void
+data_cb(struct ssh_channel *c, const u_char *data, size_t len, void *ctx)
+{
+	struct peer *p = ctx;
+	size_t i;
+
+	ASSERT_SIZE_T_LE(len, TEST_PACKET);
+	for (i = 0; i < len; i++)
+		ASSERT_U8_EQ(data[i], p->expect++);
+	p->received += len;
+	ASSERT_INT_EQ(ssh_channel_consume(c, len), 0);
+}
+
+static void
+eof_cb(struct ssh_channel *c, void *ctx)
+{
+	struct peer *p = ctx;
+
+	p->eof = 1;
+	ASSERT_INT_EQ(ssh_channel_close(c), 0);
+}
+
+static void
+close_cb(struct ssh_channel *c, void *ctx)
+{
+	struct peer *p = ctx;
+
+	p->closed = 1;
+	p->chan = NULL;
+}
+
+static void
+window_cb(struct ssh_channel *c, size_t space, void *ctx)
+{
+	pump_data(ctx);
+}
+
+static int
+request_cb(struct ssh_channel *c, const char *rtype, const u_char *data,
+    size_t len, void *ctx)
+{
+	struct peer *p = ctx;
+
+	p->requests++;
+	return 0;
+}
+
+static const struct ssh_channel_callbacks test_callbacks = {
+	open_cb, data_cb, NULL, eof_cb, close_cb, window_cb, request_cb
+};
+
+static void
+refused_cb(struct ssh_channel *c, int ok, void *ctx)
+{
+	struct peer *p = ctx;
+
+	ASSERT_INT_EQ(ok, 0);
+	p->refused++;
+}
+
+static const struct ssh_channel_callbacks refused_callbacks = {
+	refused_cb, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+static int
+accept_cb(struct ssh *ssh, struct ssh_channel *c, const char *ctype,
+    const u_char *extra, size_t extralen, void *ctx)
+{
+	struct peer *p = ctx;
+
+	if (strcmp(ctype, "test@openssh.com") != 0)
+		return SSH2_OPEN_UNKNOWN_CHANNEL_TYPE;
+	ASSERT_SIZE_T_EQ(extralen, 4);
+	ASSERT_MEM_EQ(extra, "\0\0\0\0", 4);
+	ASSERT_INT_EQ(ssh_channel_set_window(c, TEST_WINDOW, TEST_PACKET), 0);
+	ssh_channel_set_callbacks(c, &test_callbacks, p);
+	p->chan = c;
+	p->opened = 1;
+	return 0;
+}
+
+/* throw away what 'p' has sent so far */
+static void
+discard_output(struct peer *p)
+{
+	size_t len;
+
+	(void)ssh_output_ptr(p->ssh, &len);
+	ASSERT_INT_EQ(ssh_output_consume(p->ssh, len), 0);
+}
+
+/* move output to the peer and feed all packets to the channel layer */
+static void
+transfer(struct peer *from, struct peer *to)
+{
+	const u_char *buf;
+	size_t len;
+	u_char type;
+	int handled;
+
+	buf = ssh_output_ptr(from->ssh, &len);
+	if (len > 0) {
+		ASSERT_INT_EQ(ssh_input_append(to->ssh, buf, len), 0);
+		ASSERT_INT_EQ(ssh_output_consume(from->ssh, len), 0);
+	}
+	for (;;) {
+		ASSERT_INT_EQ(ssh_packet_next(to->ssh, &type), 0);
+		if (type == 0)
+			break;
+		ASSERT_INT_EQ(ssh_channel_input(to->ssh, type, &handled), 0);
+		ASSERT_INT_EQ(handled, 1);
+	}
+}
+
+static void
+run(struct peer *client, struct peer *server, int rounds)
+{
+	int i;
+
+	for (i = 0; i < rounds; i++) {
+		transfer(client, server);
+		transfer(server, client);
+	}
+}
+
+void
+channel_tests(void)
+{
+	struct peer client, server;
+	struct sshkey *private, *public;
+	struct ssh_channel *c;
+	int i;
+
+	TEST_START("setup");
+	memset(&client, 0, sizeof(client));
+	memset(&server, 0, sizeof(server));
+	ASSERT_INT_EQ(sshkey_generate(KEY_ECDSA, 256, &private), 0);
+	ASSERT_INT_EQ(sshkey_from_private(private, &public), 0);
+	ASSERT_INT_EQ(ssh_init(&client.ssh, 0, NULL), 0);
+	ASSERT_INT_EQ(ssh_init(&server.ssh, 1, NULL), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(server.ssh, private), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(client.ssh, public), 0);
+	for (i = 0; i < 10; i++)
+		run(&client, &server, 1);
+	ASSERT_INT_EQ(client.ssh->kex->done, 1);
+	ASSERT_INT_EQ(server.ssh->kex->done, 1);
+	TEST_DONE();
+
+	TEST_START("open refused without accept callback");
+	ASSERT_INT_EQ(ssh_channel_open(client.ssh, "test@openssh.com",
+	    "\0\0\0\0", 4, &refused_callbacks, &client, &c), 0);
+	ASSERT_PTR_NE(c, NULL);
+	run(&client, &server, 2);
+	ASSERT_INT_EQ(client.refused, 1);
+	ASSERT_INT_EQ(client.opened, 0);
+	ASSERT_PTR_EQ(server.chan, NULL);
+	TEST_DONE();
+
+	TEST_START("open unknown type");
+	ASSERT_INT_EQ(ssh_channel_set_accept_callback(server.ssh,
+	    accept_cb, &server), 0);
+	ASSERT_INT_EQ(ssh_channel_open(client.ssh, "unknown@openssh.com",
+	    NULL, 0, &refused_callbacks, &client, &c), 0);
+	run(&client, &server, 2);
+	ASSERT_INT_EQ(client.refused, 2);
+	ASSERT_INT_EQ(client.opened, 0);
+	ASSERT_PTR_EQ(server.chan, NULL);
+	TEST_DONE();
+
+	TEST_START("open");
+	ASSERT_INT_EQ(ssh_channel_open(client.ssh, "test@openssh.com",
+	    "\0\0\0\0", 4, &test_callbacks, &client, &client.chan), 0);
+	run(&client, &server, 1);
+	ASSERT_PTR_NE(server.chan, NULL);
+	ASSERT_INT_EQ(client.opened, 1);
+	ASSERT_SIZE_T_EQ(client.sent, TEST_WINDOW);
+	TEST_DONE();
+
+	TEST_START("data with window adjust");
+	run(&client, &server, 2 * TEST_TOTAL / TEST_WINDOW);
+	ASSERT_SIZE_T_EQ(client.sent, TEST_TOTAL);
+	ASSERT_SIZE_T_EQ(server.received, TEST_TOTAL);
+	TEST_DONE();
+
+	TEST_START("eof and close");
+	run(&client, &server, 2);
+	ASSERT_INT_EQ(server.eof, 1);
+	ASSERT_INT_EQ(client.closed, 1);
+	ASSERT_INT_EQ(server.closed, 1);
+	TEST_DONE();
+
+	TEST_START("open with zero max packet size refused");
+	server.opened = server.eof = server.closed = 0;
+	server.received = 0;
+	ASSERT_INT_EQ(ssh_channel_open(client.ssh, "test@openssh.com",
+	    "\0\0\0\0", 4, &refused_callbacks, &client, &c), 0);
+	discard_output(&client);
+	ASSERT_INT_EQ(sshpkt_start(client.ssh, SSH2_MSG_CHANNEL_OPEN), 0);
+	ASSERT_INT_EQ(sshpkt_put_cstring(client.ssh, "test@openssh.com"), 0);
+	ASSERT_INT_EQ(sshpkt_put_u32(client.ssh, ssh_channel_id(c)), 0);
+	ASSERT_INT_EQ(sshpkt_put_u32(client.ssh, TEST_WINDOW), 0);
+	ASSERT_INT_EQ(sshpkt_put_u32(client.ssh, 0), 0);
+	ASSERT_INT_EQ(sshpkt_put(client.ssh, "\0\0\0\0", 4), 0);
+	ASSERT_INT_EQ(sshpkt_send(client.ssh), 0);
+	run(&client, &server, 1);
+	ASSERT_PTR_EQ(server.chan, NULL);
+	ASSERT_INT_EQ(client.refused, 3);
+	TEST_DONE();
+
+	TEST_START("open confirmed with zero max packet size");
+	ASSERT_INT_EQ(ssh_channel_open(client.ssh, "test@openssh.com",
+	    "\0\0\0\0", 4, &refused_callbacks, &client, &c), 0);
+	transfer(&client, &server);
+	ASSERT_PTR_NE(server.chan, NULL);
+	discard_output(&server);
+	ASSERT_INT_EQ(sshpkt_start(server.ssh,
+	    SSH2_MSG_CHANNEL_OPEN_CONFIRMATION), 0);
+	ASSERT_INT_EQ(sshpkt_put_u32(server.ssh, ssh_channel_id(c)), 0);
+	ASSERT_INT_EQ(sshpkt_put_u32(server.ssh,
+	    ssh_channel_id(server.chan)), 0);
+	ASSERT_INT_EQ(sshpkt_put_u32(server.ssh, TEST_WINDOW), 0);
+	ASSERT_INT_EQ(sshpkt_put_u32(server.ssh, 0), 0);
+	ASSERT_INT_EQ(sshpkt_send(server.ssh), 0);
+	transfer(&server, &client);
+	ASSERT_INT_EQ(client.refused, 4);
+	/* the client closes the channel, the server answers */
+	run(&client, &server, 1);
+	ASSERT_INT_EQ(server.closed, 1);
+	ASSERT_PTR_EQ(server.chan, NULL);
+	ASSERT_SIZE_T_EQ(server.received, 0);
+	TEST_DONE();
+
+	TEST_START("cleanup");
+	ssh_free(client.ssh);
+	ssh_free(server.ssh);
+	sshkey_free(private);
+	sshkey_free(public);
+	TEST_DONE();
+}
@@ -0,0 +1,14 @@
+/* 	$OpenBSD$ */
+/*
+ * Placed in the public domain
+ */
+
+#include "test_helper.h"
+
+void channel_tests(void);
+
+void
+tests(void)
+{
+	channel_tests();
+}
@@ -75,9 +75,13 @@ static void
 do_kex_with_key(char *kex, int key_type, int bits)
 {
 	struct ssh *client = NULL, *server = NULL, *server2 = NULL;
+	struct ssh *client2 = NULL;
 	struct sshkey *private, *public;
 	struct sshbuf *state;
 	struct kex_params kex_params;
+	const u_char *buf;
+	size_t len;
+	u_char type;
 
 	TEST_START("sshkey_generate");
 	ASSERT_INT_EQ(sshkey_generate(key_type, bits, &private), 0);
@@ -150,15 +154,128 @@ do_kex_with_key(char *kex, int key_type, int bits)
 	run_kex(client, server2);
 	TEST_DONE();
 
+	TEST_START("ssh_export_state");
+	state = sshbuf_new();
+	ASSERT_PTR_NE(state, NULL);
+	ASSERT_INT_EQ(ssh_packet_put(client, 90, "before", 6), 0);
+	ASSERT_INT_EQ(ssh_export_state(client, state), 0);
+	TEST_DONE();
+
+	TEST_START("ssh_import_state");
+	ASSERT_INT_EQ(ssh_import_state(&client2, 0, &kex_params, state), 0);
+	ASSERT_PTR_NE(client2, NULL);
+	ASSERT_INT_EQ(sshbuf_len(state), 0);
+	sshbuf_free(state);
+	ASSERT_INT_EQ(ssh_add_hostkey(client2, public), 0);
+	/* output buffered before the export is carried over */
+	ASSERT_INT_EQ(ssh_packet_put(client2, 91, "after", 5), 0);
+	buf = ssh_output_ptr(client2, &len);
+	ASSERT_INT_EQ(ssh_input_append(server2, buf, len), 0);
+	ASSERT_INT_EQ(ssh_output_consume(client2, len), 0);
+	ASSERT_INT_EQ(ssh_packet_next(server2, &type), 0);
+	ASSERT_U8_EQ(type, 90);
+	buf = ssh_packet_payload(server2, &len);
+	ASSERT_SIZE_T_EQ(len, 6);
+	ASSERT_MEM_EQ(buf, "before", 6);
+	ASSERT_INT_EQ(ssh_packet_next(server2, &type), 0);
+	ASSERT_U8_EQ(type, 91);
+	TEST_DONE();
+
+	TEST_START("rekeying imported client");
+	ASSERT_INT_EQ(kex_send_kexinit(client2), 0);
+	state = sshbuf_new();
+	ASSERT_PTR_NE(state, NULL);
+	ASSERT_INT_EQ(ssh_export_state(client2, state),
+	    SSH_ERR_INVALID_ARGUMENT);
+	sshbuf_free(state);
+	run_kex(client2, server2);
+	TEST_DONE();
+
 	TEST_START("cleanup");
 	sshkey_free(private);
 	sshkey_free(public);
 	ssh_free(client);
+	ssh_free(client2);
 	ssh_free(server);
 	ssh_free(server2);
 	TEST_DONE();
 }
 
+static int deferred_calls;
+
+static int
+deferred_verify_cb(struct sshkey *key, struct ssh *ssh)
+{
+	deferred_calls++;
+	return KEX_VERIFY_DEFERRED;
+}
+
+static void
+do_kex_deferred(int ok)
+{
+	struct ssh *client = NULL, *server = NULL;
+	struct sshkey *private, *public;
+	size_t len;
+	u_char type;
+	int i;
+
+	TEST_START("deferred verification setup");
+	ASSERT_INT_EQ(sshkey_generate(KEY_ECDSA, 256, &private), 0);
+	ASSERT_INT_EQ(sshkey_from_private(private, &public), 0);
+	ASSERT_INT_EQ(ssh_init(&client, 0, NULL), 0);
+	ASSERT_INT_EQ(ssh_init(&server, 1, NULL), 0);
+	ASSERT_INT_EQ(ssh_add_hostkey(server, private), 0);
+	ASSERT_INT_EQ(ssh_set_verify_host_key_callback(client,
+	    deferred_verify_cb), 0);
+	ASSERT_INT_EQ(ssh_hostkey_verified(client, 1),
+	    SSH_ERR_INVALID_ARGUMENT);
+	TEST_DONE();
+
+	TEST_START("deferred verification parks kex");
+	deferred_calls = 0;
+	for (i = 0; i < 10; i++) {
+		ASSERT_INT_EQ(do_send_and_receive(server, client), 0);
+		ASSERT_INT_EQ(do_send_and_receive(client, server), 0);
+	}
+	ASSERT_INT_EQ(deferred_calls, 1);
+	ASSERT_INT_EQ(client->kex->done, 0);
+	TEST_DONE();
+
+	TEST_START("deferred verification leaves NEWKEYS queued");
+	/* the server's ECDH reply and NEWKEYS arrived in one buffer */
+	ASSERT_INT_NE(client->kex->flags & KEX_HOSTKEY_PENDING, 0);
+	len = sshbuf_len(ssh_packet_get_input(client));
+	ASSERT_SIZE_T_GT(len, 0);
+	ASSERT_INT_EQ(ssh_packet_next(client, &type), 0);
+	ASSERT_U8_EQ(type, 0);
+	ASSERT_SIZE_T_EQ(sshbuf_len(ssh_packet_get_input(client)), len);
+	TEST_DONE();
+
+	if (ok) {
+		TEST_START("deferred verification accepted");
+		ASSERT_INT_EQ(ssh_hostkey_verified(client, 1), 0);
+		run_kex(client, server);
+		ASSERT_INT_EQ(ssh_hostkey_verified(client, 1),
+		    SSH_ERR_INVALID_ARGUMENT);
+		TEST_DONE();
+	} else {
+		TEST_START("deferred verification rejected");
+		ASSERT_INT_EQ(ssh_hostkey_verified(client, 0),
+		    SSH_ERR_SIGNATURE_INVALID);
+		ASSERT_INT_EQ(do_send_and_receive(client, server),
+		    SSH_ERR_SIGNATURE_INVALID);
+		ASSERT_INT_EQ(client->kex->done, 0);
+		TEST_DONE();
+	}
+
+	TEST_START("deferred verification cleanup");
+	sshkey_free(private);
+	sshkey_free(public);
+	ssh_free(client);
+	ssh_free(server);
+	TEST_DONE();
+}
+
 static void
 do_kex(char *kex)
 {
@@ -177,4 +294,6 @@ kex_tests(void)
 	do_kex("diffie-hellman-group-exchange-sha1");
 	do_kex("diffie-hellman-group14-sha1");
 	do_kex("diffie-hellman-group1-sha1");
+	do_kex_deferred(1);
+	do_kex_deferred(0);
 }
@@ -0,0 +1,205 @@
+/* 	$OpenBSD$ */
+/*
+ * Regress test running many in-memory connections across threads
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+
+#include "test_helper.h"
+
+#include "err.h"
+#include "ssh_api.h"
+#include "sshbuf.h"
+#include "packet.h"
+#include "myproposal.h"
+
+#define NTHREADS	8
+#define NCONNS		256	/* per thread */
+#define NPACKETS	16	/* per direction and connection */
+#define TEST_MSG_TYPE	94	/* SSH2_MSG_CHANNEL_DATA */
+
+void kex_threads_tests(void);
+
+struct worker {
+	pthread_t tid;
+	int id;
+	struct sshkey *private, *public;
+	u_int done;
+	int error;
+};
+
+static pthread_mutex_t *crypto_locks;
+
+static void
+crypto_lock_cb(int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&crypto_locks[n]);
+	else
+		pthread_mutex_unlock(&crypto_locks[n]);
+}
+
+static unsigned long
+crypto_id_cb(void)
+{
+	return (unsigned long)pthread_self();
+}
+
+static int
+transfer(struct ssh *from, struct ssh *to)
+{
+	const u_char *buf;
+	size_t len;
+	int r;
+
+	buf = ssh_output_ptr(from, &len);
+	if (len == 0)
+		return 0;
+	if ((r = ssh_input_append(to, buf, len)) != 0 ||
+	    (r = ssh_output_consume(from, len)) != 0)
+		return r;
+	return 0;
+}
+
+/* deliver queued output in both directions until kex has finished */
+static int
+run_kex(struct ssh *client, struct ssh *server)
+{
+	u_char type;
+	int r, n;
+
+	for (n = 0; n < 100; n++) {
+		if ((r = ssh_packet_next(server, &type)) != 0 ||
+		    (r = transfer(server, client)) != 0 ||
+		    (r = ssh_packet_next(client, &type)) != 0 ||
+		    (r = transfer(client, server)) != 0)
+			return r;
+		if (server->kex->done && client->kex->done)
+			return 0;
+	}
+	return SSH_ERR_INTERNAL_ERROR;
+}
+
+static int
+send_packets(struct ssh *from, struct ssh *to, int id, int conn)
+{
+	char msg[64];
+	const u_char *data;
+	u_char type;
+	size_t len;
+	int i, r;
+
+	for (i = 0; i < NPACKETS; i++) {
+		snprintf(msg, sizeof(msg), "thread %d conn %d packet %d",
+		    id, conn, i);
+		if ((r = ssh_packet_put(from, TEST_MSG_TYPE, msg,
+		    strlen(msg))) != 0)
+			return r;
+	}
+	if ((r = transfer(from, to)) != 0)
+		return r;
+	for (i = 0; i < NPACKETS; i++) {
+		if ((r = ssh_packet_next(to, &type)) != 0)
+			return r;
+		if (type != TEST_MSG_TYPE)
+			return SSH_ERR_INVALID_FORMAT;
+		snprintf(msg, sizeof(msg), "thread %d conn %d packet %d",
+		    id, conn, i);
+		data = ssh_packet_payload(to, &len);
+		if (len != strlen(msg) || memcmp(data, msg, len) != 0)
+			return SSH_ERR_INVALID_FORMAT;
+	}
+	return 0;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct ssh *client, *server;
+	struct kex_params kex_params;
+	int i, r;
+
+	memcpy(kex_params.proposal, myproposal, sizeof(myproposal));
+	kex_params.proposal[PROPOSAL_KEX_ALGS] = "ecdh-sha2-nistp256";
+	for (i = 0; i < NCONNS; i++) {
+		client = server = NULL;
+		if ((r = ssh_init(&client, 0, &kex_params)) != 0 ||
+		    (r = ssh_init(&server, 1, &kex_params)) != 0 ||
+		    (r = ssh_add_hostkey(server, w->private)) != 0 ||
+		    (r = ssh_add_hostkey(client, w->public)) != 0 ||
+		    (r = run_kex(client, server)) != 0 ||
+		    (r = send_packets(client, server, w->id, i)) != 0 ||
+		    (r = send_packets(server, client, w->id, i)) != 0) {
+			w->error = r;
+			if (client != NULL)
+				ssh_free(client);
+			if (server != NULL)
+				ssh_free(server);
+			break;
+		}
+		ssh_free(client);
+		ssh_free(server);
+		w->done++;
+	}
+	return NULL;
+}
+
+void
+kex_threads_tests(void)
+{
+	struct worker workers[NTHREADS];
+	struct sshkey *private, *public;
+	int i, nlocks;
+
+	TEST_START("crypto locking");
+	nlocks = CRYPTO_num_locks();
+	crypto_locks = calloc(nlocks, sizeof(*crypto_locks));
+	ASSERT_PTR_NE(crypto_locks, NULL);
+	for (i = 0; i < nlocks; i++)
+		ASSERT_INT_EQ(pthread_mutex_init(&crypto_locks[i], NULL), 0);
+	CRYPTO_set_id_callback(crypto_id_cb);
+	CRYPTO_set_locking_callback(crypto_lock_cb);
+	TEST_DONE();
+
+	TEST_START("sshkey_generate");
+	ASSERT_INT_EQ(sshkey_generate(KEY_ECDSA, 256, &private), 0);
+	ASSERT_INT_EQ(sshkey_from_private(private, &public), 0);
+	TEST_DONE();
+
+	TEST_START("threaded kex");
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < NTHREADS; i++) {
+		workers[i].id = i;
+		workers[i].private = private;
+		workers[i].public = public;
+		ASSERT_INT_EQ(pthread_create(&workers[i].tid, NULL,
+		    worker_main, &workers[i]), 0);
+	}
+	for (i = 0; i < NTHREADS; i++) {
+		ASSERT_INT_EQ(pthread_join(workers[i].tid, NULL), 0);
+		ASSERT_INT_EQ(workers[i].error, 0);
+		ASSERT_U_INT_EQ(workers[i].done, NCONNS);
+	}
+	TEST_DONE();
+
+	TEST_START("cleanup");
+	CRYPTO_set_locking_callback(NULL);
+	CRYPTO_set_id_callback(NULL);
+	for (i = 0; i < nlocks; i++)
+		pthread_mutex_destroy(&crypto_locks[i]);
+	free(crypto_locks);
+	sshkey_free(private);
+	sshkey_free(public);
+	TEST_DONE();
+}
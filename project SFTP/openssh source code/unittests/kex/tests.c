@@ -6,9 +6,11 @@
 #include "test_helper.h"
 
 void kex_tests(void);
+void kex_threads_tests(void);
 
 void
 tests(void)
 {
 	kex_tests();
+	kex_threads_tests();
 }
@@ -0,0 +1,126 @@
+/* 	$OpenBSD$ */
+/*
+ * Regress test for the main loop poller
+ *
+ * Placed in the public domain
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_helper.h"
+
+#include "poller.h"
+
+void poller_tests(void);
+
+/* Returns the number of descriptors that poller_next_ready() walks. */
+static int
+count_ready(struct poller *p)
+{
+	u_int i = 0;
+	int n = 0;
+
+	while (poller_next_ready(p, &i) != -1)
+		n++;
+	return n;
+}
+
+void
+poller_tests(void)
+{
+	struct poller *p;
+	char path[] = "/tmp/test_poller.XXXXXX";
+	int fds[2], fds2[2], rfd, fd;
+	u_int i;
+
+	TEST_START("interest persists across waits");
+	p = poller_new();
+	ASSERT_PTR_NE(p, NULL);
+	ASSERT_INT_EQ(pipe(fds), 0);
+	poller_set(p, fds[0], POLLER_READ);
+	ASSERT_INT_EQ(poller_wait(p, 0), 0);
+	ASSERT_INT_EQ(poller_ready(p, fds[0], POLLER_READ), 0);
+	ASSERT_INT_EQ(write(fds[1], "x", 1), 1);
+	ASSERT_INT_EQ(poller_wait(p, 0), 1);
+	ASSERT_INT_EQ(poller_ready(p, fds[0], POLLER_READ), 1);
+	ASSERT_INT_EQ(poller_ready(p, fds[0], POLLER_WRITE), 0);
+	/* not set again, still registered */
+	ASSERT_INT_EQ(poller_wait(p, 0), 1);
+	ASSERT_INT_EQ(poller_ready(p, fds[0], POLLER_READ), 1);
+	/* the same interest again changes nothing */
+	poller_set(p, fds[0], POLLER_READ);
+	ASSERT_INT_EQ(poller_wait(p, 0), 1);
+	ASSERT_INT_EQ(poller_ready(p, fds[0], POLLER_READ), 1);
+	TEST_DONE();
+
+	TEST_START("interest withdrawn");
+	poller_set(p, fds[0], 0);
+	ASSERT_INT_EQ(poller_wait(p, 0), 0);
+	ASSERT_INT_EQ(poller_ready(p, fds[0], POLLER_READ), 0);
+	/* changed and changed back before the wait */
+	poller_set(p, fds[0], POLLER_READ);
+	poller_set(p, fds[0], 0);
+	ASSERT_INT_EQ(poller_wait(p, 0), 0);
+	poller_set(p, fds[0], POLLER_READ);
+	ASSERT_INT_EQ(poller_wait(p, 0), 1);
+	TEST_DONE();
+
+	TEST_START("ready descriptors walked");
+	ASSERT_INT_EQ(pipe(fds2), 0);
+	poller_set(p, fds2[0], POLLER_READ);
+	poller_set(p, fds2[1], POLLER_WRITE);
+	ASSERT_INT_EQ(poller_wait(p, 0), 2);
+	ASSERT_INT_EQ(poller_ready(p, fds2[0], POLLER_READ), 0);
+	ASSERT_INT_EQ(poller_ready(p, fds2[1], POLLER_WRITE), 1);
+	ASSERT_INT_EQ(count_ready(p), 2);
+	/* forgotten descriptors are skipped */
+	poller_forget(p, fds2[1]);
+	ASSERT_INT_EQ(count_ready(p), 1);
+	i = 0;
+	ASSERT_INT_EQ(poller_next_ready(p, &i), fds[0]);
+	ASSERT_INT_EQ(poller_next_ready(p, &i), -1);
+	poller_clear(p);
+	ASSERT_INT_EQ(count_ready(p), 0);
+	ASSERT_INT_EQ(poller_ready(p, fds[0], POLLER_READ), 0);
+	TEST_DONE();
+
+	TEST_START("forgotten descriptor number reused");
+	poller_forget(p, fds[0]);
+	close(fds[0]);
+	close(fds[1]);
+	poller_forget(p, fds2[0]);
+	close(fds2[0]);
+	close(fds2[1]);
+	ASSERT_INT_EQ(pipe(fds2), 0);
+	rfd = fds2[0];
+	ASSERT_INT_EQ(poller_wait(p, 0), 0);
+	poller_set(p, rfd, POLLER_READ);
+	ASSERT_INT_EQ(write(fds2[1], "x", 1), 1);
+	ASSERT_INT_EQ(poller_wait(p, 0), 1);
+	ASSERT_INT_EQ(poller_ready(p, rfd, POLLER_READ), 1);
+	poller_forget(p, rfd);
+	close(fds2[0]);
+	close(fds2[1]);
+	TEST_DONE();
+
+	TEST_START("regular file always ready");
+	fd = mkstemp(path);
+	ASSERT_INT_NE(fd, -1);
+	unlink(path);
+	poller_set(p, fd, POLLER_READ);
+	ASSERT_INT_EQ(poller_wait(p, 1000), 1);
+	ASSERT_INT_EQ(poller_ready(p, fd, POLLER_READ), 1);
+	ASSERT_INT_EQ(count_ready(p), 1);
+	poller_set(p, fd, 0);
+	ASSERT_INT_EQ(poller_wait(p, 0), 0);
+	poller_forget(p, fd);
+	close(fd);
+	poller_free(p);
+	TEST_DONE();
+}